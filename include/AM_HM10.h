@@ -23,53 +23,184 @@
 #include <avr/eeprom.h>
 #include <Arduino.h>
 #include <HardwareSerial.h>
+#include "AM_MessageParser.h"
 
 //#define SD_SUPPORT        // uncomment to enable support for SD Widget - Download only
 //#define ALARMS_SUPPORT    // uncomment to enable support for Alarm Widget
 //#define SDLOGGEDATAGRAPH_SUPPORT    // uncomment to enable support for Logged Data Widget
+//#define SDLOGROLLUP_SUPPORT         // uncomment to keep 10 s / 1 min / 10 min rollups of logged data (needs SDLOGGEDATAGRAPH_SUPPORT)
 //#define DEBUG           // uncomment to enable debugging - You should not need it !
 
 #define HM10_COM_SPEED			  9600
 
+/*
+  Binary telemetry frames: START, payload length, sequence number, payload, CRC-16 (little endian).
+  The CRC is avr-libc's _crc_ccitt_update (reflected 0x8408, initial 0xFFFF) over length, sequence and payload.
+  A device asks for them by sending $BinFrame$=1 before Sync, and the mode is confirmed with $BinFrame$=1
+  when the Sync arrives. Text messages are used otherwise and after the link drops.
+*/
+#define AM_FRAME_START            0xA5
+#define AM_FRAME_MAX_PAYLOAD      32
+#define AM_BINARY_FRAME_VARIABLE  "$BinFrame$"
+
 #if defined(SD_SUPPORT) || defined(SDLOGGEDATAGRAPH_SUPPORT)
 #include <SPI.h>
 #include <SD.h>
+
+/*
+  SD downloads ($SDDL$ files, $SDLogData$ logs) are sent a piece per loop() and while loop() waits
+  out its delay, as much as the transmit queue has room for, so the sketch keeps running. A
+  transfer can be resumed by sending $SDOffset$=<n> right before the request: n is the number of
+  file bytes, or of log records, the device already has. A new request or a lost link ends the
+  transfer.
+*/
+#define AM_SD_TRANSFER
+#define AM_SD_OFFSET_VARIABLE     "$SDOffset$"
+#define AM_SD_BUFFER_SIZE         100     // a log line: 12 character variable, time and 5 values
+#define AM_SD_FILE_DELAY          3000    // [ms] from SD=$C$ to the first byte of the file
+#define AM_SD_LOG_DELAY           250     // [ms] from the request to the first log line
+#define AM_SD_STEP_INTERVAL       20      // [ms] between pieces while loop() waits
+#define AM_SD_REPLY_SIZE          16      // control replies held back during a transfer, "$BinFrame$=1#" is 13
+
+#define AM_SD_IDLE                0
+#define AM_SD_STARTING            1       // waiting out the start delay
+#define AM_SD_FILE                2
+#define AM_SD_LOG                 3
+#define AM_SD_ENDING              4       // end marker left to send
+#endif
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+#include "SdBlockLogger.h"
+
+#define SD_LOG_VALUES 5
+
+// One sdLog() call as kept in the log file, unused values are NaN and read back as "-"
+typedef struct {
+  uint32_t  time;
+  float     value[SD_LOG_VALUES];
+} sdLogRecord;
+#endif
+
+#if defined(SDLOGROLLUP_SUPPORT) && !defined(SDLOGGEDATAGRAPH_SUPPORT)
+#error "SDLOGROLLUP_SUPPORT needs SDLOGGEDATAGRAPH_SUPPORT, the rollups are kept of the logged data"
+#endif
+
+#ifdef SDLOGROLLUP_SUPPORT
+#include "SdLogRollup.h"
+
+static_assert(SD_ROLLUP_VALUES == SD_LOG_VALUES, "rollups keep every logged value");
+
+/*
+  Overview of a log: $SDFrom$=<time>, $SDTo$=<time>, $SDPoints$=<n> and $SDStat$=min|avg|max, each
+  optional, then $SDQuery$=<variable>. The answer has the same lines as $SDLogData$, from the raw
+  records or the finest rollup that has no more than n lines in the range, one line per bucket
+  with the bucket's min, average or max. If even the 10 min rollup has more, every k-th bucket is
+  sent. The parameters go back to their defaults after each query.
+*/
+#define AM_SD_QUERY_VARIABLE      "$SDQuery$"
+#define AM_SD_QUERY_POINTS        100
 #endif
 
 #ifdef ALARMS_SUPPORT
+#include "EepromLog.h"
+
+/*
+  Alarms are kept in a RAM table, ordered by the time they fire next, so checking them every loop
+  only looks at the first one. Every change is written to a wear-leveled EEPROM log, with the slot
+  in the table as the key.
+*/
+#define ALARM_SLOTS           5
+#define ALARM_EEPROM_START    0
+#define ALARM_EEPROM_LENGTH   512     // 22 log slots for 5 alarms; the rest of the EEPROM is free
+#define ALARM_REPEAT_PERIOD   86400UL // [s]
+
+// 16 bytes on the Uno and on host builds
+typedef struct {
+  uint32_t  time;                     // next time it fires
+  char      id[11];                   // empty for a free slot
+  uint8_t   repeat;
+} alarm;
 
+// Fixed EEPROM slots of earlier versions, read once to carry the alarms over to the log
 typedef struct  {
   char 						id[12];  // First character of id is always A
   unsigned long 	time;
   bool						repeat;
-} alarm;
-
-
-#define ALARM_CHECK_INTERVAL  60      // [s]
+} legacyAlarm;
 
 #endif
 
-#define VARIABLELEN 14
-#define VALUELEN 14
-
 
 class AMController {
 
   private:
-    char				_variable[VARIABLELEN + 1];
-    char 	   		_value[VALUELEN + 1];
-    bool	   		_var;
-    int       	_idx;
+    AMMessageParser _parser;
+
+    bool            _binaryRequested;
+    bool            _binaryMode;
+    uint8_t         _frameSeq;
+
+    unsigned long   _txBytes;
+    unsigned long   _txMicros;
 
 #ifdef SD_SUPPORT
     File 				_root;
     File				_entry;
 #endif
 
+#ifdef AM_SD_TRANSFER
+    uint8_t         _sdState;
+    bool            _sdLogTransfer;     // log lines rather than the file's bytes
+    char            _sdName[13];
+    unsigned long   _sdOffset;          // bytes or records the device has
+    unsigned long   _sdRequestedOffset; // from $SDOffset$, for the next request
+    unsigned long   _sdStarted;         // [ms]
+    unsigned long   _sdFinished;        // [ms]
+    unsigned long   _sdBytes;
+    uint8_t         _sdBuffer[AM_SD_BUFFER_SIZE];
+    uint8_t         _sdPending;         // bytes in _sdBuffer
+    uint8_t         _sdSent;            // of those already queued
+    File            _sdFile;            // file being downloaded or rollup being sent
+    uint8_t         _sdReplies[AM_SD_REPLY_SIZE];
+    uint8_t         _sdReplyLength;
+
+    void sdStartTransfer(const char *name, bool log);
+    void sdTransferStep(void);
+    bool sdFillBuffer(void);
+    void sdBufferText(const char *variable, const char *value);
+    void sdEndTransfer(void);
+#endif
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+    SdBlockLogger   _logger;            // file of the variable logged last, kept open
+    SdBlockReader   _sdReader;          // log being sent
+    uint8_t         _sdLevel;           // 0 for the raw records, else the rollup level
+    uint8_t         _sdStat;            // SD_ROLLUP_MIN, _AVG or _MAX
+    uint16_t        _sdStride;          // records per line sent
+    uint32_t        _sdTo;              // last log time sent
+
+    void sdBufferRecord(uint32_t time, const float *values);
+
+    bool sdLogOpen(const char *variable);
+    void sdLogAppend(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5);
+#endif
+
+#ifdef SDLOGROLLUP_SUPPORT
+    SdLogRollup     _rollup;
+    uint32_t        _sdQueryFrom;
+    uint32_t        _sdQueryTo;
+    uint16_t        _sdQueryPoints;
+    uint8_t         _sdQueryStat;
+#endif
+
 #ifdef ALARMS_SUPPORT
     unsigned long		_startTime;
-    unsigned long   _lastAlarmCheck;    
+    EepromLog       _alarmLog;
+    alarm           _alarms[ALARM_SLOTS];
+    uint8_t         _alarmOrder[ALARM_SLOTS]; // slots by next fire time, the used ones first
+    uint8_t         _alarmCount;
     unsigned long 	_tmpTime;
+    char            _tmpId[11];
 #endif
 
     /**
@@ -112,6 +243,11 @@ class AMController {
     void (*_deviceDisconnected)(void);
 
     void readVariable(void);
+    void reply(const char *variable, const char *value);
+    void transmit(const uint8_t *buffer, size_t len);
+    void queue(const uint8_t *buffer, size_t len);
+    int queueFree(void);
+    bool processMessage(char *variable, char *value);
 
 #ifdef ALARMS_SUPPORT
 
@@ -121,6 +257,8 @@ class AMController {
     void readTime();
 
     void inizializeAlarms(void);
+    void sortAlarms(void);
+    void storeAlarm(uint8_t slot);
     void checkAndFireAlarms(void);
     void createUpdateAlarm(char *id, unsigned long time, bool repeat);
     void removeAlarm(char *id);
@@ -157,6 +295,20 @@ class AMController {
     void writeTripleMessage(const char *variable, float vX, float vY, float vZ);
     void writeTxtMessage(const char *variable, const char *value);
 
+    bool binaryMode(void);
+    void writeBinaryFrame(const void *payload, uint8_t len);
+
+    /*
+      Bytes that can be written to the BLE module right now without blocking
+    */
+    int txFree(void);
+
+    /*
+      Totals of bytes written to the BLE module and of the time spent writing them
+    */
+    unsigned long txBytes(void);
+    unsigned long txMicros(void);
+
     void log(const char *msg);
     void log(int msg);
 
@@ -170,6 +322,15 @@ class AMController {
     void sendFile(char *fileName);
 #endif
 
+#ifdef AM_SD_TRANSFER
+    /*
+      Download in progress, and bytes sent and throughput [bytes/s] of the current or last one
+    */
+    bool sdTransferActive(void);
+    unsigned long sdTransferBytes(void);
+    unsigned long sdTransferRate(void);
+#endif
+
     void temporaryDigitalWrite(uint8_t pin, uint8_t value, unsigned long ms);
 
 #ifdef ALARMS_SUPPORT
@@ -194,10 +355,20 @@ class AMController {
     void sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4);
     void sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5);
 
+    /*
+      Start sending the log of variable to the device, returns before it is sent
+    */
     void sdSendLogData(const char *variable);
 
     void sdPurgeLogData(const char *variable);
 
+#ifdef SDLOGROLLUP_SUPPORT
+    /*
+      Start sending the records of variable between from and to, at most points lines of them
+    */
+    void sdQueryLogData(const char *variable, uint32_t from, uint32_t to, uint16_t points, uint8_t stat);
+#endif
+
 #endif
 
 };
@@ -0,0 +1,75 @@
+/*
+   Incremental parser for the AMController "variable=value#" protocol.
+
+   The parser keeps its framing state between calls, so a message split across several
+   loop() iterations is reassembled, and writes characters straight into a small queue of
+   complete messages. HM-10 link notifications (OK+CONN / OK+LOST) are recognised wherever
+   they appear in the stream and discard any partial message.
+
+   Fields longer than VARIABLELEN / VALUELEN, or a '#' before the '=', make the whole
+   message be dropped at its terminator and counted in overflows().
+*/
+
+#ifndef AM_MESSAGEPARSER_h
+#define AM_MESSAGEPARSER_h
+
+#include <Arduino.h>
+
+#define VARIABLELEN 14
+#define VALUELEN 14
+
+#ifndef AM_MESSAGE_QUEUE_LEN
+#define AM_MESSAGE_QUEUE_LEN  4
+#endif
+
+#define AM_PARSER_NONE          0
+#define AM_PARSER_MESSAGE       1
+#define AM_PARSER_CONNECTED     2
+#define AM_PARSER_DISCONNECTED  3
+
+typedef struct {
+  char variable[VARIABLELEN + 1];
+  char value[VALUELEN + 1];
+} amMessage;
+
+
+class AMMessageParser {
+
+  private:
+    amMessage     _queue[AM_MESSAGE_QUEUE_LEN];
+    uint8_t       _head;
+    uint8_t       _count;
+
+    bool          _var;
+    uint8_t       _idx;
+    bool          _discard;
+
+    uint8_t       _connIdx;
+    uint8_t       _lostIdx;
+
+    unsigned int  _overflows;
+
+    uint8_t matchLinkStatus(char c);
+    void resetMessage(void);
+
+  public:
+    AMMessageParser();
+
+    /*
+      Consume one character from the stream and return the resulting AM_PARSER_* event.
+      Characters fed while the queue is full are lost, so check isFull() first.
+    */
+    uint8_t feed(char c);
+
+    bool isFull(void) const;
+
+    /*
+      Oldest complete message, or NULL when the queue is empty
+    */
+    amMessage *peek(void);
+    void pop(void);
+
+    unsigned int overflows(void) const;
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*
+   Change-driven publishing on top of AMController::writeMessage.
+
+   The last value sent for each variable is remembered and a new value is only written when it
+   differs by more than the deadband, or when the heartbeat period has passed since it was last
+   sent. resendAll() forgets everything so the next publish of each variable goes out, which is
+   what a Sync needs.
+
+   When the transmit queue has no room for a message it is deferred rather than blocking;
+   its last sent value is left untouched so it goes out on a later call.
+*/
+
+#ifndef AM_PUBLISHER_h
+#define AM_PUBLISHER_h
+
+#include "AM_HM10.h"
+
+#ifndef AM_PUBLISHER_MAX_VARIABLES
+#define AM_PUBLISHER_MAX_VARIABLES  21
+#endif
+
+#define AM_PUBLISHER_VALUE_ROOM     8       // '=', value and '#'
+#define AM_PUBLISHER_FRAME_ROOM     5       // frame header and CRC
+
+typedef struct {
+  const char      *variable;
+  int             value;
+  unsigned long   time;
+} amPublished;
+
+
+class AMPublisher {
+
+  private:
+    AMController    *_controller;
+    unsigned long   _heartbeat;
+
+    amPublished     _published[AM_PUBLISHER_MAX_VARIABLES];
+    uint8_t         _count;
+
+    bool            _frameValid;
+    uint16_t        _frameCrc;
+    unsigned long   _frameTime;
+
+    unsigned long   _sent;
+    unsigned long   _suppressed;
+    unsigned long   _deferred;
+
+    amPublished *find(const char *variable);
+
+  public:
+    AMPublisher(AMController *controller, unsigned long heartbeat);
+
+    /*
+      Write variable=value if it changed by more than deadband or its heartbeat is due.
+      Returns true if the message was written.
+    */
+    bool publish(const char *variable, int value, int deadband = 0);
+
+    /*
+      Write a binary frame if its content changed or the heartbeat is due
+    */
+    bool publishFrame(const void *payload, uint8_t len);
+
+    void resendAll(void);
+
+    unsigned long sent(void);
+    unsigned long suppressed(void);
+    unsigned long deferred(void);
+};
+
+#endif
@@ -0,0 +1,83 @@
+/*
+   Timer-triggered ADC acquisition of one analog input.
+
+   Timer1 runs in CTC mode and its compare match B starts a conversion at a fixed rate, with no
+   code involved. The ADC interrupt adds each result to a running sum and, every 4^bits
+   conversions, queues the sum as one oversampled reading (see AdcSampler) and starts the next.
+   The main loop takes the queued sums with next(), so readings come at a constant period however
+   long a loop takes, and the CPU never waits for a conversion.
+
+   The same timer period drives a PWM output on OC1A (pin 9) with drive(): the output is high from
+   the start of the period for the duty, and a conversion is started ADC_ACQUISITION_PWM_LEAD ticks
+   before the period ends, at least ADC_ACQUISITION_PWM_SETTLE ticks after the output went low.
+   A load it switches, such as the pump, is off and settled while the input is sampled, so its
+   current doesn't show in the readings; the price is that the output is never fully on.
+
+   Only one instance can run: it owns Timer1 and the ADC, and analogRead() must not be called
+   between begin() and end(). The queue holds ADC_ACQUISITION_QUEUE_SIZE readings; when a loop
+   stalls for longer the newest ones are lost and counted in dropped().
+
+   On host builds the conversions are triggered by the native harness' timer interrupt on the
+   virtual clock and read the simulated input.
+*/
+
+#ifndef ADCACQUISITION_h
+#define ADCACQUISITION_h
+
+#include <Arduino.h>
+#include "AdcSampler.h"
+
+#define ADC_ACQUISITION_PWM_PIN     9               // OC1A
+#define ADC_ACQUISITION_PWM_LEAD    4               // [ticks of 4 us] sample and hold takes 12 us
+#define ADC_ACQUISITION_PWM_SETTLE  25              // [ticks] off before the sample
+
+#ifndef ADC_ACQUISITION_QUEUE_SIZE
+#define ADC_ACQUISITION_QUEUE_SIZE  8
+#endif
+
+
+class AdcAcquisition {
+
+  static_assert((ADC_ACQUISITION_QUEUE_SIZE & (ADC_ACQUISITION_QUEUE_SIZE - 1)) == 0 && ADC_ACQUISITION_QUEUE_SIZE <= 128,
+                "ADC_ACQUISITION_QUEUE_SIZE must be a power of two <= 128");
+
+  private:
+    uint8_t         _pin;
+    uint8_t         _samples;
+    uint16_t        _period;                        // [ticks]
+    uint8_t         _duty;
+
+    void output(void);
+
+  public:
+    AdcAcquisition(uint8_t pin);
+
+    /*
+      Start conversions at rate per second (4 .. 9000) and queue a sum every 4^bits of them
+      (bits 0..ADC_SAMPLER_MAX_BITS)
+    */
+    void begin(uint8_t bits, unsigned int rate);
+    void end(void);
+
+    /*
+      Duty of the PWM output on ADC_ACQUISITION_PWM_PIN, 0 (low) .. 255 (on to the sample's
+      settling time), at the conversion rate; kept across begin() and low after end()
+    */
+    void drive(uint8_t duty);
+    uint8_t duty(void);
+
+    /*
+      Oldest queued sum of samples() conversions into sum, false if there is none
+    */
+    bool next(uint16_t *sum);
+
+    /*
+      Queue a sum as the interrupt would, e.g. to replay a capture after end()
+    */
+    void push(uint16_t sum);
+
+    uint8_t samples(void);
+    uint16_t dropped(void);
+};
+
+#endif
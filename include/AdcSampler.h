@@ -0,0 +1,45 @@
+/*
+   Burst reads of an analog input, back to back at the ADC's conversion rate.
+
+   read(bits) adds up 4^bits conversions and shifts the sum right by bits: oversampling and
+   decimation, which gives a reading with bits more resolution than the 10-bit ADC (0 ..
+   1023 << bits) as long as the input carries about an LSB of noise to dither it. Sender and
+   vehicle noise is well above that. A conversion takes about 112 us with the Arduino core's
+   125 kHz ADC clock, so 2 extra bits cost 1.8 ms and 3 cost 7.2 ms.
+
+   The reading only depends on the sum, which is kept with its conversion count: spreading the
+   same sum over the same number of conversions reproduces the reading exactly, which is how a
+   capture of it is replayed.
+*/
+
+#ifndef ADCSAMPLER_h
+#define ADCSAMPLER_h
+
+#include <Arduino.h>
+
+#define ADC_SAMPLER_MAX_BITS        3       // 64 conversions, a sum of 1023s still fits 16 bits
+
+
+class AdcSampler {
+
+  private:
+    uint8_t         _pin;
+    uint8_t         _samples;
+    uint16_t        _sum;
+
+  public:
+    AdcSampler(uint8_t pin);
+
+    /*
+      Oversampled reading with bits (0..ADC_SAMPLER_MAX_BITS) extra bits of resolution
+    */
+    uint16_t read(uint8_t bits);
+
+    /*
+      Conversions and their sum behind the last read()
+    */
+    uint8_t samples(void);
+    uint16_t sum(void);
+};
+
+#endif
@@ -0,0 +1,18 @@
+/*
+   Default calibration points of the aux sender, generated by src/calgen from the linear
+   125 .. 450 ADC count range used before the tank was calibrated.
+   Readings are ADC counts << AUX_OVERSAMPLE_BITS, sorted; the lookup table is built from them
+   at compile time (calibrationTableOf() in SenderCalibration.h).
+*/
+
+#ifndef AUXSENDERCALIBRATION_h
+#define AUXSENDERCALIBRATION_h
+
+#include "SenderCalibration.h"
+
+constexpr calibrationPoint auxSenderPoints[] = {
+  {   500, 100, 0 },
+  {  1800,   0, 0 },
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _CAN_FRAME_QUEUE_H_
+#define _CAN_FRAME_QUEUE_H_
+
+#include <Arduino.h>
+#include <util/atomic.h>
+
+// A CAN frame as read from the MCP2515, stamped with the time it was drained
+typedef struct {
+  unsigned long id;       // MCP_CAN identifier: bit 31 = extended, bit 30 = remote request
+  unsigned long time;     // millis() when the frame was read
+  byte          len;
+  byte          data[8];
+} canFrame;
+
+/*
+  Lock-free single-producer/single-consumer ring of CAN frames.
+
+  The CAN interrupt is the only producer (back()/push()/drop()) and the main loop the only
+  consumer (front()/pop()). Head and tail are single bytes, so each side reads the other's
+  index atomically on AVR without disabling interrupts. N must be a power of two <= 128.
+*/
+template<uint8_t N>
+class CanFrameQueue {
+
+  static_assert(N >= 2 && N <= 128 && (N & (N - 1)) == 0, "CanFrameQueue size must be a power of two <= 128");
+
+  public:
+    CanFrameQueue() : _head(0), _tail(0), _received(0), _dropped(0), _highWater(0) {}
+
+    // Producer: slot to read the next frame into, or NULL when the queue is full
+    canFrame *back() {
+      if ((uint8_t)(_head - _tail) >= N)
+        return NULL;
+      return &_frames[_head & (N - 1)];
+    }
+
+    // Producer: publish the slot returned by back()
+    void push() {
+      __asm__ __volatile__("" ::: "memory");
+      _head++;
+      _received++;
+
+      uint8_t used = _head - _tail;
+      if (used > _highWater)
+        _highWater = used;
+    }
+
+    // Producer: account for a frame that had to be discarded because the queue was full
+    void drop() {
+      _dropped++;
+    }
+
+    // Consumer: oldest frame, or NULL when the queue is empty
+    const canFrame *front() const {
+      if (_head == _tail)
+        return NULL;
+      __asm__ __volatile__("" ::: "memory");
+      return &_frames[_tail & (N - 1)];
+    }
+
+    // Consumer: release the frame returned by front()
+    void pop() {
+      __asm__ __volatile__("" ::: "memory");
+      _tail++;
+    }
+
+    uint8_t count() const {
+      return (uint8_t)(_head - _tail);
+    }
+
+    uint8_t highWater() const {
+      return _highWater;
+    }
+
+    uint16_t received() const {
+      uint16_t n;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n = _received;
+      }
+      return n;
+    }
+
+    uint16_t dropped() const {
+      uint16_t n;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        n = _dropped;
+      }
+      return n;
+    }
+
+  private:
+    canFrame          _frames[N];
+    volatile uint8_t  _head;
+    volatile uint8_t  _tail;
+    volatile uint16_t _received;
+    volatile uint16_t _dropped;
+    volatile uint8_t  _highWater;
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*
+   Binary capture of the control inputs and decisions, written to SD for replay on the host.
+
+   A capture file starts with the 4-byte magic "RZC1" followed by records of type, 16-bit
+   millis() delta since the previous record and a payload (little endian):
+
+     CAPTURE_TIME     uint32 millis()                  absolute time, first record and long gaps
+     CAPTURE_CAN      uint32 id, uint8 len, len bytes  frame as it was processed
+     CAPTURE_ADC      uint8 pin, uint16 value          every analogRead() the control code uses
+     CAPTURE_MANUAL   uint8 on                         manual pump command from the device
+     CAPTURE_PUMP     uint8 on                         pump output changed
+     CAPTURE_ADC_SUM  uint8 pin, uint8 n, uint16 sum   burst of n analogRead()s (AdcSampler)
+
+   A loop's records appear in the order the loop consumed them, so replaying them in file order
+   reproduces its decisions; the burst setup() reads to fill the aux filter is the first record.
+   The file is kept open and flushed every CAPTURE_FLUSH_INTERVAL, a power loss costs at most
+   that much of the capture.
+*/
+
+#ifndef CAPTURELOG_h
+#define CAPTURELOG_h
+
+#include <Arduino.h>
+#include <SD.h>
+#include "CanFrameQueue.h"
+
+#define CAPTURE_MAGIC             "RZC1"
+#define CAPTURE_MAGIC_LEN         4
+
+#define CAPTURE_TIME              0x00
+#define CAPTURE_CAN               0x01
+#define CAPTURE_ADC               0x02
+#define CAPTURE_MANUAL            0x03
+#define CAPTURE_PUMP              0x04
+#define CAPTURE_ADC_SUM           0x05
+
+#define CAPTURE_HEADER_LEN        3       // type and time delta
+#define CAPTURE_MAX_RECORD        (CAPTURE_HEADER_LEN + 5 + 8)
+
+#ifndef CAPTURE_FLUSH_INTERVAL
+#define CAPTURE_FLUSH_INTERVAL    2000    // [ms]
+#endif
+
+class CaptureLog {
+
+  private:
+    File            _file;
+    bool            _active;
+    unsigned long   _lastTime;
+    unsigned long   _lastFlush;
+    unsigned long   _bytes;
+    unsigned long   _errors;
+
+    void record(uint8_t type, const uint8_t *payload, uint8_t len);
+
+  public:
+    CaptureLog();
+
+    /*
+      Open the first free CAPxx.BIN on the card (SD.begin() must have succeeded).
+      Returns false if no file could be created, capturing is then off.
+    */
+    bool begin(void);
+
+    void frame(const canFrame &frame);
+    void adcSample(uint8_t pin, int value);
+    void adcSum(uint8_t pin, uint8_t samples, uint16_t sum);
+    void manual(bool on);
+    void pump(bool on);
+
+    /*
+      Flush to the card when CAPTURE_FLUSH_INTERVAL has passed, call once per loop
+    */
+    void loop(void);
+
+    bool active(void);
+    unsigned long bytes(void);
+    unsigned long errors(void);
+};
+
+#endif
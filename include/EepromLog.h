@@ -0,0 +1,77 @@
+/*
+   Wear-leveled store of small fixed-size values in a region of the EEPROM.
+
+   The region is cut into slots of a 4-byte sequence number, a one-byte key, the value and a
+   CRC-16. write() never rewrites a value in place: it programs the next slot in the region that
+   doesn't hold the current value of some key, so a value that changes every day moves around the
+   region instead of wearing out the same cells. The valid slot with the highest sequence number of
+   a key is its value. A slot cut off by a power loss fails its CRC and the key keeps the value
+   written before, which is still in its own slot.
+
+   The region needs a slot for every key plus at least one spare; every spare slot divides the
+   writes each cell sees. The sequence number doesn't wrap within the life of the EEPROM.
+
+   begin() scans the whole region once and keeps a bit per slot that holds a current value, so
+   read() only looks at those slots and write() finds the next free one without checking CRCs.
+   Up to EEPROM_LOG_MAX_SLOTS slots are used, the rest of a longer region stays untouched. Bytes
+   that already hold the right value aren't programmed again, but a write still costs up to 3.3 ms
+   per byte of the slot.
+*/
+
+#ifndef EEPROMLOG_h
+#define EEPROMLOG_h
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+#define EEPROM_LOG_SLOT_OVERHEAD    7       // sequence, key, CRC
+#define EEPROM_LOG_SLOT_SIZE(size)  ((size) + EEPROM_LOG_SLOT_OVERHEAD)
+#define EEPROM_LOG_MAX_SLOTS        32      // one bit each in _current
+
+
+class EepromLog {
+
+  private:
+    uint16_t        _start;
+    uint8_t         _slots;
+    uint8_t         _size;                  // value bytes per slot
+    uint8_t         _next;                  // slot the next write tries first
+    uint32_t        _sequence;              // of the next write
+    uint32_t        _current;               // slots holding the current value of their key
+    unsigned long   _writes;
+
+    size_t address(uint8_t slot);
+    bool valid(uint8_t slot, uint32_t *sequence, uint8_t *key);
+    uint8_t key(uint8_t slot);
+    uint32_t sequence(uint8_t slot);
+    int16_t find(uint8_t key);
+
+  public:
+    EepromLog();
+
+    /*
+      Use length bytes from start for values of size bytes and find where writing goes on.
+      Returns false if the region can't hold two slots.
+    */
+    bool begin(uint16_t start, uint16_t length, uint8_t size);
+
+    /*
+      Copy the current value of key into value, false if the key was never written
+    */
+    bool read(uint8_t key, void *value);
+
+    /*
+      Store value as the current value of key, false if every slot holds a current value
+    */
+    bool write(uint8_t key, const void *value);
+
+    /*
+      True if no slot holds a valid value, e.g. on a new or erased EEPROM
+    */
+    bool empty(void);
+
+    uint8_t slots(void);
+    unsigned long writes(void);
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef _FIXED_FILTERS_H_
+#define _FIXED_FILTERS_H_
+
+#include <Arduino.h>
+
+/*
+  Integer filters for sensor smoothing on the AVR.
+
+  The window length is a template parameter so buffers are sized at compile time and the
+  steady-state divisions are by constants. T is the sample type and S the accumulator, which
+  must be able to hold N * the largest sample (uint16_t covers 100 byte-sized samples).
+*/
+
+
+// Simple moving average over the last N samples, updated in constant time from a running sum
+template<uint8_t N, typename T = uint8_t, typename S = uint16_t>
+class MovingAverage {
+
+  static_assert(N > 0, "MovingAverage needs at least one sample");
+
+  public:
+    MovingAverage() {
+      reset();
+    }
+
+    void reset() {
+      _sum = 0;
+      _index = 0;
+      _count = 0;
+    }
+
+    T add(T sample) {
+      if (_count < N)
+        _count++;
+      else
+        _sum -= _samples[_index];
+
+      _samples[_index] = sample;
+      _sum += sample;
+
+      if (++_index >= N)
+        _index = 0;
+
+      return value();
+    }
+
+    // Start out with a full window of value, e.g. a level restored at power-up
+    void fill(T value) {
+      for (uint8_t i = 0; i < N; i++)
+        _samples[i] = value;
+      _sum = (S)value * N;
+      _index = 0;
+      _count = N;
+    }
+
+    // Average of the samples seen so far (truncated, like sum / count)
+    T value() const {
+      if (_count == N)
+        return _sum / N;
+      return _count == 0 ? 0 : _sum / _count;
+    }
+
+    uint8_t count() const {
+      return _count;
+    }
+
+    bool full() const {
+      return _count == N;
+    }
+
+  private:
+    T       _samples[N];
+    S       _sum;
+    uint8_t _index;
+    uint8_t _count;
+};
+
+
+// Exponential moving average with alpha = 1 / 2^SHIFT, state kept with 8 fractional bits
+template<uint8_t SHIFT, typename T = uint8_t, typename S = uint16_t>
+class ExpMovingAverage {
+
+  static_assert(SHIFT > 0 && SHIFT < 8, "ExpMovingAverage SHIFT must be 1..7");
+
+  public:
+    ExpMovingAverage() {
+      reset();
+    }
+
+    void reset() {
+      _state = 0;
+      _primed = false;
+    }
+
+    T add(T sample) {
+      S scaled = (S)sample << 8;
+
+      if (!_primed) {
+        _state = scaled;
+        _primed = true;
+      }
+      else {
+        _state = _state - (_state >> SHIFT) + (scaled >> SHIFT);
+      }
+      return value();
+    }
+
+    void fill(T value) {
+      _state = (S)value << 8;
+      _primed = true;
+    }
+
+    // Rounded to the nearest whole sample
+    T value() const {
+      return (_state + 0x80) >> 8;
+    }
+
+    bool primed() const {
+      return _primed;
+    }
+
+  private:
+    S    _state;
+    bool _primed;
+};
+
+
+// Median of the last N samples; a sorted copy of the window is kept so updates are O(N) shifts
+template<uint8_t N, typename T = uint8_t>
+class SlidingMedian {
+
+  static_assert(N > 0, "SlidingMedian needs at least one sample");
+
+  public:
+    SlidingMedian() {
+      reset();
+    }
+
+    void reset() {
+      _index = 0;
+      _count = 0;
+    }
+
+    T add(T sample) {
+      uint8_t i;
+
+      if (_count == N) {
+        // Drop the oldest sample from the sorted window
+        T oldest = _window[_index];
+
+        for (i = 0; _sorted[i] != oldest; i++)
+          ;
+        for (; i + 1 < N; i++)
+          _sorted[i] = _sorted[i + 1];
+        _count--;
+      }
+
+      // Insertion into the sorted window
+      for (i = _count; i > 0 && _sorted[i - 1] > sample; i--)
+        _sorted[i] = _sorted[i - 1];
+      _sorted[i] = sample;
+      _count++;
+
+      _window[_index] = sample;
+      if (++_index >= N)
+        _index = 0;
+
+      return value();
+    }
+
+    void fill(T value) {
+      for (uint8_t i = 0; i < N; i++) {
+        _window[i] = value;
+        _sorted[i] = value;
+      }
+      _index = 0;
+      _count = N;
+    }
+
+    // Middle sample (the lower one while an even number of samples has been seen)
+    T value() const {
+      return _count == 0 ? 0 : _sorted[(_count - 1) / 2];
+    }
+
+    uint8_t count() const {
+      return _count;
+    }
+
+    bool full() const {
+      return _count == N;
+    }
+
+  private:
+    T       _window[N];
+    T       _sorted[N];
+    uint8_t _index;
+    uint8_t _count;
+};
+
+
+// Median of M to reject spikes (slosh, sender contact bounce), then an N sample moving average
+template<uint8_t M, uint8_t N, typename T = uint8_t, typename S = uint16_t>
+class MedianMovingAverage {
+
+  public:
+    void reset() {
+      _median.reset();
+      _average.reset();
+    }
+
+    T add(T sample) {
+      return _average.add(_median.add(sample));
+    }
+
+    void fill(T value) {
+      _median.fill(value);
+      _average.fill(value);
+    }
+
+    T value() const {
+      return _average.value();
+    }
+
+    uint8_t count() const {
+      return _average.count();
+    }
+
+    bool full() const {
+      return _average.full();
+    }
+
+  private:
+    SlidingMedian<M, T>       _median;
+    MovingAverage<N, T, S>    _average;
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*
+   Consumption and transfer figures from the deltas of the two tank levels.
+
+   Fed the level estimates and the pump output every loop, it keeps no history: time is cut into
+   fixed windows, and only the fuel at the start of the current window, the aux level at the start
+   of the current pump run and a running figure per metric are kept.
+
+     consumption   drop of the fuel in both tanks over a window, per hour, in an exponential
+                   average over the windows (1 / 2^ANALYTICS_SHIFT). A window in which the fuel
+                   rose by more than ANALYTICS_REFILL was a fill-up and is left out.
+     transferred   drop of the aux level while the pump runs, the aux tank only drains through
+                   it. Counted at the end of a run and of every window while it runs, by how far
+                   the level fell below its lowest of the run so far. Kept since power-up (the
+                   session) and over the life of the device, which is restored at power-up.
+     duty cycle    time the pump was on of every window, in the same exponential average
+     range         time the fuel in both tanks lasts at the consumption
+
+   Fuel is in ml, from levels in the estimator's Q16 percent of each tank. Every time is a millis()
+   timestamp, so the figures don't depend on how long a loop takes.
+*/
+
+#ifndef FUELANALYTICS_h
+#define FUELANALYTICS_h
+
+#include <Arduino.h>
+
+#define ANALYTICS_SHIFT             3               // windows averaged, about 8
+#define ANALYTICS_REFILL            1000            // [ml] rise of the fuel in a window that is a fill-up
+#define ANALYTICS_IDLE              100             // [ml/h] least consumption a range is given for
+#define ANALYTICS_NO_RANGE          0xFFFF
+
+class FuelAnalytics {
+
+  private:
+    uint8_t         _priLiters;
+    uint8_t         _auxLiters;
+    unsigned long   _window;                        // [ms]
+    bool            _started;
+    unsigned long   _windowStart;                   // [ms]
+    unsigned long   _last;                          // [ms] of the last update
+    int32_t         _windowFuel;                    // [ml] in both tanks at the window's start
+    unsigned long   _windowPump;                    // [ms] the pump was on in the window
+    int32_t         _fuel;                          // [ml] in both tanks
+    bool            _pumping;
+    int32_t         _runAux;                        // [ml] lowest in the aux tank of the pump run
+    int32_t         _consumption;                   // [ml/h] << ANALYTICS_SHIFT
+    uint32_t        _duty;                          // Q16 << ANALYTICS_SHIFT
+    uint32_t        _session;                       // [ml]
+    uint32_t        _lifetime;                      // [ml]
+
+    int32_t milliliters(int32_t level, uint8_t liters);
+    void closeRun(int32_t aux);
+    void closeWindow(unsigned long ms);
+
+  public:
+    /*
+      Tanks of priLiters and auxLiters, windows of window seconds (up to 6553)
+    */
+    FuelAnalytics(uint8_t priLiters, uint8_t auxLiters, uint16_t window);
+
+    /*
+      Figures kept from the last power cycle, before the first update
+    */
+    void restore(uint32_t lifetime, uint16_t consumption, uint16_t dutyCycle);
+
+    /*
+      Step at ms with the level estimates of both tanks (Q16 %) and whether the pump is on, called
+      every loop once both levels are known
+    */
+    void update(unsigned long ms, int32_t primary, int32_t aux, bool pumping);
+
+    uint16_t consumption(void);                     // [ml/h]
+    uint32_t sessionTransferred(void);              // [ml]
+    uint32_t lifetimeTransferred(void);             // [ml]
+    uint16_t dutyCycle(void);                       // Q16 of the time
+    uint16_t range(void);                           // [min], ANALYTICS_NO_RANGE below ANALYTICS_IDLE
+};
+
+#endif
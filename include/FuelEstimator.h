@@ -0,0 +1,204 @@
+/*
+   Level and rate estimates of both tanks from the aux sender, the dash's fuel level and the pump.
+
+   Each tank is tracked by a two-state (level, rate) Kalman filter. The measurements of a tank
+   come at a fixed period with constant noise, where the filter's gains settle to constants, so
+   the steady-state form is used: the alpha-beta filter, with the gains computed by the compiler
+   from the tracking index lambda = process noise * T^2 / measurement noise (Kalata). A smaller
+   lambda trusts the model more: less noise, slower to follow what the model doesn't know.
+   Unlike a moving average it has no lag on a steady drain or fill, the rate carries it.
+
+   The pump is the known input. When it starts the aux rate steps down by the transfer rate and
+   the primary rate up by as much fuel, so neither estimate has to find the change in the noise,
+   and when it stops both steps are taken back; a pump driven at part flow steps by its share of
+   the transfer rate. The transfer rate at full flow starts out nominal and learns from every long
+   enough run: the slope of a least-squares line through the aux readings over the fuel the pump
+   was driven to move, so it comes from the sender and not from the estimate's own prediction.
+   The primary's rate without the transfer is the engine's consumption.
+
+   The aux readings also go through a second filter that is never told about the pump. Its rate
+   comes from the readings alone, which makes it the measurement a controller of the transfer rate
+   can close its loop on; the estimate's own rate would hand the controller back its feed-forward.
+
+   Levels are in 1/65536 % of the tank and rates in 1/65536 % per second. A tank's rate is kept
+   with ESTIMATOR_RATE_SHIFT more fraction bits and its beta in Q24: with the small tracking
+   index of the aux sender beta is about 2e-6, which rounds to nothing in Q16 and would leave the
+   rate to the pump's feed-forward alone. The filters are 32-bit integer arithmetic, the fit of a
+   run sums in 64 bits. The aux estimate is advanced by one period per reading rather than by the
+   clock, so a replayed capture gives the same estimates.
+*/
+
+#ifndef FUELESTIMATOR_h
+#define FUELESTIMATOR_h
+
+#include <Arduino.h>
+
+#define ESTIMATOR_MAX_RATE          (1L << 20)      // per period, 16 % / period
+#define ESTIMATOR_MAX_ADVANCE       10000           // [ms] a stale rate isn't extrapolated further
+#define ESTIMATOR_MIN_RUN           600             // aux readings at full flow of a pump run to learn the transfer rate from
+#define ESTIMATOR_MAX_FIT           8192            // aux readings of a run the fit takes, its sums stay within 64 bits
+#define ESTIMATOR_RATE_SHIFT        8               // fraction bits of a tank's rate below 1/65536 % per period
+#define ESTIMATOR_FULL_FLOW         256
+
+// Rate in estimator units from % per hour
+#define ESTIMATOR_RATE(percentPerHour) ((int32_t)((percentPerHour) * 65536.0 / 3600.0 + 0.5))
+
+
+// Gains of a tank, alpha in Q16 and beta in Q24, its measurement period in ms
+typedef struct {
+  uint16_t alpha;
+  uint16_t beta;
+  uint16_t period;
+} estimatorGains;
+
+constexpr double estimatorRoot(double x, double guess, uint8_t steps) {
+  return steps == 0 ? guess : estimatorRoot(x, (guess + x / guess) / 2, steps - 1);
+}
+
+constexpr double estimatorSqrt(double x) {
+  return x <= 0 ? 0 : estimatorRoot(x, x > 1 ? x : 1, 40);
+}
+
+// Steady-state alpha and beta of the tracking index (Kalata)
+constexpr double estimatorAlpha(double lambda) {
+  return 1 - ((4 + lambda - estimatorSqrt(8 * lambda + lambda * lambda)) / 4) *
+             ((4 + lambda - estimatorSqrt(8 * lambda + lambda * lambda)) / 4);
+}
+
+constexpr double estimatorBeta(double lambda) {
+  return 2 * (2 - estimatorAlpha(lambda)) - 4 * estimatorSqrt(1 - estimatorAlpha(lambda));
+}
+
+constexpr uint16_t estimatorGain(double gain, double one) {
+  return gain * one >= 65535 ? 65535 : gain <= 0 ? 0 : (uint16_t)(gain * one + 0.5);
+}
+
+constexpr estimatorGains estimatorGainsOf(double lambda, uint16_t period) {
+  return { estimatorGain(estimatorAlpha(lambda), 65536.0), estimatorGain(estimatorBeta(lambda), 16777216.0), period };
+}
+
+/*
+  True if neither gain of the tracking index rounds to zero or saturates; a zero beta never
+  corrects the rate from the readings. Check every index with a static_assert.
+*/
+constexpr bool estimatorGainsFit(double lambda) {
+  return estimatorAlpha(lambda) * 65536.0 >= 1 && estimatorAlpha(lambda) * 65536.0 < 65535 &&
+         estimatorBeta(lambda) * 16777216.0 >= 1 && estimatorBeta(lambda) * 16777216.0 < 65535;
+}
+
+
+// The alpha-beta filter of one tank
+class TankEstimator {
+
+  private:
+    estimatorGains  _gains;
+    int32_t         _level;
+    int32_t         _rate;                  // per period, << ESTIMATOR_RATE_SHIFT
+    uint8_t         _carry;                 // fraction of the level the rate moved it
+    bool            _primed;
+
+  public:
+    TankEstimator(const estimatorGains &gains);
+
+    /*
+      Start over at level (1/256 %) with no rate
+    */
+    void reset(int16_t level);
+
+    /*
+      Move the estimate dt ms ahead on its rate
+    */
+    void advance(uint16_t dt);
+
+    /*
+      Measured level (1/256 %) dt ms after the last one; the first one sets the level
+    */
+    void update(uint16_t dt, int16_t level);
+
+    /*
+      Change a known part of the rate from one value to another (per second); both are converted
+      to the period, so any number of changes that end where they started leave the rate as it was
+    */
+    void adjust(int32_t from, int32_t to);
+
+    int32_t level(void);
+    int32_t rate(void);                     // per second
+    uint16_t period(void);
+    bool primed(void);
+};
+
+
+class FuelEstimator {
+
+  private:
+    TankEstimator   _aux;
+    TankEstimator   _measured;              // the aux readings without the pump
+    TankEstimator   _primary;
+    unsigned long   _primaryTime;           // [ms] of the primary estimate
+    int32_t         _transfer;              // aux rate at full flow, per second, positive
+    int32_t         _drain;                 // aux rate taken by the running transfer
+    int32_t         _applied;               // primary rate added by it
+    int32_t         _nominal;
+    uint16_t        _runReadings;           // aux readings since the pump started, up to ESTIMATOR_MAX_FIT
+    uint32_t        _runFlow;               // flow of every aux reading since, 1/16 of a reading at full flow
+    int32_t         _sumLevel;              // least-squares sums of the readings over _runFlow
+    int64_t         _sumFlow;
+    int64_t         _sumFlowLevel;
+    int64_t         _sumFlowFlow;
+    uint16_t        _ratio;                 // aux / primary capacity, Q8
+    uint16_t        _flow;
+
+    void advancePrimary(unsigned long ms);
+    void learnTransfer(void);
+
+  public:
+    /*
+      transfer is the nominal pump flow in aux tank rate units, ratio the aux tank's capacity over
+      the primary's in Q8; measured are the gains of the aux filter without the pump, at the aux
+      period
+    */
+    FuelEstimator(const estimatorGains &aux, const estimatorGains &measured, const estimatorGains &primary,
+                  int32_t transfer, uint16_t ratio);
+
+    /*
+      Aux level to start from, e.g. an oversampled reading at power-up (1/256 %)
+    */
+    void primeAux(int16_t level);
+
+    /*
+      Measurements in 1/256 %: an aux reading, one every aux period, and a dash level at ms
+    */
+    void aux(int16_t level);
+    void primary(unsigned long ms, int16_t level);
+
+    /*
+      Pump flow at ms, 0 (off) .. ESTIMATOR_FULL_FLOW, called every loop
+    */
+    void pump(unsigned long ms, uint16_t flow);
+
+    /*
+      Estimated levels in whole percent (0..100) and 1/65536 %
+    */
+    uint8_t auxLevel(void);
+    uint8_t primaryLevel(void);
+    int32_t auxEstimate(void);
+    int32_t primaryEstimate(void);
+
+    /*
+      Learned transfer rate at full flow out of the aux tank and the engine's consumption out of
+      the primary, in rate units of the tank
+    */
+    int32_t transferRate(void);
+    int32_t burnRate(void);
+
+    /*
+      Rate at which the aux tank drains, in its rate units, positive while the pump runs: the
+      estimate's, and the one measured from the readings alone
+    */
+    int32_t auxDrain(void);
+    int32_t measuredDrain(void);
+
+    bool ready(void);
+};
+
+#endif
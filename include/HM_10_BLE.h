@@ -32,21 +32,42 @@
 #endif
 
 #include <SoftwareSerial.h>
-#include "QueueList.h"
+#include "StaticQueue.h"
 
 #define HM_10_BLE_DEBUG true
 #define HM_10_BLE_BAUDRATE 9600
+#define HM_10_BLE_AT_QUEUE_LEN 4
+#define HM_10_BLE_AT_LEN 24
+#define HM_10_BLE_ANSWER_LEN 32
+#define HM_10_BLE_MESSAGE_LEN 32
+
+// AT command timing [ms]
+#define HM_10_BLE_AT_TIMEOUT 1000     // deadline for a complete answer
+#define HM_10_BLE_AT_QUIET 20         // silence that ends an answer of unknown length
+#define HM_10_BLE_RESET_SETTLE 600    // time the module needs to restart after AT+RESET
+
+// called when an AT command is answered (ok) or fails / times out
+typedef void (*hm10ATCallback)(const char* command, bool ok, const char* answer);
+
+typedef struct {
+  char text[HM_10_BLE_AT_LEN + 1];
+  uint8_t paramOffset;            // start of the parameter in text, 0 if none
+  unsigned int timeout;
+  hm10ATCallback callback;
+} hm10ATCommand;
 
 class HM_10_BLE : public SoftwareSerial {
 public:
   HM_10_BLE(int8_t RXD, int8_t TXD);
 
   void begin(char delimiter);
-  void begin(const char* name, const char* pass, char delimiter);
+  void begin(const char* name, const char* pass, char delimiter, hm10ATCallback configured = NULL);
   
-  void atCommand();
-  void atCommand(const char* cmd);
-  void atCommand(const char* cmd, const char* param);
+  // queue an AT command; the next one is sent as soon as the module's answer matches
+  // "OK", "OK+<cmd>" or "OK+Set:<param>" (queries ending in '?' only need the "OK+" prefix)
+  void atCommand(hm10ATCallback callback = NULL, unsigned int timeout = HM_10_BLE_AT_TIMEOUT);
+  void atCommand(const char* cmd, hm10ATCallback callback = NULL, unsigned int timeout = HM_10_BLE_AT_TIMEOUT);
+  void atCommand(const char* cmd, const char* param, hm10ATCallback callback = NULL, unsigned int timeout = HM_10_BLE_AT_TIMEOUT);
 
   bool atHandler();
   
@@ -54,23 +75,43 @@ public:
 
   // overwrite this if you want something to happen when a message is received
   virtual void processMessage(const char*);
+
+  // commands, answers and messages that did not fit their buffers
+  unsigned int atOverflows() const { return atOverflowCount; }
+  unsigned int messageOverflows() const { return messageOverflowCount; }
+
+  // ms from begin() until the configuration sequence finished, 0 while it is running
+  unsigned long configurationTime() const { return configuredIn; }
  
 private:
-  const int8_t readTries = 20;
-  int8_t readCount = 0;
-
   long baudrate;
 
   bool waitForATCommand = false;
-  QueueList <String> atCommands;
-  String atAnswer;
+  StaticQueue<hm10ATCommand, HM_10_BLE_AT_QUEUE_LEN> atCommands;
+  char atAnswer[HM_10_BLE_ANSWER_LEN + 1];
+  char atExpected[HM_10_BLE_ANSWER_LEN + 1];
+  uint8_t atAnswerLength = 0;
+  bool atExpectedPrefix = false;
+  unsigned long atSentAt = 0;
+  unsigned long atLastByteAt = 0;
+  unsigned long atHoldUntil = 0;
+  unsigned int atOverflowCount = 0;
+
+  unsigned long configureStart = 0;
+  unsigned long configuredIn = 0;
+  hm10ATCallback configuredCallback = NULL;
   
-  void queueATCommand(String cmd);
-  void handleATAnswer();
+  void queueATCommand(const char* cmd, const char* param, hm10ATCallback callback, unsigned int timeout);
+  void expectATAnswer(const hm10ATCommand* command);
+  void handleATAnswer(bool ok);
+  static void configurationDone(const char* command, bool ok, const char* answer);
 
   bool waitForMessage = false;
   char messageDelimiter = '!';
-  String message;
+  char message[HM_10_BLE_MESSAGE_LEN + 1];
+  uint8_t messageLength = 0;
+  bool messageOverflow = false;
+  unsigned int messageOverflowCount = 0;
   void handleMessage();
   void writeMessage(const char* msg);
 };
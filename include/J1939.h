@@ -0,0 +1,92 @@
+#ifndef _J1939_H_
+#define _J1939_H_
+
+#include <Arduino.h>
+#include <mcp_can.h>
+#include "CanFrameQueue.h"
+
+/*
+  J1939 helpers for the RZR bus.
+
+  29-bit identifier layout: priority (3) | EDP/DP (2) | PDU format (8) | PDU specific (8) | source address (8).
+  For PDU1 formats (PF < 240) the PDU specific byte is a destination address and not part of the PGN.
+*/
+
+#define J1939_FRAME_EXTENDED  0x80000000UL
+#define J1939_FRAME_REMOTE    0x40000000UL
+#define J1939_ID_MASK         0x1FFFFFFFUL
+#define J1939_PRIORITY_MASK   0x1C000000UL
+#define J1939_PS_MASK         0x0000FF00UL
+
+#define MCP2515_MASKS   2
+#define MCP2515_FILTERS 6
+
+typedef struct {
+  unsigned long pgn;
+  byte          sourceAddress;
+  void          (*decode)(const canFrame &frame);
+} pgnDecoder;
+
+constexpr bool j1939IsPdu1(unsigned long pgn) {
+  return ((pgn >> 8) & 0xFF) < 240;
+}
+
+constexpr unsigned long j1939Pgn(unsigned long id) {
+  return j1939IsPdu1((id >> 8) & 0x3FFFFUL) ? ((id >> 8) & 0x3FF00UL) : ((id >> 8) & 0x3FFFFUL);
+}
+
+constexpr byte j1939SourceAddress(unsigned long id) {
+  return id & 0xFF;
+}
+
+// Identifier the MCP2515 filters compare against (priority and destination are masked off)
+constexpr unsigned long j1939FilterId(const pgnDecoder &decoder) {
+  return (decoder.pgn << 8) | decoder.sourceAddress;
+}
+
+// One mask is shared by every filter, so a PDU1 entry anywhere opens up the destination byte for all
+constexpr unsigned long j1939FilterMask(const pgnDecoder *table, uint8_t count) {
+  return count == 0 ? (J1939_ID_MASK & ~J1939_PRIORITY_MASK)
+                    : (j1939FilterMask(table + 1, count - 1) & (j1939IsPdu1(table->pgn) ? ~J1939_PS_MASK : J1939_ID_MASK));
+}
+
+/*
+  Program the MCP2515 masks and filters so only the frames in table are accepted.
+
+  Must be called after MCP_CAN::begin(MCP_EXT, ...) and before setMode(), while the controller
+  is still in its initial mode. Unused filters repeat the first entry so they accept nothing else.
+*/
+template<uint8_t N>
+void j1939ConfigureFilters(MCP_CAN &can, const pgnDecoder (&table)[N]) {
+
+  static_assert(N > 0 && N <= MCP2515_FILTERS, "The MCP2515 has six acceptance filters");
+
+  unsigned long mask = j1939FilterMask(table, N);
+
+  for (uint8_t i = 0; i < MCP2515_MASKS; i++)
+    can.init_Mask(i, 1, mask);
+
+  for (uint8_t i = 0; i < MCP2515_FILTERS; i++)
+    can.init_Filt(i, 1, j1939FilterId(table[i < N ? i : 0]));
+}
+
+// Hand frame to the decoder registered for its PGN and source address; returns false if there is none
+template<uint8_t N>
+bool j1939Dispatch(const pgnDecoder (&table)[N], const canFrame &frame) {
+
+  if ((frame.id & (J1939_FRAME_EXTENDED | J1939_FRAME_REMOTE)) != J1939_FRAME_EXTENDED)
+    return false;
+
+  unsigned long pgn = j1939Pgn(frame.id);
+  byte sa = j1939SourceAddress(frame.id);
+
+  for (uint8_t i = 0; i < N; i++) {
+    if (table[i].pgn == pgn && table[i].sourceAddress == sa) {
+      table[i].decode(frame);
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif
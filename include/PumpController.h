@@ -0,0 +1,101 @@
+/*
+   Pump controller between the transfer decision and the pump output.
+
+   The decision (shouldTransferFuel() in main.cpp) says whether fuel should move; the controller
+   decides when the pump actually switches, so that slosh across a limit doesn't chatter the pump
+   and a pump that moves nothing is stopped:
+
+     idle          off, starts on demand if fewer than maxStarts starts fell in the last hour
+     priming       on, for the first dry-run window, in which the lines fill and the level sets
+                   the reference the next window is checked against
+     transferring  on, until the demand is gone and the pump ran at least minOn; at the end of
+                   every window the aux level has to have dropped by dryDrop from the last one
+     cooldown      off, for at least minOff and until the start cap lets it start again
+     fault         off, the level didn't drop while the pump ran: the aux tank is dry or its
+                   sender stuck. Cleared by reset(), or when the level rises by refill (the tank
+                   was filled), then through cooldown.
+
+   The aux level is fed per reading and averaged over each window, so the check compares the
+   means of two windows rather than two readings in the slosh. A pump run at part flow
+   (PumpDrive) is checked once the windows since the last check add up to one at full flow. Every
+   time is a millis() timestamp, so the limits don't depend on how long a loop takes.
+*/
+
+#ifndef PUMPCONTROLLER_h
+#define PUMPCONTROLLER_h
+
+#include <Arduino.h>
+
+#define PUMP_START_HISTORY          8               // most starts per hour that can be allowed
+#define PUMP_START_WINDOW           3600000UL       // [ms]
+#define PUMP_FULL_FLOW              256
+
+typedef enum {
+  PUMP_IDLE,
+  PUMP_PRIMING,
+  PUMP_TRANSFERRING,
+  PUMP_COOLDOWN,
+  PUMP_FAULT
+} pumpState;
+
+typedef struct {
+  uint16_t minOn;                                   // [s]
+  uint16_t minOff;                                  // [s]
+  uint16_t dryWindow;                               // [s]
+  int16_t  dryDrop;                                 // [1/256 %] least drop of the aux level per window
+  int16_t  refill;                                  // [1/256 %] rise of the aux level that clears a fault
+  uint8_t  maxStarts;                               // per hour, up to PUMP_START_HISTORY
+} pumpLimits;
+
+
+class PumpController {
+
+  private:
+    pumpLimits      _limits;
+    pumpState       _state;
+    unsigned long   _switched;                      // [ms] the pump last started or stopped
+    unsigned long   _windowStart;                   // [ms]
+    int32_t         _windowSum;                     // aux levels of the window
+    uint32_t        _windowFlow;                    // and flows
+    uint16_t        _windowReadings;
+    int16_t         _reference;                     // mean aux level of the last checked window, or at the fault
+    bool            _referenced;
+    uint16_t        _flowSince;                     // mean flows of the windows since
+    unsigned long   _starts[PUMP_START_HISTORY];    // [ms] ring of the last starts
+    uint8_t         _startCount;
+    uint8_t         _startNext;
+
+    void expire(unsigned long ms);
+    bool canStart(unsigned long ms);
+    void enter(unsigned long ms, pumpState state);
+    bool closeWindow(unsigned long ms, int16_t *mean, uint16_t *flow);
+
+  public:
+    PumpController(const pumpLimits &limits);
+
+    /*
+      Aux level (1/256 %) of every new reading, and the pump's flow (Q8) meanwhile
+    */
+    void level(int16_t level, uint16_t flow = PUMP_FULL_FLOW);
+
+    /*
+      Step at ms with the current transfer decision, called every loop; returns the pump output
+    */
+    bool update(unsigned long ms, bool demand);
+
+    /*
+      Clear a fault, the pump may start again after minOff
+    */
+    void reset(void);
+
+    pumpState state(void);
+    bool on(void);
+    bool fault(void);
+
+    /*
+      Starts in the last hour
+    */
+    uint8_t starts(unsigned long ms);
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+   Speed of a PWM-driven pump from a fixed-point PI controller on the transfer rate.
+
+   The setpoint and the measurement are rates out of the aux tank as fractions of the pump's full
+   flow, Q8 (256 is full flow). The PI output is a flow: the setpoint fed forward plus the
+   proportional and integral terms of the error. It is turned into a duty through the pump's
+   linear flow model, no flow up to the dead duty and full flow at 255. While running the duty is
+   held within minDuty and maxDuty, and the integral stops growing towards a limit the output is
+   already held at (anti-windup).
+
+   Every change of the duty is slewed at most ramp per second: the pump starts at minDuty and
+   ramps up, a soft start that keeps the motor's inrush current down, and ramps down to stop.
+   Time comes from millis() timestamps, so the ramp and the integral don't depend on the loop.
+*/
+
+#ifndef PUMPDRIVE_h
+#define PUMPDRIVE_h
+
+#include <Arduino.h>
+
+#define PUMP_DRIVE_FULL_FLOW        256
+#define PUMP_DRIVE_INTEGRAL_LIMIT   (256000L * PUMP_DRIVE_FULL_FLOW)
+
+typedef struct {
+  uint8_t  dead;                                    // duty the pump starts to move fuel above
+  uint8_t  minDuty;                                 // while running
+  uint8_t  maxDuty;
+  uint16_t ramp;                                    // duty per second
+  uint16_t kp;                                      // Q8
+  uint16_t ki;                                      // Q8 per second
+} pumpDriveGains;
+
+
+class PumpDrive {
+
+  private:
+    pumpDriveGains  _gains;
+    uint16_t        _duty;                          // Q8, so a slow ramp moves by fractions
+    int32_t         _integral;                      // Q16 of full flow in 1/1000, a ms at a time
+    unsigned long   _time;                          // [ms] of the last update
+
+  public:
+    PumpDrive(const pumpDriveGains &gains);
+
+    /*
+      Step at ms, called every loop: run at setpoint with the measured rate, or ramp down to
+      stop. Returns the duty.
+    */
+    uint8_t update(unsigned long ms, bool run, uint16_t setpoint, int16_t measured);
+
+    uint8_t duty(void);
+
+    /*
+      Flow of the duty by the pump's model, Q8
+    */
+    uint16_t flow(void);
+    uint16_t flowOf(uint8_t duty);
+};
+
+#endif
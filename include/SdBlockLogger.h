@@ -0,0 +1,173 @@
+/*
+   Binary logger that writes whole 512-byte SD blocks into a pre-extended file.
+
+   The file stays open. Fixed-size records are packed into a RAM copy of the current block, and
+   a full block is written in one go at a block-aligned offset, which the SD library sends straight
+   to the card without reading the block first. The file is created SD_LOG_PREALLOCATE_BLOCKS
+   longer than the data and grows by one block for every block filled, so records are never
+   written past its end; the directory entry with the new size is only rewritten every
+   SD_LOG_DIR_UPDATE_BLOCKS blocks. Growing is deferred to the next call that doesn't write a
+   block, so no append() or loop() costs more than one block write.
+
+   A partly filled block is written in place every SD_LOG_SYNC_INTERVAL, so a power cut loses at
+   most that much logging. Block 0 holds the file header and a caller-defined header text; every
+   data block starts with sdLogBlockHeader, and a block whose magic or index doesn't match ends
+   the log. Blocks added to grow the file are copies of the block in RAM, whose index doesn't
+   match their place, so they read as unused.
+
+   The block buffer costs 512 bytes of RAM on top of the SD library's own cache; SdBlockReader
+   reads through the library's cache and needs no buffer of its own, so one can stay open while
+   a download is sent a piece per loop().
+*/
+
+#ifndef SDBLOCKLOGGER_h
+#define SDBLOCKLOGGER_h
+
+#include <Arduino.h>
+#include <SD.h>
+
+#define SD_LOG_BLOCK_SIZE           512
+#define SD_LOG_MAGIC                0xB10C
+#define SD_LOG_FILE_MAGIC           "RZL1"
+#define SD_LOG_HEADER_TEXT_LEN      120
+
+#ifndef SD_LOG_PREALLOCATE_BLOCKS
+#define SD_LOG_PREALLOCATE_BLOCKS   64      // 32 KB ahead of the data
+#endif
+#ifndef SD_LOG_DIR_UPDATE_BLOCKS
+#define SD_LOG_DIR_UPDATE_BLOCKS    8       // blocks added between directory entry writes
+#endif
+#ifndef SD_LOG_SYNC_INTERVAL
+#define SD_LOG_SYNC_INTERVAL        5000    // [ms]
+#endif
+
+typedef struct {
+  uint16_t  magic;
+  uint8_t   count;                          // records in this block
+  uint8_t   recordSize;
+  uint32_t  index;                          // block number in the file
+} sdLogBlockHeader;
+
+typedef struct {
+  char      magic[4];
+  uint8_t   recordSize;
+  char      text[SD_LOG_HEADER_TEXT_LEN];   // e.g. labels, NUL terminated
+} sdLogFileHeader;
+
+#define SD_LOG_RECORDS_PER_BLOCK(size) ((SD_LOG_BLOCK_SIZE - sizeof(sdLogBlockHeader)) / (size))
+
+
+class SdBlockLogger {
+
+  private:
+    File            _file;
+    char            _name[13];
+    uint8_t         _block[SD_LOG_BLOCK_SIZE];
+    uint8_t         _recordSize;
+    uint8_t         _perBlock;
+    uint32_t        _index;                 // block being filled
+    uint32_t        _allocated;             // blocks in the file
+    uint8_t         _grow;                  // blocks to add
+    uint8_t         _grown;                 // blocks added since the directory entry was written
+    bool            _dirty;
+    unsigned long   _lastSync;
+
+    unsigned long   _records;
+    unsigned long   _blocks;
+    unsigned long   _maxWriteMicros;
+    unsigned long   _errors;
+
+    bool writeBlock(void);
+    bool addBlock(void);
+    void grow(void);
+    bool validBlock(uint32_t index, sdLogBlockHeader *header);
+    void startBlock(void);
+
+  public:
+    SdBlockLogger();
+
+    /*
+      Open or create name for records of recordSize bytes and continue after the last record.
+      Returns false if the file can't be opened or was written with another record size.
+    */
+    bool open(const char *name, uint8_t recordSize);
+
+    /*
+      Replace the header text kept in block 0
+    */
+    bool setHeaderText(const char *text);
+
+    /*
+      Add one record; writes the block when it fills up or the sync interval has passed, otherwise
+      grows the file if that is due
+    */
+    bool append(const void *record);
+
+    /*
+      Write the partly filled block now
+    */
+    bool sync(void);
+
+    /*
+      Sync when the interval has passed without a record or grow the file, call once per loop
+    */
+    void loop(void);
+
+    void close(void);
+
+    bool isOpen(void);
+    const char *name(void);
+
+    unsigned long records(void);
+    unsigned long blocks(void);
+    unsigned long maxWriteMicros(void);
+    unsigned long errors(void);
+};
+
+
+class SdBlockReader {
+
+  private:
+    File            _file;
+    uint8_t         _recordSize;
+    uint32_t        _index;                 // block being read
+    uint8_t         _left;                  // records left in the current block
+
+  public:
+    SdBlockReader();
+
+    bool open(const char *name);
+    bool isOpen(void);
+
+    /*
+      Copy the header text into text, read from the card so the reader keeps no copy
+    */
+    bool headerText(char *text, uint8_t size);
+    uint8_t recordSize(void);
+
+    /*
+      Continue reading at the record with this number (0 is the first). Every block but the last
+      is full, so the block is worked out rather than searched for. Returns false past the end.
+    */
+    bool seek(uint32_t record);
+
+    /*
+      Copy the next record into record, returns false at the end of the log
+    */
+    bool next(void *record);
+
+    /*
+      Records in the log, found by bisection over the block headers
+    */
+    uint32_t count(void);
+
+    /*
+      Number of the first record whose time is at or after time, for records that start with a
+      uint32_t time in increasing order. Use seek() before reading on.
+    */
+    uint32_t find(uint32_t time);
+
+    void close(void);
+};
+
+#endif
@@ -0,0 +1,125 @@
+/*
+   Min / max / average rollups kept next to an SdBlockLogger log, so an overview of a long ride
+   can be sent without going through the raw records.
+
+   Every record added updates one bucket per level: 10 s, 1 min and 10 min of log time. When a
+   record falls into a new bucket, the finished one is appended to the level's file as an
+   sdRollupRecord. The files stay open and are flushed every SD_LOG_SYNC_INTERVAL, one file per
+   call, so a power cut loses the buckets in RAM and at most that interval of finished ones.
+
+   The level files are named after the log with the extension replaced (FUEL -> FUEL.R1, .R2 and
+   .R3) and hold a short header followed by fixed-size records in time order. A time is found by
+   bisection over the records, which is what picking the resolution for a query needs.
+
+   Log times have to increase, as AMController::now() does; SD_LOG_TIME_UNITS is how many of them
+   make a second.
+*/
+
+#ifndef SDLOGROLLUP_h
+#define SDLOGROLLUP_h
+
+#include <Arduino.h>
+#include <SD.h>
+#include "SdBlockLogger.h"
+
+#define SD_ROLLUP_LEVELS            3
+#define SD_ROLLUP_VALUES            5
+#define SD_ROLLUP_MAGIC             "RZR1"
+#define SD_ROLLUP_HEADER_LEN        9       // magic, record size, period
+
+#ifndef SD_LOG_TIME_UNITS
+#define SD_LOG_TIME_UNITS           1UL     // per second: 1 for now(), 1000 for millis()
+#endif
+
+#define SD_ROLLUP_MIN               0
+#define SD_ROLLUP_AVG               1
+#define SD_ROLLUP_MAX               2
+
+// 4-byte count keeps the layout the same on the Uno and on host builds
+typedef struct {
+  uint32_t  time;                           // start of the bucket
+  uint32_t  count;                          // records in it
+  float     min[SD_ROLLUP_VALUES];
+  float     max[SD_ROLLUP_VALUES];
+  float     avg[SD_ROLLUP_VALUES];
+} sdRollupRecord;
+
+typedef struct {
+  uint32_t  start;
+  uint32_t  count;
+  float     min[SD_ROLLUP_VALUES];
+  float     max[SD_ROLLUP_VALUES];
+  float     sum[SD_ROLLUP_VALUES];
+} sdRollupBucket;
+
+
+class SdLogRollup {
+
+  private:
+    File            _files[SD_ROLLUP_LEVELS];
+    sdRollupBucket  _buckets[SD_ROLLUP_LEVELS];
+    bool            _unflushed[SD_ROLLUP_LEVELS];
+    uint8_t         _nextFlush;
+    unsigned long   _lastFlush;
+    unsigned long   _errors;
+
+    void emit(uint8_t level);
+
+  public:
+    SdLogRollup();
+
+    /*
+      Bucket length of a level (1..SD_ROLLUP_LEVELS) in log time
+    */
+    static uint32_t period(uint8_t level);
+
+    /*
+      File name of a level of log into name, which has room for 13 characters
+    */
+    static void fileName(const char *log, uint8_t level, char *name);
+
+    /*
+      Open or create the level files of log and append after their last whole record
+    */
+    bool open(const char *log);
+
+    void add(uint32_t time, const float *values);
+
+    /*
+      Flush a file with new buckets when the sync interval has passed, call once per loop
+    */
+    void loop(void);
+
+    /*
+      Write every file's buffered buckets to the card
+    */
+    void sync(void);
+
+    /*
+      Write the unfinished buckets and close the files
+    */
+    void close(void);
+
+    bool isOpen(void);
+    unsigned long errors(void);
+
+    static void remove(const char *log);
+
+    /*
+      Reading a level file opened with SD.open(): number of records, index of the first record
+      starting at or after time, and one record
+    */
+    static uint32_t count(File &file);
+    static uint32_t find(File &file, uint32_t time);
+    static bool read(File &file, uint32_t index, sdRollupRecord *record);
+
+    /*
+      Level to answer a query of log from..to (inclusive) with at most points records: the raw
+      log (0) if it fits, else the finest level that does, else the coarsest there is. first and
+      count are the records of that level in the range, reader is only used while selecting.
+    */
+    static uint8_t select(SdBlockReader &reader, const char *log, uint32_t from, uint32_t to, uint16_t points,
+                          uint32_t *first, uint32_t *count);
+};
+
+#endif
@@ -0,0 +1,166 @@
+/*
+   Piecewise-linear calibration of a fuel level sender.
+
+   A tank that isn't a rectangular box doesn't fill linearly with the sender's travel, so the
+   reading is mapped to a level through points measured while the tank was filled in known
+   steps. The points are resampled into a table of CALIBRATION_SEGMENTS + 1 levels spaced 2^shift
+   readings apart from the first point's reading, with the shift the smallest that spans the
+   points; the node after the last point continues its segment, and readings are held to the
+   points' range, so both ends are exact. A lookup is a shift, two table reads and one 16 x 16 bit
+   multiply, no division. Levels are in 1/256 %, readings in whatever unit the points were taken
+   in.
+
+   The default table is built by the compiler from a constexpr array of points
+   (calibrationTableOf()) and lives in flash. A calibration taken on the vehicle (start(),
+   record() for every step, save()) goes to a record in the EEPROM with its points and its table,
+   which is then read from there, so neither costs RAM beyond the points of a calibration in
+   progress. src/calgen turns the stored points back into the default table's source.
+*/
+
+#ifndef SENDERCALIBRATION_h
+#define SENDERCALIBRATION_h
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#define CALIBRATION_SEGMENTS        32
+#define CALIBRATION_MAX_POINTS      12
+#define CALIBRATION_VERSION         1
+
+
+typedef struct {
+  uint16_t reading;
+  uint8_t  percent;
+  uint8_t  reserved;
+} calibrationPoint;
+
+typedef struct {
+  uint16_t base;                                    // reading of level[0], the first point's
+  uint16_t top;                                     // the last point's reading
+  uint8_t  shift;                                   // level[i] is at base + (i << shift)
+  uint8_t  reserved;
+  int16_t  level[CALIBRATION_SEGMENTS + 1];
+} calibrationTable;
+
+// Layout in the EEPROM, CRC-16 over everything before it
+typedef struct {
+  uint8_t          version;
+  uint8_t          count;
+  calibrationPoint points[CALIBRATION_MAX_POINTS];
+  calibrationTable table;
+  uint16_t         crc;
+} calibrationRecord;
+
+
+// Rounded to the nearest, halves away from zero
+constexpr long calibrationDivide(long numerator, long denominator) {
+  return (2 * numerator + (numerator < 0 ? -denominator : denominator)) / (2 * denominator);
+}
+
+// Level at reading on the line through two points
+constexpr long calibrationLine(const calibrationPoint &from, const calibrationPoint &to, long reading) {
+  return ((long)from.percent << 8) +
+         calibrationDivide(((long)to.percent - from.percent) * 256 * (reading - from.reading), (long)to.reading - from.reading);
+}
+
+// Level at reading of points sorted by reading, flat before the first one and on the last
+// segment's line past the last one
+constexpr long calibrationLevel(const calibrationPoint *points, uint8_t count, long reading) {
+  return count == 1 || reading <= points[0].reading ? (long)points[0].percent << 8
+       : count == 2 || reading < points[1].reading ? calibrationLine(points[0], points[1], reading)
+       : calibrationLevel(points + 1, count - 1, reading);
+}
+
+constexpr int16_t calibrationNode(long level) {
+  return level < -32768 ? -32768 : level > 32767 ? 32767 : level;
+}
+
+// Smallest shift with which the table spans range
+constexpr uint8_t calibrationShift(uint16_t range, uint8_t shift = 0) {
+  return (range >> shift) <= CALIBRATION_SEGMENTS ? shift : calibrationShift(range, shift + 1);
+}
+
+constexpr bool calibrationSorted(const calibrationPoint *points, uint8_t count) {
+  return count < 2 || (points[0].reading < points[1].reading && calibrationSorted(points + 1, count - 1));
+}
+
+// Table node indices 0..N-1 as a parameter pack
+template<uint8_t... I> struct calibrationNodes {};
+template<uint8_t N, uint8_t... I> struct calibrationNodeList : calibrationNodeList<N - 1, N - 1, I...> {};
+template<uint8_t... I> struct calibrationNodeList<0, I...> { typedef calibrationNodes<I...> type; };
+
+template<uint8_t... I>
+constexpr calibrationTable calibrationBuild(const calibrationPoint *points, uint8_t count, uint16_t base, uint8_t shift,
+                                            calibrationNodes<I...>) {
+  return { base, points[count - 1].reading, shift, 0,
+           { calibrationNode(calibrationLevel(points, count, base + ((long)I << shift)))... } };
+}
+
+// Table of points sorted by reading, at compile time for a constexpr array
+constexpr calibrationTable calibrationTableOf(const calibrationPoint *points, uint8_t count) {
+  return calibrationBuild(points, count, points[0].reading,
+                          calibrationShift(points[count - 1].reading - points[0].reading),
+                          calibrationNodeList<CALIBRATION_SEGMENTS + 1>::type());
+}
+
+
+class SenderCalibration {
+
+  private:
+    const calibrationTable *_defaults;              // in flash
+    uint16_t        _start;                         // EEPROM address of the calibrationRecord
+    bool            _stored;
+    uint16_t        _base;
+    uint16_t        _top;
+    uint8_t         _shift;
+    bool            _recording;
+    uint8_t         _count;
+    calibrationPoint _points[CALIBRATION_MAX_POINTS];
+
+    int16_t node(uint8_t index);
+    void load(void);
+
+  public:
+    /*
+      defaults is a calibrationTable in PROGMEM
+    */
+    SenderCalibration(const calibrationTable *defaults);
+
+    /*
+      Use the calibration stored at start if there is a valid one, the defaults otherwise
+    */
+    bool begin(uint16_t start);
+
+    /*
+      Level at reading, in 1/256 % and in whole percent (0 .. 100)
+    */
+    int16_t level(uint16_t reading);
+    uint8_t percent(uint16_t reading);
+
+    /*
+      Calibration procedure: start(), then record() the reading at every known level, a level
+      recorded again replaces its point, and save() the points to the EEPROM. save() fails
+      without two points or when the levels don't rise or fall steadily with the reading.
+    */
+    void start(void);
+    bool record(uint16_t reading, uint8_t percent);
+    bool save(void);
+    void cancel(void);
+
+    /*
+      Forget the stored calibration and go back to the defaults
+    */
+    void clear(void);
+
+    bool recording(void);
+    uint8_t points(void);
+    bool stored(void);
+
+    /*
+      Sort points by reading and check them as save() does
+    */
+    static bool sortPoints(calibrationPoint *points, uint8_t count);
+};
+
+#endif
@@ -0,0 +1,25 @@
+/*
+   Worst-case stack use on the AVR, measured by painting.
+
+   Before the C runtime sets anything up, the free RAM between the end of the static data and
+   the top of the stack is filled with STACK_PAINT. The stack grows down into it, and whatever it
+   reached, in loop() or in any interrupt, is overwritten. stackHeadroom() counts the painted
+   bytes left above the static data: the least free RAM there has been since reset. The sketch
+   doesn't use the heap; if something did, the count would stop at its first block and read low.
+
+   On the host there is nothing to paint and stackHeadroom() returns 0.
+*/
+
+#ifndef STACKPAINT_h
+#define STACKPAINT_h
+
+#include <Arduino.h>
+
+#define STACK_PAINT                 0xC5
+
+/*
+  Bytes between the static data and the deepest the stack has been since reset
+*/
+uint16_t stackHeadroom(void);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+   Fixed-capacity FIFO queue with no dynamic allocation.
+
+   Storage for N items is part of the object, so the memory cost is known at compile time
+   and a full queue is reported to the caller instead of failing at runtime. When N is a
+   power of two the indices wrap with a mask, otherwise with a compare.
+*/
+
+#ifndef _STATICQUEUE_H
+#define _STATICQUEUE_H
+
+#include <Arduino.h>
+
+template<typename T, uint8_t N>
+class StaticQueue {
+
+  static_assert(N > 0, "StaticQueue needs room for at least one item");
+
+  public:
+    static constexpr uint8_t capacity = N;
+
+    StaticQueue() : _head(0), _count(0) {}
+
+    // Append a copy of item, returns false if the queue is full
+    bool tryPush(const T &item) {
+      if (_count >= N)
+        return false;
+      _items[wrap(_head + _count)] = item;
+      _count++;
+      return true;
+    }
+
+    // Move the oldest item into item, returns false if the queue is empty
+    bool tryPop(T &item) {
+      if (_count == 0)
+        return false;
+      item = _items[_head];
+      pop();
+      return true;
+    }
+
+    // Oldest item, or NULL if the queue is empty
+    T *peek() {
+      return _count == 0 ? NULL : &_items[_head];
+    }
+
+    const T *peek() const {
+      return _count == 0 ? NULL : &_items[_head];
+    }
+
+    // Discard the oldest item
+    void pop() {
+      if (_count == 0)
+        return;
+      _head = wrap(_head + 1);
+      _count--;
+    }
+
+    void clear() {
+      _head = 0;
+      _count = 0;
+    }
+
+    bool isEmpty() const {
+      return _count == 0;
+    }
+
+    bool isFull() const {
+      return _count >= N;
+    }
+
+    uint8_t count() const {
+      return _count;
+    }
+
+  private:
+    static constexpr bool powerOfTwo = (N & (N - 1)) == 0;
+
+    static uint8_t wrap(uint16_t index) {
+      return powerOfTwo ? (index & (N - 1)) : (index >= N ? index - N : index);
+    }
+
+    T       _items[N];
+    uint8_t _head;
+    uint8_t _count;
+};
+
+template<typename T, uint8_t N>
+constexpr uint8_t StaticQueue<T, N>::capacity;
+
+#endif // _STATICQUEUE_H
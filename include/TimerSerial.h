@@ -0,0 +1,74 @@
+/*
+   SoftwareSerial with an interrupt-driven transmitter.
+
+   SoftwareSerial::write() bit-bangs every byte with interrupts disabled, stalling the CPU for
+   about 1 ms per byte at 9600 baud and holding off the CAN and ADC interrupts. TimerSerial keeps
+   SoftwareSerial for receiving but queues outgoing bytes in a ring buffer that a Timer2 compare
+   interrupt shifts out one bit per tick, so write() returns immediately while there is room.
+
+   Only one instance can exist (it owns Timer2, which also drives tone() and PWM on pins 3 and 11).
+   A byte being received holds off the timer interrupt for its whole duration, so bytes sent while
+   the module is talking to us can be distorted; the AMController traffic is request/response
+   and rarely overlaps.
+
+   Any other interrupt running when a compare match comes delays that bit's edge. The edges
+   after it stay on the timer, so the delays don't add up, and the receiver samples the middle
+   of a bit: a delay up to about 40 % of a bit (40 us at 9600 baud) is harmless, one longer than
+   a bit loses the match and the byte. The ADC interrupt (AdcAcquisition) takes about 5 us. The
+   CAN interrupt reads a frame over SPI for about 70 us, so it lets this interrupt preempt it
+   (onCanInterrupt() in main.cpp).
+
+   On host builds the queue drains at the configured baud rate against the virtual clock.
+*/
+
+#ifndef TIMERSERIAL_h
+#define TIMERSERIAL_h
+
+#include <Arduino.h>
+#include <SoftwareSerial.h>
+
+#ifndef TIMER_SERIAL_TX_QUEUE_SIZE
+#define TIMER_SERIAL_TX_QUEUE_SIZE  64
+#endif
+
+
+class TimerSerial : public SoftwareSerial {
+
+  static_assert((TIMER_SERIAL_TX_QUEUE_SIZE & (TIMER_SERIAL_TX_QUEUE_SIZE - 1)) == 0 && TIMER_SERIAL_TX_QUEUE_SIZE <= 128,
+                "TIMER_SERIAL_TX_QUEUE_SIZE must be a power of two <= 128");
+
+  private:
+    uint8_t         _txPin;
+
+#if !defined(__AVR__)
+    unsigned long   _byteMicros;
+    unsigned long   _txTime;
+
+    void service(void);
+#endif
+
+  public:
+    TimerSerial(uint8_t receivePin, uint8_t transmitPin);
+
+    void begin(long speed);
+
+    /*
+      Queue a byte for transmission. Blocks only while the queue is full, use txFree() to avoid that.
+      Must not be called from an interrupt handler.
+    */
+    virtual size_t write(uint8_t byte);
+    using Print::write;
+
+    /*
+      Bytes that can be written without blocking
+    */
+    int txFree(void);
+    virtual int availableForWrite(void);
+
+    /*
+      Wait until every queued byte has been sent
+    */
+    virtual void flush(void);
+};
+
+#endif
@@ -0,0 +1,310 @@
+#include "Arduino.h"
+#include "ArduinoNative.h"
+
+// An analogRead() takes 13 ADC clocks at 125 kHz plus setup on the Uno
+#define NATIVE_ANALOG_READ_MICROS 112
+
+static unsigned long clockMicros = 0;
+static bool advancing = false;
+static void (*advanceHook)(unsigned long now) = NULL;
+
+static uint8_t pinModes[NUM_DIGITAL_PINS];
+static uint8_t pinInputs[NUM_DIGITAL_PINS];
+static int pinOutputs[NUM_DIGITAL_PINS];
+static int analogInputs[NUM_ANALOG_INPUTS];
+static void (*pinHook)(uint8_t pin, int value) = NULL;
+static int (*analogHook)(uint8_t pin) = NULL;
+
+static bool interruptsEnabled = true;
+static bool inInterrupt = false;
+static void (*interruptHandlers[2])(void) = { NULL, NULL };
+static int interruptModes[2];
+static bool interruptPending[2] = { false, false };
+
+// One hardware timer interrupt, e.g. the compare match that triggers ADC conversions
+static unsigned long timerPeriod = 0;
+static unsigned long timerNext = 0;
+static void (*timerHandler)(void) = NULL;
+static bool timerPending = false;
+
+// Script events, defined in ArduinoNative.cpp
+void nativeRunScript(unsigned long now);
+unsigned long nativeNextEvent(void);
+
+static void runInterrupts(void) {
+  if (!interruptsEnabled || inInterrupt)
+    return;
+
+  // Like the hardware flag, ticks missed while interrupts were off fire once
+  if (timerPending && timerHandler != NULL) {
+    timerPending = false;
+    inInterrupt = true;
+    interruptsEnabled = false;
+    timerHandler();
+    interruptsEnabled = true;
+    inInterrupt = false;
+  }
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (interruptPending[i] && interruptHandlers[i] != NULL) {
+      interruptPending[i] = false;
+      inInterrupt = true;
+      interruptsEnabled = false;
+      interruptHandlers[i]();
+      interruptsEnabled = true;
+      inInterrupt = false;
+    }
+  }
+}
+
+void nativeAdvance(unsigned long us) {
+  unsigned long target = clockMicros + us;
+
+  if (advancing) {
+    // Time passing inside a script event or hook, no events are fired from here
+    clockMicros = target;
+    return;
+  }
+
+  advancing = true;
+  unsigned long next;
+  while ((next = nativeNextEvent()) <= target || (timerPeriod > 0 && timerNext <= target)) {
+    // Timer ticks and script events in time order
+    if (timerPeriod > 0 && timerNext <= next) {
+      if (timerNext > clockMicros)
+        clockMicros = timerNext;
+      timerNext += timerPeriod;
+      timerPending = true;
+      runInterrupts();
+      continue;
+    }
+    if (next > clockMicros)
+      clockMicros = next;
+    nativeRunScript(clockMicros);
+  }
+  clockMicros = target;
+  if (advanceHook != NULL)
+    advanceHook(clockMicros);
+  advancing = false;
+
+  runInterrupts();
+}
+
+unsigned long nativeMicros(void) {
+  return clockMicros;
+}
+
+void nativeTimerInterrupt(unsigned long periodMicros, void (*handler)(void)) {
+  timerPeriod = periodMicros;
+  timerNext = clockMicros + periodMicros;
+  timerHandler = handler;
+  timerPending = false;
+}
+
+void nativeOnAdvance(void (*hook)(unsigned long now)) {
+  advanceHook = hook;
+}
+
+unsigned long millis(void) {
+  return clockMicros / 1000;
+}
+
+unsigned long micros(void) {
+  return clockMicros;
+}
+
+void delay(unsigned long ms) {
+  nativeAdvance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  nativeAdvance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= NUM_DIGITAL_PINS)
+    return;
+  pinModes[pin] = mode;
+  if (mode == INPUT_PULLUP)
+    pinInputs[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  if (pin >= NUM_DIGITAL_PINS)
+    return;
+  int value = val ? HIGH : LOW;
+  if (pinOutputs[pin] != value) {
+    pinOutputs[pin] = value;
+    if (pinHook != NULL)
+      pinHook(pin, value);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= NUM_DIGITAL_PINS)
+    return LOW;
+  return pinModes[pin] == OUTPUT ? pinOutputs[pin] : pinInputs[pin];
+}
+
+int nativeAnalogSample(uint8_t pin) {
+  if (pin >= A0)
+    pin -= A0;
+  if (pin >= NUM_ANALOG_INPUTS)
+    return 0;
+  return analogHook != NULL ? analogHook(pin + A0) : analogInputs[pin];
+}
+
+int analogRead(uint8_t pin) {
+  nativeAdvance(NATIVE_ANALOG_READ_MICROS);
+  return nativeAnalogSample(pin);
+}
+
+void analogWrite(uint8_t pin, int val) {
+  if (pin >= NUM_DIGITAL_PINS)
+    return;
+  val = constrain(val, 0, 255);
+  if (pinOutputs[pin] != val) {
+    pinOutputs[pin] = val;
+    if (pinHook != NULL)
+      pinHook(pin, val);
+  }
+}
+
+void nativeSetAnalog(uint8_t pin, int value) {
+  if (pin >= A0)
+    pin -= A0;
+  if (pin < NUM_ANALOG_INPUTS)
+    analogInputs[pin] = constrain(value, 0, 1023);
+}
+
+// Level change on an input, pins 2 and 3 raise INT0 / INT1 on the configured edge
+void nativeSetDigital(uint8_t pin, uint8_t value) {
+  if (pin >= NUM_DIGITAL_PINS)
+    return;
+
+  uint8_t previous = pinInputs[pin];
+  pinInputs[pin] = value ? HIGH : LOW;
+  if (previous == pinInputs[pin])
+    return;
+
+  int num = digitalPinToInterrupt(pin);
+  if (num == NOT_AN_INTERRUPT || interruptHandlers[num] == NULL)
+    return;
+
+  int mode = interruptModes[num];
+  if (mode == CHANGE || (mode == FALLING && !pinInputs[pin]) || (mode == RISING && pinInputs[pin])) {
+    interruptPending[num] = true;
+    runInterrupts();
+  }
+}
+
+void nativeOnAnalogRead(int (*hook)(uint8_t pin)) {
+  analogHook = hook;
+}
+
+int nativePinOutput(uint8_t pin) {
+  return pin < NUM_DIGITAL_PINS ? pinOutputs[pin] : 0;
+}
+
+void nativeOnPinChange(void (*hook)(uint8_t pin, int value)) {
+  pinHook = hook;
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode) {
+  if (interruptNum >= 2)
+    return;
+  interruptHandlers[interruptNum] = userFunc;
+  interruptModes[interruptNum] = mode;
+  interruptPending[interruptNum] = false;
+}
+
+void detachInterrupt(uint8_t interruptNum) {
+  if (interruptNum < 2)
+    interruptHandlers[interruptNum] = NULL;
+}
+
+void interrupts(void) {
+  interruptsEnabled = true;
+  runInterrupts();
+}
+
+void noInterrupts(void) {
+  interruptsEnabled = false;
+}
+
+// Used by util/atomic.h
+uint8_t nativeInterruptsSave(void) {
+  uint8_t state = interruptsEnabled;
+  interruptsEnabled = false;
+  return state;
+}
+
+void nativeInterruptsRestore(uint8_t state) {
+  if (state)
+    interrupts();
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+static unsigned long randomState = 1;
+
+long random(long howbig) {
+  if (howbig == 0)
+    return 0;
+  // Same sequence on every host
+  randomState = randomState * 1103515245UL + 12345UL;
+  return ((randomState >> 16) & 0x7FFFFFFFUL) % howbig;
+}
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig)
+    return howsmall;
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0)
+    randomState = seed;
+}
+
+char *ultoa(unsigned long value, char *buffer, int radix) {
+  char digits[8 * sizeof(unsigned long) + 1];
+  int count = 0;
+
+  if (radix < 2 || radix > 36)
+    radix = 10;
+  do {
+    int digit = value % radix;
+    digits[count++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    value /= radix;
+  } while (value > 0);
+
+  for (int i = 0; i < count; i++)
+    buffer[i] = digits[count - 1 - i];
+  buffer[count] = '\0';
+  return buffer;
+}
+
+char *ltoa(long value, char *buffer, int radix) {
+  if (value < 0 && radix == 10) {
+    buffer[0] = '-';
+    ultoa(-(unsigned long)value, buffer + 1, radix);
+    return buffer;
+  }
+  return ultoa((unsigned long)value, buffer, radix);
+}
+
+char *utoa(unsigned int value, char *buffer, int radix) {
+  return ultoa(value, buffer, radix);
+}
+
+char *itoa(int value, char *buffer, int radix) {
+  return ltoa(value, buffer, radix);
+}
+
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer) {
+  sprintf(buffer, "%*.*f", width, precision, value);
+  return buffer;
+}
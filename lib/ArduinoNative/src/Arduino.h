@@ -0,0 +1,121 @@
+/*
+   Host stand-in for the Arduino core, used by [env:native].
+
+   Only the parts of the API this project touches are provided. Time is virtual: millis() and
+   micros() only move when the harness advances the clock (between loop() calls, in delay() and
+   while bytes are shifted out of a SoftwareSerial), so a run is deterministic and as fast as the
+   host allows. Pins, the ADC, the MCP2515, the SD card and the EEPROM are driven from
+   ArduinoNative.h.
+
+   Differences to the Uno that matter: int is 32 bits and unsigned long is 64 bits on most hosts,
+   so overflow behaviour and struct sizes are not those of the target.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#ifndef ARDUINO
+#define ARDUINO 10819
+#endif
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define NUM_DIGITAL_PINS 20
+#define NUM_ANALOG_INPUTS 6
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define LED_BUILTIN 13
+
+#define NOT_A_PIN 0
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : NOT_AN_INTERRUPT))
+
+#define PI 3.1415926535897932384626433832795
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define bit(b) (1UL << (b))
+#define _BV(b) (1 << (b))
+
+// Templates instead of the AVR core's macros so host headers included later still compile
+template<class T, class L>
+auto min(const T &a, const L &b) -> decltype(a < b ? a : b) {
+  return (b < a) ? b : a;
+}
+
+template<class T, class L>
+auto max(const T &a, const L &b) -> decltype(a < b ? a : b) {
+  return (a < b) ? b : a;
+}
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define sq(x) ((x) * (x))
+
+#define F(string_literal) (string_literal)
+#define PSTR(string_literal) (string_literal)
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode);
+void detachInterrupt(uint8_t interruptNum);
+void interrupts(void);
+void noInterrupts(void);
+#define cli() noInterrupts()
+#define sei() interrupts()
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+char *itoa(int value, char *buffer, int radix);
+char *ltoa(long value, char *buffer, int radix);
+char *utoa(unsigned int value, char *buffer, int radix);
+char *ultoa(unsigned long value, char *buffer, int radix);
+char *dtostrf(double value, signed char width, unsigned char precision, char *buffer);
+
+#include "Print.h"
+#include "Stream.h"
+#include "HardwareSerial.h"
+
+void setup(void);
+void loop(void);
+
+#endif
@@ -0,0 +1,221 @@
+#include "ArduinoNative.h"
+#include <getopt.h>
+#include <time.h>
+
+#define NATIVE_DEFAULT_RUN_MS 60000UL
+#define NATIVE_DEFAULT_LOOP_MICROS 1000UL
+#define NATIVE_NO_EVENT ((unsigned long)-1)
+
+typedef enum {
+  NATIVE_ANALOG,
+  NATIVE_DIGITAL,
+  NATIVE_CAN,
+  NATIVE_BLE
+} nativeEventType;
+
+typedef struct {
+  unsigned long time;                   // us
+  nativeEventType type;
+  unsigned long id;                     // pin or CAN id
+  int value;
+  uint8_t length;
+  uint8_t data[8];
+  char *text;
+} nativeEvent;
+
+static nativeEvent *events = NULL;
+static size_t eventCount = 0;
+static size_t nextEvent = 0;
+static unsigned long scriptEnd = 0;
+
+static FILE *bleOut = NULL;
+
+unsigned long nativeNextEvent(void) {
+  return nextEvent < eventCount ? events[nextEvent].time : NATIVE_NO_EVENT;
+}
+
+// Apply every event due at now, called from nativeAdvance()
+void nativeRunScript(unsigned long now) {
+  while (nextEvent < eventCount && events[nextEvent].time <= now) {
+    nativeEvent *event = &events[nextEvent++];
+
+    switch (event->type) {
+      case NATIVE_ANALOG:
+        nativeSetAnalog(event->id, event->value);
+        break;
+      case NATIVE_DIGITAL:
+        nativeSetDigital(event->id, event->value);
+        break;
+      case NATIVE_CAN:
+        nativeCanInject(event->id, event->length, event->data);
+        break;
+      case NATIVE_BLE:
+        nativeSerialInject((const uint8_t *)event->text, strlen(event->text));
+        break;
+    }
+  }
+}
+
+static bool parseEvent(char *line, nativeEvent *event) {
+  char command[16];
+  unsigned long ms;
+  int consumed = 0;
+
+  if (sscanf(line, "%lu %15s %n", &ms, command, &consumed) < 2)
+    return false;
+
+  char *arguments = line + consumed;
+  memset(event, 0, sizeof(*event));
+  event->time = ms * 1000;
+
+  if (strcmp(command, "analog") == 0 || strcmp(command, "digital") == 0) {
+    event->type = command[0] == 'a' ? NATIVE_ANALOG : NATIVE_DIGITAL;
+    return sscanf(arguments, "%lu %d", &event->id, &event->value) == 2;
+  }
+
+  if (strcmp(command, "can") == 0) {
+    event->type = NATIVE_CAN;
+    if (sscanf(arguments, "%lx %n", &event->id, &consumed) < 1)
+      return false;
+    if (event->id > 0x7FF)
+      event->id |= 0x80000000UL;
+    arguments += consumed;
+    unsigned int byte;
+    while (event->length < 8 && sscanf(arguments, "%x %n", &byte, &consumed) == 1) {
+      event->data[event->length++] = byte;
+      arguments += consumed;
+    }
+    return true;
+  }
+
+  if (strcmp(command, "ble") == 0) {
+    event->type = NATIVE_BLE;
+    arguments[strcspn(arguments, "\r\n")] = '\0';
+    event->text = strdup(arguments);
+    return true;
+  }
+
+  if (strcmp(command, "end") == 0) {
+    scriptEnd = ms;
+    return false;
+  }
+
+  fprintf(stderr, "unknown script command: %s\n", command);
+  return false;
+}
+
+bool nativeLoadScript(const char *path) {
+  FILE *file = fopen(path, "r");
+  char line[512];
+
+  if (file == NULL)
+    return false;
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    nativeEvent event;
+
+    if (line[0] == ';' || !parseEvent(line, &event))
+      continue;
+
+    events = (nativeEvent *)realloc(events, (eventCount + 1) * sizeof(nativeEvent));
+
+    // Keep the events in time order, equal times in file order
+    size_t i = eventCount++;
+    while (i > nextEvent && events[i - 1].time > event.time) {
+      events[i] = events[i - 1];
+      i--;
+    }
+    events[i] = event;
+  }
+
+  fclose(file);
+  return true;
+}
+
+unsigned long nativeScriptEnd(void) {
+  return scriptEnd;
+}
+
+static void writeBleOut(uint8_t byte) {
+  fputc(byte, bleOut);
+}
+
+static double hostSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int nativeRun(int argc, char **argv) {
+  unsigned long runMs = 0;
+  unsigned long loopMicros = NATIVE_DEFAULT_LOOP_MICROS;
+  const char *eepromPath = NULL;
+  int option;
+
+  while ((option = getopt(argc, argv, "s:t:l:qo:d:e:")) != -1) {
+    switch (option) {
+      case 's':
+        if (!nativeLoadScript(optarg)) {
+          fprintf(stderr, "cannot read script %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        runMs = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        loopMicros = strtoul(optarg, NULL, 10);
+        break;
+      case 'q':
+        nativeSerialQuiet(true);
+        break;
+      case 'o':
+        bleOut = strcmp(optarg, "-") == 0 ? stdout : fopen(optarg, "wb");
+        if (bleOut == NULL) {
+          fprintf(stderr, "cannot write %s\n", optarg);
+          return 1;
+        }
+        nativeOnSerialTx(&writeBleOut);
+        break;
+      case 'd':
+        nativeSdRoot(optarg);
+        break;
+      case 'e':
+        eepromPath = optarg;
+        nativeEepromLoad(eepromPath);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-s script] [-t ms] [-l us] [-q] [-o file] [-d sd-dir] [-e eeprom-file]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (runMs == 0)
+    runMs = scriptEnd > 0 ? scriptEnd : NATIVE_DEFAULT_RUN_MS;
+
+  double start = hostSeconds();
+  unsigned long loops = 0;
+
+  setup();
+  while (millis() < runMs) {
+    loop();
+    loops++;
+    nativeAdvance(loopMicros);
+  }
+
+  double elapsed = hostSeconds() - start;
+
+  fflush(stdout);
+  if (bleOut != NULL && bleOut != stdout)
+    fclose(bleOut);
+  if (eepromPath != NULL)
+    nativeEepromSave(eepromPath);
+
+  fprintf(stderr, "%lu ms simulated in %.3f s, %lu loops (%.0f loops/s), %lu CAN overflows, %lu max EEPROM writes\n",
+          millis(), elapsed, loops, elapsed > 0 ? loops / elapsed : 0.0, nativeCanOverflows(), nativeEepromMaxWrites());
+  return 0;
+}
+
+__attribute__((weak)) int main(int argc, char **argv) {
+  return nativeRun(argc, argv);
+}
@@ -0,0 +1,87 @@
+/*
+   Control surface of the host harness behind [env:native].
+
+   The default main() runs setup() and then loop() until the script ends, advancing the virtual
+   clock by a fixed cost per loop() call:
+
+     program [-s script] [-t ms] [-l us] [-q] [-o file] [-d sd-dir] [-e eeprom-file]
+
+       -s  script of timed inputs (see below), default none
+       -t  stop after this many ms of virtual time, default 60000 or the script's end
+       -l  virtual time a loop() call costs, default 1000 us
+       -q  discard Serial output
+       -o  write bytes sent to the BLE module to file ("-" for stdout)
+       -d  directory backing the SD card, default ./sd
+       -e  file the EEPROM is loaded from and saved to, default none (erased EEPROM)
+
+   A script line is "<ms> <command> <arguments>", lines starting with ';' are comments:
+
+     1000 analog 14 300                 ADC reading of A0 from now on
+     1000 digital 3 0                   level of an input pin
+     1500 can 18FEFC17 00 C0 00 00      extended CAN frame, hex id and data bytes
+     2000 ble manualPumpOn=1#           text arriving from the BLE module
+     9000 end                           stop the run
+
+   Programs that drive the inputs themselves (simulators, replays) define their own main() and
+   use the functions below; the harness' main() is weak.
+*/
+
+#ifndef ArduinoNative_h
+#define ArduinoNative_h
+
+#include "Arduino.h"
+
+// Virtual clock, fires due script events, CAN interrupts and the advance hook
+void nativeAdvance(unsigned long us);
+unsigned long nativeMicros(void);
+
+// Called every time the clock moves, e.g. to integrate a plant model
+void nativeOnAdvance(void (*hook)(unsigned long now));
+
+// Inputs
+void nativeSetAnalog(uint8_t pin, int value);
+void nativeSetDigital(uint8_t pin, uint8_t value);
+
+// Serve analogRead() from hook instead of the values set above, e.g. to replay recorded samples
+void nativeOnAnalogRead(int (*hook)(uint8_t pin));
+
+// What a conversion of pin reads, without the time analogRead() costs, for code driving the ADC itself
+int nativeAnalogSample(uint8_t pin);
+
+// A hardware timer interrupt every periodMicros of virtual time, 0 stops it; held off like the
+// external interrupts while interrupts are disabled
+void nativeTimerInterrupt(unsigned long periodMicros, void (*handler)(void));
+
+// Outputs; value is HIGH / LOW after digitalWrite() and 0..255 after analogWrite()
+int nativePinOutput(uint8_t pin);
+void nativeOnPinChange(void (*hook)(uint8_t pin, int value));
+
+// Bytes arriving at the SoftwareSerial receiver, paced at its baud rate
+void nativeSerialInject(const uint8_t *data, size_t length);
+void nativeOnSerialTx(void (*hook)(uint8_t byte));
+
+// Serial (USB) output on or off
+void nativeSerialQuiet(bool quiet);
+
+// Put a frame on the bus; id has bit 31 set for extended frames like MCP_CAN::readMsgBuf() returns.
+// Returns false if the MCP2515 filters rejected it or both receive buffers were full.
+bool nativeCanInject(unsigned long id, uint8_t length, const uint8_t *data);
+void nativeCanIntPin(uint8_t pin);
+unsigned long nativeCanOverflows(void);
+
+// Host directory the SD card is backed by
+void nativeSdRoot(const char *path);
+
+// EEPROM contents, wear and bytes read so far
+bool nativeEepromLoad(const char *path);
+bool nativeEepromSave(const char *path);
+unsigned long nativeEepromWrites(int address);
+unsigned long nativeEepromMaxWrites(void);
+unsigned long nativeEepromReads(void);
+
+// Script handling used by the default main()
+bool nativeLoadScript(const char *path);
+unsigned long nativeScriptEnd(void);
+int nativeRun(int argc, char **argv);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Stream.h"
+
+// The USB serial port, written to the host's stdout (or nowhere with the harness' -q)
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long) {}
+    void end() {}
+
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+
+    virtual size_t write(uint8_t c);
+    using Print::write;
+
+    virtual int availableForWrite() { return 63; }
+    virtual void flush();
+
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,115 @@
+#include "Arduino.h"
+#include "ArduinoNative.h"
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    if (write(*buffer++))
+      n++;
+    else
+      break;
+  }
+  return n;
+}
+
+size_t Print::print(const char *str) {
+  return write(str);
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char value, int base) {
+  return print((unsigned long)value, base);
+}
+
+size_t Print::print(int value, int base) {
+  return print((long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base) {
+  return print((unsigned long)value, base);
+}
+
+size_t Print::print(long value, int base) {
+  char buffer[8 * sizeof(long) + 2];
+  if (base == 0)
+    return write((uint8_t)value);
+  return write(ltoa(value, buffer, base));
+}
+
+size_t Print::print(unsigned long value, int base) {
+  char buffer[8 * sizeof(long) + 1];
+  if (base == 0)
+    return write((uint8_t)value);
+  return write(ultoa(value, buffer, base));
+}
+
+size_t Print::print(double value, int digits) {
+  char buffer[48];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+  return write(buffer);
+}
+
+size_t Print::println(void) {
+  return write("\r\n");
+}
+
+size_t Print::println(const char *str) {
+  size_t n = print(str);
+  return n + println();
+}
+
+size_t Print::println(char c) {
+  size_t n = print(c);
+  return n + println();
+}
+
+size_t Print::println(unsigned char value, int base) {
+  size_t n = print(value, base);
+  return n + println();
+}
+
+size_t Print::println(int value, int base) {
+  size_t n = print(value, base);
+  return n + println();
+}
+
+size_t Print::println(unsigned int value, int base) {
+  size_t n = print(value, base);
+  return n + println();
+}
+
+size_t Print::println(long value, int base) {
+  size_t n = print(value, base);
+  return n + println();
+}
+
+size_t Print::println(unsigned long value, int base) {
+  size_t n = print(value, base);
+  return n + println();
+}
+
+size_t Print::println(double value, int digits) {
+  size_t n = print(value, digits);
+  return n + println();
+}
+
+static bool serialQuiet = false;
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (!serialQuiet && c != '\r')
+    fputc(c, stdout);
+  return 1;
+}
+
+void HardwareSerial::flush() {
+  fflush(stdout);
+}
+
+void nativeSerialQuiet(bool quiet) {
+  serialQuiet = quiet;
+}
@@ -0,0 +1,298 @@
+#include "SD.h"
+#include "ArduinoNative.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define NATIVE_SD_BLOCK 512
+#define NATIVE_SD_READ_MICROS 1200      // fetch one block into the library's cache
+#define NATIVE_SD_WRITE_MICROS 2500     // write back one dirty block
+#define NATIVE_SD_OPEN_MICROS 4000      // directory search
+
+struct nativeFile {
+  FILE *fp;
+  DIR *dir;
+  char path[256];
+  char name[64];
+  uint8_t mode;
+  long block;                           // block held in the cache, -1 if none
+  bool dirty;
+  bool modified;                        // directory entry needs the new size
+};
+
+static char sdRoot[200] = "sd";
+
+SDClass SD;
+
+void nativeSdRoot(const char *path) {
+  strncpy(sdRoot, path, sizeof(sdRoot) - 1);
+  sdRoot[sizeof(sdRoot) - 1] = '\0';
+}
+
+static void hostPath(const char *filepath, char *path, size_t size) {
+  while (*filepath == '/')
+    filepath++;
+  snprintf(path, size, "%s/%s", sdRoot, filepath);
+}
+
+static void writeBack(nativeFile *file) {
+  if (file->dirty) {
+    nativeAdvance(NATIVE_SD_WRITE_MICROS);
+    file->dirty = false;
+    // On the card now, other open files see it
+    fflush(file->fp);
+  }
+}
+
+// Bring the block holding the file position into the cache
+static void touch(nativeFile *file, bool writing) {
+  long block = ftell(file->fp) / NATIVE_SD_BLOCK;
+
+  if (block != file->block) {
+    writeBack(file);
+    nativeAdvance(NATIVE_SD_READ_MICROS);
+    file->block = block;
+  }
+  if (writing)
+    file->dirty = true;
+}
+
+static File openPath(const char *path, const char *name, uint8_t mode) {
+  struct stat info;
+  bool found = stat(path, &info) == 0;
+  nativeFile *file;
+
+  nativeAdvance(NATIVE_SD_OPEN_MICROS);
+
+  if (found && S_ISDIR(info.st_mode)) {
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+      return File();
+    file = (nativeFile *)calloc(1, sizeof(nativeFile));
+    file->dir = dir;
+  } else {
+    FILE *fp;
+    if (!(mode & O_WRITE))
+      fp = found ? fopen(path, "rb") : NULL;
+    else if (found)
+      fp = fopen(path, "r+b");
+    else
+      fp = (mode & O_CREAT) ? fopen(path, "w+b") : NULL;
+    if (fp == NULL)
+      return File();
+    if (mode & O_APPEND)
+      fseek(fp, 0, SEEK_END);
+    file = (nativeFile *)calloc(1, sizeof(nativeFile));
+    file->fp = fp;
+  }
+
+  strncpy(file->path, path, sizeof(file->path) - 1);
+  strncpy(file->name, name, sizeof(file->name) - 1);
+  file->mode = mode;
+  file->block = -1;
+  return File(file);
+}
+
+boolean SDClass::begin(uint8_t) {
+  struct stat info;
+  return stat(sdRoot, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+File SDClass::open(const char *filename, uint8_t mode) {
+  char path[256];
+  const char *name = strrchr(filename, '/');
+
+  hostPath(filename, path, sizeof(path));
+  return openPath(path, name != NULL && name[1] != '\0' ? name + 1 : filename, mode);
+}
+
+boolean SDClass::exists(const char *filepath) {
+  char path[256];
+  struct stat info;
+
+  hostPath(filepath, path, sizeof(path));
+  return stat(path, &info) == 0;
+}
+
+boolean SDClass::mkdir(const char *filepath) {
+  char path[256];
+
+  hostPath(filepath, path, sizeof(path));
+  return ::mkdir(path, 0755) == 0;
+}
+
+boolean SDClass::remove(const char *filepath) {
+  char path[256];
+
+  hostPath(filepath, path, sizeof(path));
+  return ::remove(path) == 0;
+}
+
+boolean SDClass::rmdir(const char *filepath) {
+  return remove(filepath);
+}
+
+size_t File::write(uint8_t byte) {
+  return write(&byte, 1);
+}
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  if (_file == NULL || _file->fp == NULL || !(_file->mode & O_WRITE))
+    return 0;
+
+  size_t written = 0;
+  // stdio needs a seek between reading and writing the same stream
+  fseek(_file->fp, 0, (_file->mode & O_APPEND) ? SEEK_END : SEEK_CUR);
+  long end = this->size();
+  while (written < size) {
+    // Stop at each block boundary so every block touched is paid for
+    long position = ftell(_file->fp);
+    size_t room = NATIVE_SD_BLOCK - position % NATIVE_SD_BLOCK;
+    size_t n = min(room, size - written);
+    if (n == NATIVE_SD_BLOCK) {
+      // Like SdFile::write(), a whole aligned block goes straight to the card and drops a cached copy
+      if (position / NATIVE_SD_BLOCK == _file->block) {
+        _file->block = -1;
+        _file->dirty = false;
+      }
+      nativeAdvance(NATIVE_SD_WRITE_MICROS);
+      n = fwrite(buffer + written, 1, n, _file->fp);
+      fflush(_file->fp);
+    } else {
+      touch(_file, true);
+      n = fwrite(buffer + written, 1, n, _file->fp);
+    }
+    if (n == 0)
+      break;
+    written += n;
+    // Only a longer file needs its directory entry rewritten
+    if (position + (long)n > end) {
+      end = position + n;
+      _file->modified = true;
+    }
+  }
+  return written;
+}
+
+int File::availableForWrite() {
+  if (_file == NULL || _file->fp == NULL)
+    return 0;
+  return NATIVE_SD_BLOCK - ftell(_file->fp) % NATIVE_SD_BLOCK;
+}
+
+int File::read() {
+  uint8_t byte;
+  return read(&byte, 1) == 1 ? byte : -1;
+}
+
+int File::peek() {
+  if (_file == NULL || _file->fp == NULL)
+    return -1;
+  int c = fgetc(_file->fp);
+  if (c != EOF)
+    ungetc(c, _file->fp);
+  return c == EOF ? -1 : c;
+}
+
+int File::available() {
+  if (_file == NULL || _file->fp == NULL)
+    return 0;
+  long remaining = (long)size() - (long)position();
+  return remaining > 0x7FFF ? 0x7FFF : (int)remaining;
+}
+
+void File::flush() {
+  if (_file == NULL || _file->fp == NULL)
+    return;
+  writeBack(_file);
+  if (_file->modified) {
+    // Directory entry with the new size
+    nativeAdvance(NATIVE_SD_WRITE_MICROS);
+    _file->modified = false;
+  }
+  fflush(_file->fp);
+}
+
+int File::read(void *buffer, uint16_t nbyte) {
+  if (_file == NULL || _file->fp == NULL)
+    return -1;
+
+  size_t done = 0;
+  fseek(_file->fp, 0, SEEK_CUR);
+  while (done < nbyte) {
+    size_t room = NATIVE_SD_BLOCK - ftell(_file->fp) % NATIVE_SD_BLOCK;
+    size_t n = min(room, (size_t)nbyte - done);
+    touch(_file, false);
+    n = fread((uint8_t *)buffer + done, 1, n, _file->fp);
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+boolean File::seek(uint32_t pos) {
+  if (_file == NULL || _file->fp == NULL || pos > size())
+    return false;
+  return fseek(_file->fp, pos, SEEK_SET) == 0;
+}
+
+uint32_t File::position() {
+  if (_file == NULL || _file->fp == NULL)
+    return 0;
+  return ftell(_file->fp);
+}
+
+uint32_t File::size() {
+  if (_file == NULL || _file->fp == NULL)
+    return 0;
+  long here = ftell(_file->fp);
+  fseek(_file->fp, 0, SEEK_END);
+  long end = ftell(_file->fp);
+  fseek(_file->fp, here, SEEK_SET);
+  return end;
+}
+
+void File::close() {
+  if (_file == NULL)
+    return;
+  if (_file->fp != NULL) {
+    flush();
+    fclose(_file->fp);
+  }
+  if (_file->dir != NULL)
+    closedir(_file->dir);
+  free(_file);
+  _file = NULL;
+}
+
+File::operator bool() {
+  return _file != NULL;
+}
+
+char *File::name() {
+  return _file == NULL ? NULL : _file->name;
+}
+
+boolean File::isDirectory(void) {
+  return _file != NULL && _file->dir != NULL;
+}
+
+File File::openNextFile(uint8_t mode) {
+  if (!isDirectory())
+    return File();
+
+  struct dirent *entry;
+  while ((entry = readdir(_file->dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char path[sizeof(_file->path) + sizeof(entry->d_name) + 1];
+    snprintf(path, sizeof(path), "%s/%s", _file->path, entry->d_name);
+    return openPath(path, entry->d_name, mode);
+  }
+  return File();
+}
+
+void File::rewindDirectory(void) {
+  if (isDirectory())
+    rewinddir(_file->dir);
+}
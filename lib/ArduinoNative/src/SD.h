@@ -0,0 +1,75 @@
+/*
+   Host stand-in for the Arduino SD library, backed by a directory (nativeSdRoot(), ./sd by
+   default). Reading or writing into a new 512-byte block and flush() cost card time on the
+   virtual clock, roughly what a class 4 card on the Uno's SPI bus takes. A whole block written
+   at a block boundary skips the cache read, and flush() only rewrites the directory entry when
+   the file grew, as in the library.
+*/
+
+#ifndef __SD_H__
+#define __SD_H__
+
+#include "Arduino.h"
+#include <SPI.h>
+
+#define O_READ 0x01
+#define O_RDONLY O_READ
+#define O_WRITE 0x02
+#define O_WRONLY O_WRITE
+#define O_RDWR (O_READ | O_WRITE)
+#define O_APPEND 0x04
+#define O_CREAT 0x10
+
+#define FILE_READ O_READ
+#define FILE_WRITE (O_READ | O_WRITE | O_CREAT | O_APPEND)
+
+#define SD_CHIP_SELECT_PIN 10
+
+struct nativeFile;
+
+class File : public Stream {
+  public:
+    File() : _file(NULL) {}
+    File(nativeFile *file) : _file(file) {}
+
+    virtual size_t write(uint8_t byte);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    virtual int availableForWrite();
+
+    virtual int read();
+    virtual int peek();
+    virtual int available();
+    virtual void flush();
+
+    int read(void *buffer, uint16_t nbyte);
+    boolean seek(uint32_t pos);
+    uint32_t position();
+    uint32_t size();
+    void close();
+    operator bool();
+    char *name();
+
+    boolean isDirectory(void);
+    File openNextFile(uint8_t mode = O_RDONLY);
+    void rewindDirectory(void);
+
+  private:
+    nativeFile *_file;
+};
+
+class SDClass {
+  public:
+    boolean begin(uint8_t csPin = SD_CHIP_SELECT_PIN);
+    void end() {}
+
+    File open(const char *filename, uint8_t mode = FILE_READ);
+    boolean exists(const char *filepath);
+    boolean mkdir(const char *filepath);
+    boolean remove(const char *filepath);
+    boolean rmdir(const char *filepath);
+};
+
+extern SDClass SD;
+
+#endif
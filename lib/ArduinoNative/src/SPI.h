@@ -0,0 +1,30 @@
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include "Arduino.h"
+
+#define SPI_MODE0 0x00
+#define MSBFIRST 1
+#define LSBFIRST 0
+
+class SPISettings {
+  public:
+    SPISettings() {}
+    SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+// Nothing is on the bus, the MCP2515 and SD card stand-ins are driven directly
+class SPIClass {
+  public:
+    static void begin() {}
+    static void end() {}
+    static void usingInterrupt(uint8_t) {}
+    static void notUsingInterrupt(uint8_t) {}
+    static void beginTransaction(SPISettings) {}
+    static void endTransaction(void) {}
+    static uint8_t transfer(uint8_t) { return 0xFF; }
+};
+
+extern SPIClass SPI;
+
+#endif
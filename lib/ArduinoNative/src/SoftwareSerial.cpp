@@ -0,0 +1,105 @@
+#include "SoftwareSerial.h"
+#include "ArduinoNative.h"
+#include <util/atomic.h>
+
+#define NATIVE_SERIAL_PENDING 4096
+
+// Bytes injected but not yet on the wire, with the time their stop bit arrives
+static uint8_t pendingBytes[NATIVE_SERIAL_PENDING];
+static unsigned long pendingTimes[NATIVE_SERIAL_PENDING];
+static unsigned int pendingHead = 0;
+static unsigned int pendingCount = 0;
+static unsigned long lastArrival = 0;
+
+// The receive buffer the sketch reads from
+static uint8_t rxBuffer[_SS_MAX_RX_BUFF];
+static uint8_t rxHead = 0;
+static uint8_t rxCount = 0;
+static bool rxOverflow = false;
+
+static unsigned long rxByteMicros = 1042;
+static void (*txHook)(uint8_t byte) = NULL;
+
+static void receivePending(void) {
+  unsigned long now = nativeMicros();
+
+  while (pendingCount > 0 && pendingTimes[pendingHead] <= now) {
+    if (rxCount < _SS_MAX_RX_BUFF) {
+      rxBuffer[(rxHead + rxCount) % _SS_MAX_RX_BUFF] = pendingBytes[pendingHead];
+      rxCount++;
+    } else {
+      rxOverflow = true;
+    }
+    pendingHead = (pendingHead + 1) % NATIVE_SERIAL_PENDING;
+    pendingCount--;
+  }
+}
+
+void nativeSerialInject(const uint8_t *data, size_t length) {
+  unsigned long now = nativeMicros();
+
+  if (lastArrival < now)
+    lastArrival = now;
+
+  for (size_t i = 0; i < length && pendingCount < NATIVE_SERIAL_PENDING; i++) {
+    unsigned int index = (pendingHead + pendingCount) % NATIVE_SERIAL_PENDING;
+    lastArrival += rxByteMicros;
+    pendingBytes[index] = data[i];
+    pendingTimes[index] = lastArrival;
+    pendingCount++;
+  }
+}
+
+void nativeOnSerialTx(void (*hook)(uint8_t byte)) {
+  txHook = hook;
+}
+
+SoftwareSerial::SoftwareSerial(uint8_t, uint8_t, bool) {
+  _byteMicros = rxByteMicros;
+}
+
+void SoftwareSerial::begin(long speed) {
+  // Start bit, 8 data bits and stop bit
+  _byteMicros = 10000000UL / speed;
+  rxByteMicros = _byteMicros;
+}
+
+bool SoftwareSerial::overflow() {
+  bool overflowed = rxOverflow;
+  rxOverflow = false;
+  return overflowed;
+}
+
+int SoftwareSerial::available() {
+  receivePending();
+  return rxCount;
+}
+
+int SoftwareSerial::read() {
+  receivePending();
+  if (rxCount == 0)
+    return -1;
+  uint8_t byte = rxBuffer[rxHead];
+  rxHead = (rxHead + 1) % _SS_MAX_RX_BUFF;
+  rxCount--;
+  return byte;
+}
+
+int SoftwareSerial::peek() {
+  receivePending();
+  return rxCount == 0 ? -1 : rxBuffer[rxHead];
+}
+
+size_t SoftwareSerial::write(uint8_t byte) {
+  // The original bit-bangs with interrupts off
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    nativeAdvance(_byteMicros);
+  }
+  this->nativeTransmit(byte);
+  return 1;
+}
+
+void SoftwareSerial::nativeTransmit(uint8_t byte) {
+  if (txHook != NULL)
+    txHook(byte);
+}
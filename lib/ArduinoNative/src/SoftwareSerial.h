@@ -0,0 +1,46 @@
+/*
+   Host SoftwareSerial. There is one receive line: bytes given to nativeSerialInject() arrive one
+   byte time apart and go into the usual 64-byte buffer, which overflows like the real one.
+   write() holds interrupts off and takes a byte time of virtual clock, like the bit-banged
+   original; the byte is then handed to the nativeOnSerialTx() hook.
+*/
+
+#ifndef SoftwareSerial_h
+#define SoftwareSerial_h
+
+#include "Arduino.h"
+
+#ifndef _SS_MAX_RX_BUFF
+#define _SS_MAX_RX_BUFF 64
+#endif
+
+class SoftwareSerial : public Stream {
+  public:
+    SoftwareSerial(uint8_t receivePin, uint8_t transmitPin, bool inverse_logic = false);
+    virtual ~SoftwareSerial() {}
+
+    void begin(long speed);
+    bool listen() { return true; }
+    void end() {}
+    bool isListening() { return true; }
+    bool overflow();
+
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+
+    virtual size_t write(uint8_t byte);
+    using Print::write;
+    virtual void flush() {}
+
+    operator bool() { return true; }
+
+  protected:
+    // Deliver a byte that has left the TX pin, for transmitters that do their own timing
+    void nativeTransmit(uint8_t byte);
+
+  private:
+    unsigned long _byteMicros;
+};
+
+#endif
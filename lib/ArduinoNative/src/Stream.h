@@ -0,0 +1,26 @@
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    // No timeout on the host, only what is already available is returned
+    size_t readBytes(char *buffer, size_t length) {
+      size_t count = 0;
+      while (count < length && available() > 0)
+        buffer[count++] = (char)read();
+      return count;
+    }
+    size_t readBytes(uint8_t *buffer, size_t length) {
+      return readBytes((char *)buffer, length);
+    }
+
+    void setTimeout(unsigned long) {}
+};
+
+#endif
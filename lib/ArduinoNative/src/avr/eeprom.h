@@ -0,0 +1,36 @@
+/*
+   The Uno's 1 KB EEPROM in host memory. Every byte actually programmed is counted, so wear
+   can be read back with nativeEepromWrites(); update functions skip bytes that already hold
+   the value, like avr-libc's.
+*/
+
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define E2END 0x3FF
+
+#define EEMEM
+
+static inline bool eeprom_is_ready(void) {
+  return true;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address);
+uint16_t eeprom_read_word(const uint16_t *address);
+uint32_t eeprom_read_dword(const uint32_t *address);
+void eeprom_read_block(void *destination, const void *source, size_t size);
+
+void eeprom_write_byte(uint8_t *address, uint8_t value);
+void eeprom_write_word(uint16_t *address, uint16_t value);
+void eeprom_write_dword(uint32_t *address, uint32_t value);
+void eeprom_write_block(const void *source, void *destination, size_t size);
+
+void eeprom_update_byte(uint8_t *address, uint8_t value);
+void eeprom_update_word(uint16_t *address, uint16_t value);
+void eeprom_update_dword(uint32_t *address, uint32_t value);
+void eeprom_update_block(const void *source, void *destination, size_t size);
+
+#endif
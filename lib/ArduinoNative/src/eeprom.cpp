@@ -0,0 +1,123 @@
+#include <avr/eeprom.h>
+#include "ArduinoNative.h"
+
+// Programming one byte takes 3.3 ms; avr-libc waits for the previous write, so count it up front
+#define NATIVE_EEPROM_WRITE_MICROS 3400
+
+static uint8_t eeprom[E2END + 1];
+static unsigned long eepromWrites[E2END + 1];
+static unsigned long eepromReads = 0;
+static bool eepromErased = false;
+
+static void eraseOnce(void) {
+  if (!eepromErased) {
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    eepromErased = true;
+  }
+}
+
+static void program(size_t address, uint8_t value) {
+  if (address > E2END)
+    return;
+  eraseOnce();
+  nativeAdvance(NATIVE_EEPROM_WRITE_MICROS);
+  eeprom[address] = value;
+  eepromWrites[address]++;
+}
+
+static uint8_t fetch(size_t address) {
+  eraseOnce();
+  eepromReads++;
+  return address > E2END ? 0xFF : eeprom[address];
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+  return fetch((size_t)address);
+}
+
+uint16_t eeprom_read_word(const uint16_t *address) {
+  uint16_t value;
+  eeprom_read_block(&value, address, sizeof(value));
+  return value;
+}
+
+uint32_t eeprom_read_dword(const uint32_t *address) {
+  uint32_t value;
+  eeprom_read_block(&value, address, sizeof(value));
+  return value;
+}
+
+void eeprom_read_block(void *destination, const void *source, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    ((uint8_t *)destination)[i] = fetch((size_t)source + i);
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value) {
+  program((size_t)address, value);
+}
+
+void eeprom_write_word(uint16_t *address, uint16_t value) {
+  eeprom_write_block(&value, address, sizeof(value));
+}
+
+void eeprom_write_dword(uint32_t *address, uint32_t value) {
+  eeprom_write_block(&value, address, sizeof(value));
+}
+
+void eeprom_write_block(const void *source, void *destination, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    program((size_t)destination + i, ((const uint8_t *)source)[i]);
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value) {
+  if (fetch((size_t)address) != value)
+    program((size_t)address, value);
+}
+
+void eeprom_update_word(uint16_t *address, uint16_t value) {
+  eeprom_update_block(&value, address, sizeof(value));
+}
+
+void eeprom_update_dword(uint32_t *address, uint32_t value) {
+  eeprom_update_block(&value, address, sizeof(value));
+}
+
+void eeprom_update_block(const void *source, void *destination, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    eeprom_update_byte((uint8_t *)destination + i, ((const uint8_t *)source)[i]);
+}
+
+bool nativeEepromLoad(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  eraseOnce();
+  size_t n = fread(eeprom, 1, sizeof(eeprom), file);
+  fclose(file);
+  return n == sizeof(eeprom);
+}
+
+bool nativeEepromSave(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+  eraseOnce();
+  size_t n = fwrite(eeprom, 1, sizeof(eeprom), file);
+  fclose(file);
+  return n == sizeof(eeprom);
+}
+
+unsigned long nativeEepromWrites(int address) {
+  return address >= 0 && address <= E2END ? eepromWrites[address] : 0;
+}
+
+unsigned long nativeEepromMaxWrites(void) {
+  unsigned long most = 0;
+  for (int i = 0; i <= E2END; i++)
+    most = max(most, eepromWrites[i]);
+  return most;
+}
+
+unsigned long nativeEepromReads(void) {
+  return eepromReads;
+}
@@ -0,0 +1,168 @@
+#include "mcp_can.h"
+#include "ArduinoNative.h"
+
+#define CAN_FRAME_EXTENDED 0x80000000UL
+#define CAN_FRAME_REMOTE 0x40000000UL
+#define CAN_ID_MASK 0x1FFFFFFFUL
+
+// Reading a buffer over SPI at 10 MHz plus the library overhead
+#define NATIVE_CAN_READ_MICROS 40
+
+typedef struct {
+  unsigned long id;
+  uint8_t len;
+  uint8_t data[8];
+} nativeCanBuffer;
+
+// There is only ever one controller on the board
+static uint8_t canIdMode = MCP_ANY;
+static uint8_t canOpMode = MODE_CONFIG;
+static unsigned long canMasks[2];
+static unsigned long canFilters[6];
+static nativeCanBuffer canBuffers[2];
+static uint8_t canFull = 0;             // buffers in use, oldest first
+static uint8_t canIntPin = 2;
+static unsigned long canOverflows = 0;
+
+static void updateIntPin(void) {
+  nativeSetDigital(canIntPin, canFull > 0 ? LOW : HIGH);
+}
+
+static bool filterAccepts(unsigned long id, bool extended) {
+  if (canIdMode == MCP_ANY)
+    return true;
+  if (canIdMode == MCP_EXT && !extended)
+    return false;
+  if (canIdMode == MCP_STD && extended)
+    return false;
+
+  // RXB0 uses mask 0 with filters 0-1, RXB1 mask 1 with filters 2-5; rollover lets either fill
+  for (uint8_t i = 0; i < 6; i++) {
+    unsigned long mask = canMasks[i < 2 ? 0 : 1];
+    if ((id & mask) == (canFilters[i] & mask))
+      return true;
+  }
+  return false;
+}
+
+bool nativeCanInject(unsigned long id, uint8_t length, const uint8_t *data) {
+  bool extended = (id & CAN_FRAME_EXTENDED) != 0;
+
+  if (canOpMode == MODE_CONFIG || canOpMode == MCP_SLEEP)
+    return false;
+  if (!filterAccepts(id & CAN_ID_MASK, extended))
+    return false;
+  if (canFull >= 2) {
+    canOverflows++;
+    return false;
+  }
+
+  nativeCanBuffer *buffer = &canBuffers[canFull++];
+  buffer->id = id;
+  buffer->len = length > 8 ? 8 : length;
+  memcpy(buffer->data, data, buffer->len);
+  updateIntPin();
+  return true;
+}
+
+void nativeCanIntPin(uint8_t pin) {
+  canIntPin = pin;
+  updateIntPin();
+}
+
+unsigned long nativeCanOverflows(void) {
+  return canOverflows;
+}
+
+MCP_CAN::MCP_CAN(INT8U) {
+  updateIntPin();
+}
+
+INT8U MCP_CAN::begin(INT8U idmodeset, INT8U, INT8U) {
+  canIdMode = idmodeset;
+  canOpMode = MODE_CONFIG;
+  memset(canMasks, 0, sizeof(canMasks));
+  memset(canFilters, 0, sizeof(canFilters));
+  canFull = 0;
+  updateIntPin();
+  return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Mask(INT8U num, INT8U, INT32U ulData) {
+  if (num >= 2 || canOpMode != MODE_CONFIG)
+    return CAN_FAIL;
+  canMasks[num] = ulData & CAN_ID_MASK;
+  return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Mask(INT8U num, INT32U ulData) {
+  return init_Mask(num, (ulData & CAN_FRAME_EXTENDED) ? 1 : 0, ulData);
+}
+
+INT8U MCP_CAN::init_Filt(INT8U num, INT8U, INT32U ulData) {
+  if (num >= 6 || canOpMode != MODE_CONFIG)
+    return CAN_FAIL;
+  canFilters[num] = ulData & CAN_ID_MASK;
+  return CAN_OK;
+}
+
+INT8U MCP_CAN::init_Filt(INT8U num, INT32U ulData) {
+  return init_Filt(num, (ulData & CAN_FRAME_EXTENDED) ? 1 : 0, ulData);
+}
+
+INT8U MCP_CAN::setMode(INT8U opMode) {
+  canOpMode = opMode;
+  return CAN_OK;
+}
+
+// Nothing else is on the simulated bus, frames are acknowledged and forgotten
+INT8U MCP_CAN::sendMsgBuf(INT32U, INT8U, INT8U, INT8U *) {
+  return canOpMode == MCP_NORMAL || canOpMode == MCP_LOOPBACK ? CAN_OK : CAN_FAILTX;
+}
+
+INT8U MCP_CAN::sendMsgBuf(INT32U id, INT8U len, INT8U *buf) {
+  return sendMsgBuf(id, (id & CAN_FRAME_EXTENDED) ? 1 : 0, len, buf);
+}
+
+INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *ext, INT8U *len, INT8U *buf) {
+  if (canFull == 0)
+    return CAN_NOMSG;
+
+  nativeAdvance(NATIVE_CAN_READ_MICROS);
+
+  nativeCanBuffer *buffer = &canBuffers[0];
+  *id = buffer->id;
+  if (ext != NULL)
+    *ext = (buffer->id & CAN_FRAME_EXTENDED) ? 1 : 0;
+  *len = buffer->len;
+  memcpy(buf, buffer->data, buffer->len);
+
+  canBuffers[0] = canBuffers[1];
+  canFull--;
+  updateIntPin();
+  return CAN_OK;
+}
+
+INT8U MCP_CAN::readMsgBuf(INT32U *id, INT8U *len, INT8U *buf) {
+  return readMsgBuf(id, NULL, len, buf);
+}
+
+INT8U MCP_CAN::checkReceive(void) {
+  return canFull > 0 ? CAN_MSGAVAIL : CAN_NOMSG;
+}
+
+INT8U MCP_CAN::checkError(void) {
+  return CAN_OK;
+}
+
+INT8U MCP_CAN::getError(void) {
+  return 0;
+}
+
+INT8U MCP_CAN::errorCountRX(void) {
+  return 0;
+}
+
+INT8U MCP_CAN::errorCountTX(void) {
+  return 0;
+}
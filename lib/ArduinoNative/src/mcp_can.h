@@ -0,0 +1,85 @@
+/*
+   Host stand-in for coryjfowler's MCP_CAN. Frames come from nativeCanInject(), pass the
+   programmed masks and filters and wait in the controller's two receive buffers; while either is
+   full the INT pin (nativeCanIntPin(), pin 2 by default) is held low, so the sketch sees the same
+   edges, lost frames and level-triggered recovery as with the real chip.
+*/
+
+#ifndef _MCP2515_H_
+#define _MCP2515_H_
+
+#include "Arduino.h"
+#include <SPI.h>
+
+#ifndef INT8U
+#define INT8U byte
+#endif
+#ifndef INT32U
+#define INT32U unsigned long
+#endif
+
+#define MCP_ANY 0
+#define MCP_STD 1
+#define MCP_EXT 2
+#define MCP_STDEXT 3
+
+#define MCP_20MHZ 0
+#define MCP_16MHZ 1
+#define MCP_8MHZ 2
+
+#define CAN_4K096BPS 0
+#define CAN_5KBPS 1
+#define CAN_10KBPS 2
+#define CAN_20KBPS 3
+#define CAN_31K25BPS 4
+#define CAN_33K3BPS 5
+#define CAN_40KBPS 6
+#define CAN_50KBPS 7
+#define CAN_80KBPS 8
+#define CAN_100KBPS 9
+#define CAN_125KBPS 10
+#define CAN_200KBPS 11
+#define CAN_250KBPS 12
+#define CAN_500KBPS 13
+#define CAN_1000KBPS 14
+
+#define MCP_NORMAL 0x00
+#define MCP_SLEEP 0x20
+#define MCP_LOOPBACK 0x40
+#define MCP_LISTENONLY 0x60
+#define MODE_CONFIG 0x80
+
+#define CAN_OK 0
+#define CAN_FAILINIT 1
+#define CAN_FAILTX 2
+#define CAN_MSGAVAIL 3
+#define CAN_NOMSG 4
+#define CAN_CTRLERROR 5
+#define CAN_GETTXBFTIMEOUT 6
+#define CAN_SENDMSGTIMEOUT 7
+#define CAN_FAIL 0xff
+
+class MCP_CAN {
+  public:
+    MCP_CAN(INT8U _CS);
+
+    INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset);
+    INT8U init_Mask(INT8U num, INT8U ext, INT32U ulData);
+    INT8U init_Mask(INT8U num, INT32U ulData);
+    INT8U init_Filt(INT8U num, INT8U ext, INT32U ulData);
+    INT8U init_Filt(INT8U num, INT32U ulData);
+    INT8U setMode(INT8U opMode);
+
+    INT8U sendMsgBuf(INT32U id, INT8U ext, INT8U len, INT8U *buf);
+    INT8U sendMsgBuf(INT32U id, INT8U len, INT8U *buf);
+    INT8U readMsgBuf(INT32U *id, INT8U *ext, INT8U *len, INT8U *buf);
+    INT8U readMsgBuf(INT32U *id, INT8U *len, INT8U *buf);
+
+    INT8U checkReceive(void);
+    INT8U checkError(void);
+    INT8U getError(void);
+    INT8U errorCountRX(void);
+    INT8U errorCountTX(void);
+};
+
+#endif
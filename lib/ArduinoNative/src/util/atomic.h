@@ -0,0 +1,27 @@
+#ifndef _UTIL_ATOMIC_H_
+#define _UTIL_ATOMIC_H_
+
+#include <stdint.h>
+
+// Defined in Arduino.cpp, save returns whether interrupts were enabled and disables them
+uint8_t nativeInterruptsSave(void);
+void nativeInterruptsRestore(uint8_t state);
+
+static inline uint8_t __nativeAtomicTodo(void) {
+  return 1;
+}
+
+static inline void __nativeAtomicRestore(const uint8_t *state) {
+  nativeInterruptsRestore(*state);
+}
+
+static inline void __nativeAtomicForceOn(const uint8_t *) {
+  nativeInterruptsRestore(1);
+}
+
+#define ATOMIC_RESTORESTATE uint8_t __sreg_save __attribute__((__cleanup__(__nativeAtomicRestore))) = nativeInterruptsSave()
+#define ATOMIC_FORCEON uint8_t __sreg_save __attribute__((__cleanup__(__nativeAtomicForceOn))) = nativeInterruptsSave()
+
+#define ATOMIC_BLOCK(type) for (type, __ToDo = __nativeAtomicTodo(); __ToDo; __ToDo = 0)
+
+#endif
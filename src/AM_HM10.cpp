@@ -20,10 +20,11 @@
 
 */
 #include "AM_HM10.h"
+#include <util/crc16.h>
 
 #if defined(ARDUINO_AVR_UNO)
-#include <SoftwareSerial.h>
-SoftwareSerial deviceSerial(6, 5, false);
+#include "TimerSerial.h"
+TimerSerial deviceSerial(6, 5);
 #endif
 
 #if defined(ARDUINO_AVR_MEGA2560)
@@ -47,8 +48,6 @@ AMController::AMController(
   void (*deviceConnected)(void),
   void (*deviceDisconnected)(void))
 {
-  _var = true;
-  _idx = 0;
   _doWork = doWork;
   _doSync = doSync;
   _processIncomingMessages = processIncomingMessages;
@@ -57,11 +56,45 @@ AMController::AMController(
   _deviceConnected = deviceConnected;
   _deviceDisconnected = deviceDisconnected;
 
-  _variable[0] = '\0';
-  _value[0]    = '\0';
+  _binaryRequested = false;
+  _binaryMode = false;
+  _frameSeq = 0;
+
+  _txBytes = 0;
+  _txMicros = 0;
+
+#ifdef AM_SD_TRANSFER
+  _sdState = AM_SD_IDLE;
+  _sdLogTransfer = false;
+  _sdName[0] = '\0';
+  _sdOffset = 0;
+  _sdRequestedOffset = 0;
+  _sdStarted = 0;
+  _sdFinished = 0;
+  _sdBytes = 0;
+  _sdPending = 0;
+  _sdSent = 0;
+  _sdReplyLength = 0;
+#endif
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+  _sdLevel = 0;
+  _sdStat = 0;
+  _sdStride = 1;
+  _sdTo = 0xFFFFFFFFUL;
+#endif
+
+#ifdef SDLOGROLLUP_SUPPORT
+  _sdQueryFrom = 0;
+  _sdQueryTo = 0xFFFFFFFFUL;
+  _sdQueryPoints = AM_SD_QUERY_POINTS;
+  _sdQueryStat = SD_ROLLUP_AVG;
+#endif
 
   _startTime = 0;
-  _lastAlarmCheck = 0;
+  _alarmCount = 0;
+  _tmpTime = 0;
+  _tmpId[0] = '\0';
 
   this->inizializeAlarms();
 
@@ -78,8 +111,6 @@ AMController::AMController(
   void (*deviceConnected)(void),
   void (*deviceDisconnected)(void))
 {
-  _var = true;
-  _idx = 0;
   _doWork = doWork;
   _doSync = doSync;
   _processIncomingMessages = processIncomingMessages;
@@ -87,8 +118,40 @@ AMController::AMController(
   _deviceConnected = deviceConnected;
   _deviceDisconnected = deviceDisconnected;
 
-  _variable[0] = '\0';
-  _value[0]    = '\0';
+  _binaryRequested = false;
+  _binaryMode = false;
+  _frameSeq = 0;
+
+  _txBytes = 0;
+  _txMicros = 0;
+
+#ifdef AM_SD_TRANSFER
+  _sdState = AM_SD_IDLE;
+  _sdLogTransfer = false;
+  _sdName[0] = '\0';
+  _sdOffset = 0;
+  _sdRequestedOffset = 0;
+  _sdStarted = 0;
+  _sdFinished = 0;
+  _sdBytes = 0;
+  _sdPending = 0;
+  _sdSent = 0;
+  _sdReplyLength = 0;
+#endif
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+  _sdLevel = 0;
+  _sdStat = 0;
+  _sdStride = 1;
+  _sdTo = 0xFFFFFFFFUL;
+#endif
+
+#ifdef SDLOGROLLUP_SUPPORT
+  _sdQueryFrom = 0;
+  _sdQueryTo = 0xFFFFFFFFUL;
+  _sdQueryPoints = AM_SD_QUERY_POINTS;
+  _sdQueryStat = SD_ROLLUP_AVG;
+#endif
 }
 
 void AMController::begin() {
@@ -102,51 +165,137 @@ void AMController::loop() {
 void AMController::loop(unsigned long _delay) {
 #ifdef ALARMS_SUPPORT
 
-  if (_processAlarms != NULL) {
-	  unsigned long now = this->now();
-	  
-    if ( (now - _lastAlarmCheck) > ALARM_CHECK_INTERVAL) {
-      _lastAlarmCheck = now;
-      this->checkAndFireAlarms();
-    }
-  }
+  if (_processAlarms != NULL)
+    this->checkAndFireAlarms();
 
 #endif
 
   _doWork();
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+  // Partly filled log block to the card every SD_LOG_SYNC_INTERVAL
+  _logger.loop();
+#endif
+#ifdef SDLOGROLLUP_SUPPORT
+  _rollup.loop();
+#endif
   
   // Read incoming messages if any
   this->readVariable();
 
+  // Process every complete message received so far
+  amMessage *message;
+
+  while ((message = _parser.peek()) != NULL) {
+    bool handled = this->processMessage(message->variable, message->value);
+
+    _parser.pop();
+
+    if (handled)
+      return;
+  }
+
+#ifdef ALARMS_SUPPORT
+  // Check and Fire Alarms
+  if (_processAlarms != NULL)
+    this->checkAndFireAlarms();
+#endif
+
+  // Write outgoing messages
+  _processOutgoingMessages();
+
+#ifdef AM_SD_TRANSFER
+  // Keep a download going while waiting out the delay
+  this->sdTransferStep();
+  while (_sdState != AM_SD_IDLE && _delay >= AM_SD_STEP_INTERVAL) {
+    delay(AM_SD_STEP_INTERVAL);
+    _delay -= AM_SD_STEP_INTERVAL;
+    this->sdTransferStep();
+  }
+#endif
+
+  delay(_delay);
+}
+
+void AMController::readVariable(void) {
+
+  // Drain the serial buffer into the parser, leaving the rest for the next loop if the queue fills up
+  while (!_parser.isFull() && deviceSerial.available() > 0) {
+
+    switch (_parser.feed(deviceSerial.read())) {
+
+      case AM_PARSER_CONNECTED:
+        _binaryRequested = false;
+        _binaryMode = false;
+        _deviceConnected();
+        break;
+
+      case AM_PARSER_DISCONNECTED:
+        _binaryRequested = false;
+        _binaryMode = false;
+#ifdef AM_SD_TRANSFER
+        // The device resumes with $SDOffset$ after reconnecting, and syncs again
+        _sdReplyLength = 0;
+        this->sdEndTransfer();
+#endif
+        _deviceDisconnected();
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+/*
+  Handle one incoming message, returns true when the rest of this loop() should be skipped
+*/
+bool AMController::processMessage(char *variable, char *value) {
 #ifdef DEBUG
-  if (strlen(_variable) > 0) {
-    Serial.print("Received "); Serial.print(_variable); Serial.print(" "); Serial.println(_value);
+  if (strlen(variable) > 0) {
+    Serial.print("Received "); Serial.print(variable); Serial.print(" "); Serial.println(value);
+  }
+#endif
+
+  if (strcmp(variable, AM_BINARY_FRAME_VARIABLE) == 0) {
+    _binaryRequested = atoi(value) == 1;
+    return false;
+  }
+
+#ifdef AM_SD_TRANSFER
+  if (strcmp(variable, AM_SD_OFFSET_VARIABLE) == 0) {
+    _sdRequestedOffset = strtoul(value, NULL, 10);
+    return false;
   }
 #endif
 
-  if (strcmp(_variable, "Sync") == 0 && strlen(_value) > 0) {
-    // Process sync messages for the variable _value
+  if (strcmp(variable, "Sync") == 0 && strlen(value) > 0) {
+    // Confirm binary telemetry frames if the device asked for them
+    if (_binaryRequested && !_binaryMode)
+      this->reply(AM_BINARY_FRAME_VARIABLE, "1");
+    _binaryMode = _binaryRequested;
+
+    // Process sync messages for the variable value
     _doSync();
-    return;
+    return true;
   }
   else {
 
 #ifdef ALARMS_SUPPORT
     // Manages Alarm creation and update requests
 
-    char id[8];
+    if (strcmp(variable, "$AlarmId$") == 0 && strlen(value) > 0) {
+      strncpy(_tmpId, value, sizeof(_tmpId) - 1);
+      _tmpId[sizeof(_tmpId) - 1] = '\0';
+    } else if (strcmp(variable, "$AlarmT$") == 0 && strlen(value) > 0) {
 
-    if (strcmp(_variable, "$AlarmId$") == 0 && strlen(_value) > 0) {
-      strcpy(id, _value);
-    } else if (strcmp(_variable, "$AlarmT$") == 0 && strlen(_value) > 0) {
-
-      _tmpTime = atol(_value);
+      _tmpTime = atol(value);
     }
-    else if (strcmp(_variable, "$AlarmR$") == 0 && strlen(_value) > 0) {
+    else if (strcmp(variable, "$AlarmR$") == 0 && strlen(value) > 0) {
       if (_tmpTime == 0)
-        this->removeAlarm(id);
+        this->removeAlarm(_tmpId);
       else
-        this->createUpdateAlarm(id, _tmpTime, atoi(_value));
+        this->createUpdateAlarm(_tmpId, _tmpTime, atoi(value));
 
 #ifdef DEBUG
       this->dumpAlarms();
@@ -155,7 +304,7 @@ void AMController::loop(unsigned long _delay) {
     else
 #endif
 #ifdef SD_SUPPORT
-      if (strlen(_variable) > 0 && strcmp(_variable, "SD") == 0) {
+      if (strlen(variable) > 0 && strcmp(variable, "SD") == 0) {
 #ifdef DEBUG
         Serial.println("List of Files");
 #endif
@@ -185,145 +334,67 @@ void AMController::loop(unsigned long _delay) {
         Serial.println("File list sent");
 #endif
       }
-      else if (strlen(_variable) > 0 && strcmp(_variable, "$SDDL$") == 0) {
+      else if (strlen(variable) > 0 && strcmp(variable, "$SDDL$") == 0) {
 #ifdef DEBUG
-        Serial.print("File: "); Serial.println(_value);
+        Serial.print("File: "); Serial.println(value);
 #endif
-        _entry = SD.open(_value, FILE_READ);
-        if (_entry) {
-#ifdef DEBUG
-          Serial.println("File Opened");
-#endif
-          unsigned long n = 0;
-          uint8_t buffer[64];
-          deviceSerial.print("SD=$C$#");
-          delay(3000);
-          while (_entry.available()) {
-            n = _entry.read(buffer, sizeof(buffer));
-            deviceSerial.write(buffer, n * sizeof(uint8_t));
-          }
-          _entry.close();
-          deviceSerial.print("SD=$E$#");
-#ifdef DEBUG
-          Serial.println("Fine Sent");
-#endif
-        }
-        deviceSerial.flush();
+        this->sdStartTransfer(value, false);
       }
 #endif
-    if (strlen(_variable) > 0 && strlen(_value) > 0) {
+    if (strlen(variable) > 0 && strlen(value) > 0) {
 #ifdef ALARMS_SUPPORT
-      if (strcmp(_variable, "$Time$") == 0) {
-        _startTime = atol(_value) - millis() / 1000;
+      if (strcmp(variable, "$Time$") == 0) {
+        _startTime = atol(value) - millis() / 1000;
 #ifdef DEBUG
         Serial.print("Time Synchronized ");
         Serial.print(_startTime);
         Serial.print(" ");
         this->printTime(_startTime);
 #endif
-				return;
+				return true;
       }
 #endif
       // Process incoming messages
-      _processIncomingMessages(_variable, _value);
+      _processIncomingMessages(variable, value);
     }
   }
 
-#ifdef ALARMS_SUPPORT
-  // Check and Fire Alarms
-  if (_processAlarms != NULL) {
-	  unsigned long now = this->now();
-	  
-    if ( (now - _lastAlarmCheck) > ALARM_CHECK_INTERVAL) {
-      _lastAlarmCheck = now;
-      this->checkAndFireAlarms();
-    }
-  }
-#endif
-
 #ifdef SDLOGGEDATAGRAPH_SUPPORT
-  if (strlen(_variable) > 0 && strcmp(_variable, "$SDLogData$") == 0) {
+  if (strlen(variable) > 0 && strcmp(variable, "$SDLogData$") == 0) {
 
 #ifdef DEBUG
     Serial.print("Logged data request for: ");
-    Serial.println(_value);
+    Serial.println(value);
 #endif
-    this->sdSendLogData(_value);
+    this->sdSendLogData(value);
 
 #ifdef DEBUG
     Serial.println("Logged data sent");
 #endif
   }
 #endif
-  // Write outgoing messages
-  _processOutgoingMessages();
-
-  delay(_delay);
-}
-
-void AMController::readVariable(void) {
-
-  _variable[0] = '\0';
-  _value[0] = '\0';
-  char buffer[VARIABLELEN + VALUELEN + 2];
-  short  idx = 0;
 
-  memset(buffer, 0, VARIABLELEN + VALUELEN + 2);
-  _var = true;
-
-  while (deviceSerial.available() > 0) {
-
-    char c = deviceSerial.read();
-
-    //Serial.print(c);
-
-    buffer[idx++] = c;
-    
-    //Serial.print(">"); Serial.print(buffer); Serial.println("<");
-
-    if (memcmp(buffer, "OK+CONN", 7) == 0) {
-      _deviceConnected();
-      memset(buffer, 0, 7);
-      idx = 0;
-    }
-
-    if (memcmp(buffer, "OK+LOST", 7) == 0) {
-      _deviceDisconnected();
-      memset(buffer, 0, 7);
-      idx = 0;
-    }
-    
-    //Serial.print(" c -> "); Serial.print(c); Serial.print(" id -> "); Serial.println(idx); 
-    
-    if (_var == true) {
-    	if ((char)c == '=') {
-      	_variable[_idx] = '\0';
-      	_var = false;
-      	_idx = 0;
-      	
-      	//Serial.print("final vr -> "); Serial.println(_variable);
-    	}
-    	else if (c != '\0') {
-    		_variable[_idx++] = c;
-    		_variable[_idx] = '\0';
-    		//Serial.print("vr -> "); Serial.println(_variable);
-    	}
-    }
-		else {
-			if ((char)c == '#') {
-				 _value[_idx] = '\0';
-        _var = true;
-        _idx = 0;
-        //Serial.print(_variable); Serial.print("->");Serial.println(_value);
-        return;
-			}
-			else {
-				_value[_idx++] = c;	
-			}
-		}
+#ifdef SDLOGROLLUP_SUPPORT
+  if (strcmp(variable, "$SDFrom$") == 0)
+    _sdQueryFrom = strtoul(value, NULL, 10);
+  else if (strcmp(variable, "$SDTo$") == 0)
+    _sdQueryTo = strtoul(value, NULL, 10);
+  else if (strcmp(variable, "$SDPoints$") == 0)
+    _sdQueryPoints = atoi(value);
+  else if (strcmp(variable, "$SDStat$") == 0)
+    _sdQueryStat = strcmp(value, "min") == 0 ? SD_ROLLUP_MIN : strcmp(value, "max") == 0 ? SD_ROLLUP_MAX : SD_ROLLUP_AVG;
+  else if (strcmp(variable, AM_SD_QUERY_VARIABLE) == 0 && strlen(value) > 0) {
+    this->sdQueryLogData(value, _sdQueryFrom, _sdQueryTo, _sdQueryPoints, _sdQueryStat);
+
+    _sdQueryFrom = 0;
+    _sdQueryTo = 0xFFFFFFFFUL;
+    _sdQueryPoints = AM_SD_QUERY_POINTS;
+    _sdQueryStat = SD_ROLLUP_AVG;
   }
-}
+#endif
 
+  return false;
+}
 
 void AMController::writeMessage(const char *variable, int value) {
   char buffer[VARIABLELEN + VALUELEN + 3];
@@ -332,7 +403,7 @@ void AMController::writeMessage(const char *variable, int value) {
     return;
 
   snprintf(buffer, VARIABLELEN + VALUELEN + 3, "%s=%d#", variable, value);
-  deviceSerial.write((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
+  this->transmit((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
 }
 
 void AMController::writeMessage(const char *variable, float value) {
@@ -345,7 +416,7 @@ void AMController::writeMessage(const char *variable, float value) {
   dtostrf(value, 0, 3, vbuffer);
   snprintf(buffer, VARIABLELEN + VALUELEN + 3, "%s=%s#", variable, vbuffer);
 
-  deviceSerial.write((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
+  this->transmit((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
 }
 
 void AMController::writeTripleMessage(const char *variable, float vX, float vY, float vZ) {
@@ -360,7 +431,7 @@ void AMController::writeTripleMessage(const char *variable, float vX, float vY,
   dtostrf(vZ, 0, 2, vbufferAz);
   snprintf(buffer, VARIABLELEN + VALUELEN + 3, "%s=%s:%s:%s#", variable, vbufferAx, vbufferAy, vbufferAz);
 
-  deviceSerial.write((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
+  this->transmit((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
 }
 
 
@@ -377,21 +448,105 @@ void AMController::writeTxtMessage(const char *variable, const char *value)
       deviceSerial.write((const uint8_t *)buffer, strlen(buffer)*sizeof(char));
   */
 
-  int i = 0;
-  while (variable[i] != '\0')
-  {
-    deviceSerial.write(variable[i++]);
-  }
+  this->transmit((const uint8_t *)variable, strlen(variable));
+  this->transmit((const uint8_t *)"=", 1);
+  this->transmit((const uint8_t *)value, strlen(value));
+  this->transmit((const uint8_t *)"#", 1);
+}
+
+bool AMController::binaryMode(void) {
+  return _binaryMode;
+}
+
+void AMController::writeBinaryFrame(const void *payload, uint8_t len)
+{
+  if (!deviceSerial || len > AM_FRAME_MAX_PAYLOAD)
+    return;
+
+  uint8_t header[3] = { AM_FRAME_START, len, _frameSeq++ };
+  uint16_t crc = 0xFFFF;
 
-  deviceSerial.write('=');
+  crc = _crc_ccitt_update(crc, header[1]);
+  crc = _crc_ccitt_update(crc, header[2]);
+  for (uint8_t i = 0; i < len; i++)
+    crc = _crc_ccitt_update(crc, ((const uint8_t *)payload)[i]);
 
-  i = 0;
-  while (value[i] != '\0')
-  {
-    deviceSerial.write(value[i++]);
+  uint8_t trailer[2] = { (uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8) };
+
+  this->transmit(header, sizeof(header));
+  this->transmit((const uint8_t *)payload, len);
+  this->transmit(trailer, sizeof(trailer));
+}
+
+void AMController::transmit(const uint8_t *buffer, size_t len)
+{
+#ifdef AM_SD_TRANSFER
+  // Nothing else may land in the middle of a download, AMPublisher resends the telemetry after it
+  if (_sdState != AM_SD_IDLE)
+    return;
+#endif
+  this->queue(buffer, len);
+}
+
+/*
+  A reply the device waits for, as variable=value#. During a download it is held back and sent
+  first thing after it, as it can't be resent like the telemetry
+*/
+void AMController::reply(const char *variable, const char *value)
+{
+#ifdef AM_SD_TRANSFER
+  if (_sdState != AM_SD_IDLE) {
+    size_t vlen = strlen(variable);
+    size_t len = vlen + strlen(value) + 2;
+
+    if (_sdReplyLength + len > sizeof(_sdReplies))
+      return;
+
+    uint8_t *end = _sdReplies + _sdReplyLength;
+    memcpy(end, variable, vlen);
+    end[vlen] = '=';
+    memcpy(end + vlen + 1, value, len - vlen - 2);
+    end[len - 1] = '#';
+    _sdReplyLength += len;
+    return;
   }
+#endif
+  this->writeTxtMessage(variable, value);
+}
+
+void AMController::queue(const uint8_t *buffer, size_t len)
+{
+  unsigned long start = micros();
 
-  deviceSerial.write('#');
+  deviceSerial.write(buffer, len);
+
+  _txMicros += micros() - start;
+  _txBytes += len;
+}
+
+int AMController::txFree(void) {
+#ifdef AM_SD_TRANSFER
+  // Lets AMPublisher defer its messages until a download is over
+  if (_sdState != AM_SD_IDLE)
+    return 0;
+#endif
+  return this->queueFree();
+}
+
+int AMController::queueFree(void) {
+#if defined(ARDUINO_AVR_UNO)
+  return deviceSerial.txFree();
+#else
+  return deviceSerial.availableForWrite();
+#endif
+}
+
+unsigned long AMController::txBytes(void) {
+  return _txBytes;
+}
+
+unsigned long AMController::txMicros(void) {
+  return _txMicros;
 }
 
 void AMController::log(const char *msg)
@@ -543,111 +698,116 @@ void AMController::printTime(unsigned long time) {
 
 void AMController::createUpdateAlarm(char *id, unsigned long time, bool repeat) {
 
-  char lid[12];
-
-  lid[0] = 'A';
-  strcpy(&lid[1], id);
-
-  // Update
+  int8_t slot = -1;
 
-  for (int i = 0; i < 5; i++) {
+  // Update, or create in the first free slot
 
-    alarm a;
-
-    eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
-
-    if (strcmp(a.id, lid) == 0) {
-      a.time = time;
-      a.repeat = repeat;
-
-      eeprom_write_block((const void*)&a, (void*)(i * sizeof(a)), sizeof(a));
-
-      return;
+  for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+    if (strcmp(_alarms[i].id, id) == 0) {
+      slot = i;
+      break;
     }
+    if (slot < 0 && _alarms[i].id[0] == '\0')
+      slot = i;
   }
 
-  // Create
-
-  for (int i = 0; i < 5; i++) {
-
-    alarm a;
-
-    eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+  if (slot < 0 || id[0] == '\0')
+    return;
 
-    if (a.id[1] == '\0') {
+  strncpy(_alarms[slot].id, id, sizeof(_alarms[slot].id) - 1);
+  _alarms[slot].id[sizeof(_alarms[slot].id) - 1] = '\0';
+  _alarms[slot].time = time;
+  _alarms[slot].repeat = repeat;
 
-      strcpy(a.id, lid);
-      a.time = time;
-      a.repeat = repeat;
+  this->storeAlarm(slot);
+  this->sortAlarms();
+}
 
-      eeprom_write_block((const void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+void AMController::removeAlarm(char *id) {
 
-      return;
+  for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+    if (_alarms[i].id[0] != '\0' && strcmp(_alarms[i].id, id) == 0) {
+      memset(&_alarms[i], 0, sizeof(alarm));
+      this->storeAlarm(i);
     }
   }
+  this->sortAlarms();
 }
 
-void AMController::removeAlarm(char *id) {
-
-  char lid[12];
+void AMController::inizializeAlarms() {
 
-  lid[0] = 'A';
-  strcpy(&lid[1], id);
+  _alarmLog.begin(ALARM_EEPROM_START, ALARM_EEPROM_LENGTH, sizeof(alarm));
 
-  for (int i = 0; i < 5; i++) {
+  if (_alarmLog.empty()) {
 
-    alarm a;
+    // First start after the fixed slots, bring their alarms over before the log writes over them
 
-    eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+    for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
 
-    if (strcmp(a.id, lid) == 0) {
+      legacyAlarm a;
 
-      a.id[1] = '\0';
-      a.time = 0;
-      a.repeat = 0;
+      eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+      memset(&_alarms[i], 0, sizeof(alarm));
 
-      eeprom_write_block((const void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+      if (a.id[0] == 'A' && a.id[1] != '\0' && a.time != 0) {
+        memcpy(_alarms[i].id, &a.id[1], sizeof(_alarms[i].id) - 1);
+        _alarms[i].time = a.time;
+        _alarms[i].repeat = a.repeat;
+      }
+    }
+    for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+      if (_alarms[i].id[0] != '\0')
+        this->storeAlarm(i);
+    }
+  } else {
+    for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+      if (!_alarmLog.read(i, &_alarms[i]))
+        memset(&_alarms[i], 0, sizeof(alarm));
+      _alarms[i].id[sizeof(_alarms[i].id) - 1] = '\0';
     }
   }
-}
-
-void AMController::inizializeAlarms() {
 
-  for (int i = 0; i < 5; i++) {
+  this->sortAlarms();
+}
 
-    alarm a;
+// Insertion sort of the used slots by time, the table is only ALARM_SLOTS long
+void AMController::sortAlarms() {
 
-    eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+  _alarmCount = 0;
 
-    if (a.id[0] != 'A') {
+  for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+    if (_alarms[i].id[0] == '\0')
+      continue;
 
-      a.id[0] = 'A';
-      a.id[1] = '\0';
-      a.time = 0;
-      a.repeat = 0;
+    uint8_t j = _alarmCount++;
 
-      eeprom_write_block((const void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+    while (j > 0 && _alarms[_alarmOrder[j - 1]].time > _alarms[i].time) {
+      _alarmOrder[j] = _alarmOrder[j - 1];
+      j--;
     }
+    _alarmOrder[j] = i;
   }
 }
 
+void AMController::storeAlarm(uint8_t slot) {
+  _alarmLog.write(slot, &_alarms[slot]);
+}
+
 #ifdef DEBUG
 void AMController::dumpAlarms() {
 
   Serial.println("\t----Dump Alarms -----");
 
-  for (int i = 0; i < 5; i++) {
-
-    alarm al;
+  for (uint8_t i = 0; i < _alarmCount; i++) {
 
-    eeprom_read_block((void*)&al, (void*)(i * sizeof(al)), sizeof(al));
+    alarm *al = &_alarms[_alarmOrder[i]];
 
     Serial.print("\t");
-    Serial.print(al.id);
+    Serial.print(al->id);
     Serial.print(" ");
-    Serial.print(al.time);
+    Serial.print(al->time);
     Serial.print(" ");
-    Serial.println(al.repeat);
+    Serial.println(al->repeat);
   }
 }
 #endif
@@ -656,288 +816,450 @@ void AMController::checkAndFireAlarms(void) {
 
     unsigned long now = this->now();
 
-#ifdef DEBUG
-    Serial.print("checkAndFireAlarms ");
-    this->printTime(now);
-    this->dumpAlarms();
-#endif
-
-    for (int i = 0; i < 5; i++) {
-
-      alarm a;
+    // Only the first alarm can be due before the others
 
-      eeprom_read_block((void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+    while (_alarmCount > 0 && _alarms[_alarmOrder[0]].time < now) {
 
-      if (a.id[1] != '\0' && a.time < now) {
+      uint8_t slot = _alarmOrder[0];
+      alarm *a = &_alarms[slot];
 
 #ifdef DEBUG
-        Serial.println(a.id);
+      Serial.print("checkAndFireAlarms ");
+      this->printTime(now);
+      Serial.println(a->id);
 #endif
-        // First character of id is A and has to be removed
-        _processAlarms(&a.id[1]);
+      _processAlarms(a->id);
 
-        if (a.repeat) {
+      if (a->repeat) {
 
-          a.time += 86400; // Scheduled again tomorrow
+        // Next time it is due; days missed while off fire once, not once each
+        do {
+          a->time += ALARM_REPEAT_PERIOD;
+        } while (a->time < now);
 
 #ifdef DEBUG
-          Serial.print("Alarm rescheduled at ");
-          this->printTime(a.time);
+        Serial.print("Alarm rescheduled at ");
+        this->printTime(a->time);
 #endif
-        }
-        else {
-          //     Alarm removed
-
-          a.id[1] = '\0';
-          a.time = 0;
-          a.repeat = 0;
-        }
+      }
+      else {
+        //     Alarm removed
+        memset(a, 0, sizeof(alarm));
+      }
 
-        eeprom_write_block((const void*)&a, (void*)(i * sizeof(a)), sizeof(a));
+      this->storeAlarm(slot);
+      this->sortAlarms();
 #ifdef DEBUG
-        this->dumpAlarms();
+      this->dumpAlarms();
 #endif
-      }
     }
 }
 #endif
 
+// SD downloads
+
+#ifdef AM_SD_TRANSFER
+
+void AMController::sdStartTransfer(const char *name, bool log) {
+
+  // One at a time, a new request replaces the one in progress
+  this->sdEndTransfer();
+
+  strncpy(_sdName, name, sizeof(_sdName) - 1);
+  _sdName[sizeof(_sdName) - 1] = '\0';
+  _sdLogTransfer = log;
+  _sdOffset = _sdRequestedOffset;
+  _sdRequestedOffset = 0;
+  _sdBytes = 0;
+  _sdPending = 0;
+  _sdSent = 0;
+
+  if (log) {
 #ifdef SDLOGGEDATAGRAPH_SUPPORT
+    // A missing log only gets the end of the data, as before
+    if (_sdReader.open(name) && _sdReader.recordSize() == sizeof(sdLogRecord)) {
+      if (_sdOffset == 0) {
+        // Labels first
+        char labels[AM_SD_BUFFER_SIZE - sizeof(_sdName) - 2];
+
+        if (_sdReader.headerText(labels, sizeof(labels)) && labels[0] != '\0')
+          this->sdBufferText(_sdName, labels);
+      }
+    }
+    else
+      _sdReader.close();
 
-void AMController::sdLogLabels(const char *variable, const char *label1) {
+#ifdef SDLOGROLLUP_SUPPORT
+    if (_sdLevel > 0) {
+      char rollup[13];
 
-  this->sdLogLabels(variable, label1, NULL, NULL, NULL, NULL);
-}
+      _sdReader.close();
+      SdLogRollup::fileName(name, _sdLevel, rollup);
+      _sdFile = SD.open(rollup, FILE_READ);
+    }
+#endif
+#else
+    return;
+#endif
+  }
+  else {
+#ifdef SD_SUPPORT
+    _sdFile = SD.open(name, FILE_READ);
+    if (!_sdFile)
+      return;
 
-void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2) {
+    _sdFile.seek(min(_sdOffset, (unsigned long)_sdFile.size()));
+    this->writeTxtMessage("SD", "$C$");
+#else
+    return;
+#endif
+  }
 
-  this->sdLogLabels(variable, label1, label2, NULL, NULL, NULL);
+  _sdStarted = millis();
+  _sdState = AM_SD_STARTING;
 }
 
-void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3) {
+// Message text into the transfer buffer, cut to fit
+void AMController::sdBufferText(const char *variable, const char *value) {
 
-  this->sdLogLabels(variable, label1, label2, label3, NULL, NULL);
+  int len = snprintf((char *)_sdBuffer, sizeof(_sdBuffer), "%s=%s", variable, value);
+
+  if (len > (int)sizeof(_sdBuffer) - 2)
+    len = sizeof(_sdBuffer) - 2;
+  _sdBuffer[len++] = '#';
+  _sdPending = len;
+  _sdSent = 0;
 }
 
-void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4) {
+/*
+  Next piece of the transfer into the buffer, returns false when everything has been queued
+*/
+bool AMController::sdFillBuffer(void) {
 
-  this->sdLogLabels(variable, label1, label2, label3, label4, NULL);
-}
+  _sdPending = 0;
+  _sdSent = 0;
 
-void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5) {
+#ifdef SD_SUPPORT
+  if (_sdState == AM_SD_FILE) {
+    int n = _sdFile.read(_sdBuffer, sizeof(_sdBuffer));
 
-  File dataFile = SD.open(variable, FILE_WRITE);
+    if (n > 0) {
+      _sdPending = n;
+      _sdOffset += n;
+      return true;
+    }
 
-  if (dataFile)
-  {
-    dataFile.print("-");
-    dataFile.print(";");
-    dataFile.print(label1);
-    dataFile.print(";");
+    _sdFile.close();
+    this->sdBufferText("SD", "$E$");
+    _sdState = AM_SD_ENDING;
+    return true;
+  }
+#endif
 
-    if (label2 != NULL)
-      dataFile.print(label2);
-    else
-      dataFile.print("-");
-    dataFile.print(";");
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+  if (_sdState == AM_SD_LOG) {
+    if (_sdLevel == 0) {
+      sdLogRecord record;
+
+      if (_sdReader.seek(_sdOffset) && _sdReader.next(&record) && record.time <= _sdTo) {
+        this->sdBufferRecord(record.time, record.value);
+        _sdOffset += _sdStride;
+        return true;
+      }
+    }
+#ifdef SDLOGROLLUP_SUPPORT
+    else {
+      sdRollupRecord record;
 
-    if (label3 != NULL)
-      dataFile.print(label3);
-    else
-      dataFile.print("-");
-    dataFile.print(";");
+      if (_sdFile && SdLogRollup::read(_sdFile, _sdOffset, &record) && record.time <= _sdTo) {
+        this->sdBufferRecord(record.time, _sdStat == SD_ROLLUP_MIN ? record.min : _sdStat == SD_ROLLUP_MAX ? record.max : record.avg);
+        _sdOffset += _sdStride;
+        return true;
+      }
+    }
+#endif
 
-    if (label4 != NULL)
-      dataFile.print(label4);
-    else
-      dataFile.print("-");
-    dataFile.print(";");
+    _sdReader.close();
+    if (_sdFile)
+      _sdFile.close();
+    this->sdBufferText(_sdName, "");
+    _sdState = AM_SD_ENDING;
+    return true;
+  }
+#endif
 
-    if (label5 != NULL)
-      dataFile.println(label5);
-    else
-      dataFile.println("-");
+  return false;
+}
+
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+// "time;v1;v2;v3;v4;v5" line of the log, "-" for no value
+void AMController::sdBufferRecord(uint32_t time, const float *values) {
 
-    dataFile.println("\n");
+  char line[AM_SD_BUFFER_SIZE];
 
-    dataFile.flush();
-    dataFile.close();
+  ultoa(time, line, 10);
+
+  for (uint8_t i = 0; i < SD_LOG_VALUES; i++) {
+    char *end = line + strlen(line);
+
+    *end++ = ';';
+    if (isnan(values[i]))
+      strcpy(end, "-");
+    else if (fabs(values[i]) > 4294967040.0)
+      strcpy(end, "ovf");               // as Print::print(float) wrote it
+    else
+      dtostrf(values[i], 0, 2, end);
   }
-}
 
+  this->sdBufferText(_sdName, line);
+}
+#endif
 
-void AMController::sdLog(const char *variable, unsigned long time, float v1) {
+void AMController::sdTransferStep(void) {
 
-  File dataFile = SD.open(variable, FILE_WRITE);
+  if (_sdState == AM_SD_IDLE)
+    return;
 
-  if (dataFile && time > 0)
-  {
-    dataFile.print(time);
-    dataFile.print(";");
-    dataFile.print(v1);
-    dataFile.print(";");
+  if (_sdState == AM_SD_STARTING) {
+    if (millis() - _sdStarted < (_sdLogTransfer ? AM_SD_LOG_DELAY : AM_SD_FILE_DELAY))
+      return;
+    _sdStarted = millis();
+    _sdState = _sdLogTransfer ? AM_SD_LOG : AM_SD_FILE;
+  }
 
-    dataFile.print(v1);
+  // As much as the transmit queue takes without blocking
+  while (true) {
+    if (_sdSent == _sdPending && !this->sdFillBuffer()) {
+      this->sdEndTransfer();
+      return;
+    }
 
-    dataFile.print(";-;-;-\n");
+    int room = this->queueFree();
+    if (room <= 0)
+      return;
 
-    dataFile.flush();
-    dataFile.close();
+    uint8_t n = min(room, _sdPending - _sdSent);
+    this->queue(_sdBuffer + _sdSent, n);
+    _sdSent += n;
+    _sdBytes += n;
   }
 }
 
-void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2) {
-
-  File dataFile = SD.open(variable, FILE_WRITE);
+void AMController::sdEndTransfer(void) {
 
-  if (dataFile && time > 0)
-  {
-    dataFile.print(time);
-    dataFile.print(";");
-    dataFile.print(v1);
-    dataFile.print(";");
+  if (_sdState == AM_SD_IDLE)
+    return;
 
-    dataFile.print(v2);
+  if (_sdFile)
+    _sdFile.close();
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+  _sdReader.close();
+#endif
 
-    dataFile.print(";-;-;-\n");
+  _sdState = AM_SD_IDLE;
+  _sdFinished = millis();
 
-    dataFile.flush();
-    dataFile.close();
+  if (_sdReplyLength > 0) {
+    this->queue(_sdReplies, _sdReplyLength);
+    _sdReplyLength = 0;
   }
+
+#ifdef DEBUG
+  Serial.print("SD transfer of "); Serial.print(_sdName); Serial.print(": ");
+  Serial.print(_sdBytes); Serial.print(" bytes, ");
+  Serial.print(this->sdTransferRate()); Serial.println(" bytes/s");
+#endif
 }
 
-void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3) {
+bool AMController::sdTransferActive(void) {
+  return _sdState != AM_SD_IDLE;
+}
 
-  File dataFile = SD.open(variable, FILE_WRITE);
+unsigned long AMController::sdTransferBytes(void) {
+  return _sdBytes;
+}
 
-  if (dataFile && time > 0)
-  {
-    dataFile.print(time);
-    dataFile.print(";");
-    dataFile.print(v1);
-    dataFile.print(";");
+unsigned long AMController::sdTransferRate(void) {
 
-    dataFile.print(v2);
-    dataFile.print(";");
+  // From the first byte of the data, the start delay is the device's
+  if (_sdState == AM_SD_STARTING)
+    return 0;
 
-    dataFile.print(v3);
+  unsigned long elapsed = (_sdState == AM_SD_IDLE ? _sdFinished : millis()) - _sdStarted;
+  return elapsed > 0 ? _sdBytes * 1000UL / elapsed : 0;
+}
 
-    dataFile.print(";-;-\n");
+#endif
 
-    dataFile.flush();
-    dataFile.close();
-  }
+#ifdef SDLOGGEDATAGRAPH_SUPPORT
+
+bool AMController::sdLogOpen(const char *variable) {
+
+  if (_logger.isOpen() && strcmp(_logger.name(), variable) == 0)
+    return true;
+
+  // One file open at a time, switching flushes the previous one
+  if (!_logger.open(variable, sizeof(sdLogRecord)))
+    return false;
+
+#ifdef SDLOGROLLUP_SUPPORT
+  // Without rollups the log still works, queries answer from the raw records
+  _rollup.open(variable);
+#endif
+  return true;
 }
 
-void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4) {
+void AMController::sdLogAppend(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5) {
 
-  File dataFile = SD.open(variable, FILE_WRITE);
+  if (time == 0 || !this->sdLogOpen(variable))
+    return;
 
-  if (dataFile && time > 0)
-  {
-    dataFile.print(time);
-    dataFile.print(";");
-    dataFile.print(v1);
-    dataFile.print(";");
+  sdLogRecord record;
 
-    dataFile.print(v2);
-    dataFile.print(";");
+  record.time = time;
+  record.value[0] = v1;
+  record.value[1] = v2;
+  record.value[2] = v3;
+  record.value[3] = v4;
+  record.value[4] = v5;
 
-    dataFile.print(v3);
-    dataFile.print(";");
+  _logger.append(&record);
+#ifdef SDLOGROLLUP_SUPPORT
+  _rollup.add(time, record.value);
+#endif
+}
 
-    dataFile.print(v4);
+void AMController::sdLogLabels(const char *variable, const char *label1) {
 
-    dataFile.println(";-\n");
+  this->sdLogLabels(variable, label1, NULL, NULL, NULL, NULL);
+}
 
-    dataFile.flush();
-    dataFile.close();
-  }
+void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2) {
+
+  this->sdLogLabels(variable, label1, label2, NULL, NULL, NULL);
 }
 
-void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5) {
+void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3) {
 
-  File dataFile = SD.open(variable, FILE_WRITE);
+  this->sdLogLabels(variable, label1, label2, label3, NULL, NULL);
+}
 
-  if (dataFile && time > 0)
-  {
-    dataFile.print(time);
-    dataFile.print(";");
-    dataFile.print(v1);
-    dataFile.print(";");
+void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4) {
 
-    dataFile.print(v2);
-    dataFile.print(";");
+  this->sdLogLabels(variable, label1, label2, label3, label4, NULL);
+}
 
-    dataFile.print(v3);
-    dataFile.print(";");
+void AMController::sdLogLabels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5) {
 
-    dataFile.print(v4);
-    dataFile.print(";");
+  if (!this->sdLogOpen(variable))
+    return;
 
-    dataFile.println(v5);
+  // Sent ahead of the records as the widget's first line
+  char labels[SD_LOG_HEADER_TEXT_LEN];
 
-    dataFile.println("\n");
+  snprintf(labels, sizeof(labels), "-;%s;%s;%s;%s;%s", label1,
+           label2 != NULL ? label2 : "-",
+           label3 != NULL ? label3 : "-",
+           label4 != NULL ? label4 : "-",
+           label5 != NULL ? label5 : "-");
 
-    dataFile.flush();
-    dataFile.close();
-  }
+  _logger.setHeaderText(labels);
 }
 
-void AMController::sdSendLogData(const char *variable) {
 
-  //	cli();
+void AMController::sdLog(const char *variable, unsigned long time, float v1) {
 
-  delay(250);
+  this->sdLogAppend(variable, time, v1, NAN, NAN, NAN, NAN);
+}
 
-  _entry = SD.open(variable, FILE_WRITE);
+void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2) {
 
-  if (_entry) {
+  this->sdLogAppend(variable, time, v1, v2, NAN, NAN, NAN);
+}
 
-    char c;
-    char buffer[128];
-    char buffer1[128];
-    int i = 0;
+void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3) {
+
+  this->sdLogAppend(variable, time, v1, v2, v3, NAN, NAN);
+}
+
+void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4) {
+
+  this->sdLogAppend(variable, time, v1, v2, v3, v4, NAN);
+}
 
-    _entry.seek(0);
+void AMController::sdLog(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5) {
 
-    delay(250);
+  this->sdLogAppend(variable, time, v1, v2, v3, v4, v5);
+}
 
-    while ( (c = _entry.read()) != -1 ) {
+void AMController::sdSendLogData(const char *variable) {
 
-      if (c == '\n') {
+  // Records still in the logger's RAM block go to the card first
+  if (_logger.isOpen() && strcmp(_logger.name(), variable) == 0)
+    _logger.sync();
 
-        buffer[i++] = '\0';
+  _sdLevel = 0;
+  _sdStride = 1;
+  _sdTo = 0xFFFFFFFFUL;
+  this->sdStartTransfer(variable, true);
+}
 
-        //this->writeTxtMessage(variable,buffer);
+#ifdef SDLOGROLLUP_SUPPORT
 
-        snprintf(buffer1, 128, "%s=%s#", variable, buffer);
-        deviceSerial.write((const uint8_t *)buffer1, strlen(buffer1)*sizeof(char));
+void AMController::sdQueryLogData(const char *variable, uint32_t from, uint32_t to, uint16_t points, uint8_t stat) {
 
-        //delay(250);
+  uint32_t first;
+  uint32_t count;
 
-        i = 0;
-      }
-      else
-        buffer[i++] = c;
-    }
+  if (points == 0)
+    points = 1;
 
-    _entry.close();
+  if (_logger.isOpen() && strcmp(_logger.name(), variable) == 0) {
+    _logger.sync();
+    _rollup.sync();
   }
 
-  this->writeTxtMessage(variable, "");
+  // Raw records if they fit, else the finest rollup that does
+  _sdLevel = SdLogRollup::select(_sdReader, variable, from, to, points, &first, &count);
+
+  _sdStat = stat;
+  _sdStride = count > points ? (count + points - 1) / points : 1;
+  _sdTo = to;
 
-  //  	sei();
+#ifdef DEBUG
+  Serial.print("Query of "); Serial.print(variable); Serial.print(": level ");
+  Serial.print(_sdLevel); Serial.print(", "); Serial.print(count);
+  Serial.print(" records, every "); Serial.println(_sdStride);
+#endif
+
+  this->sdStartTransfer(variable, true);
+
+  // Resuming counts lines the device has
+  _sdOffset = first + _sdOffset * _sdStride;
 }
 
+#endif
+
 
 void AMController::sdPurgeLogData(const char *variable) {
 
+  if (_logger.isOpen() && strcmp(_logger.name(), variable) == 0) {
+    _logger.close();
+#ifdef SDLOGROLLUP_SUPPORT
+    _rollup.close();
+#endif
+  }
+  if (_sdState != AM_SD_IDLE && strcmp(_sdName, variable) == 0)
+    this->sdEndTransfer();
+
   cli();
 
   SD.remove(variable);
+#ifdef SDLOGROLLUP_SUPPORT
+  SdLogRollup::remove(variable);
+#endif
 
   sei();
 }
 
-#endif
\ No newline at end of file
+#endif
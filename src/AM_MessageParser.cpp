@@ -0,0 +1,141 @@
+#include "AM_MessageParser.h"
+
+static const char linkConnected[] = "OK+CONN";
+static const char linkLost[]      = "OK+LOST";
+
+#define LINK_STATUS_LEN (sizeof(linkConnected) - 1)
+
+AMMessageParser::AMMessageParser() {
+  _head = 0;
+  _count = 0;
+  _connIdx = 0;
+  _lostIdx = 0;
+  _overflows = 0;
+
+  this->resetMessage();
+}
+
+void AMMessageParser::resetMessage(void) {
+  _var = true;
+  _idx = 0;
+  _discard = false;
+}
+
+// Characters of token matched after c, from matched before it. On a mismatch the match falls back
+// to the longest shorter prefix that still ends the stream (KMP, with the borders found by comparing
+// the token with itself instead of a table): "OK+CO" ends in "O", so "OK+COK+CONN" is found
+static uint8_t matchStep(const char *token, uint8_t matched, char c) {
+  for (;;) {
+    if (c == token[matched])
+      return matched + 1;
+    if (matched == 0)
+      return 0;
+
+    uint8_t border = matched - 1;
+
+    while (border > 0 && strncmp(token, token + matched - border, border) != 0)
+      border--;
+    matched = border;
+  }
+}
+
+uint8_t AMMessageParser::matchLinkStatus(char c) {
+
+  _connIdx = matchStep(linkConnected, _connIdx, c);
+  _lostIdx = matchStep(linkLost, _lostIdx, c);
+
+  if (_connIdx == LINK_STATUS_LEN) {
+    _connIdx = 0;
+    _lostIdx = 0;
+    return AM_PARSER_CONNECTED;
+  }
+
+  if (_lostIdx == LINK_STATUS_LEN) {
+    _connIdx = 0;
+    _lostIdx = 0;
+    return AM_PARSER_DISCONNECTED;
+  }
+
+  return AM_PARSER_NONE;
+}
+
+uint8_t AMMessageParser::feed(char c) {
+
+  uint8_t event = this->matchLinkStatus(c);
+
+  if (event != AM_PARSER_NONE) {
+    this->resetMessage();
+    return event;
+  }
+
+  if (this->isFull()) {
+    _overflows++;
+    return AM_PARSER_NONE;
+  }
+
+  amMessage *message = &_queue[(_head + _count) % AM_MESSAGE_QUEUE_LEN];
+
+  if (_var) {
+    if (c == '=') {
+      message->variable[_idx] = '\0';
+      _var = false;
+      _idx = 0;
+    }
+    else if (c == '#') {
+      // Terminator without a value, resynchronise on the next message
+      _overflows++;
+      this->resetMessage();
+    }
+    else if (c != '\0') {
+      if (_idx < VARIABLELEN)
+        message->variable[_idx++] = c;
+      else
+        _discard = true;
+    }
+  }
+  else {
+    if (c == '#') {
+      message->value[_idx] = '\0';
+
+      bool complete = !_discard;
+
+      if (complete)
+        _count++;
+      else
+        _overflows++;
+
+      this->resetMessage();
+
+      return complete ? AM_PARSER_MESSAGE : AM_PARSER_NONE;
+    }
+    else {
+      if (_idx < VALUELEN)
+        message->value[_idx++] = c;
+      else
+        _discard = true;
+    }
+  }
+
+  return AM_PARSER_NONE;
+}
+
+bool AMMessageParser::isFull(void) const {
+  return _count >= AM_MESSAGE_QUEUE_LEN;
+}
+
+amMessage *AMMessageParser::peek(void) {
+  if (_count == 0)
+    return NULL;
+  return &_queue[_head];
+}
+
+void AMMessageParser::pop(void) {
+  if (_count == 0)
+    return;
+  _head = (_head + 1) % AM_MESSAGE_QUEUE_LEN;
+  _count--;
+}
+
+unsigned int AMMessageParser::overflows(void) const {
+  return _overflows;
+}
@@ -0,0 +1,105 @@
+#include "AM_Publisher.h"
+#include <util/crc16.h>
+
+AMPublisher::AMPublisher(AMController *controller, unsigned long heartbeat) {
+  _controller = controller;
+  _heartbeat = heartbeat;
+  _count = 0;
+  _frameValid = false;
+  _frameCrc = 0;
+  _frameTime = 0;
+  _sent = 0;
+  _suppressed = 0;
+  _deferred = 0;
+}
+
+amPublished *AMPublisher::find(const char *variable) {
+
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_published[i].variable == variable || strcmp(_published[i].variable, variable) == 0)
+      return &_published[i];
+  }
+  return NULL;
+}
+
+bool AMPublisher::publish(const char *variable, int value, int deadband) {
+
+  unsigned long now = millis();
+  amPublished *entry = this->find(variable);
+
+  if (entry != NULL) {
+    long change = (long)value - entry->value;
+
+    if (change < 0)
+      change = -change;
+
+    if (change <= deadband && (now - entry->time) < _heartbeat) {
+      _suppressed++;
+      return false;
+    }
+  }
+
+  if (_controller->txFree() < (int)strlen(variable) + AM_PUBLISHER_VALUE_ROOM) {
+    _deferred++;
+    return false;
+  }
+
+  if (entry == NULL && _count < AM_PUBLISHER_MAX_VARIABLES) {
+    entry = &_published[_count++];
+    entry->variable = variable;
+  }
+
+  _controller->writeMessage(variable, value);
+  _sent++;
+
+  // Variables beyond the table size are simply always sent
+  if (entry != NULL) {
+    entry->value = value;
+    entry->time = now;
+  }
+  return true;
+}
+
+bool AMPublisher::publishFrame(const void *payload, uint8_t len) {
+
+  unsigned long now = millis();
+  uint16_t crc = 0xFFFF;
+
+  for (uint8_t i = 0; i < len; i++)
+    crc = _crc_ccitt_update(crc, ((const uint8_t *)payload)[i]);
+
+  if (_frameValid && crc == _frameCrc && (now - _frameTime) < _heartbeat) {
+    _suppressed++;
+    return false;
+  }
+
+  if (_controller->txFree() < len + AM_PUBLISHER_FRAME_ROOM) {
+    _deferred++;
+    return false;
+  }
+
+  _controller->writeBinaryFrame(payload, len);
+  _sent++;
+
+  _frameValid = true;
+  _frameCrc = crc;
+  _frameTime = now;
+  return true;
+}
+
+void AMPublisher::resendAll(void) {
+  _count = 0;
+  _frameValid = false;
+}
+
+unsigned long AMPublisher::sent(void) {
+  return _sent;
+}
+
+unsigned long AMPublisher::suppressed(void) {
+  return _suppressed;
+}
+
+unsigned long AMPublisher::deferred(void) {
+  return _deferred;
+}
@@ -0,0 +1,194 @@
+#include "AdcAcquisition.h"
+#include <util/atomic.h>
+
+#if defined(__AVR__)
+#include <avr/interrupt.h>
+#else
+#include <ArduinoNative.h>
+#endif
+
+#define ADC_QUEUE_MASK (ADC_ACQUISITION_QUEUE_SIZE - 1)
+#define ADC_TIMER_HZ   250000UL             // Timer1 at 16 MHz / 64, 4 us per tick
+
+// Shared with the ADC interrupt, there is only one acquisition
+static uint16_t          adcQueue[ADC_ACQUISITION_QUEUE_SIZE];
+static volatile uint8_t  adcHead = 0;
+static volatile uint8_t  adcTail = 0;
+static volatile uint16_t adcDropped = 0;
+static uint8_t           adcSamples = 1;
+static uint8_t           adcCount = 0;
+static uint16_t          adcSum = 0;
+
+static void queueSum(uint16_t sum) {
+  if ((uint8_t)(adcHead - adcTail) >= ADC_ACQUISITION_QUEUE_SIZE) {
+    adcDropped++;
+    return;
+  }
+  adcQueue[adcHead & ADC_QUEUE_MASK] = sum;
+  __asm__ __volatile__("" ::: "memory");
+  adcHead++;
+}
+
+// One conversion result, in interrupt context
+static void acquire(uint16_t value) {
+  adcSum += value;
+  if (++adcCount < adcSamples)
+    return;
+
+  queueSum(adcSum);
+  adcSum = 0;
+  adcCount = 0;
+}
+
+#if defined(__AVR__)
+
+ISR(ADC_vect) {
+  uint16_t value = ADC;
+
+  // A conversion is triggered by the flag's rising edge, clear it for the next compare match
+  TIFR1 = _BV(OCF1B);
+  acquire(value);
+}
+
+#else
+
+static uint8_t adcPin;
+
+static void onTimer(void) {
+  acquire(nativeAnalogSample(adcPin));
+}
+
+#endif
+
+AdcAcquisition::AdcAcquisition(uint8_t pin) {
+  _pin = pin;
+  _samples = 1;
+  _period = 0;
+  _duty = 0;
+}
+
+void AdcAcquisition::begin(uint8_t bits, unsigned int rate) {
+  if (bits > ADC_SAMPLER_MAX_BITS)
+    bits = ADC_SAMPLER_MAX_BITS;
+  rate = constrain(rate, 4, 9000);
+
+  unsigned long ticks = ADC_TIMER_HZ / rate;
+
+  this->end();
+
+  _period = ticks;
+  _samples = 1 << (2 * bits);
+  adcSamples = _samples;
+  adcCount = 0;
+  adcSum = 0;
+
+#if defined(__AVR__)
+  uint8_t channel = _pin >= A0 ? _pin - A0 : _pin;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // Fast PWM up to ICR1, compare match B just before the end of every period triggers the
+    // conversion, OC1A is the output
+    TCCR1A = _BV(WGM11);
+    TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11) | _BV(CS10);
+    ICR1 = ticks - 1;
+    OCR1B = ticks - 1 - ADC_ACQUISITION_PWM_LEAD;
+    TCNT1 = 0;
+    TIMSK1 = 0;
+    TIFR1 = _BV(OCF1B);
+
+    if (channel < 6)
+      DIDR0 |= _BV(channel);
+    ADMUX = _BV(REFS0) | (channel & 0x07);
+    ADCSRB = _BV(ADTS2) | _BV(ADTS0);
+    // 125 kHz ADC clock as analogRead() uses
+    ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  }
+#else
+  adcPin = _pin;
+  nativeTimerInterrupt(ticks * (1000000UL / ADC_TIMER_HZ), &onTimer);
+#endif
+  this->output();
+}
+
+void AdcAcquisition::end(void) {
+#if defined(__AVR__)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // Back to what the Arduino core set up: analogRead() and 8-bit PWM on pins 9 and 10
+    ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    ADCSRB = 0;
+    TCCR1A = _BV(WGM10);
+    TCCR1B = _BV(CS11) | _BV(CS10);
+    digitalWrite(ADC_ACQUISITION_PWM_PIN, LOW);
+  }
+#else
+  nativeTimerInterrupt(0, NULL);
+  analogWrite(ADC_ACQUISITION_PWM_PIN, 0);
+#endif
+  _period = 0;
+}
+
+void AdcAcquisition::drive(uint8_t duty) {
+  if (duty == _duty)
+    return;
+  _duty = duty;
+  this->output();
+}
+
+uint8_t AdcAcquisition::duty(void) {
+  return _duty;
+}
+
+// Duty to the timer while it runs
+void AdcAcquisition::output(void) {
+  if (_period == 0)
+    return;
+
+#if defined(__AVR__)
+  uint16_t on = ((uint32_t)(_period - ADC_ACQUISITION_PWM_LEAD - ADC_ACQUISITION_PWM_SETTLE) * _duty) / 255;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // OCR1A 0 would still be high for a tick, so 0 disconnects the pin; it is double buffered
+    // and changes at the end of the period
+    if (_duty == 0) {
+      TCCR1A &= ~_BV(COM1A1);
+      digitalWrite(ADC_ACQUISITION_PWM_PIN, LOW);
+    } else {
+      pinMode(ADC_ACQUISITION_PWM_PIN, OUTPUT);
+      OCR1A = on;
+      TCCR1A |= _BV(COM1A1);
+    }
+  }
+#else
+  analogWrite(ADC_ACQUISITION_PWM_PIN, _duty);
+#endif
+}
+
+bool AdcAcquisition::next(uint16_t *sum) {
+  if (adcHead == adcTail)
+    return false;
+
+  __asm__ __volatile__("" ::: "memory");
+  *sum = adcQueue[adcTail & ADC_QUEUE_MASK];
+  __asm__ __volatile__("" ::: "memory");
+  adcTail++;
+  return true;
+}
+
+void AdcAcquisition::push(uint16_t sum) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    queueSum(sum);
+  }
+}
+
+uint8_t AdcAcquisition::samples(void) {
+  return _samples;
+}
+
+uint16_t AdcAcquisition::dropped(void) {
+  uint16_t n;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n = adcDropped;
+  }
+  return n;
+}
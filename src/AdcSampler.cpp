@@ -0,0 +1,28 @@
+#include "AdcSampler.h"
+
+AdcSampler::AdcSampler(uint8_t pin) {
+  _pin = pin;
+  _samples = 0;
+  _sum = 0;
+}
+
+uint16_t AdcSampler::read(uint8_t bits) {
+  if (bits > ADC_SAMPLER_MAX_BITS)
+    bits = ADC_SAMPLER_MAX_BITS;
+
+  // 4^bits conversions
+  _samples = 1 << (2 * bits);
+  _sum = 0;
+  for (uint8_t i = 0; i < _samples; i++)
+    _sum += analogRead(_pin);
+
+  return _sum >> bits;
+}
+
+uint8_t AdcSampler::samples(void) {
+  return _samples;
+}
+
+uint16_t AdcSampler::sum(void) {
+  return _sum;
+}
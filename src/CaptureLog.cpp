@@ -0,0 +1,125 @@
+#include "CaptureLog.h"
+
+static uint8_t *putLong(uint8_t *p, unsigned long value) {
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = (value >> 24) & 0xFF;
+  return p + 4;
+}
+
+CaptureLog::CaptureLog() {
+  _active = false;
+  _lastTime = 0;
+  _lastFlush = 0;
+  _bytes = 0;
+  _errors = 0;
+}
+
+bool CaptureLog::begin(void) {
+  char name[] = "CAP00.BIN";
+
+  for (uint8_t i = 0; i < 100; i++) {
+    name[3] = '0' + i / 10;
+    name[4] = '0' + i % 10;
+    if (SD.exists(name))
+      continue;
+
+    _file = SD.open(name, FILE_WRITE);
+    if (!_file)
+      return false;
+
+    _file.write((const uint8_t *)CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    _bytes = CAPTURE_MAGIC_LEN;
+    _active = true;
+
+    // Anchor the deltas
+    uint8_t payload[4];
+    _lastTime = millis();
+    putLong(payload, _lastTime);
+    this->record(CAPTURE_TIME, payload, sizeof(payload));
+
+    _file.flush();
+    _lastFlush = _lastTime;
+    return true;
+  }
+  return false;
+}
+
+void CaptureLog::record(uint8_t type, const uint8_t *payload, uint8_t len) {
+
+  if (!_active)
+    return;
+
+  unsigned long now = millis();
+  unsigned long delta = now - _lastTime;
+
+  if (delta > 0xFFFF && type != CAPTURE_TIME) {
+    uint8_t time[4];
+    putLong(time, now);
+    this->record(CAPTURE_TIME, time, sizeof(time));
+    delta = 0;
+  }
+  _lastTime = now;
+
+  // One write per record, the SD library copies it into its block cache
+  uint8_t buffer[CAPTURE_MAX_RECORD];
+  buffer[0] = type;
+  buffer[1] = delta & 0xFF;
+  buffer[2] = (delta >> 8) & 0xFF;
+  memcpy(buffer + CAPTURE_HEADER_LEN, payload, len);
+
+  uint8_t size = CAPTURE_HEADER_LEN + len;
+  if (_file.write(buffer, size) != size)
+    _errors++;
+  _bytes += size;
+}
+
+void CaptureLog::frame(const canFrame &frame) {
+  uint8_t payload[5 + 8];
+  uint8_t len = min(frame.len, (byte)8);
+
+  putLong(payload, frame.id);
+  payload[4] = len;
+  memcpy(payload + 5, frame.data, len);
+  this->record(CAPTURE_CAN, payload, 5 + len);
+}
+
+void CaptureLog::adcSample(uint8_t pin, int value) {
+  uint8_t payload[3] = { pin, (uint8_t)(value & 0xFF), (uint8_t)((value >> 8) & 0xFF) };
+  this->record(CAPTURE_ADC, payload, sizeof(payload));
+}
+
+void CaptureLog::adcSum(uint8_t pin, uint8_t samples, uint16_t sum) {
+  uint8_t payload[4] = { pin, samples, (uint8_t)(sum & 0xFF), (uint8_t)(sum >> 8) };
+  this->record(CAPTURE_ADC_SUM, payload, sizeof(payload));
+}
+
+void CaptureLog::manual(bool on) {
+  uint8_t payload = on;
+  this->record(CAPTURE_MANUAL, &payload, 1);
+}
+
+void CaptureLog::pump(bool on) {
+  uint8_t payload = on;
+  this->record(CAPTURE_PUMP, &payload, 1);
+}
+
+void CaptureLog::loop(void) {
+  if (_active && millis() - _lastFlush >= CAPTURE_FLUSH_INTERVAL) {
+    _file.flush();
+    _lastFlush = millis();
+  }
+}
+
+bool CaptureLog::active(void) {
+  return _active;
+}
+
+unsigned long CaptureLog::bytes(void) {
+  return _bytes;
+}
+
+unsigned long CaptureLog::errors(void) {
+  return _errors;
+}
@@ -0,0 +1,149 @@
+#include "EepromLog.h"
+#include <util/crc16.h>
+
+EepromLog::EepromLog() {
+  _start = 0;
+  _slots = 0;
+  _size = 0;
+  _next = 0;
+  _sequence = 1;
+  _current = 0;
+  _writes = 0;
+}
+
+bool EepromLog::begin(uint16_t start, uint16_t length, uint8_t size) {
+  uint16_t slots = length / EEPROM_LOG_SLOT_SIZE(size);
+
+  _start = start;
+  _slots = min(slots, (uint16_t)EEPROM_LOG_MAX_SLOTS);
+  _size = size;
+  _next = 0;
+  _sequence = 1;
+  _current = 0;
+
+  if (_slots < 2) {
+    _slots = 0;
+    return false;
+  }
+
+  for (uint8_t i = 0; i < _slots; i++) {
+    uint32_t sequence;
+    uint8_t key;
+
+    if (!this->valid(i, &sequence, &key))
+      continue;
+
+    // Carry on after the newest slot
+    if (sequence >= _sequence) {
+      _sequence = sequence + 1;
+      _next = (i + 1) % _slots;
+    }
+
+    // Newer than the key's slot so far, or its first
+    int16_t found = this->find(key);
+    if (found < 0 || sequence > this->sequence(found)) {
+      if (found >= 0)
+        _current &= ~(1UL << found);
+      _current |= 1UL << i;
+    }
+  }
+  return true;
+}
+
+size_t EepromLog::address(uint8_t slot) {
+  return _start + slot * EEPROM_LOG_SLOT_SIZE(_size);
+}
+
+// Sequence and key of a slot whose CRC checks out
+bool EepromLog::valid(uint8_t slot, uint32_t *sequence, uint8_t *key) {
+  size_t address = this->address(slot);
+  uint16_t crc = 0xFFFF;
+
+  eeprom_read_block(sequence, (const void *)address, sizeof(*sequence));
+  // Erased cells read 0xFF
+  if (*sequence == 0xFFFFFFFFUL)
+    return false;
+
+  // Byte by byte, so checking needs no buffer for the value
+  for (uint8_t i = 0; i < 5 + _size; i++)
+    crc = _crc_ccitt_update(crc, eeprom_read_byte((const uint8_t *)(address + i)));
+
+  *key = eeprom_read_byte((const uint8_t *)(address + 4));
+  return eeprom_read_word((const uint16_t *)(address + 5 + _size)) == crc;
+}
+
+uint8_t EepromLog::key(uint8_t slot) {
+  return eeprom_read_byte((const uint8_t *)(this->address(slot) + 4));
+}
+
+uint32_t EepromLog::sequence(uint8_t slot) {
+  return eeprom_read_dword((const uint32_t *)this->address(slot));
+}
+
+// Slot with the current value of key, -1 if there is none
+int16_t EepromLog::find(uint8_t key) {
+  for (uint8_t i = 0; i < _slots; i++) {
+    if ((_current & (1UL << i)) && this->key(i) == key)
+      return i;
+  }
+  return -1;
+}
+
+bool EepromLog::read(uint8_t key, void *value) {
+  int16_t slot = this->find(key);
+
+  if (slot < 0)
+    return false;
+
+  eeprom_read_block(value, (const void *)(this->address(slot) + 5), _size);
+  return true;
+}
+
+bool EepromLog::write(uint8_t key, const void *value) {
+  int16_t previous = this->find(key);
+
+  for (uint8_t tries = 0; tries < _slots; tries++) {
+    uint8_t slot = _next;
+
+    _next = (_next + 1) % _slots;
+
+    // Never over a current value, the key's own included: it is what a power loss falls back to
+    if (_current & (1UL << slot))
+      continue;
+
+    size_t address = this->address(slot);
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < 4; i++)
+      crc = _crc_ccitt_update(crc, ((const uint8_t *)&_sequence)[i]);
+    crc = _crc_ccitt_update(crc, key);
+    for (uint8_t i = 0; i < _size; i++)
+      crc = _crc_ccitt_update(crc, ((const uint8_t *)value)[i]);
+
+    eeprom_update_block(&_sequence, (void *)address, sizeof(_sequence));
+    eeprom_update_byte((uint8_t *)(address + 4), key);
+    eeprom_update_block(value, (void *)(address + 5), _size);
+    eeprom_update_word((uint16_t *)(address + 5 + _size), crc);
+
+    if (previous >= 0)
+      _current &= ~(1UL << previous);
+    _current |= 1UL << slot;
+
+    _sequence++;
+    _writes++;
+    return true;
+  }
+  return false;
+}
+
+bool EepromLog::empty(void) {
+  return _current == 0;
+}
+
+uint8_t EepromLog::slots(void) {
+  return _slots;
+}
+
+unsigned long EepromLog::writes(void) {
+  return _writes;
+}
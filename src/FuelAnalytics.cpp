@@ -0,0 +1,112 @@
+#include "FuelAnalytics.h"
+
+FuelAnalytics::FuelAnalytics(uint8_t priLiters, uint8_t auxLiters, uint16_t window) {
+  _priLiters = priLiters;
+  _auxLiters = auxLiters;
+  _window = window * 1000UL;
+  _started = false;
+  _consumption = 0;
+  _duty = 0;
+  _session = 0;
+  _lifetime = 0;
+}
+
+void FuelAnalytics::restore(uint32_t lifetime, uint16_t consumption, uint16_t dutyCycle) {
+  _lifetime = lifetime;
+  _consumption = (int32_t)consumption << ANALYTICS_SHIFT;
+  _duty = (uint32_t)dutyCycle << ANALYTICS_SHIFT;
+}
+
+// Q16 % of a tank in ml, from 1/256 % so a full 36 l tank stays well within 32 bits
+int32_t FuelAnalytics::milliliters(int32_t level, uint8_t liters) {
+  return (level >> 8) * liters * 10 / 256;
+}
+
+// Only a new low of the run counts, so the noise of the level adds up to one swing per run
+// rather than one per window
+void FuelAnalytics::closeRun(int32_t aux) {
+  if (_runAux > aux) {
+    _session += _runAux - aux;
+    _lifetime += _runAux - aux;
+    _runAux = aux;
+  }
+}
+
+void FuelAnalytics::closeWindow(unsigned long ms) {
+  unsigned long length = ms - _windowStart;
+  int32_t used = constrain(_windowFuel - _fuel, -32767L, 32767L);
+
+  // A fill-up isn't consumption, the window is left out. Timed in 0.1 s, as a loop can run
+  // the window over by most of a second
+  if (used > -ANALYTICS_REFILL) {
+    int32_t rate = used * 36000 / (int32_t)(length / 100);
+
+    _consumption += rate - (_consumption >> ANALYTICS_SHIFT);
+  }
+
+  // In 0.1 s, so the product stays within 32 bits for windows up to 6553 s
+  uint32_t fraction = (_windowPump / 100) * 65535UL / (length / 100);
+
+  _duty += fraction - (_duty >> ANALYTICS_SHIFT);
+
+  _windowStart = ms;
+  _windowFuel = _fuel;
+  _windowPump = 0;
+}
+
+void FuelAnalytics::update(unsigned long ms, int32_t primary, int32_t aux, bool pumping) {
+  int32_t auxFuel = this->milliliters(aux, _auxLiters);
+
+  _fuel = this->milliliters(primary, _priLiters) + auxFuel;
+
+  if (!_started) {
+    _started = true;
+    _windowStart = ms;
+    _windowFuel = _fuel;
+    _windowPump = 0;
+    _last = ms;
+    _pumping = pumping;
+    _runAux = auxFuel;
+    return;
+  }
+
+  if (_pumping)
+    _windowPump += ms - _last;
+  _last = ms;
+
+  if (pumping && !_pumping)
+    _runAux = auxFuel;
+  if (_pumping && !pumping)
+    this->closeRun(auxFuel);
+  _pumping = pumping;
+
+  if (ms - _windowStart >= _window) {
+    if (_pumping)
+      this->closeRun(auxFuel);
+    this->closeWindow(ms);
+  }
+}
+
+uint16_t FuelAnalytics::consumption(void) {
+  return constrain(_consumption >> ANALYTICS_SHIFT, 0L, 0xFFFFL);
+}
+
+uint32_t FuelAnalytics::sessionTransferred(void) {
+  return _session;
+}
+
+uint32_t FuelAnalytics::lifetimeTransferred(void) {
+  return _lifetime;
+}
+
+uint16_t FuelAnalytics::dutyCycle(void) {
+  return min(_duty >> ANALYTICS_SHIFT, 0xFFFFUL);
+}
+
+uint16_t FuelAnalytics::range(void) {
+  uint16_t rate = this->consumption();
+
+  if (rate < ANALYTICS_IDLE)
+    return ANALYTICS_NO_RANGE;
+  return min((uint32_t)max(_fuel, 0L) * 60 / rate, (uint32_t)ANALYTICS_NO_RANGE - 1);
+}
@@ -0,0 +1,210 @@
+#include "FuelEstimator.h"
+
+TankEstimator::TankEstimator(const estimatorGains &gains) {
+  _gains = gains;
+  _level = 0;
+  _rate = 0;
+  _carry = 0;
+  _primed = false;
+}
+
+void TankEstimator::reset(int16_t level) {
+  _level = (int32_t)level << 8;
+  _rate = 0;
+  _carry = 0;
+  _primed = true;
+}
+
+void TankEstimator::advance(uint16_t dt) {
+  dt = min(dt, (uint16_t)ESTIMATOR_MAX_ADVANCE);
+
+  // A period at a time; the fraction bits of the rate are carried, so they add up over the periods
+  while (dt > 0) {
+    uint16_t step = min(dt, _gains.period);
+    int32_t moved = step == _gains.period ? _rate : (int32_t)((int64_t)_rate * step / _gains.period);
+
+    moved += _carry;
+    _level += moved >> ESTIMATOR_RATE_SHIFT;
+    _carry = moved & ((1 << ESTIMATOR_RATE_SHIFT) - 1);
+    dt -= step;
+  }
+}
+
+void TankEstimator::update(uint16_t dt, int16_t level) {
+  if (!_primed) {
+    _level = (int32_t)level << 8;
+    _primed = true;
+    return;
+  }
+
+  this->advance(dt);
+
+  // Residual in 1/256 %, so the 16-bit gains multiply within 32 bits
+  int32_t residual = constrain(((int32_t)level << 8) - _level, -(32767L << 8), 32767L << 8) >> 8;
+
+  _level += ((int32_t)_gains.alpha * residual) >> 8;
+  _rate += ((int32_t)_gains.beta * residual) >> (16 - ESTIMATOR_RATE_SHIFT);
+  _rate = constrain(_rate, -(ESTIMATOR_MAX_RATE << ESTIMATOR_RATE_SHIFT), ESTIMATOR_MAX_RATE << ESTIMATOR_RATE_SHIFT);
+}
+
+void TankEstimator::adjust(int32_t from, int32_t to) {
+  _rate += (int32_t)((int64_t)to * _gains.period * (1 << ESTIMATOR_RATE_SHIFT) / 1000) -
+           (int32_t)((int64_t)from * _gains.period * (1 << ESTIMATOR_RATE_SHIFT) / 1000);
+  _rate = constrain(_rate, -(ESTIMATOR_MAX_RATE << ESTIMATOR_RATE_SHIFT), ESTIMATOR_MAX_RATE << ESTIMATOR_RATE_SHIFT);
+}
+
+int32_t TankEstimator::level(void) {
+  return _level;
+}
+
+int32_t TankEstimator::rate(void) {
+  return (int32_t)((int64_t)_rate * 1000 / _gains.period >> ESTIMATOR_RATE_SHIFT);
+}
+
+uint16_t TankEstimator::period(void) {
+  return _gains.period;
+}
+
+bool TankEstimator::primed(void) {
+  return _primed;
+}
+
+FuelEstimator::FuelEstimator(const estimatorGains &aux, const estimatorGains &measured, const estimatorGains &primary,
+                             int32_t transfer, uint16_t ratio)
+  : _aux(aux), _measured(measured), _primary(primary) {
+  _primaryTime = 0;
+  _transfer = transfer;
+  _drain = 0;
+  _applied = 0;
+  _nominal = transfer;
+  _runReadings = 0;
+  _runFlow = 0;
+  _sumLevel = 0;
+  _sumFlow = 0;
+  _sumFlowLevel = 0;
+  _sumFlowFlow = 0;
+  _ratio = ratio;
+  _flow = 0;
+}
+
+void FuelEstimator::primeAux(int16_t level) {
+  _aux.reset(level);
+  _measured.reset(level);
+}
+
+void FuelEstimator::aux(int16_t level) {
+  _aux.update(_aux.period(), level);
+  _measured.update(_measured.period(), level);
+
+  // The readings of the run against the fuel the pump was driven to move up to each of them
+  if (_flow == 0 || _runReadings >= ESTIMATOR_MAX_FIT)
+    return;
+  _runReadings++;
+  _runFlow += _flow >> 4;
+  _sumLevel += level;
+  _sumFlow += _runFlow;
+  _sumFlowLevel += (int64_t)_runFlow * level;
+  _sumFlowFlow += (int64_t)_runFlow * _runFlow;
+}
+
+// Slope of the run's least-squares line in aux rate units at full flow, averaged with the runs
+// before, within reason of the nominal rate
+void FuelEstimator::learnTransfer(void) {
+  if (_runFlow < (uint32_t)ESTIMATOR_MIN_RUN * (ESTIMATOR_FULL_FLOW >> 4))
+    return;
+
+  int64_t n = _runReadings;
+  int64_t covariance = n * _sumFlowLevel - _sumFlow * _sumLevel;
+  int64_t variance = (n * _sumFlowFlow - _sumFlow * _sumFlow) >> 12;
+
+  if (variance <= 0)
+    return;
+
+  // 1/256 % per 1/16 reading at full flow to 1/65536 % per second
+  int32_t drained = (int32_t)(-covariance / variance) * (1000 / _aux.period());
+
+  _transfer = constrain((_transfer + drained) / 2, _nominal / 2, _nominal * 2);
+}
+
+void FuelEstimator::advancePrimary(unsigned long ms) {
+  if (_primary.primed())
+    _primary.advance(min(ms - _primaryTime, (unsigned long)ESTIMATOR_MAX_ADVANCE));
+  _primaryTime = ms;
+}
+
+void FuelEstimator::primary(unsigned long ms, int16_t level) {
+  unsigned long dt = min(ms - _primaryTime, (unsigned long)ESTIMATOR_MAX_ADVANCE);
+
+  _primaryTime = ms;
+  _primary.update(dt, level);
+}
+
+void FuelEstimator::pump(unsigned long ms, uint16_t flow) {
+  flow = min(flow, (uint16_t)ESTIMATOR_FULL_FLOW);
+  if (flow == _flow)
+    return;
+
+  this->advancePrimary(ms);
+
+  if (_flow == 0) {
+    _runReadings = 0;
+    _runFlow = 0;
+    _sumLevel = 0;
+    _sumFlow = 0;
+    _sumFlowLevel = 0;
+    _sumFlowFlow = 0;
+  }
+  _flow = flow;
+
+  // The learned transfer rate at this flow, the fuel it moves in primary tank units
+  int32_t drain = (_transfer * flow) >> 8;
+  int32_t applied = (drain * _ratio) >> 8;
+
+  _aux.adjust(-_drain, -drain);
+  _primary.adjust(_applied, applied);
+  _drain = drain;
+  _applied = applied;
+
+  if (flow == 0)
+    this->learnTransfer();
+}
+
+static uint8_t wholePercent(int32_t level) {
+  return constrain((level + 0x8000) >> 16, 0, 100);
+}
+
+uint8_t FuelEstimator::auxLevel(void) {
+  return wholePercent(_aux.level());
+}
+
+uint8_t FuelEstimator::primaryLevel(void) {
+  return wholePercent(_primary.level());
+}
+
+int32_t FuelEstimator::auxEstimate(void) {
+  return _aux.level();
+}
+
+int32_t FuelEstimator::primaryEstimate(void) {
+  return _primary.level();
+}
+
+int32_t FuelEstimator::transferRate(void) {
+  return _transfer;
+}
+
+int32_t FuelEstimator::burnRate(void) {
+  return _applied - _primary.rate();
+}
+
+int32_t FuelEstimator::auxDrain(void) {
+  return -_aux.rate();
+}
+
+int32_t FuelEstimator::measuredDrain(void) {
+  return -_measured.rate();
+}
+
+bool FuelEstimator::ready(void) {
+  return _aux.primed();
+}
@@ -21,18 +21,23 @@
 // THE SOFTWARE.
 
 #include <SoftwareSerial.h>
-#include "QueueList.h"
+#include "StaticQueue.h"
 #include "HM_10_BLE.h"
 
 HM_10_BLE::HM_10_BLE(int8_t TXD, int8_t RXD) : SoftwareSerial(TXD, RXD) {
+  atAnswer[0] = '\0';
+  message[0] = '\0';
 }
 
+// the configuration callback has no object, only one HM-10 is ever attached
+static HM_10_BLE* configuring = NULL;
+
 void HM_10_BLE::begin(char delimiter) {
   begin("HM_10_BLE", "123456", delimiter);
 }
 
-// init the HM-10 with custom name and password
-void HM_10_BLE::begin(const char* name, const char* pass, char delimiter) {
+// init the HM-10 with custom name and password, the commands are pipelined by atHandler()
+void HM_10_BLE::begin(const char* name, const char* pass, char delimiter, hm10ATCallback configured) {
   SoftwareSerial::begin(HM_10_BLE_BAUDRATE);
 
   #if HM_10_BLE_DEBUG
@@ -41,39 +46,105 @@ void HM_10_BLE::begin(const char* name, const char* pass, char delimiter) {
 
   messageDelimiter = delimiter;
 
+  configuring = this;
+  configureStart = millis();
+  configuredIn = 0;
+  configuredCallback = configured;
+
   atCommand("TYPE", "3");
   atCommand("NAME", name);
   atCommand("PASS", pass);
-  atCommand("RESET");
+  atCommand("RESET", &HM_10_BLE::configurationDone);
 }
 
-void HM_10_BLE::queueATCommand(String cmd) {
+// last command of begin() answered
+void HM_10_BLE::configurationDone(const char* command, bool ok, const char* answer) {
+  if (configuring == NULL) {
+    return;
+  }
+  configuring->configuredIn = max(millis() - configuring->configureStart, 1UL);
+  #if HM_10_BLE_DEBUG
+    Serial.print("configured in ");
+    Serial.print(configuring->configuredIn);
+    Serial.println(" ms");
+  #endif
+  if (configuring->configuredCallback) {
+    configuring->configuredCallback(command, ok, answer);
+  }
+}
+
+// build "AT", "AT+<cmd>" or "AT+<cmd><param>" in place and queue it
+void HM_10_BLE::queueATCommand(const char* cmd, const char* param, hm10ATCallback callback, unsigned int timeout) {
+  hm10ATCommand command;
+  size_t length = 2 + (cmd ? 1 + strlen(cmd) : 0) + (param ? strlen(param) : 0);
+
+  if (length > HM_10_BLE_AT_LEN) {
+    atOverflowCount++;
+    #if HM_10_BLE_DEBUG
+      Serial.println("AT command too long, dropped");
+    #endif
+    return;
+  }
+
+  strcpy(command.text, "AT");
+  if (cmd) {
+    strcat(command.text, "+");
+    strcat(command.text, cmd);
+  }
+  command.paramOffset = 0;
+  if (param) {
+    command.paramOffset = strlen(command.text);
+    strcat(command.text, param);
+  }
+  command.callback = callback;
+  command.timeout = timeout;
+
   #if HM_10_BLE_DEBUG
     Serial.print("queue AT command: ");
-    Serial.println(cmd);
+    Serial.println(command.text);
   #endif
-  atCommands.push(cmd);
+  if (!atCommands.tryPush(command)) {
+    atOverflowCount++;
+    #if HM_10_BLE_DEBUG
+      Serial.println("AT command queue full, dropped");
+    #endif
+  }
 }
 
 // send AT commands
-void HM_10_BLE::atCommand() {
-  queueATCommand(String("AT"));
+void HM_10_BLE::atCommand(hm10ATCallback callback, unsigned int timeout) {
+  queueATCommand(NULL, NULL, callback, timeout);
 }
 
 // send AT command without parameter
-void HM_10_BLE::atCommand(const char* cmd) {
-  String cmdString = "AT+";
-  cmdString += String(cmd);
-  queueATCommand(cmdString);
-
+void HM_10_BLE::atCommand(const char* cmd, hm10ATCallback callback, unsigned int timeout) {
+  queueATCommand(cmd, NULL, callback, timeout);
 }
 
 // send AT command with parameter
-void HM_10_BLE::atCommand(const char* cmd, const char* param) {
-  String cmdString = "AT+";
-  cmdString += String(cmd);
-  cmdString += String(param);
-  queueATCommand(cmdString);
+void HM_10_BLE::atCommand(const char* cmd, const char* param, hm10ATCallback callback, unsigned int timeout) {
+  queueATCommand(cmd, param, callback, timeout);
+}
+
+// work out the answer the module gives to a successful command
+void HM_10_BLE::expectATAnswer(const hm10ATCommand* command) {
+  const char* text = command->text;
+  size_t length = strlen(text);
+
+  atExpectedPrefix = false;
+  if (length <= 2) {
+    strcpy(atExpected, "OK");
+  } else if (text[length - 1] == '?') {
+    // queries answer with a value of unknown length
+    strcpy(atExpected, "OK+");
+    atExpectedPrefix = true;
+  } else if (command->paramOffset > 0) {
+    strcpy(atExpected, "OK+Set:");
+    strncat(atExpected, text + command->paramOffset, HM_10_BLE_ANSWER_LEN - 7);
+  } else {
+    strcpy(atExpected, "OK+");
+    strncat(atExpected, text + 3, HM_10_BLE_ANSWER_LEN - 3);
+  }
 }
 
 // send, wait for and read AT command answer
@@ -84,41 +155,69 @@ bool HM_10_BLE::atHandler() {
   if (waitForMessage && !waitForATCommand) {
     return false;
   }
+  unsigned long now = millis();
   if (!waitForATCommand) {
+    if ((long)(now - atHoldUntil) < 0) {
+      // module is still restarting
+      return true;
+    }
+    hm10ATCommand* command = atCommands.peek();
     #if HM_10_BLE_DEBUG
       Serial.print("send AT command: ");
+      Serial.println(command->text);
     #endif
-    String cmdString = atCommands.peek();
-    char cmd[cmdString.length()+1];
-    cmdString.toCharArray(cmd, cmdString.length()+1);
-    write(cmd);
+    expectATAnswer(command);
+    write(command->text);
+    atSentAt = now;
+    atLastByteAt = now;
     waitForATCommand = true;
     return true;
   }
-  if (available() <= 0) {
-    if (readCount == 0) {
-      return true;
-    }
-    readCount++;
-    if (readCount > readTries) {
-      handleATAnswer();
+  while (available() > 0) {
+    char character = read();
+    if (atAnswerLength < HM_10_BLE_ANSWER_LEN) {
+      atAnswer[atAnswerLength++] = character;
+      atAnswer[atAnswerLength] = '\0';
+    } else {
+      atOverflowCount++;
     }
-    return true;
+    atLastByteAt = now;
+  }
+
+  size_t expectedLength = strlen(atExpected);
+  bool matches = strncmp(atAnswer, atExpected, min((size_t)atAnswerLength, expectedLength)) == 0;
+  bool quiet = now - atLastByteAt >= HM_10_BLE_AT_QUIET;
+
+  if (matches && atAnswerLength >= expectedLength && (!atExpectedPrefix || quiet)) {
+    // exact answers complete on their last character, queries once the module goes quiet
+    handleATAnswer(atExpectedPrefix || atAnswerLength == expectedLength);
+  } else if (!matches && quiet) {
+    handleATAnswer(false);
+  } else if (now - atSentAt >= atCommands.peek()->timeout) {
+    handleATAnswer(false);
   }
-  readCount = 1;
-  atAnswer += (char)read();
   return true;
 }
 
 // remove AT command from queue after answer was received
-void HM_10_BLE::handleATAnswer() {
+void HM_10_BLE::handleATAnswer(bool ok) {
+  hm10ATCommand command = *atCommands.peek();
+  atCommands.pop();
+  waitForATCommand = false;
   #if HM_10_BLE_DEBUG
+    Serial.print(ok ? "AT ok in " : "AT failed in ");
+    Serial.print(millis() - atSentAt);
+    Serial.print(" ms: ");
     Serial.println(atAnswer);
   #endif
-  atAnswer = "";
-  waitForATCommand = false;
-  readCount = 0;
-  atCommands.pop();
+  if (ok && strcmp(command.text, "AT+RESET") == 0) {
+    atHoldUntil = millis() + HM_10_BLE_RESET_SETTLE;
+  }
+  if (command.callback) {
+    command.callback(command.text, ok, atAnswer);
+  }
+  atAnswer[0] = '\0';
+  atAnswerLength = 0;
 }
 
 // read messages from BLE serial and wait for delimiter
@@ -136,7 +235,13 @@ bool HM_10_BLE::messageHandler() {
     return true;
   }
   waitForMessage = true;
-  message += character;
+  if (messageLength < HM_10_BLE_MESSAGE_LEN) {
+    message[messageLength++] = character;
+    message[messageLength] = '\0';
+  } else {
+    // keep reading up to the delimiter, the whole message is dropped there
+    messageOverflow = true;
+  }
   return true;
 }
 
@@ -154,14 +259,18 @@ void HM_10_BLE::handleMessage() {
   // if (message.equals("AT") || message.startsWith("AT+")) {
   //   queueATCommand(message);
   // } else {
-    char msg[message.length()+1];
-    message.toCharArray(msg, message.length()+1);
-    processMessage(msg);
+    if (messageOverflow) {
+      messageOverflowCount++;
+    } else {
+      processMessage(message);
+    }
   // }
   #if HM_10_BLE_DEBUG
     Serial.println(message);
   #endif
-  message = "";
+  message[0] = '\0';
+  messageLength = 0;
+  messageOverflow = false;
   waitForMessage = false;
 }
 
@@ -0,0 +1,152 @@
+#include "PumpController.h"
+
+PumpController::PumpController(const pumpLimits &limits) {
+  _limits = limits;
+  _limits.maxStarts = min(_limits.maxStarts, (uint8_t)PUMP_START_HISTORY);
+  _state = PUMP_IDLE;
+  _switched = 0;
+  _windowStart = 0;
+  _windowSum = 0;
+  _windowFlow = 0;
+  _windowReadings = 0;
+  _reference = 0;
+  _referenced = false;
+  _flowSince = 0;
+  _startCount = 0;
+  _startNext = 0;
+}
+
+void PumpController::level(int16_t level, uint16_t flow) {
+  // Only the pump's windows and a fault's watch for a refill need the level
+  if (_state == PUMP_IDLE || _state == PUMP_COOLDOWN || _windowReadings == 0xFFFF)
+    return;
+  _windowSum += level;
+  _windowFlow += min(flow, (uint16_t)PUMP_FULL_FLOW);
+  _windowReadings++;
+}
+
+// Starts that left the hour no longer count
+void PumpController::expire(unsigned long ms) {
+  while (_startCount > 0) {
+    uint8_t oldest = (_startNext + PUMP_START_HISTORY - _startCount) % PUMP_START_HISTORY;
+
+    if (ms - _starts[oldest] < PUMP_START_WINDOW)
+      break;
+    _startCount--;
+  }
+}
+
+bool PumpController::canStart(unsigned long ms) {
+  this->expire(ms);
+  return _startCount < _limits.maxStarts;
+}
+
+void PumpController::enter(unsigned long ms, pumpState state) {
+  bool wasOn = this->on();
+
+  _state = state;
+  if (this->on() != wasOn)
+    _switched = ms;
+
+  if (state == PUMP_PRIMING) {
+    _starts[_startNext] = ms;
+    _startNext = (_startNext + 1) % PUMP_START_HISTORY;
+    _startCount++;
+    _referenced = false;
+  }
+
+  _windowStart = ms;
+  _windowSum = 0;
+  _windowFlow = 0;
+  _windowReadings = 0;
+}
+
+// Mean level and flow of the window when it is over, which starts the next one; a window without
+// readings tells nothing
+bool PumpController::closeWindow(unsigned long ms, int16_t *mean, uint16_t *flow) {
+  if (ms - _windowStart < _limits.dryWindow * 1000UL)
+    return false;
+
+  bool valid = _windowReadings > 0;
+
+  if (valid) {
+    *mean = _windowSum / _windowReadings;
+    *flow = _windowFlow / _windowReadings;
+  }
+  _windowStart = ms;
+  _windowSum = 0;
+  _windowFlow = 0;
+  _windowReadings = 0;
+  return valid;
+}
+
+bool PumpController::update(unsigned long ms, bool demand) {
+  int16_t mean;
+  uint16_t flow;
+
+  switch (_state) {
+    case PUMP_COOLDOWN:
+      if (ms - _switched < _limits.minOff * 1000UL || !this->canStart(ms))
+        break;
+
+      // A demand that waited starts right away
+      _state = PUMP_IDLE;
+      // fall through
+    case PUMP_IDLE:
+      if (demand && this->canStart(ms))
+        this->enter(ms, PUMP_PRIMING);
+      break;
+
+    case PUMP_PRIMING:
+    case PUMP_TRANSFERRING:
+      if (this->closeWindow(ms, &mean, &flow)) {
+        _flowSince = min(_flowSince + flow, 0xFFFF);
+        _state = PUMP_TRANSFERRING;
+
+        // Checked once the windows since the last check moved as much as one at full flow
+        if (!_referenced || _flowSince >= PUMP_FULL_FLOW) {
+          if (_referenced && _reference - mean < _limits.dryDrop) {
+            this->enter(ms, PUMP_FAULT);
+            _reference = mean;
+            break;
+          }
+          _reference = mean;
+          _referenced = true;
+          _flowSince = 0;
+        }
+      }
+      if (!demand && ms - _switched >= _limits.minOn * 1000UL)
+        this->enter(ms, PUMP_COOLDOWN);
+      break;
+
+    case PUMP_FAULT:
+      if (this->closeWindow(ms, &mean, &flow) && mean - _reference >= _limits.refill)
+        this->reset();
+      break;
+  }
+
+  return this->on();
+}
+
+void PumpController::reset(void) {
+  // Off since the fault, the cooldown counts from there
+  if (_state == PUMP_FAULT)
+    _state = PUMP_COOLDOWN;
+}
+
+pumpState PumpController::state(void) {
+  return _state;
+}
+
+bool PumpController::on(void) {
+  return _state == PUMP_PRIMING || _state == PUMP_TRANSFERRING;
+}
+
+bool PumpController::fault(void) {
+  return _state == PUMP_FAULT;
+}
+
+uint8_t PumpController::starts(unsigned long ms) {
+  this->expire(ms);
+  return _startCount;
+}
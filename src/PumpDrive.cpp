@@ -0,0 +1,63 @@
+#include "PumpDrive.h"
+
+PumpDrive::PumpDrive(const pumpDriveGains &gains) {
+  _gains = gains;
+  _duty = 0;
+  _integral = 0;
+  _time = 0;
+}
+
+uint16_t PumpDrive::flowOf(uint8_t duty) {
+  if (duty <= _gains.dead)
+    return 0;
+  return ((uint16_t)(duty - _gains.dead) * PUMP_DRIVE_FULL_FLOW) / (255 - _gains.dead);
+}
+
+uint8_t PumpDrive::update(unsigned long ms, bool run, uint16_t setpoint, int16_t measured) {
+  unsigned long dt = min(ms - _time, 1000UL);
+  uint16_t target = 0;
+
+  _time = ms;
+
+  if (run) {
+    int16_t error = (int16_t)setpoint - measured;
+    int32_t low = this->flowOf(_gains.minDuty);
+    int32_t output = setpoint + (((int32_t)_gains.kp * error) >> 8) + _integral / 256000;
+
+    // The integral only grows while the output isn't held at the limit it grows towards
+    if (!(output >= PUMP_DRIVE_FULL_FLOW && error > 0) && !(output <= low && error < 0))
+      _integral += (int32_t)_gains.ki * error * (int32_t)dt;
+    _integral = constrain(_integral, -PUMP_DRIVE_INTEGRAL_LIMIT, PUMP_DRIVE_INTEGRAL_LIMIT);
+
+    output = constrain(output, low, (int32_t)PUMP_DRIVE_FULL_FLOW);
+    target = _gains.dead + (output * (255 - _gains.dead) + PUMP_DRIVE_FULL_FLOW / 2) / PUMP_DRIVE_FULL_FLOW;
+    target = constrain(target, _gains.minDuty, _gains.maxDuty) << 8;
+
+    // A stopped pump starts at the least duty, then ramps
+    if (_duty < (uint16_t)_gains.minDuty << 8)
+      _duty = (uint16_t)_gains.minDuty << 8;
+  } else {
+    _integral = 0;
+  }
+
+  uint16_t step = min((unsigned long)_gains.ramp * dt * 256 / 1000, 0xFFFFUL);
+
+  if (target > _duty)
+    _duty = target - _duty > step ? _duty + step : target;
+  else
+    _duty = _duty - target > step ? _duty - step : target;
+
+  // Below the least duty a stopping pump is off
+  if (!run && _duty < (uint16_t)_gains.minDuty << 8)
+    _duty = 0;
+
+  return this->duty();
+}
+
+uint8_t PumpDrive::duty(void) {
+  return _duty >> 8;
+}
+
+uint16_t PumpDrive::flow(void) {
+  return this->flowOf(this->duty());
+}
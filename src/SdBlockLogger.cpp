@@ -0,0 +1,401 @@
+#include "SdBlockLogger.h"
+
+SdBlockLogger::SdBlockLogger() {
+  _name[0] = '\0';
+  _recordSize = 0;
+  _perBlock = 0;
+  _index = 0;
+  _allocated = 0;
+  _grow = 0;
+  _grown = 0;
+  _dirty = false;
+  _lastSync = 0;
+
+  _records = 0;
+  _blocks = 0;
+  _maxWriteMicros = 0;
+  _errors = 0;
+}
+
+bool SdBlockLogger::open(const char *name, uint8_t recordSize) {
+  sdLogFileHeader header;
+
+  this->close();
+
+  if (recordSize == 0 || recordSize > SD_LOG_BLOCK_SIZE - sizeof(sdLogBlockHeader))
+    return false;
+
+  // No O_APPEND, the library would move every write to the end of the file
+  _file = SD.open(name, O_RDWR | O_CREAT);
+  if (!_file)
+    return false;
+
+  strncpy(_name, name, sizeof(_name) - 1);
+  _name[sizeof(_name) - 1] = '\0';
+  _recordSize = recordSize;
+  _perBlock = SD_LOG_RECORDS_PER_BLOCK(recordSize);
+  _allocated = _file.size() / SD_LOG_BLOCK_SIZE;
+  _grow = 0;
+  _grown = 0;
+
+  if (_allocated == 0) {
+    // New file: header block, then the empty blocks ahead of the data
+    memset(_block, 0, sizeof(_block));
+    memcpy(_block, SD_LOG_FILE_MAGIC, sizeof(header.magic));
+    _block[sizeof(header.magic)] = recordSize;
+
+    if (_file.write(_block, SD_LOG_BLOCK_SIZE) != SD_LOG_BLOCK_SIZE) {
+      this->close();
+      return false;
+    }
+    _allocated = 1;
+
+    memset(_block, 0, sizeof(_block));
+    for (uint16_t i = 0; i < SD_LOG_PREALLOCATE_BLOCKS; i++) {
+      if (!this->addBlock()) {
+        this->close();
+        return false;
+      }
+    }
+    _file.flush();
+    _grown = 0;
+
+    _index = 1;
+    this->startBlock();
+  } else {
+    _file.seek(0);
+    if (_file.read(&header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, SD_LOG_FILE_MAGIC, sizeof(header.magic)) != 0 || header.recordSize != recordSize) {
+      this->close();
+      return false;
+    }
+
+    // Written blocks come first, so the first invalid one is found by bisection
+    uint32_t low = 1;
+    uint32_t high = _allocated;
+    sdLogBlockHeader block;
+
+    while (low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      if (this->validBlock(middle, &block))
+        low = middle + 1;
+      else
+        high = middle;
+    }
+
+    // Keep filling the last block if it has room
+    if (low > 1 && this->validBlock(low - 1, &block) && block.count < _perBlock) {
+      _index = low - 1;
+      _file.seek(_index * SD_LOG_BLOCK_SIZE);
+      _file.read(_block, SD_LOG_BLOCK_SIZE);
+    } else {
+      _index = low;
+      this->startBlock();
+    }
+
+    // Back to the full stretch of empty blocks ahead
+    if (_allocated < _index + SD_LOG_PREALLOCATE_BLOCKS)
+      _grow = min(_index + SD_LOG_PREALLOCATE_BLOCKS - _allocated, (uint32_t)255);
+  }
+
+  _dirty = false;
+  _lastSync = millis();
+  return true;
+}
+
+bool SdBlockLogger::validBlock(uint32_t index, sdLogBlockHeader *header) {
+  if (!_file.seek(index * SD_LOG_BLOCK_SIZE) || _file.read(header, sizeof(sdLogBlockHeader)) != sizeof(sdLogBlockHeader))
+    return false;
+  return header->magic == SD_LOG_MAGIC && header->index == index && header->recordSize == _recordSize &&
+         header->count > 0 && header->count <= _perBlock;
+}
+
+// Empty RAM block for _index
+void SdBlockLogger::startBlock(void) {
+  memset(_block, 0, sizeof(_block));
+
+  sdLogBlockHeader *header = (sdLogBlockHeader *)_block;
+  header->magic = SD_LOG_MAGIC;
+  header->recordSize = _recordSize;
+  header->index = _index;
+}
+
+// Copy of the RAM block at the end of the file; its index doesn't match the place, so it reads as unused
+bool SdBlockLogger::addBlock(void) {
+  if (!_file.seek(_allocated * SD_LOG_BLOCK_SIZE) || _file.write(_block, SD_LOG_BLOCK_SIZE) != SD_LOG_BLOCK_SIZE)
+    return false;
+  _allocated++;
+  _grown++;
+  return true;
+}
+
+// One card write's worth of growing the file: a block, or the directory entry with the new size
+void SdBlockLogger::grow(void) {
+  unsigned long start = micros();
+
+  if (_grow > 0) {
+    if (this->addBlock())
+      _grow--;
+    else
+      _errors++;
+  } else if (_grown >= SD_LOG_DIR_UPDATE_BLOCKS) {
+    _file.flush();
+    _grown = 0;
+  } else {
+    return;
+  }
+
+  unsigned long elapsed = micros() - start;
+  if (elapsed > _maxWriteMicros)
+    _maxWriteMicros = elapsed;
+}
+
+bool SdBlockLogger::writeBlock(void) {
+  unsigned long start = micros();
+  bool ok = _file.seek(_index * SD_LOG_BLOCK_SIZE) && _file.write(_block, SD_LOG_BLOCK_SIZE) == SD_LOG_BLOCK_SIZE;
+
+  if (ok) {
+    _blocks++;
+    _dirty = false;
+    // Growing fell behind, the block went past the end
+    if (_index >= _allocated) {
+      _allocated = _index + 1;
+      _grown++;
+    }
+  } else {
+    _errors++;
+  }
+  _lastSync = millis();
+
+  unsigned long elapsed = micros() - start;
+  if (elapsed > _maxWriteMicros)
+    _maxWriteMicros = elapsed;
+  return ok;
+}
+
+bool SdBlockLogger::setHeaderText(const char *text) {
+  char buffer[SD_LOG_HEADER_TEXT_LEN];
+
+  if (!_file)
+    return false;
+
+  // Through the library's cache, the header is written once per file
+  memset(buffer, 0, sizeof(buffer));
+  strncpy(buffer, text, sizeof(buffer) - 1);
+  bool ok = _file.seek(offsetof(sdLogFileHeader, text)) && _file.write((const uint8_t *)buffer, sizeof(buffer)) == sizeof(buffer);
+  _file.flush();
+  return ok;
+}
+
+bool SdBlockLogger::append(const void *record) {
+  if (!_file)
+    return false;
+
+  sdLogBlockHeader *header = (sdLogBlockHeader *)_block;
+
+  memcpy(_block + sizeof(sdLogBlockHeader) + header->count * _recordSize, record, _recordSize);
+  header->count++;
+  _records++;
+  _dirty = true;
+
+  if (header->count >= _perBlock) {
+    bool ok = this->writeBlock();
+
+    _index++;
+    this->startBlock();
+    if (_grow < 255)
+      _grow++;
+    return ok;
+  }
+
+  if (millis() - _lastSync >= SD_LOG_SYNC_INTERVAL)
+    return this->writeBlock();
+
+  this->grow();
+  return true;
+}
+
+bool SdBlockLogger::sync(void) {
+  if (!_file)
+    return false;
+  return _dirty ? this->writeBlock() : true;
+}
+
+void SdBlockLogger::loop(void) {
+  if (!_file)
+    return;
+
+  if (_dirty && millis() - _lastSync >= SD_LOG_SYNC_INTERVAL)
+    this->writeBlock();
+  else
+    this->grow();
+}
+
+void SdBlockLogger::close(void) {
+  if (!_file)
+    return;
+
+  this->sync();
+  _file.close();
+  _name[0] = '\0';
+}
+
+bool SdBlockLogger::isOpen(void) {
+  return (bool)_file;
+}
+
+const char *SdBlockLogger::name(void) {
+  return _name;
+}
+
+unsigned long SdBlockLogger::records(void) {
+  return _records;
+}
+
+unsigned long SdBlockLogger::blocks(void) {
+  return _blocks;
+}
+
+unsigned long SdBlockLogger::maxWriteMicros(void) {
+  return _maxWriteMicros;
+}
+
+unsigned long SdBlockLogger::errors(void) {
+  return _errors;
+}
+
+
+SdBlockReader::SdBlockReader() {
+  _recordSize = 0;
+  _index = 0;
+  _left = 0;
+}
+
+bool SdBlockReader::open(const char *name) {
+  char magic[sizeof(((sdLogFileHeader *)0)->magic)];
+
+  this->close();
+
+  _file = SD.open(name, FILE_READ);
+  if (!_file)
+    return false;
+
+  if (_file.read(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, SD_LOG_FILE_MAGIC, sizeof(magic)) != 0 ||
+      (_recordSize = _file.read()) == 0 || _recordSize > SD_LOG_BLOCK_SIZE - sizeof(sdLogBlockHeader)) {
+    this->close();
+    return false;
+  }
+
+  _index = 0;
+  _left = 0;
+  return true;
+}
+
+bool SdBlockReader::isOpen(void) {
+  return (bool)_file;
+}
+
+bool SdBlockReader::headerText(char *text, uint8_t size) {
+  uint32_t position = _file.position();
+
+  if (size == 0 || !_file.seek(offsetof(sdLogFileHeader, text)))
+    return false;
+
+  uint8_t len = min(size - 1, SD_LOG_HEADER_TEXT_LEN - 1);
+  bool ok = _file.read(text, len) == len;
+
+  text[ok ? len : 0] = '\0';
+  _file.seek(position);
+  return ok;
+}
+
+uint8_t SdBlockReader::recordSize(void) {
+  return _recordSize;
+}
+
+bool SdBlockReader::seek(uint32_t record) {
+  uint8_t perBlock = SD_LOG_RECORDS_PER_BLOCK(_recordSize);
+  uint32_t block = 1 + record / perBlock;
+  uint8_t skip = record % perBlock;
+  sdLogBlockHeader header;
+
+  // Nothing left to read unless the block checks out
+  _index = block;
+  _left = 0;
+
+  if (!_file || !_file.seek(block * SD_LOG_BLOCK_SIZE) || _file.read(&header, sizeof(header)) != sizeof(header))
+    return false;
+  if (header.magic != SD_LOG_MAGIC || header.index != block || header.recordSize != _recordSize ||
+      header.count > perBlock || skip >= header.count)
+    return false;
+
+  _left = header.count - skip;
+  return _file.seek(block * SD_LOG_BLOCK_SIZE + sizeof(header) + skip * _recordSize);
+}
+
+bool SdBlockReader::next(void *record) {
+  if (!_file)
+    return false;
+
+  while (_left == 0) {
+    sdLogBlockHeader header;
+
+    _index++;
+    if (!_file.seek(_index * SD_LOG_BLOCK_SIZE) || _file.read(&header, sizeof(header)) != sizeof(header))
+      return false;
+    // Unused pre-extended blocks end the log
+    if (header.magic != SD_LOG_MAGIC || header.index != _index || header.recordSize != _recordSize ||
+        header.count > SD_LOG_RECORDS_PER_BLOCK(_recordSize) || header.count == 0)
+      return false;
+    _left = header.count;
+  }
+
+  _left--;
+  return _file.read(record, _recordSize) == _recordSize;
+}
+
+uint32_t SdBlockReader::count(void) {
+  uint32_t low = 1;
+  uint32_t high = _file ? _file.size() / SD_LOG_BLOCK_SIZE : 0;
+  sdLogBlockHeader header;
+
+  if (high <= low)
+    return 0;
+
+  // Written blocks come first, and all but the last one are full
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (this->seek((middle - 1) * SD_LOG_RECORDS_PER_BLOCK(_recordSize)))
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 1 || !_file.seek((low - 1) * SD_LOG_BLOCK_SIZE) || _file.read(&header, sizeof(header)) != sizeof(header))
+    return 0;
+
+  return (low - 2) * SD_LOG_RECORDS_PER_BLOCK(_recordSize) + header.count;
+}
+
+uint32_t SdBlockReader::find(uint32_t time) {
+  uint32_t low = 0;
+  uint32_t high = this->count();
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    uint32_t start;
+
+    if (!this->seek(middle) || _file.read(&start, sizeof(start)) != sizeof(start))
+      break;
+    if (start < time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+void SdBlockReader::close(void) {
+  if (_file)
+    _file.close();
+}
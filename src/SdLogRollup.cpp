@@ -0,0 +1,246 @@
+#include "SdLogRollup.h"
+
+SdLogRollup::SdLogRollup() {
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    _buckets[i].count = 0;
+    _unflushed[i] = false;
+  }
+  _nextFlush = 0;
+  _lastFlush = 0;
+  _errors = 0;
+}
+
+uint32_t SdLogRollup::period(uint8_t level) {
+  switch (level) {
+    case 1: return 10UL * SD_LOG_TIME_UNITS;
+    case 2: return 60UL * SD_LOG_TIME_UNITS;
+    case 3: return 600UL * SD_LOG_TIME_UNITS;
+  }
+  return 1;
+}
+
+void SdLogRollup::fileName(const char *log, uint8_t level, char *name) {
+  uint8_t len = 0;
+
+  // 8.3: the log's base name with .R1, .R2 or .R3
+  while (len < 8 && log[len] != '\0' && log[len] != '.') {
+    name[len] = log[len];
+    len++;
+  }
+  name[len++] = '.';
+  name[len++] = 'R';
+  name[len++] = '0' + level;
+  name[len] = '\0';
+}
+
+bool SdLogRollup::open(const char *log) {
+  char name[13];
+
+  this->close();
+
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    this->fileName(log, i + 1, name);
+
+    // No O_APPEND, a record cut off by a power loss is written over
+    _files[i] = SD.open(name, O_RDWR | O_CREAT);
+    if (!_files[i]) {
+      this->close();
+      return false;
+    }
+
+    uint32_t records = this->count(_files[i]);
+
+    if (records == 0) {
+      uint8_t header[SD_ROLLUP_HEADER_LEN];
+      uint32_t length = this->period(i + 1);
+
+      memcpy(header, SD_ROLLUP_MAGIC, 4);
+      header[4] = sizeof(sdRollupRecord);
+      memcpy(header + 5, &length, sizeof(length));
+      _files[i].seek(0);
+      _files[i].write(header, sizeof(header));
+    } else {
+      _files[i].seek(SD_ROLLUP_HEADER_LEN + records * sizeof(sdRollupRecord));
+    }
+
+    _buckets[i].count = 0;
+    _unflushed[i] = true;
+  }
+
+  _lastFlush = millis();
+  return true;
+}
+
+void SdLogRollup::add(uint32_t time, const float *values) {
+  if (!this->isOpen())
+    return;
+
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    sdRollupBucket *bucket = &_buckets[i];
+    uint32_t start = time - time % this->period(i + 1);
+
+    if (bucket->count > 0 && bucket->start != start)
+      this->emit(i);
+
+    if (bucket->count == 0) {
+      bucket->start = start;
+      for (uint8_t v = 0; v < SD_ROLLUP_VALUES; v++) {
+        bucket->min[v] = values[v];
+        bucket->max[v] = values[v];
+        bucket->sum[v] = values[v];
+      }
+    } else {
+      // A value that isn't logged stays NaN through all three
+      for (uint8_t v = 0; v < SD_ROLLUP_VALUES; v++) {
+        if (values[v] < bucket->min[v])
+          bucket->min[v] = values[v];
+        if (values[v] > bucket->max[v])
+          bucket->max[v] = values[v];
+        bucket->sum[v] += values[v];
+      }
+    }
+    bucket->count++;
+  }
+}
+
+void SdLogRollup::emit(uint8_t level) {
+  sdRollupBucket *bucket = &_buckets[level];
+  sdRollupRecord record;
+
+  record.time = bucket->start;
+  record.count = bucket->count;
+  for (uint8_t v = 0; v < SD_ROLLUP_VALUES; v++) {
+    record.min[v] = bucket->min[v];
+    record.max[v] = bucket->max[v];
+    record.avg[v] = bucket->sum[v] / bucket->count;
+  }
+
+  // Through the library's cache, a bucket is at most a few per minute
+  if (_files[level].write((const uint8_t *)&record, sizeof(record)) != sizeof(record))
+    _errors++;
+  _unflushed[level] = true;
+  bucket->count = 0;
+}
+
+void SdLogRollup::loop(void) {
+  if (!this->isOpen() || millis() - _lastFlush < SD_LOG_SYNC_INTERVAL / SD_ROLLUP_LEVELS)
+    return;
+
+  // One file per call keeps each call to a cache write and a directory entry
+  _lastFlush = millis();
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    uint8_t level = _nextFlush;
+
+    _nextFlush = (_nextFlush + 1) % SD_ROLLUP_LEVELS;
+    if (_unflushed[level]) {
+      _files[level].flush();
+      _unflushed[level] = false;
+      return;
+    }
+  }
+}
+
+void SdLogRollup::sync(void) {
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    if (_files[i] && _unflushed[i]) {
+      _files[i].flush();
+      _unflushed[i] = false;
+    }
+  }
+}
+
+void SdLogRollup::close(void) {
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    if (_files[i]) {
+      if (_buckets[i].count > 0)
+        this->emit(i);
+      _files[i].close();
+    }
+    _buckets[i].count = 0;
+    _unflushed[i] = false;
+  }
+}
+
+bool SdLogRollup::isOpen(void) {
+  return (bool)_files[0];
+}
+
+unsigned long SdLogRollup::errors(void) {
+  return _errors;
+}
+
+void SdLogRollup::remove(const char *log) {
+  char name[13];
+
+  for (uint8_t i = 0; i < SD_ROLLUP_LEVELS; i++) {
+    fileName(log, i + 1, name);
+    SD.remove(name);
+  }
+}
+
+uint32_t SdLogRollup::count(File &file) {
+  uint8_t header[SD_ROLLUP_HEADER_LEN];
+  uint32_t size = file.size();
+
+  if (size < SD_ROLLUP_HEADER_LEN || !file.seek(0) || file.read(header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, SD_ROLLUP_MAGIC, 4) != 0 || header[4] != sizeof(sdRollupRecord))
+    return 0;
+  return (size - SD_ROLLUP_HEADER_LEN) / sizeof(sdRollupRecord);
+}
+
+uint32_t SdLogRollup::find(File &file, uint32_t time) {
+  uint32_t low = 0;
+  uint32_t high = count(file);
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    uint32_t start;
+
+    if (!file.seek(SD_ROLLUP_HEADER_LEN + middle * sizeof(sdRollupRecord)) || file.read(&start, sizeof(start)) != sizeof(start))
+      break;
+    if (start < time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+bool SdLogRollup::read(File &file, uint32_t index, sdRollupRecord *record) {
+  return file.seek(SD_ROLLUP_HEADER_LEN + index * sizeof(sdRollupRecord)) &&
+         file.read(record, sizeof(sdRollupRecord)) == sizeof(sdRollupRecord);
+}
+
+uint8_t SdLogRollup::select(SdBlockReader &reader, const char *log, uint32_t from, uint32_t to, uint16_t points,
+                            uint32_t *first, uint32_t *count) {
+  uint8_t selected = 0;
+
+  *first = 0;
+  *count = 0;
+  if (reader.open(log)) {
+    *first = reader.find(from);
+    *count = reader.find(to == 0xFFFFFFFFUL ? to : to + 1) - *first;
+    reader.close();
+  }
+
+  for (uint8_t level = 1; level <= SD_ROLLUP_LEVELS && *count > points; level++) {
+    char name[13];
+    File rollup;
+
+    fileName(log, level, name);
+    rollup = SD.open(name, FILE_READ);
+    if (!rollup)
+      break;
+
+    // The bucket holding from starts before it
+    uint32_t length = period(level);
+    uint32_t start = find(rollup, from - from % length);
+    uint32_t end = find(rollup, to == 0xFFFFFFFFUL ? to : to + 1);
+    rollup.close();
+
+    selected = level;
+    *first = start;
+    *count = end - start;
+  }
+  return selected;
+}
@@ -0,0 +1,192 @@
+#include "SenderCalibration.h"
+#include <util/crc16.h>
+
+#define CALIBRATION_FIELD(start, field) ((size_t)(start) + offsetof(calibrationRecord, field))
+
+// save() writes the fields one after the other and the CRC covers every byte before it
+static_assert(offsetof(calibrationRecord, table) == 2 + CALIBRATION_MAX_POINTS * sizeof(calibrationPoint) &&
+              offsetof(calibrationRecord, crc) == offsetof(calibrationRecord, table) + 6 + (CALIBRATION_SEGMENTS + 1) * sizeof(int16_t),
+              "calibrationRecord has padding");
+
+// Program the bytes at address, only those that changed (3.3 ms each), and add them to the CRC;
+// no data writes zeros
+static uint16_t calibrationUpdate(size_t address, const void *data, uint8_t size, uint16_t crc) {
+  for (uint8_t i = 0; i < size; i++) {
+    uint8_t value = data != NULL ? ((const uint8_t *)data)[i] : 0;
+
+    eeprom_update_byte((uint8_t *)(address + i), value);
+    crc = _crc_ccitt_update(crc, value);
+  }
+  return crc;
+}
+
+SenderCalibration::SenderCalibration(const calibrationTable *defaults) {
+  _defaults = defaults;
+  _start = 0;
+  _stored = false;
+  _recording = false;
+  _count = 0;
+  this->load();
+}
+
+bool SenderCalibration::begin(uint16_t start) {
+  uint16_t crc = 0xFFFF;
+
+  _start = start;
+  _stored = false;
+
+  for (uint8_t i = 0; i < offsetof(calibrationRecord, crc); i++)
+    crc = _crc_ccitt_update(crc, eeprom_read_byte((const uint8_t *)((size_t)start + i)));
+
+  // Erased cells fail the version check, a write cut off by a power loss the CRC
+  _stored = eeprom_read_byte((const uint8_t *)CALIBRATION_FIELD(start, version)) == CALIBRATION_VERSION &&
+            eeprom_read_word((const uint16_t *)CALIBRATION_FIELD(start, crc)) == crc;
+  this->load();
+  return _stored;
+}
+
+// Base, top and shift of the table in use
+void SenderCalibration::load(void) {
+  if (_stored) {
+    _base = eeprom_read_word((const uint16_t *)CALIBRATION_FIELD(_start, table.base));
+    _top = eeprom_read_word((const uint16_t *)CALIBRATION_FIELD(_start, table.top));
+    _shift = eeprom_read_byte((const uint8_t *)CALIBRATION_FIELD(_start, table.shift));
+  } else {
+    _base = pgm_read_word(&_defaults->base);
+    _top = pgm_read_word(&_defaults->top);
+    _shift = pgm_read_byte(&_defaults->shift);
+  }
+}
+
+int16_t SenderCalibration::node(uint8_t index) {
+  if (_stored)
+    return eeprom_read_word((const uint16_t *)(CALIBRATION_FIELD(_start, table.level) + index * sizeof(uint16_t)));
+  return pgm_read_word(&_defaults->level[index]);
+}
+
+int16_t SenderCalibration::level(uint16_t reading) {
+  if (reading <= _base)
+    return this->node(0);
+
+  uint16_t offset = min(reading, _top) - _base;
+  uint16_t index = offset >> _shift;
+
+  if (index >= CALIBRATION_SEGMENTS)
+    return this->node(CALIBRATION_SEGMENTS);
+
+  int16_t from = this->node(index);
+  int16_t to = this->node(index + 1);
+  uint8_t fraction = offset & ((1 << _shift) - 1);
+
+  return from + (int16_t)((((int32_t)to - from) * fraction) >> _shift);
+}
+
+uint8_t SenderCalibration::percent(uint16_t reading) {
+  return constrain((this->level(reading) + 0x80) >> 8, 0, 100);
+}
+
+void SenderCalibration::start(void) {
+  _recording = true;
+  _count = 0;
+}
+
+bool SenderCalibration::record(uint16_t reading, uint8_t percent) {
+  uint8_t i;
+
+  if (!_recording || percent > 100)
+    return false;
+
+  for (i = 0; i < _count && _points[i].percent != percent; i++)
+    ;
+  if (i == CALIBRATION_MAX_POINTS)
+    return false;
+
+  _points[i].reading = reading;
+  _points[i].percent = percent;
+  _points[i].reserved = 0;
+  if (i == _count)
+    _count++;
+  return true;
+}
+
+bool SenderCalibration::save(void) {
+  uint16_t crc = 0xFFFF;
+  uint8_t version = CALIBRATION_VERSION;
+
+  if (!_recording || !sortPoints(_points, _count))
+    return false;
+
+  // The record straight from the points, field by field, rather than built on the stack first
+  uint16_t base = _points[0].reading;
+  uint16_t top = _points[_count - 1].reading;
+  uint8_t shift = calibrationShift(top - base);
+
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, version), &version, 1, crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, count), &_count, 1, crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, points), _points, _count * sizeof(calibrationPoint), crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, points) + _count * sizeof(calibrationPoint), NULL,
+                          (CALIBRATION_MAX_POINTS - _count) * sizeof(calibrationPoint), crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, table.base), &base, sizeof(base), crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, table.top), &top, sizeof(top), crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, table.shift), &shift, 1, crc);
+  crc = calibrationUpdate(CALIBRATION_FIELD(_start, table.reserved), NULL, 1, crc);
+
+  // The same nodes calibrationTableOf() gives the defaults
+  for (uint8_t i = 0; i <= CALIBRATION_SEGMENTS; i++) {
+    int16_t level = calibrationNode(calibrationLevel(_points, _count, base + ((long)i << shift)));
+
+    crc = calibrationUpdate(CALIBRATION_FIELD(_start, table.level) + i * sizeof(int16_t), &level, sizeof(level), crc);
+  }
+  eeprom_update_word((uint16_t *)CALIBRATION_FIELD(_start, crc), crc);
+
+  _recording = false;
+  return this->begin(_start);
+}
+
+void SenderCalibration::cancel(void) {
+  _recording = false;
+}
+
+void SenderCalibration::clear(void) {
+  eeprom_update_byte((uint8_t *)CALIBRATION_FIELD(_start, version), 0xFF);
+  _stored = false;
+  this->load();
+}
+
+bool SenderCalibration::recording(void) {
+  return _recording;
+}
+
+uint8_t SenderCalibration::points(void) {
+  return _count;
+}
+
+bool SenderCalibration::stored(void) {
+  return _stored;
+}
+
+bool SenderCalibration::sortPoints(calibrationPoint *points, uint8_t count) {
+  if (count < 2)
+    return false;
+
+  // Insertion sort, there are only a few
+  for (uint8_t i = 1; i < count; i++) {
+    calibrationPoint point = points[i];
+    uint8_t j = i;
+
+    for (; j > 0 && points[j - 1].reading > point.reading; j--)
+      points[j] = points[j - 1];
+    points[j] = point;
+  }
+
+  // Every reading its own level, all rising or all falling
+  bool rising = points[count - 1].percent > points[0].percent;
+
+  for (uint8_t i = 1; i < count; i++) {
+    if (points[i].reading == points[i - 1].reading)
+      return false;
+    if (rising ? points[i].percent <= points[i - 1].percent : points[i].percent >= points[i - 1].percent)
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,43 @@
+#include "StackPaint.h"
+
+#if defined(__AVR__)
+
+extern uint8_t _end;                            // end of .bss and .noinit, the heap's start
+extern uint8_t __stack;                         // RAMEND
+
+// Runs from .init1, before r1 is cleared and the stack pointer set, so it only uses Z and r24/r25
+void stackPaint(void) __attribute__((naked, used, section(".init1")));
+
+void stackPaint(void) {
+  __asm__ __volatile__(
+    "    ldi r30, lo8(_end)\n"
+    "    ldi r31, hi8(_end)\n"
+    "    ldi r24, %0\n"
+    "    ldi r25, hi8(__stack)\n"
+    "    rjmp 2f\n"
+    "1:  st Z+, r24\n"
+    "2:  cpi r30, lo8(__stack)\n"
+    "    cpc r31, r25\n"
+    "    brlo 1b\n"
+    "    breq 1b\n"
+    :: "M" (STACK_PAINT));
+}
+
+uint16_t stackHeadroom(void) {
+  const uint8_t *p = &_end;
+  uint16_t count = 0;
+
+  while (p <= &__stack && *p == STACK_PAINT) {
+    p++;
+    count++;
+  }
+  return count;
+}
+
+#else
+
+uint16_t stackHeadroom(void) {
+  return 0;
+}
+
+#endif
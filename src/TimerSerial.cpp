@@ -0,0 +1,158 @@
+#include "TimerSerial.h"
+
+#if defined(__AVR__)
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#endif
+
+#define TX_QUEUE_MASK (TIMER_SERIAL_TX_QUEUE_SIZE - 1)
+
+// Shared with the Timer2 interrupt, there is only one transmitter
+static uint8_t          txQueue[TIMER_SERIAL_TX_QUEUE_SIZE];
+static volatile uint8_t txHead = 0;
+static volatile uint8_t txTail = 0;
+
+#if defined(__AVR__)
+
+static volatile uint8_t *txPort;
+static uint8_t          txMask;
+static volatile bool    txActive = false;
+static uint8_t          txByte;
+static uint8_t          txBit = 0;           // 0 = next tick sends a start bit, 1..8 data bits, 9 stop bit
+
+/*
+  One bit per compare match: start bit, eight data bits LSB first, stop bit.
+  The interrupt switches itself off when the queue is empty and the stop bit has been sent.
+*/
+ISR(TIMER2_COMPA_vect) {
+
+  if (txBit == 0) {
+    if (txHead == txTail) {
+      TIMSK2 &= ~_BV(OCIE2A);
+      txActive = false;
+      return;
+    }
+    txByte = txQueue[txTail & TX_QUEUE_MASK];
+    txTail++;
+    *txPort &= ~txMask;
+    txBit = 1;
+  }
+  else if (txBit <= 8) {
+    if (txByte & 0x01)
+      *txPort |= txMask;
+    else
+      *txPort &= ~txMask;
+    txByte >>= 1;
+    txBit++;
+  }
+  else {
+    *txPort |= txMask;
+    txBit = 0;
+  }
+}
+
+#endif
+
+TimerSerial::TimerSerial(uint8_t receivePin, uint8_t transmitPin) : SoftwareSerial(receivePin, transmitPin, false) {
+  _txPin = transmitPin;
+}
+
+void TimerSerial::begin(long speed) {
+
+  SoftwareSerial::begin(speed);
+
+#if defined(__AVR__)
+  txPort = portOutputRegister(digitalPinToPort(_txPin));
+  txMask = digitalPinToBitMask(_txPin);
+
+  // CTC mode, one compare match per bit time
+  unsigned long ticks = F_CPU / 8 / speed;
+
+  TCCR2A = _BV(WGM21);
+  if (ticks <= 256) {
+    TCCR2B = _BV(CS21);                     // clk / 8
+  }
+  else {
+    TCCR2B = _BV(CS22);                     // clk / 64
+    ticks /= 8;
+  }
+  OCR2A = ticks - 1;
+  TIMSK2 &= ~_BV(OCIE2A);
+#else
+  _byteMicros = 10000000UL / speed;
+  _txTime = micros();
+#endif
+}
+
+size_t TimerSerial::write(uint8_t byte) {
+
+  // Wait for the interrupt to make room
+  while ((uint8_t)(txHead - txTail) >= TIMER_SERIAL_TX_QUEUE_SIZE) {
+#if !defined(__AVR__)
+    delayMicroseconds(_byteMicros);
+    this->service();
+#endif
+  }
+
+  txQueue[txHead & TX_QUEUE_MASK] = byte;
+
+#if defined(__AVR__)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    txHead++;
+    if (!txActive) {
+      // Start the first bit one full bit time from now
+      txActive = true;
+      TCNT2 = 0;
+      TIFR2 = _BV(OCF2A);
+      TIMSK2 |= _BV(OCIE2A);
+    }
+  }
+#else
+  this->service();
+  txHead++;
+#endif
+
+  return 1;
+}
+
+int TimerSerial::txFree(void) {
+#if !defined(__AVR__)
+  this->service();
+#endif
+  return TIMER_SERIAL_TX_QUEUE_SIZE - (uint8_t)(txHead - txTail);
+}
+
+int TimerSerial::availableForWrite(void) {
+  return this->txFree();
+}
+
+void TimerSerial::flush(void) {
+#if defined(__AVR__)
+  while (txActive)
+    ;
+#else
+  while (txHead != txTail) {
+    delayMicroseconds(_byteMicros);
+    this->service();
+  }
+#endif
+}
+
+#if !defined(__AVR__)
+// Hand over the bytes the line would have shifted out since the last call
+void TimerSerial::service(void) {
+
+  unsigned long now = micros();
+
+  if (txHead == txTail) {
+    _txTime = now;
+    return;
+  }
+
+  while (txHead != txTail && (now - _txTime) >= _byteMicros) {
+    this->nativeTransmit(txQueue[txTail & TX_QUEUE_MASK]);
+    txTail++;
+    _txTime += _byteMicros;
+  }
+}
+#endif
@@ -0,0 +1,154 @@
+/*
+   Benchmark of the Logged Data Widget's SD logging on the native SD cost model ([env:bench]).
+
+   Logs the same samples twice into a scratch SD directory: once the way sdLog() used to, opening
+   the file, printing a text line, flushing and closing it for every sample, and once through
+   AMController::sdLog() and SdBlockLogger. The time each call holds up loop() is taken from the
+   virtual clock, so the figures follow the card costs in lib/ArduinoNative/src/SD.cpp.
+
+     program [-n samples] [-i ms] [-d dir]
+
+       -n  samples per run, default 10000
+       -i  virtual time between samples, default 100 ms
+       -d  scratch SD directory, default a new one under /tmp
+
+   Prints records per second of logging time and the average and worst time of a call, then starts
+   sending the block log as for the app and reads it back to check that no sample was lost.
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include "AM_HM10.h"
+#include "SdBlockLogger.h"
+
+#define BENCH_LEGACY_FILE "LEGACY.TXT"
+#define BENCH_BLOCK_FILE  "BLOCK.LOG"
+
+extern AMController amController;
+
+typedef struct {
+  unsigned long calls;
+  unsigned long total;                        // us
+  unsigned long worst;                        // us
+} benchResult;
+
+// sdLog(variable, time, v1, v2, v3) before SdBlockLogger
+static void legacySdLog(const char *variable, unsigned long time, float v1, float v2, float v3) {
+  File dataFile = SD.open(variable, FILE_WRITE);
+
+  if (dataFile && time > 0) {
+    dataFile.print(time);
+    dataFile.print(";");
+    dataFile.print(v1);
+    dataFile.print(";");
+    dataFile.print(v2);
+    dataFile.print(";");
+    dataFile.print(v3);
+    dataFile.print(";-;-\n");
+    dataFile.flush();
+    dataFile.close();
+  }
+}
+
+static float sample(unsigned long i, uint8_t channel) {
+  return 50.0 + 40.0 * sin(i / 300.0 + channel) + random(100) / 100.0;
+}
+
+static void account(benchResult *result, unsigned long start) {
+  unsigned long elapsed = micros() - start;
+
+  result->calls++;
+  result->total += elapsed;
+  if (elapsed > result->worst)
+    result->worst = elapsed;
+}
+
+static void run(bool legacy, unsigned long samples, unsigned long interval, benchResult *result) {
+  memset(result, 0, sizeof(benchResult));
+  randomSeed(1);
+
+  if (!legacy)
+    amController.sdLogLabels(BENCH_BLOCK_FILE, "Primary", "Aux", "Pump");
+
+  for (unsigned long i = 0; i < samples; i++) {
+    unsigned long start = micros();
+
+    if (legacy)
+      legacySdLog(BENCH_LEGACY_FILE, millis(), sample(i, 0), sample(i, 1), sample(i, 2));
+    else
+      amController.sdLog(BENCH_BLOCK_FILE, millis(), sample(i, 0), sample(i, 1), sample(i, 2));
+    account(result, start);
+
+    // Samples come faster than SD_LOG_SYNC_INTERVAL, so sdLog() also does the periodic sync
+    unsigned long next = start + interval * 1000;
+    if (micros() < next)
+      nativeAdvance(next - micros());
+  }
+}
+
+static void report(const char *name, const benchResult *result) {
+  printf("%-14s %10.0f %12.0f %12lu\n", name,
+         result->total > 0 ? result->calls * 1e6 / result->total : 0.0,
+         result->calls > 0 ? (double)result->total / result->calls : 0.0,
+         result->worst);
+}
+
+int main(int argc, char **argv) {
+  unsigned long samples = 10000;
+  unsigned long interval = 100;
+  const char *dir = NULL;
+  char scratch[] = "/tmp/sdbenchXXXXXX";
+  int option;
+
+  while ((option = getopt(argc, argv, "n:i:d:")) != -1) {
+    switch (option) {
+      case 'n': samples = strtoul(optarg, NULL, 10); break;
+      case 'i': interval = strtoul(optarg, NULL, 10); break;
+      case 'd': dir = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-n samples] [-i ms] [-d dir]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (dir == NULL && (dir = mkdtemp(scratch)) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  nativeSerialQuiet(true);
+  nativeSdRoot(dir);
+  SD.remove(BENCH_LEGACY_FILE);
+  SD.remove(BENCH_BLOCK_FILE);
+
+  benchResult legacy, block;
+  run(true, samples, interval, &legacy);
+  run(false, samples, interval, &block);
+
+  printf("%lu samples of 3 values every %lu ms, SD in %s\n\n", samples, interval, dir);
+  printf("%-14s %10s %12s %12s\n", "path", "records/s", "average us", "worst us");
+  report("open/close", &legacy);
+  report("block logger", &block);
+
+  // Everything logged has to come back; starting to send it to the app syncs the last block
+  amController.sdSendLogData(BENCH_BLOCK_FILE);
+  SdBlockReader reader;
+  sdLogRecord record;
+  unsigned long read = 0;
+
+  if (reader.open(BENCH_BLOCK_FILE)) {
+    while (reader.next(&record))
+      read++;
+    reader.close();
+  }
+
+  File legacyFile = SD.open(BENCH_LEGACY_FILE);
+  File blockFile = SD.open(BENCH_BLOCK_FILE);
+  printf("\nfile sizes: %lu bytes text, %lu bytes blocks; %lu of %lu records read back\n",
+         (unsigned long)legacyFile.size(), (unsigned long)blockFile.size(), read, samples);
+  legacyFile.close();
+  blockFile.close();
+
+  return read == samples ? 0 : 2;
+}
@@ -0,0 +1,190 @@
+/*
+   Source of the aux sender's default calibration from measured points ([env:calgen]).
+
+   The points come from a calibration taken over BLE (calStart, calPoint, calSave), read from an
+   EEPROM image such as the native harness' -e file, or from a text file of "<reading> <percent>"
+   lines, readings in ADC counts << AUX_OVERSAMPLE_BITS as the app shows calReading.
+
+     program [-o header] [-a address] -e eeprom.bin
+     program [-o header] points.txt
+
+       -o  write the header there instead of stdout, e.g. include/AuxSenderCalibration.h
+       -a  EEPROM address of the calibration, default that of main.cpp
+       -e  EEPROM image to read the calibration from
+
+   The points are sorted and checked like SenderCalibration::save() does, and the table the
+   compiler will build from them is printed to stderr with its largest deviation from the points
+   and how far the points are from the straight line between the first and the last one.
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "SenderCalibration.h"
+
+// Layout from main.cpp
+#define CALGEN_EEPROM_START 896
+
+static calibrationPoint points[CALIBRATION_MAX_POINTS];
+static uint8_t count = 0;
+
+static bool readEeprom(const char *path, uint16_t start) {
+  calibrationTable none = {};
+  SenderCalibration calibration(&none);
+
+  if (!nativeEepromLoad(path)) {
+    fprintf(stderr, "%s: can't read\n", path);
+    return false;
+  }
+  if (!calibration.begin(start)) {
+    fprintf(stderr, "%s: no calibration at %u\n", path, start);
+    return false;
+  }
+
+  count = eeprom_read_byte((const uint8_t *)(start + offsetof(calibrationRecord, count)));
+  count = min(count, (uint8_t)CALIBRATION_MAX_POINTS);
+  eeprom_read_block(points, (const void *)(start + offsetof(calibrationRecord, points)), count * sizeof(calibrationPoint));
+  return true;
+}
+
+static bool readPoints(const char *path) {
+  FILE *file = fopen(path, "r");
+  char line[80];
+
+  if (file == NULL) {
+    fprintf(stderr, "%s: can't open\n", path);
+    return false;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    unsigned int reading, percent;
+
+    if (line[0] == '#' || sscanf(line, "%u %u", &reading, &percent) != 2)
+      continue;
+    if (count == CALIBRATION_MAX_POINTS || reading > 0xFFFF || percent > 100) {
+      fprintf(stderr, "%s: more than %d points or out of range: %s", path, CALIBRATION_MAX_POINTS, line);
+      fclose(file);
+      return false;
+    }
+    points[count].reading = reading;
+    points[count].percent = percent;
+    points[count].reserved = 0;
+    count++;
+  }
+  fclose(file);
+  return true;
+}
+
+// Lookup as SenderCalibration::level() does it
+static int16_t tableLevel(const calibrationTable &table, uint16_t reading) {
+  if (reading <= table.base)
+    return table.level[0];
+
+  uint16_t offset = min(reading, table.top) - table.base;
+  uint16_t index = offset >> table.shift;
+
+  if (index >= CALIBRATION_SEGMENTS)
+    return table.level[CALIBRATION_SEGMENTS];
+  return table.level[index] + (int16_t)((((int32_t)table.level[index + 1] - table.level[index]) *
+                                         (offset & ((1 << table.shift) - 1))) >> table.shift);
+}
+
+static void report(const calibrationTable &table) {
+  calibrationPoint line[2] = { points[0], points[count - 1] };
+  double tableError = 0;
+  double lineError = 0;
+
+  for (uint16_t reading = points[0].reading; reading <= points[count - 1].reading; reading++) {
+    double level = calibrationLevel(points, count, reading) / 256.0;
+
+    tableError = max(tableError, fabs(tableLevel(table, reading) / 256.0 - level));
+    lineError = max(lineError, fabs(calibrationLevel(line, 2, reading) / 256.0 - level));
+  }
+
+  fprintf(stderr, "%u points, table from %u every %u readings\n", count, table.base, 1 << table.shift);
+  for (uint8_t i = 0; i <= CALIBRATION_SEGMENTS; i++)
+    fprintf(stderr, "%5u %6.2f %%%s", table.base + (i << table.shift), table.level[i] / 256.0, i % 4 == 3 ? "\n" : "   ");
+  fprintf(stderr, "\ntable off the points by %.2f %% at most, the points off a straight line by %.2f %%\n",
+          tableError, lineError);
+}
+
+static void writeHeader(FILE *out, const char *source) {
+  fprintf(out, "/*\n"
+               "   Default calibration points of the aux sender, generated by src/calgen from %s.\n"
+               "   Readings are ADC counts << AUX_OVERSAMPLE_BITS, sorted; the lookup table is built from them\n"
+               "   at compile time (calibrationTableOf() in SenderCalibration.h).\n"
+               "*/\n"
+               "\n"
+               "#ifndef AUXSENDERCALIBRATION_h\n"
+               "#define AUXSENDERCALIBRATION_h\n"
+               "\n"
+               "#include \"SenderCalibration.h\"\n"
+               "\n"
+               "constexpr calibrationPoint auxSenderPoints[] = {\n", source);
+  for (uint8_t i = 0; i < count; i++)
+    fprintf(out, "  { %5u, %3u, 0 },\n", points[i].reading, points[i].percent);
+  fprintf(out, "};\n"
+               "\n"
+               "#endif\n");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-o header] [-a address] -e eeprom.bin\n"
+                  "       %s [-o header] points.txt\n", name, name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *outPath = NULL;
+  const char *eepromPath = NULL;
+  uint16_t start = CALGEN_EEPROM_START;
+  int option;
+
+  while ((option = getopt(argc, argv, "o:a:e:")) != -1) {
+    switch (option) {
+      case 'o':
+        outPath = optarg;
+        break;
+      case 'a':
+        start = strtoul(optarg, NULL, 0);
+        break;
+      case 'e':
+        eepromPath = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  const char *source = eepromPath;
+
+  if (eepromPath != NULL) {
+    if (!readEeprom(eepromPath, start))
+      return 1;
+  } else {
+    if (optind >= argc)
+      usage(argv[0]);
+    source = argv[optind];
+    if (!readPoints(source))
+      return 1;
+  }
+
+  if (!SenderCalibration::sortPoints(points, count)) {
+    fprintf(stderr, "%s: needs two or more points with distinct readings and steadily rising or falling levels\n", source);
+    return 1;
+  }
+
+  report(calibrationTableOf(points, count));
+
+  FILE *out = outPath != NULL ? fopen(outPath, "w") : stdout;
+
+  if (out == NULL) {
+    fprintf(stderr, "%s: can't write\n", outPath);
+    return 1;
+  }
+  writeHeader(out, source);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -1,36 +1,208 @@
 #include <mcp_can.h>
 #include <SPI.h>
 #include "AM_HM10.h"
-#include "hm_10_ble.h"
+#include "AM_Publisher.h"
+#include "HM_10_BLE.h"
+#include "CanFrameQueue.h"
+#include "J1939.h"
+#include "FixedFilters.h"
+#include "EepromLog.h"
+#include "AdcSampler.h"
+#include "AdcAcquisition.h"
+#include "SenderCalibration.h"
+#include "AuxSenderCalibration.h"
+#include "FuelEstimator.h"
+#include "PumpController.h"
+#include "PumpDrive.h"
+#include "FuelAnalytics.h"
+#include "StackPaint.h"
+
+//#define CAPTURE_SUPPORT   // uncomment to record CAN frames, ADC samples and pump decisions to SD for replay
+
+#ifdef CAPTURE_SUPPORT
+#include "CaptureLog.h"
+#endif
 
 #define DEBUG_AUX false
 #define DEBUG_CAN false
+#define DEBUG_TX false
+#define DEBUG_STACK false          // least free RAM since reset, run a drive with it before a new build goes in the car
 
 // Define MCP2515 (CAN BUS) PINS
 #define CAN0_INT 2
 #define CAN0_CS 10
+#define CAN_RX_QUEUE_SIZE 8
 
-// Define the constants for the auxillary fuel level sensor
+// SD card chip select, shares the SPI bus with the MCP2515
+#define SD_CS 4
+
+// J1939 messages consumed from the RZR bus
+#define PGN_DASH_DISPLAY 0xFEFC
+#define SA_INSTRUMENT_CLUSTER 0x17
+
+// Define the constants for the auxillary fuel level sensor, its levels come from the points in
+// AuxSenderCalibration.h or a calibration taken over BLE
 #define AUX_FUEL_LEVEL_PIN A0
-#define AUX_FUEL_LEVEL_MIN 125
-#define AUX_FUEL_LEVEL_MAX 450
-#define FUEL_SAMPLE_SIZE 100
+#define AUX_OVERSAMPLE_BITS 2         // 16 conversions per reading
+#define AUX_READING_RATE 10           // readings per second
+#define AUX_BOOT_OVERSAMPLE_BITS 3    // 64 conversions to start the estimate from at power-up, 7.2 ms
+#define AUX_CALIBRATION_SHIFT 4       // readings averaged for a calibration point, about 1.6 s
+
+// Tanks and pump for the level estimates, see FuelEstimator.h for the tracking indices
+#define AUX_TANK_LITERS 19
+#define PRI_TANK_LITERS 36
+#define PUMP_FLOW_LPH 60
+#define AUX_TRACKING_INDEX 0.000002
+#define AUX_MEASURED_INDEX 0.000002   // of the aux filter without the pump, the PWM drive's measurement
+#define PRI_TRACKING_INDEX 0.0002
+#define PRI_LEVEL_PERIOD 1000         // [ms] the dash display broadcast
+#define ANALYTICS_WINDOW 60           // [s] the level deltas are taken over, see FuelAnalytics.h
 
 // Define the constants for fuel level transfer
 #define FUEL_TRANSFER_MAX 75
 #define FUEL_TRANSFER_THRESHOLD 10
-
-#define PUMP_PIN 8
-
+#define FUEL_TRANSFER_AUX_START 3     // [%] a transfer doesn't start on less, it stops at 0
+
+#define PUMP_PIN 8                    // on while the pump runs, in either mode
+
+// Pump drive: switched on and off, or speed-controlled to a transfer rate by PWM on pin 9 as well
+// (AdcAcquisition's Timer1 output, to a MOSFET in the pump's supply), see PumpDrive.h
+#define PUMP_MODE_SWITCHED 0
+#define PUMP_MODE_PWM 1
+#define PUMP_MODE PUMP_MODE_SWITCHED
+#define PUMP_PWM_DEAD 25              // duty the pump starts to move fuel above
+#define PUMP_PWM_MIN 38               // least duty while running, 15 %
+#define PUMP_PWM_MAX 255
+#define PUMP_PWM_RAMP 128             // [duty/s] soft start, from the least duty to full in 1.7 s
+#define PUMP_PWM_KP 128               // Q8, 0.5
+#define PUMP_PWM_KI 8                 // Q8 per second, 0.03, the measurement settles over minutes
+#define PUMP_PWM_MARGIN 8             // [%] below fuelTransferMax the primary is held at, clear of the slosh
+#define PUMP_PWM_GAP_SECONDS 600      // a level difference is closed over
+
+// Pump switching limits, see PumpController.h; the pump moves about 5 % of the aux tank a minute
+#define PUMP_MIN_ON 30                // [s]
+#define PUMP_MIN_OFF 60               // [s]
+#define PUMP_MAX_STARTS 6             // per hour
+#define PUMP_DRY_WINDOW 90            // [s] the aux level is averaged over
+#define PUMP_DRY_DROP 2               // [%] per window, less is a dry pump or a stuck sender
+#define PUMP_REFILL 10                // [%] rise of the aux level that clears a dry-run fault
+
+// Calibration, last levels and run totals kept across power cycles, after the alarm log of AM_HM10.h
+#define STATE_EEPROM_START 512
+#define STATE_EEPROM_LENGTH 384
+#define AUX_CALIBRATION_EEPROM_START 896  // calibrationRecord of the aux sender, to the end of the EEPROM
+#define STATE_VERSION 2
+#define STATE_KEY 0
+#define STATE_SAVE_INTERVAL 600000UL    // [ms] saved at least this often while something changes, and when the pump stops
+#define STATE_SEED_TOLERANCE 10         // [%] the power-up aux reading has to be this close to the saved level to start from it
+
+// Telemetry is only sent when it changes by more than these, or every heartbeat
+#define PUBLISH_HEARTBEAT 5000
+#define PUBLISH_LEVEL_DEADBAND 0
+#define PUBLISH_ANALOG_DEADBAND 4
+#define PUBLISH_READING_DEADBAND 8
+#define PUBLISH_RATE_DEADBAND 5         // [0.1 l/h]
+#define PUBLISH_DUTY_DEADBAND 2         // [%]
+#define PUBLISH_VOLUME_DEADBAND 1       // [0.1 l]
+#define PUBLISH_RANGE_DEADBAND 5        // [min]
+
+// Transfer limits, defaults from the defines; variables so the simulator can sweep them
+byte fuelTransferMax = FUEL_TRANSFER_MAX;
+byte fuelTransferThreshold = FUEL_TRANSFER_THRESHOLD;
+
+byte pumpMode = PUMP_MODE;
 boolean pumpOn = false;
+uint16_t pumpFlow = 0;                // of PUMP_DRIVE_FULL_FLOW, by the duty
 boolean manualPumpOn = false;
 byte priFuelLevel = 0;
 byte auxFuelLevel = 0;
-byte auxFuelLevelArray[FUEL_SAMPLE_SIZE];
-int auxSampleCount = 0;
-int auxSampleIndex = 0;
+AdcSampler auxSampler(AUX_FUEL_LEVEL_PIN);
+AdcAcquisition auxAcquisition(AUX_FUEL_LEVEL_PIN);
+FuelEstimator fuelEstimator(estimatorGainsOf(AUX_TRACKING_INDEX, 1000 / AUX_READING_RATE),
+                            estimatorGainsOf(AUX_MEASURED_INDEX, 1000 / AUX_READING_RATE),
+                            estimatorGainsOf(PRI_TRACKING_INDEX, PRI_LEVEL_PERIOD),
+                            ESTIMATOR_RATE(PUMP_FLOW_LPH * 100.0 / AUX_TANK_LITERS), AUX_TANK_LITERS * 256 / PRI_TANK_LITERS);
+PumpController pumpController({ PUMP_MIN_ON, PUMP_MIN_OFF, PUMP_DRY_WINDOW, (int16_t)(PUMP_DRY_DROP * 256),
+                                PUMP_REFILL * 256, PUMP_MAX_STARTS });
+PumpDrive pumpDrive({ PUMP_PWM_DEAD, PUMP_PWM_MIN, PUMP_PWM_MAX, PUMP_PWM_RAMP, PUMP_PWM_KP, PUMP_PWM_KI });
+FuelAnalytics fuelAnalytics(PRI_TANK_LITERS, AUX_TANK_LITERS, ANALYTICS_WINDOW);
+ExpMovingAverage<AUX_CALIBRATION_SHIFT, uint16_t, uint32_t> auxReadingFilter;
 int minValue = 1024;
 int maxValue = 0;
+boolean priFuelReceived = false;
+
+// Run totals
+uint32_t pumpSeconds = 0;
+uint16_t pumpStarts = 0;
+uint16_t powerCycles = 1;
+unsigned long pumpMillis = 0;
+unsigned long lastTotalsUpdate = 0;
+
+// Restored at power-up; a different version means a changed layout and a cold start
+typedef struct {
+  uint8_t  version;
+  uint8_t  priFuelLevel;
+  uint8_t  auxFuelLevel;
+  uint8_t  reserved;
+  int16_t  minValue;
+  int16_t  maxValue;
+  uint32_t pumpSeconds;
+  uint16_t pumpStarts;
+  uint16_t powerCycles;
+  uint32_t transferred;     // [ml] over the life of the device
+  uint16_t consumption;     // [ml/h]
+  uint16_t dutyCycle;       // Q16
+} persistentState;
+
+static_assert(estimatorGainsFit(AUX_TRACKING_INDEX), "Aux tracking index out of the estimator's gain range");
+static_assert(estimatorGainsFit(AUX_MEASURED_INDEX), "Aux measured tracking index out of the estimator's gain range");
+static_assert(estimatorGainsFit(PRI_TRACKING_INDEX), "Primary tracking index out of the estimator's gain range");
+static_assert(PUMP_MAX_STARTS <= PUMP_START_HISTORY, "PumpController keeps fewer starts");
+static_assert(STATE_EEPROM_START + STATE_EEPROM_LENGTH <= AUX_CALIBRATION_EEPROM_START, "State store overlaps the calibration");
+static_assert(AUX_CALIBRATION_EEPROM_START + sizeof(calibrationRecord) <= E2END + 1, "Calibration past the end of the EEPROM");
+
+// Built by the compiler from the default points
+static_assert(calibrationSorted(auxSenderPoints, sizeof(auxSenderPoints) / sizeof(auxSenderPoints[0])),
+              "auxSenderPoints must be sorted by reading");
+const calibrationTable auxSenderTable PROGMEM = calibrationTableOf(auxSenderPoints, sizeof(auxSenderPoints) / sizeof(auxSenderPoints[0]));
+SenderCalibration auxCalibration(&auxSenderTable);
+
+EepromLog stateLog;
+persistentState savedState;
+boolean stateRestored = false;
+unsigned long lastStateSave = 0;
+
+// Payload of the binary telemetry frame sent instead of the text messages when the device negotiates it (little endian),
+// every text message in the same unit
+typedef struct __attribute__((packed)) {
+  byte     priFuelLevel;
+  byte     auxFuelLevel;
+  byte     flags;           // bit 0 pumpOn, bit 1 manualPumpOn, bit 2 pump fault, bit 3 calStored, bit 4 calibrating
+  byte     initStatus;
+  int16_t  minValue;
+  int16_t  maxValue;
+  uint16_t canLost;
+  byte     pumpState;
+  byte     pumpDuty;        // [%]
+  byte     pumpDutyCycle;   // [%]
+  byte     calPoints;       // while calibrating, 0 otherwise
+  int16_t  calReading;      // while calibrating, 0 otherwise
+  int16_t  pumpMinutes;
+  int16_t  transferRate;    // [0.1 l/h]
+  int16_t  burnRate;        // [0.1 l/h]
+  int16_t  consumption;     // [0.1 l/h]
+  int16_t  transferred;     // [0.1 l]
+  int16_t  xferTotal;       // [0.1 l]
+  int16_t  rangeMinutes;    // -1 while the engine uses no fuel
+} telemetryFrame;
+
+#define TELEMETRY_PUMP_ON         0x01
+#define TELEMETRY_MANUAL_PUMP_ON  0x02
+#define TELEMETRY_PUMP_FAULT      0x04
+#define TELEMETRY_CAL_STORED      0x08
+#define TELEMETRY_CALIBRATING     0x10
+
+static_assert(sizeof(telemetryFrame) <= AM_FRAME_MAX_PAYLOAD, "Telemetry frame too long");
 
 void doWork();
 void doSync();
@@ -38,36 +210,81 @@ void processIncomingMessages(char *variable, char *value);
 void processOutgoingMessages();
 void deviceConnected();
 void deviceDisconnected();
+void onCanInterrupt();
 void readPrimaryFuelLevel();
+void processCanFrame(const canFrame &frame);
+void printCanFrame(const canFrame &frame);
+void decodeDashDisplay(const canFrame &frame);
+int readAuxSender(uint8_t bits);
+int16_t auxSenderLevel(int auxFuelAnalog);
+void primeAuxFuelLevel();
 void readAuxFuelLevel();
 boolean shouldTransferFuel(boolean transferring);
+uint16_t transferSetpoint();
+int16_t transferMeasured();
+void restoreState();
+void updateRunTotals(boolean pumpWasOn);
+void saveState(boolean pumpStopped);
+
+// PGN + source address -> decoder, also used to program the MCP2515 acceptance filters
+constexpr pgnDecoder canDecoders[] = {
+  { PGN_DASH_DISPLAY, SA_INSTRUMENT_CLUSTER, &decodeDashDisplay },
+};
 
 MCP_CAN CAN0(CAN0_CS);
+CanFrameQueue<CAN_RX_QUEUE_SIZE> canRxQueue;
 AMController amController(&doWork,&doSync,&processIncomingMessages,&processOutgoingMessages,&deviceConnected,&deviceDisconnected);
+AMPublisher publisher(&amController, PUBLISH_HEARTBEAT);
 //HM_10_BLE ble(6, 5);
 
+#ifdef CAPTURE_SUPPORT
+CaptureLog capture;
+#endif
+
 void setup()
 {
   Serial.begin(115200);
   
-  // Initialize MCP2515 running at 8MHz with a baudrate of 256kb/s and the masks and filters disabled.
-  if(CAN0.begin(MCP_ANY, CAN_250KBPS, MCP_8MHZ) == CAN_OK)
-    Serial.println("MCP2515 Initialized Successfully!");
+  // Initialize MCP2515 running at 8MHz with a baudrate of 250kb/s accepting extended frames only.
+  if(CAN0.begin(MCP_EXT, CAN_250KBPS, MCP_8MHZ) == CAN_OK)
+    Serial.println(F("MCP2515 Initialized Successfully!"));
   else
-    Serial.println("Error Initializing MCP2515...");
+    Serial.println(F("Error Initializing MCP2515..."));
+
+  // Only let the PGNs we decode through, the rest of the bus never interrupts the CPU
+  j1939ConfigureFilters(CAN0, canDecoders);
   
   // Set operation mode to normal so the MCP2515 sends acks to received data.
   CAN0.setMode(MCP_LISTENONLY);
 
-  // Configuring pin for CAN BUS interupt input
+  // Configuring pin for CAN BUS interupt input and drain the receive buffers from its ISR
   pinMode(CAN0_INT, INPUT);
+  SPI.usingInterrupt(digitalPinToInterrupt(CAN0_INT));
+  attachInterrupt(digitalPinToInterrupt(CAN0_INT), onCanInterrupt, FALLING);
 
   // Configuring pin for fuel pump output
   pinMode(PUMP_PIN, OUTPUT);
+
+  // Calibration, levels and totals from the last run, so the first loop can already decide
+  restoreState();
+  auxCalibration.begin(AUX_CALIBRATION_EEPROM_START);
+
+#ifdef CAPTURE_SUPPORT
+  // The SD library uses SPI transactions, so the CAN interrupt is held off while it talks to the card
+  if (SD.begin(SD_CS) && capture.begin())
+    Serial.println(F("Capture Started"));
+  else
+    Serial.println(F("Error Starting Capture..."));
+#endif
+
+  // A burst of the aux sender to start the estimate from, then timer-triggered conversions from
+  // here on; analogRead() can't be used after this
+  primeAuxFuelLevel();
+  auxAcquisition.begin(AUX_OVERSAMPLE_BITS, AUX_READING_RATE << (2 * AUX_OVERSAMPLE_BITS));
   
   amController.begin();
   //ble.begin("RZR_FUEL", "032576", '!');
-  Serial.println("Setup Complete");
+  Serial.println(F("Setup Complete"));
 }
 
 void loop()
@@ -81,138 +298,228 @@ void loop()
 
   amController.loop(100);
 
-  // Check if we should transfer the fuel
-  pumpOn = manualPumpOn || shouldTransferFuel(pumpOn);
+  // Check if we should transfer the fuel, the controller decides when the pump switches
+  boolean pumpWasOn = pumpOn;
+  boolean transfer = pumpController.update(millis(), shouldTransferFuel(pumpController.on()));
+  uint8_t duty = manualPumpOn || transfer ? 255 : 0;
+
+  // At the speed that holds the transfer rate, ramping to start and stop
+  if (pumpMode == PUMP_MODE_PWM && !manualPumpOn)
+    duty = pumpDrive.update(millis(), transfer, transferSetpoint(), transferMeasured());
+
+  pumpOn = duty > 0;
+  pumpFlow = pumpDrive.flowOf(duty);
   digitalWrite(PUMP_PIN, pumpOn);
+  auxAcquisition.drive(duty);
+  fuelEstimator.pump(millis(), pumpFlow);
+
+  // Rates and totals from the level deltas, once both levels are known
+  if (fuelEstimator.ready() && priFuelReceived)
+    fuelAnalytics.update(millis(), fuelEstimator.primaryEstimate(), fuelEstimator.auxEstimate(), pumpOn);
+
+  updateRunTotals(pumpWasOn);
+  saveState(pumpWasOn && !pumpOn);
+
+#ifdef CAPTURE_SUPPORT
+  if (pumpOn != pumpWasOn)
+    capture.pump(pumpOn);
+  capture.loop();
+#endif
 }
 
-void readPrimaryFuelLevel()
+// Drain the MCP2515 receive buffers into canRxQueue (runs in interrupt context)
+void onCanInterrupt()
 {
-  long unsigned int rxId;
-  unsigned char len = 0;
-  unsigned char rxBuf[8];
-  char msgString[128];
-
-  // If CAN0_INT pin is low, read receive buffer
-  if(!digitalRead(CAN0_INT))
+#if defined(__AVR__)
+  // A frame's SPI reads take about 70 us, most of a 9600 baud bit: let TimerSerial's bit interrupt
+  // (and the ADC's) preempt them, with INT0 (CAN0_INT) masked so the drain doesn't nest in itself
+  EIMSK &= ~_BV(INT0);
+  interrupts();
+#endif
+
+  // INT stays low until both receive buffers are empty
+  while (!digitalRead(CAN0_INT))
   {
-    // Read data: len = data length, buf = data byte(s)
-    CAN0.readMsgBuf(&rxId, &len, rxBuf);
-    
-    if((rxId & 0x80000000) == 0x80000000)     // Determine if ID is standard (11 bits) or extended (29 bits)
-      sprintf(msgString, "Extended ID: 0x%.8lX  DLC: %1d  Data:", (rxId & 0x1FFFFFFF), len);
-    else
-      sprintf(msgString, "Standard ID: 0x%.3lX       DLC: %1d  Data:", rxId, len);
-  
-    if (DEBUG_CAN)
-       Serial.print(msgString);
-  
-    // Determine if message is a remote request frame.
-    if((rxId & 0x40000000) == 0x40000000){
-      sprintf(msgString, " REMOTE REQUEST FRAME");
-      Serial.print(msgString);
-    } else {
-
-      switch (rxId & 0x1FFFFFFF)
-      {
-        case 0x18FEFC17:
-          priFuelLevel = map(rxBuf[1],0,255,0,100);
-          break;
-        
-        default:
-          break;
-      }
-
-      if (DEBUG_CAN) {
-        for(byte i = 0; i<len; i++){
-          sprintf(msgString, " 0x%.2X", rxBuf[i]);
-          Serial.print(msgString);
-        }
-      }
+    canFrame *frame = canRxQueue.back();
+
+    if (frame == NULL) {
+      // Queue full, read the frame anyway to free the controller's buffer
+      canFrame discard;
+      CAN0.readMsgBuf(&discard.id, &discard.len, discard.data);
+      canRxQueue.drop();
+      continue;
     }
-        
-    if (DEBUG_CAN)
-      Serial.println();
+
+    CAN0.readMsgBuf(&frame->id, &frame->len, frame->data);
+    frame->time = millis();
+    canRxQueue.push();
   }
+
+#if defined(__AVR__)
+  // A frame that arrived since sets the flag again, the interrupt runs once more on return
+  noInterrupts();
+  EIMSK |= _BV(INT0);
+#endif
 }
 
-void readAuxFuelLevel()
+void readPrimaryFuelLevel()
 {
-  // Read analog input
-  int auxFuelAnalog = analogRead(A0);
-
-  if (auxFuelAnalog < minValue) {
-    minValue = auxFuelAnalog;
+  // Recover from a falling edge missed while frames were already pending
+  if (!digitalRead(CAN0_INT)) {
+    noInterrupts();
+    onCanInterrupt();
+    interrupts();
   }
-  if (auxFuelAnalog > maxValue) {
-    maxValue = auxFuelAnalog;
+
+  // Consume the frames received since the last loop, bounded so a busy bus can't stall control
+  const canFrame *frame;
+  byte batch = 0;
+
+  while (batch++ < CAN_RX_QUEUE_SIZE && (frame = canRxQueue.front()) != NULL) {
+    processCanFrame(*frame);
+    canRxQueue.pop();
   }
+}
+
+void processCanFrame(const canFrame &frame)
+{
+  if (DEBUG_CAN)
+    printCanFrame(frame);
 
-  // Standardize the analog input
-  if (auxFuelAnalog < AUX_FUEL_LEVEL_MIN) {
-    auxFuelAnalog = AUX_FUEL_LEVEL_MIN;
-  } else if (auxFuelAnalog > AUX_FUEL_LEVEL_MAX) {
-    auxFuelAnalog = AUX_FUEL_LEVEL_MAX;
+#ifdef CAPTURE_SUPPORT
+  capture.frame(frame);
+#endif
+
+  j1939Dispatch(canDecoders, frame);
+}
+
+void printCanFrame(const canFrame &frame)
+{
+  char msgString[64];
+
+  if((frame.id & J1939_FRAME_EXTENDED) == J1939_FRAME_EXTENDED)     // Determine if ID is standard (11 bits) or extended (29 bits)
+    sprintf_P(msgString, PSTR("Extended ID: 0x%.8lX  DLC: %1d  Data:"), (frame.id & J1939_ID_MASK), frame.len);
+  else
+    sprintf_P(msgString, PSTR("Standard ID: 0x%.3lX       DLC: %1d  Data:"), frame.id, frame.len);
+  Serial.print(msgString);
+
+  // Determine if message is a remote request frame.
+  if((frame.id & J1939_FRAME_REMOTE) == J1939_FRAME_REMOTE){
+    Serial.print(F(" REMOTE REQUEST FRAME"));
+  } else {
+    for(byte i = 0; i<frame.len; i++){
+      sprintf_P(msgString, PSTR(" 0x%.2X"), frame.data[i]);
+      Serial.print(msgString);
+    }
   }
-  
-  // Add the new sample to the array
-  auxFuelLevelArray[auxSampleIndex++] = map(auxFuelAnalog, AUX_FUEL_LEVEL_MIN, AUX_FUEL_LEVEL_MAX, 100, 0);
-  if (auxSampleIndex >= FUEL_SAMPLE_SIZE) {
-    auxSampleIndex = 0;
+
+  sprintf_P(msgString, PSTR("  (t=%lu, lost=%u)"), frame.time, canRxQueue.dropped());
+  Serial.println(msgString);
+}
+
+// PGN 65276 Dash Display: byte 2 is Fuel Level 1
+void decodeDashDisplay(const canFrame &frame)
+{
+  fuelEstimator.primary(millis(), (long)frame.data[1] * (100 << 8) / 255);
+  priFuelLevel = fuelEstimator.primaryLevel();
+  priFuelReceived = true;
+}
+
+// Oversampled reading of the aux sender, in ADC counts << AUX_OVERSAMPLE_BITS
+int readAuxSender(uint8_t bits)
+{
+  uint16_t reading = auxSampler.read(bits);
+
+#ifdef CAPTURE_SUPPORT
+  capture.adcSum(AUX_FUEL_LEVEL_PIN, auxSampler.samples(), auxSampler.sum());
+#endif
+
+  if (bits > AUX_OVERSAMPLE_BITS)
+    return reading >> (bits - AUX_OVERSAMPLE_BITS);
+  return reading << (AUX_OVERSAMPLE_BITS - bits);
+}
+
+// Aux tank level (1/256 %) of a readAuxSender() reading, which also moves the min / max seen
+int16_t auxSenderLevel(int auxFuelAnalog)
+{
+  // Whole ADC counts, as before oversampling
+  int counts = (auxFuelAnalog + (1 << (AUX_OVERSAMPLE_BITS - 1))) >> AUX_OVERSAMPLE_BITS;
+
+  if (counts < minValue) {
+    minValue = counts;
   }
-  
-  // Increment the sample count
-  auxSampleCount++;
-  if (auxSampleCount > FUEL_SAMPLE_SIZE) {
-    auxSampleCount = FUEL_SAMPLE_SIZE;
+  if (counts > maxValue) {
+    maxValue = counts;
   }
 
-  // Calculate the average
-  long sum = 0;
-  int samples = min(auxSampleCount, FUEL_SAMPLE_SIZE);
+  return auxCalibration.level(auxFuelAnalog);
+}
 
-  for (int i = 0; i < samples; i++) {
-    sum += auxFuelLevelArray[i];
-  }
-  int avg = sum / samples;
+// Start the aux estimate at power-up rather than from the first noisy reading
+void primeAuxFuelLevel()
+{
+  int16_t level = auxSenderLevel(readAuxSender(AUX_BOOT_OVERSAMPLE_BITS));
 
-  // Sanity check the average
-  if (avg < 0 || avg > UINT8_MAX) {
-        auxSampleIndex = 0;
-        auxSampleCount = 0;
-        avg = 0;
-  }
+  // The saved estimate is steadier, if the tank still reads about the same
+  if (stateRestored && abs(((level + 0x80) >> 8) - savedState.auxFuelLevel) <= STATE_SEED_TOLERANCE)
+    level = savedState.auxFuelLevel << 8;
 
-  auxFuelLevel = avg;
+  fuelEstimator.primeAux(level);
+  auxFuelLevel = fuelEstimator.auxLevel();
+}
 
-  if (DEBUG_AUX) {
-    Serial.print("Aux Fuel Level:");
-    Serial.print(auxFuelAnalog);
-    Serial.print(" - ");
-    Serial.println(auxFuelLevel);
+void readAuxFuelLevel()
+{
+  uint16_t sum;
+
+  // Readings the ADC interrupt queued since the last loop, one every 1 / AUX_READING_RATE s
+  while (auxAcquisition.next(&sum)) {
+#ifdef CAPTURE_SUPPORT
+    capture.adcSum(AUX_FUEL_LEVEL_PIN, auxAcquisition.samples(), sum);
+#endif
+    int auxFuelAnalog = sum >> AUX_OVERSAMPLE_BITS;
+
+    int16_t level = auxSenderLevel(auxFuelAnalog);
+
+    auxReadingFilter.add(auxFuelAnalog);
+    fuelEstimator.aux(level);
+    pumpController.level(level, pumpFlow);
+    auxFuelLevel = fuelEstimator.auxLevel();
+
+    if (DEBUG_AUX) {
+      Serial.print(F("Aux Fuel Level:"));
+      Serial.print(auxFuelAnalog);
+      Serial.print(F(" - "));
+      Serial.println(auxFuelLevel);
+    }
   }
 }
 
 boolean shouldTransferFuel(boolean transferring)
 {
-  // Check we've had enough samples to determine the average fuel level
-  if (auxSampleCount < FUEL_SAMPLE_SIZE)
+  // Check there is an aux level estimate
+  if (!fuelEstimator.ready())
+    return false;
+
+  // The restored primary level may be from before a fill-up, wait for the dash
+  if (!priFuelReceived)
     return false;
   
   // Check if the primary fuel level is too high to transfer
-  if (priFuelLevel >= FUEL_TRANSFER_MAX)
+  if (priFuelLevel >= fuelTransferMax)
     return false;
 
-  // Check if the aux fuel level is too low to transfer
-  if (auxFuelLevel == 0)
+  // Check if the aux fuel level is too low to transfer, or to start on what slosh leaves in an empty tank;
+  // a throttled pump would crawl through that slosh, so it stops there too
+  if (auxFuelLevel == 0 || ((!transferring || pumpMode == PUMP_MODE_PWM) && auxFuelLevel < FUEL_TRANSFER_AUX_START))
     return false;
 
   // If not transferring, and primary tank has less more than aux tank by the threshold, start transferring (ignore if the primary fuel level is too low)
-  if (!transferring && priFuelLevel > FUEL_TRANSFER_THRESHOLD && priFuelLevel + FUEL_TRANSFER_THRESHOLD > auxFuelLevel)
+  if (!transferring && priFuelLevel > fuelTransferThreshold && priFuelLevel + fuelTransferThreshold > auxFuelLevel)
     return false;
 
   // If transferring, and the primary tank is fuller than the aux tank by the threshold, stop transferring
-  if (transferring && priFuelLevel - FUEL_TRANSFER_THRESHOLD > auxFuelLevel)
+  if (transferring && priFuelLevel - fuelTransferThreshold > auxFuelLevel)
     return false;
 
   // If we've made it this far, we should transfer fuel
@@ -220,24 +527,172 @@ boolean shouldTransferFuel(boolean transferring)
 
 }
 
+// Transfer rate that holds the primary on the aux level, and PUMP_PWM_MARGIN below fuelTransferMax,
+// so the decision's limits aren't reached: the engine's consumption (of both tanks while they are
+// level), plus the level difference closed over PUMP_PWM_GAP_SECONDS; of the learned full flow
+uint16_t transferSetpoint()
+{
+  int32_t limit = (int32_t)(fuelTransferMax - PUMP_PWM_MARGIN) << 16;
+  int32_t target = min(fuelEstimator.auxEstimate(), limit);
+  int32_t burn = fuelEstimator.burnRate();
+
+  if (target < limit)
+    burn = burn * AUX_TANK_LITERS / (PRI_TANK_LITERS + AUX_TANK_LITERS);
+
+  int32_t rate = burn + (target - fuelEstimator.primaryEstimate()) / PUMP_PWM_GAP_SECONDS;
+
+  // Primary tank units to the aux tank's
+  rate = max(rate, 0L) * PRI_TANK_LITERS / AUX_TANK_LITERS;
+  return min(rate * PUMP_DRIVE_FULL_FLOW / fuelEstimator.transferRate(), (int32_t)PUMP_DRIVE_FULL_FLOW);
+}
+
+// Rate the aux tank drains at by its readings, of the learned full flow
+int16_t transferMeasured()
+{
+  int32_t full = fuelEstimator.transferRate();
+
+  return constrain(fuelEstimator.measuredDrain(), -2 * full, 2 * full) * PUMP_DRIVE_FULL_FLOW / full;
+}
+
+void restoreState()
+{
+  persistentState state;
+
+  stateLog.begin(STATE_EEPROM_START, STATE_EEPROM_LENGTH, sizeof(state));
+  memset(&savedState, 0, sizeof(savedState));
+
+  if (!stateLog.read(STATE_KEY, &state) || state.version != STATE_VERSION)
+    return;
+
+  savedState = state;
+  priFuelLevel = state.priFuelLevel;
+  minValue = state.minValue;
+  maxValue = state.maxValue;
+  pumpSeconds = state.pumpSeconds;
+  pumpStarts = state.pumpStarts;
+  powerCycles = state.powerCycles + 1;
+  fuelAnalytics.restore(state.transferred, state.consumption, state.dutyCycle);
+  stateRestored = true;
+}
+
+void updateRunTotals(boolean pumpWasOn)
+{
+  unsigned long now = millis();
+
+  if (pumpWasOn) {
+    pumpMillis += now - lastTotalsUpdate;
+    pumpSeconds += pumpMillis / 1000;
+    pumpMillis %= 1000;
+  }
+  if (pumpOn && !pumpWasOn)
+    pumpStarts++;
+  lastTotalsUpdate = now;
+}
+
+// Written when the pump stops and otherwise at most every STATE_SAVE_INTERVAL, and only if it changed;
+// a write blocks for 3.3 ms per changed byte
+void saveState(boolean pumpStopped)
+{
+  persistentState state;
+
+  // Nothing worth keeping before there is an aux level
+  if (!fuelEstimator.ready())
+    return;
+  if (!pumpStopped && millis() - lastStateSave < STATE_SAVE_INTERVAL)
+    return;
+  lastStateSave = millis();
+
+  state.version = STATE_VERSION;
+  state.priFuelLevel = priFuelLevel;
+  state.auxFuelLevel = auxFuelLevel;
+  state.reserved = 0;
+  state.minValue = minValue;
+  state.maxValue = maxValue;
+  state.pumpSeconds = pumpSeconds;
+  state.pumpStarts = pumpStarts;
+  state.powerCycles = powerCycles;
+  state.transferred = fuelAnalytics.lifetimeTransferred();
+  state.consumption = fuelAnalytics.consumption();
+  state.dutyCycle = fuelAnalytics.dutyCycle();
+
+  if (memcmp(&state, &savedState, sizeof(state)) != 0 && stateLog.write(STATE_KEY, &state))
+    savedState = state;
+}
+
 void sendPrimaryFuelLevel() {
-  amController.writeMessage("priFuelLevel", priFuelLevel);
+  publisher.publish("priFuelLevel", priFuelLevel, PUBLISH_LEVEL_DEADBAND);
 }
 
 void sendAuxFuelLevel() {
-  amController.writeMessage("auxFuelLevel", auxFuelLevel);
+  publisher.publish("auxFuelLevel", auxFuelLevel, PUBLISH_LEVEL_DEADBAND);
 }
 
 void sendPumpOnState() {
-  amController.writeMessage("pumpOn", pumpOn);
+  publisher.publish("pumpOn", pumpOn);
 }
 
 void sendManualPumpOnState() {
-  amController.writeMessage("manualPumpOn", manualPumpOn);
+  publisher.publish("manualPumpOn", manualPumpOn);
+}
+
+int initializeStatus() {
+  return fuelEstimator.ready() ? 100 : 0;
+}
+
+// Estimator rate of a tank in 0.1 l/h
+int litersPerHour(int32_t rate, uint8_t liters) {
+  return (long)rate * liters * 360 / 65536;
+}
+
+// Analytics figures: ml in 0.1 l, and the range in minutes, -1 while the engine uses no fuel
+int deciliters(uint32_t milliliters) {
+  return min(milliliters / 100, 32767UL);
+}
+
+int pumpDutyPercent() {
+  return auxAcquisition.duty() * 100 / 255;
+}
+
+int dutyCyclePercent() {
+  return (uint32_t)fuelAnalytics.dutyCycle() * 100 >> 16;
+}
+
+int rangeMinutes() {
+  uint16_t range = fuelAnalytics.range();
+
+  return range == ANALYTICS_NO_RANGE ? -1 : (int)min(range, (uint16_t)32767);
 }
 
 void sendInitializeStatus() {
-  amController.writeMessage("initStatus", (int) map(auxSampleCount, 0, FUEL_SAMPLE_SIZE, 0, 100));
+  publisher.publish("initStatus", initializeStatus());
+}
+
+void sendTelemetryFrame() {
+  telemetryFrame frame;
+
+  frame.priFuelLevel = priFuelLevel;
+  frame.auxFuelLevel = auxFuelLevel;
+  frame.flags = (pumpOn ? TELEMETRY_PUMP_ON : 0) | (manualPumpOn ? TELEMETRY_MANUAL_PUMP_ON : 0) |
+                (pumpController.fault() ? TELEMETRY_PUMP_FAULT : 0) | (auxCalibration.stored() ? TELEMETRY_CAL_STORED : 0) |
+                (auxCalibration.recording() ? TELEMETRY_CALIBRATING : 0);
+  frame.initStatus = initializeStatus();
+  frame.minValue = minValue;
+  frame.maxValue = maxValue;
+  frame.canLost = canRxQueue.dropped();
+  frame.pumpState = pumpController.state();
+  frame.pumpDuty = pumpDutyPercent();
+  frame.pumpDutyCycle = dutyCyclePercent();
+  frame.calPoints = auxCalibration.recording() ? auxCalibration.points() : 0;
+  frame.calReading = auxCalibration.recording() ? auxReadingFilter.value() : 0;
+  frame.pumpMinutes = min(pumpSeconds / 60, 32767UL);
+  frame.transferRate = litersPerHour(fuelEstimator.transferRate(), AUX_TANK_LITERS);
+  frame.burnRate = litersPerHour(fuelEstimator.burnRate(), PRI_TANK_LITERS);
+  frame.consumption = fuelAnalytics.consumption() / 100;
+  frame.transferred = deciliters(fuelAnalytics.sessionTransferred());
+  frame.xferTotal = deciliters(fuelAnalytics.lifetimeTransferred());
+  frame.rangeMinutes = rangeMinutes();
+
+  publisher.publishFrame(&frame, sizeof(frame));
 }
 
 /**
@@ -248,6 +703,11 @@ void sendInitializeStatus() {
 */
 void doWork() {
   amController.logLn("Doing work...");
+
+  if (DEBUG_STACK) {
+    Serial.print(F("Stack headroom: "));
+    Serial.println(stackHeadroom());
+  }
 }
 
 /**
@@ -257,6 +717,14 @@ void doWork() {
 *
 */
 void doSync() {
+  // The device has just (re)connected, so everything goes out again
+  publisher.resendAll();
+
+  if (amController.binaryMode()) {
+    sendTelemetryFrame();
+    return;
+  }
+
   sendPrimaryFuelLevel();
   sendAuxFuelLevel();
   sendPumpOnState();
@@ -271,6 +739,37 @@ void doSync() {
 void processIncomingMessages(char *variable, char *value) {
   if (strcmp(variable,"manualPumpOn")==0) {
     manualPumpOn = atoi(value) == 1;
+#ifdef CAPTURE_SUPPORT
+    capture.manual(manualPumpOn);
+#endif
+  }
+
+  // Switched (0) or PWM (1) pump drive
+  if (strcmp(variable,"pumpMode")==0) {
+    pumpMode = atoi(value) == PUMP_MODE_PWM ? PUMP_MODE_PWM : PUMP_MODE_SWITCHED;
+  }
+
+  // Clears a dry-run fault, e.g. after the aux tank was filled or the sender fixed
+  if (strcmp(variable,"pumpReset")==0) {
+    pumpController.reset();
+  }
+
+  // Calibration of the aux sender: calStart, calPoint=<percent> for every known level once the
+  // reading has settled, then calSave (or calCancel); calClear goes back to the default points
+  if (strcmp(variable,"calStart")==0) {
+    auxCalibration.start();
+  }
+  if (strcmp(variable,"calPoint")==0) {
+    auxCalibration.record(auxReadingFilter.value(), atoi(value));
+  }
+  if (strcmp(variable,"calSave")==0) {
+    auxCalibration.save();
+  }
+  if (strcmp(variable,"calCancel")==0) {
+    auxCalibration.cancel();
+  }
+  if (strcmp(variable,"calClear")==0) {
+    auxCalibration.clear();
   }
 }
 
@@ -281,20 +780,66 @@ void processIncomingMessages(char *variable, char *value) {
 *
 */
 void processOutgoingMessages() {
-  sendPrimaryFuelLevel();
-  sendAuxFuelLevel();
-  sendPumpOnState();
-  sendManualPumpOnState();
-  sendInitializeStatus();
+  unsigned long txBytes = amController.txBytes();
+  unsigned long txMicros = amController.txMicros();
+
+  if (amController.binaryMode()) {
+    sendTelemetryFrame();
+  } else {
+    sendPrimaryFuelLevel();
+    sendAuxFuelLevel();
+    sendPumpOnState();
+    sendManualPumpOnState();
+    sendInitializeStatus();
+
+    publisher.publish("min", minValue, PUBLISH_ANALOG_DEADBAND);
+    publisher.publish("max", maxValue, PUBLISH_ANALOG_DEADBAND);
+    publisher.publish("canLost", (int) canRxQueue.dropped());
+    publisher.publish("pumpMinutes", (int) min(pumpSeconds / 60, 32767UL));
+    publisher.publish("pumpState", pumpController.state());
+    publisher.publish("pumpDuty", pumpDutyPercent(), PUBLISH_DUTY_DEADBAND);
+    publisher.publish("calStored", auxCalibration.stored());
+    publisher.publish("transferRate", litersPerHour(fuelEstimator.transferRate(), AUX_TANK_LITERS), PUBLISH_RATE_DEADBAND);
+    publisher.publish("burnRate", litersPerHour(fuelEstimator.burnRate(), PRI_TANK_LITERS), PUBLISH_RATE_DEADBAND);
+    publisher.publish("consumption", fuelAnalytics.consumption() / 100, PUBLISH_RATE_DEADBAND);
+    publisher.publish("transferred", deciliters(fuelAnalytics.sessionTransferred()), PUBLISH_VOLUME_DEADBAND);
+    publisher.publish("xferTotal", deciliters(fuelAnalytics.lifetimeTransferred()), PUBLISH_VOLUME_DEADBAND);
+    publisher.publish("pumpDutyCycle", dutyCyclePercent(), PUBLISH_DUTY_DEADBAND);
+    publisher.publish("rangeMinutes", rangeMinutes(), PUBLISH_RANGE_DEADBAND);
+
+    if (auxCalibration.recording()) {
+      publisher.publish("calPoints", auxCalibration.points());
+      publisher.publish("calReading", (int) auxReadingFilter.value(), PUBLISH_READING_DEADBAND);
+    }
+  }
 
-  amController.writeMessage("min", minValue);
-  amController.writeMessage("max", maxValue);
+  if (DEBUG_TX) {
+    Serial.print(amController.binaryMode() ? F("TX binary: ") : F("TX text: "));
+    Serial.print(amController.txBytes() - txBytes);
+    Serial.print(F(" bytes, "));
+    Serial.print(amController.txMicros() - txMicros);
+    Serial.print(F(" us, sent "));
+    Serial.print(publisher.sent());
+    Serial.print(F(" suppressed "));
+    Serial.print(publisher.suppressed());
+    Serial.print(F(" deferred "));
+    Serial.println(publisher.deferred());
+#ifdef AM_SD_TRANSFER
+    if (amController.sdTransferActive()) {
+      Serial.print(F("SD download: "));
+      Serial.print(amController.sdTransferBytes());
+      Serial.print(F(" bytes, "));
+      Serial.print(amController.sdTransferRate());
+      Serial.println(F(" bytes/s"));
+    }
+#endif
+  }
 }
 
 void deviceConnected() {
-  Serial.println("deviceConnected");
+  Serial.println(F("deviceConnected"));
 }
 
 void deviceDisconnected() {
-  Serial.println("deviceDisconnected");
+  Serial.println(F("deviceDisconnected"));
 }
\ No newline at end of file
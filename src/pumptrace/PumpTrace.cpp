@@ -0,0 +1,302 @@
+/*
+   Scripted aux level traces through the pump controller ([env:pumptrace]).
+
+   A trace is a text of lines, each a time, the aux level and the transfer decision from then on,
+   optionally with the state the controller has to be in at that time:
+
+     <ms> <aux level %> <demand 0|1> [idle|priming|transferring|cooldown|fault]
+     <ms> reset [<state>]
+
+   The level is interpolated between lines and read every AUX_READING_RATE period, the decision
+   holds until the next line, and the controller steps every loop period of PUMPTRACE_LOOP ms. A
+   reset line clears a fault as the pumpReset message does. '#' starts a comment.
+
+     program [-v] [-n %] [-r seed] [-l] [trace ...]
+
+       -v  print every state change
+       -n  sender noise added to every reading (standard deviation), default 0 %
+       -r  seed of the noise
+       -l  list the built-in traces
+
+   A trace is a built-in one by name or a file. Without any, all the built-in traces are run: a
+   transfer, the minimum on and off times, a stuck sender, a tank that runs dry and is filled,
+   and the cap on starts per hour, with the times of the sketch's limits (PUMP_* in main.cpp).
+   The exit status is 1 when a state didn't match.
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PumpController.h"
+
+// The sketch's controller, never stepped by it here; every trace starts from a copy
+extern PumpController pumpController;
+
+#define PUMPTRACE_LOOP 100                    // [ms]
+#define PUMPTRACE_READING 100                 // [ms] 1 / AUX_READING_RATE
+
+typedef struct {
+  const char *name;
+  const char *text;
+} pumpTrace;
+
+static const char *stateNames[] = { "idle", "priming", "transferring", "cooldown", "fault" };
+
+static const pumpTrace traces[] = {
+  { "transfer",
+    "# draining 5 %/min while pumping, stops on the decision and rests the minimum off time\n"
+    "0        80    0  idle\n"
+    "1000     80    1  priming\n"
+    "91000    72.5  1  transferring\n"
+    "301000   55    0  cooldown\n"
+    "360900   55    0  cooldown\n"
+    "361000   55    0  idle\n" },
+  { "dwell",
+    "# a decision that flips in the slosh: held on for the minimum on, off for the minimum off\n"
+    "0        80    1  priming\n"
+    "5000     79.6  0  priming\n"
+    "10000    79.2  1  priming\n"
+    "15000    78.8  0  priming\n"
+    "29900    77.5  0  priming\n"
+    "30000    77.5  0  cooldown\n"
+    "40000    77.5  1  cooldown\n"
+    "89900    77.5  1  cooldown\n"
+    "90000    77.5  1  priming\n" },
+  { "stuck",
+    "# the sender doesn't move while the pump runs, then the fault is reset from the app\n"
+    "0        60    1  priming\n"
+    "90000    60    1  transferring\n"
+    "179900   60    1  transferring\n"
+    "180000   60    1  fault\n"
+    "200000   60    1  fault\n"
+    "200000   reset    cooldown\n"
+    "239900   60    1  cooldown\n"
+    "240000   60    1  priming\n" },
+  { "dry",
+    "# the tank runs dry with the sender on 2 %, then it is filled\n"
+    "0        20    1  priming\n"
+    "90000    12.5  1  transferring\n"
+    "216000   2     1  transferring\n"
+    "359900   2     1  transferring\n"
+    "360000   2     1  fault\n"
+    "499900   2     1  fault\n"
+    "500000   80    1  fault\n"
+    "539900   80    1  fault\n"
+    "540000   80    1  cooldown\n"
+    "540100   80    1  priming\n" },
+  { "starts",
+    "# a start every two minutes until the cap, the next one waits for the first to be an hour old\n"
+    "0        80    1  priming\n"
+    "1000     80    0  priming\n"
+    "120000   80    1  priming\n"
+    "121000   80    0  priming\n"
+    "240000   80    1  priming\n"
+    "241000   80    0  priming\n"
+    "360000   80    1  priming\n"
+    "361000   80    0  priming\n"
+    "480000   80    1  priming\n"
+    "481000   80    0  priming\n"
+    "600000   80    1  priming\n"
+    "601000   80    0  priming\n"
+    "630000   80    0  cooldown\n"
+    "720000   80    1  cooldown\n"
+    "3599900  80    1  cooldown\n"
+    "3600000  80    1  priming\n" },
+};
+
+#define PUMPTRACE_TRACES (sizeof(traces) / sizeof(traces[0]))
+
+static bool verbose = false;
+static double noise = 0;
+static uint64_t randomState = 1;
+
+static double uniform(void) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((randomState >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double gaussian(void) {
+  return sqrt(-2.0 * log(uniform())) * cos(2.0 * PI * uniform());
+}
+
+static int stateOf(const char *name) {
+  for (uint8_t i = 0; i < sizeof(stateNames) / sizeof(stateNames[0]); i++)
+    if (strcmp(name, stateNames[i]) == 0)
+      return i;
+  return -1;
+}
+
+// Controller and trace position of the trace being run
+static PumpController *controller;
+static unsigned long now;
+static unsigned long nextReading;
+static unsigned long fromTime;
+static double fromLevel;
+static bool demand;
+static pumpState lastState;
+
+// Readings and loops up to ms, the level moving from the last line's towards level, the new
+// decision from the loop at ms on
+static void stepTo(unsigned long ms, double level, bool decision) {
+  do {
+    now = min(now + PUMPTRACE_LOOP, ms);
+
+    while (nextReading <= now) {
+      double at = ms > fromTime ? fromLevel + (level - fromLevel) * (nextReading - fromTime) / (ms - fromTime) : level;
+
+      controller->level((int16_t)constrain((at + noise * gaussian()) * 256, -32768.0, 32767.0));
+      nextReading += PUMPTRACE_READING;
+    }
+    if (now == ms)
+      demand = decision;
+    controller->update(now, demand);
+
+    if (controller->state() != lastState) {
+      lastState = controller->state();
+      if (verbose)
+        printf("  %8lu %s\n", now, stateNames[lastState]);
+    }
+  } while (now < ms);
+}
+
+// Returns the number of mismatches, -1 when the trace can't be read
+static int runTrace(const char *name, FILE *file) {
+  PumpController copy = pumpController;
+  char line[120];
+  int lineNumber = 0;
+  int checks = 0;
+  int mismatches = 0;
+
+  controller = &copy;
+  now = 0;
+  nextReading = 0;
+  fromTime = 0;
+  fromLevel = 0;
+  demand = false;
+  lastState = copy.state();
+
+  if (verbose)
+    printf("%s\n", name);
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *comment = strchr(line, '#');
+    char word[2][16] = { "", "" };
+    unsigned long ms;
+    double level;
+    int on;
+    int fields;
+
+    lineNumber++;
+    if (comment != NULL)
+      *comment = '\0';
+    if (sscanf(line, "%lu %15s", &ms, word[0]) < 2)
+      continue;
+    if (ms < now) {
+      fprintf(stderr, "%s:%d: time goes back\n", name, lineNumber);
+      return -1;
+    }
+
+    if (strcmp(word[0], "reset") == 0) {
+      fields = sscanf(line, "%lu %*s %15s", &ms, word[1]) + 2;
+      stepTo(ms, fromLevel, demand);
+      controller->reset();
+      if (verbose && controller->state() != lastState)
+        printf("  %8lu %s\n", ms, stateNames[controller->state()]);
+      lastState = controller->state();
+    } else {
+      fields = sscanf(line, "%lu %lf %d %15s", &ms, &level, &on, word[1]);
+      if (fields < 3) {
+        fprintf(stderr, "%s:%d: expected <ms> <level> <demand> [<state>]\n", name, lineNumber);
+        return -1;
+      }
+      stepTo(ms, level, on != 0);
+      fromLevel = level;
+    }
+    fromTime = ms;
+
+    if (fields < 4)
+      continue;
+
+    int expected = stateOf(word[1]);
+    if (expected < 0) {
+      fprintf(stderr, "%s:%d: no state %s\n", name, lineNumber, word[1]);
+      return -1;
+    }
+    checks++;
+    if (controller->state() != expected) {
+      printf("%s: at %lu ms expected %s, was %s\n", name, ms, word[1], stateNames[controller->state()]);
+      mismatches++;
+    }
+  }
+
+  printf("%s: %s, %d states checked, %u starts in the last hour\n", name, mismatches ? "FAILED" : "ok", checks,
+         controller->starts(now));
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  int option;
+
+  while ((option = getopt(argc, argv, "vn:r:l")) != -1) {
+    switch (option) {
+      case 'v':
+        verbose = true;
+        break;
+      case 'n':
+        noise = atof(optarg);
+        break;
+      case 'r':
+        randomState = strtoull(optarg, NULL, 0) * 2654435761UL + 1;
+        break;
+      case 'l':
+        for (uint8_t i = 0; i < PUMPTRACE_TRACES; i++)
+          printf("%s\n", traces[i].name);
+        return 0;
+      default:
+        fprintf(stderr, "usage: %s [-v] [-n %%] [-r seed] [-l] [trace ...]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  int failed = 0;
+  int run = 0;
+
+  for (uint8_t i = 0; i < PUMPTRACE_TRACES; i++) {
+    bool selected = optind == argc;
+
+    for (int a = optind; a < argc && !selected; a++)
+      selected = strcmp(argv[a], traces[i].name) == 0;
+    if (!selected)
+      continue;
+
+    FILE *file = fmemopen((void *)traces[i].text, strlen(traces[i].text), "r");
+    failed += runTrace(traces[i].name, file) != 0;
+    fclose(file);
+    run++;
+  }
+
+  for (int a = optind; a < argc; a++) {
+    bool builtIn = false;
+
+    for (uint8_t i = 0; i < PUMPTRACE_TRACES; i++)
+      builtIn = builtIn || strcmp(argv[a], traces[i].name) == 0;
+    if (builtIn)
+      continue;
+
+    FILE *file = fopen(argv[a], "r");
+    if (file == NULL) {
+      fprintf(stderr, "%s: can't open\n", argv[a]);
+      failed++;
+      continue;
+    }
+    failed += runTrace(argv[a], file) != 0;
+    fclose(file);
+    run++;
+  }
+
+  printf("%d traces, %d failed\n", run, failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+/*
+   Replay of a CaptureLog file through the unmodified control code ([env:replay]).
+
+   The capture is replayed loop by loop in file order: the CAN frames a loop processed are put
+   on the simulated bus, its aux sender readings are queued on the stopped AdcAcquisition, the
+   clock is moved to the time of its inputs and manual pump commands go through
+   processIncomingMessages(). Records come in the order loop() consumes them (frames, readings,
+   commands, pump decision) and the inputs within a millisecond, so a record that goes back in
+   that order, one of the same kind recorded later, or an input more than REPLAY_LOOP_MS after
+   the record before starts the next loop. The pump decision is written at the end of its loop,
+   after amController's delay, so it doesn't move the clock: the loop runs at its inputs' time
+   and its own delay takes it to the decision's.
+   The burst setup() reads is returned by analogRead(), its sum spread over as many conversions.
+   After each loop the pump output is compared with the recorded decision. A decision the limits'
+   timers make can fall a loop earlier or later than captured, the loops on the host don't take
+   exactly as long as on the car (or in the capturing build), so one that agrees again after the
+   next loop is only counted as a loop apart. The capture doesn't hold the pump mode, a capture
+   in PWM mode (pumpMode message) is replayed by a build with that PUMP_MODE.
+
+     program [-v] [-q] capture.bin
+
+       -v  show the sketch's Serial output
+       -q  only print mismatches and the summary
+
+   Prints "<ms> pump on|off" for every pump decision of the replay, "<ms> mismatch ..." where it
+   differs from the capture for more than a loop, and exits with 2 if there was any, so captures
+   of field issues can be kept as regression tests. Those in test/captures are re-recorded when
+   the control code changes a decision on purpose:
+
+     sim-transfer.bin  pio run -e sim with CAPTURE_SUPPORT, program -H 0.5 -b 60 -r 1 -j 1
+     dry-pump.bin      pio run -e native with CAPTURE_SUPPORT, program -q -s dry-pump.txt; the
+                       pump runs dry, faults, and the refill at 12 min clears it
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <time.h>
+#include "CaptureLog.h"
+#include "AdcAcquisition.h"
+
+// Wiring from main.cpp
+#define REPLAY_PUMP_PIN 8
+#define REPLAY_LOOP_MS 1                      // longest a loop's inputs are apart
+
+void processIncomingMessages(char *variable, char *value);
+extern AdcAcquisition auxAcquisition;
+
+typedef struct {
+  uint8_t type;
+  unsigned long time;                         // ms
+  uint8_t len;
+  uint8_t payload[5 + 8];
+} replayRecord;
+
+static replayRecord *records = NULL;
+static size_t recordCount = 0;
+static long replaySum = -1;                  // of the recorded sample or burst
+static uint8_t replaySamples = 1;
+static uint8_t replayRead = 0;
+
+static unsigned long getLong(const uint8_t *p) {
+  return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// Payload length of a record, -1 for an unknown type
+static int payloadLength(uint8_t type, FILE *file) {
+  switch (type) {
+    case CAPTURE_TIME:
+      return 4;
+    case CAPTURE_CAN: {
+      // id, then the data length decides the rest
+      long here = ftell(file);
+      int len = -1;
+      if (fseek(file, 4, SEEK_CUR) == 0)
+        len = fgetc(file);
+      fseek(file, here, SEEK_SET);
+      return len < 0 || len > 8 ? -1 : 5 + len;
+    }
+    case CAPTURE_ADC:
+      return 3;
+    case CAPTURE_ADC_SUM:
+      return 4;
+    case CAPTURE_MANUAL:
+    case CAPTURE_PUMP:
+      return 1;
+  }
+  return -1;
+}
+
+static bool loadCapture(const char *path) {
+  FILE *file = fopen(path, "rb");
+  char magic[CAPTURE_MAGIC_LEN];
+  unsigned long time = 0;
+
+  if (file == NULL)
+    return false;
+
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s is not a capture\n", path);
+    fclose(file);
+    return false;
+  }
+
+  uint8_t header[CAPTURE_HEADER_LEN];
+  while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+    replayRecord record;
+    int len = payloadLength(header[0], file);
+
+    if (len < 0 || fread(record.payload, 1, len, file) != (size_t)len) {
+      // A capture cut off by a power loss ends in a partial record
+      fprintf(stderr, "capture ends in a broken record after %lu records\n", (unsigned long)recordCount);
+      break;
+    }
+
+    time += header[1] | (header[2] << 8);
+    if (header[0] == CAPTURE_TIME) {
+      time = getLong(record.payload);
+      continue;
+    }
+
+    record.type = header[0];
+    record.time = time;
+    record.len = len;
+    records = (replayRecord *)realloc(records, (recordCount + 1) * sizeof(replayRecord));
+    records[recordCount++] = record;
+  }
+
+  fclose(file);
+  return true;
+}
+
+static bool adcRecord(const replayRecord &record) {
+  return record.type == CAPTURE_ADC || record.type == CAPTURE_ADC_SUM;
+}
+
+// Position of a record in loop(), frames first and the pump decision last
+static uint8_t loopOrder(const replayRecord &record) {
+  if (record.type == CAPTURE_CAN)
+    return 0;
+  if (adcRecord(record))
+    return 1;
+  if (record.type == CAPTURE_MANUAL)
+    return 2;
+  return 3;
+}
+
+static void loadSample(const replayRecord &record) {
+  if (record.type == CAPTURE_ADC_SUM) {
+    replaySamples = max(record.payload[1], (uint8_t)1);
+    replaySum = record.payload[2] | (record.payload[3] << 8);
+  } else {
+    replaySamples = 1;
+    replaySum = record.payload[1] | (record.payload[2] << 8);
+  }
+  replayRead = 0;
+}
+
+// A burst's sum spread over its conversions, which add up to it exactly; the aux sender is the
+// only pin the sketch reads
+static int recordedSample(uint8_t) {
+  int value = (replaySum + replayRead) / replaySamples;
+
+  replayRead = (replayRead + 1) % replaySamples;
+  return value;
+}
+
+static void moveClockTo(unsigned long ms) {
+  if (ms * 1000 > nativeMicros())
+    nativeAdvance(ms * 1000 - nativeMicros());
+}
+
+int main(int argc, char **argv) {
+  bool verbose = false;
+  bool quiet = false;
+  int option;
+
+  while ((option = getopt(argc, argv, "vq")) != -1) {
+    switch (option) {
+      case 'v': verbose = true; break;
+      case 'q': quiet = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-v] [-q] capture.bin\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-v] [-q] capture.bin\n", argv[0]);
+    return 1;
+  }
+  if (!loadCapture(argv[optind]))
+    return 1;
+
+  nativeSerialQuiet(!verbose);
+  nativeOnAnalogRead(&recordedSample);
+
+  struct timespec start, stop;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The burst setup() reads comes before the first loop
+  size_t i = 0;
+
+  if (recordCount > 0 && records[0].type == CAPTURE_ADC_SUM)
+    loadSample(records[i++]);
+
+  setup();
+
+  unsigned long loops = 0;
+  unsigned long frames = 0;
+  unsigned long decisions = 0;
+  unsigned long mismatches = 0;
+  unsigned long apart = 0;
+  bool recordedPump = false;
+  bool replayedPump = false;
+  bool differs = false;
+  unsigned long differsTime = 0;
+
+  // From here on the readings come from the capture, not the timer
+  auxAcquisition.end();
+
+  while (i < recordCount) {
+    size_t first = i;
+
+    for (; i < recordCount; i++) {
+      if (i > first && (loopOrder(records[i]) < loopOrder(records[i - 1]) ||
+          (loopOrder(records[i]) == loopOrder(records[i - 1]) && records[i].time != records[i - 1].time) ||
+          (records[i].type != CAPTURE_PUMP && records[i].time - records[i - 1].time > REPLAY_LOOP_MS)))
+        break;
+      if (records[i].type != CAPTURE_PUMP)
+        moveClockTo(records[i].time);
+
+      if (records[i].type == CAPTURE_CAN) {
+        nativeCanInject(getLong(records[i].payload), records[i].payload[4], records[i].payload + 5);
+        frames++;
+      } else if (adcRecord(records[i])) {
+        // Captures from before the timer-triggered acquisition have one reading per loop
+        loadSample(records[i]);
+        auxAcquisition.push(replaySum * auxAcquisition.samples() / replaySamples);
+      } else if (records[i].type == CAPTURE_MANUAL) {
+        char variable[] = "manualPumpOn";
+        char value[] = "0";
+        value[0] += records[i].payload[0] ? 1 : 0;
+        processIncomingMessages(variable, value);
+      } else if (records[i].type == CAPTURE_PUMP) {
+        recordedPump = records[i].payload[0];
+      }
+    }
+
+    unsigned long loopTime = millis();
+    loop();
+    loops++;
+
+    bool pump = nativePinOutput(REPLAY_PUMP_PIN) == HIGH;
+    if (pump != replayedPump) {
+      replayedPump = pump;
+      decisions++;
+      if (!quiet)
+        printf("%lu pump %s\n", loopTime, pump ? "on" : "off");
+    }
+    if (pump == recordedPump) {
+      if (differs)
+        apart++;
+      differs = false;
+    } else if (!differs) {
+      differs = true;
+      differsTime = loopTime;
+    } else {
+      mismatches++;
+      printf("%lu mismatch: captured pump %s, replayed %s\n", differsTime, recordedPump ? "on" : "off", pump ? "on" : "off");
+      // Follow the replay from here so one divergence is reported once
+      recordedPump = pump;
+      differs = false;
+    }
+  }
+
+  if (differs) {
+    mismatches++;
+    printf("%lu mismatch: captured pump %s, replayed %s\n", differsTime, recordedPump ? "on" : "off", replayedPump ? "on" : "off");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  double elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+  fflush(stdout);
+  fprintf(stderr, "%lu loops, %lu CAN frames, %lu pump decisions, %lu a loop apart, %lu mismatches, %lu ms of capture replayed in %.3f s\n",
+          loops, frames, decisions, apart, mismatches, recordCount > 0 ? records[recordCount - 1].time : 0UL, elapsed);
+  return mismatches > 0 ? 2 : 0;
+}
@@ -0,0 +1,517 @@
+/*
+   Tank and pump simulator for tuning the transfer limits ([env:sim]).
+
+   Runs the real sketch on the native virtual clock against a model of both tanks: the engine
+   burns from the primary tank, the pump moves fuel from the aux tank while PUMP_PIN is high, at
+   the flow of the PWM duty on pin 9 above its dead duty, the dash reports the primary level over
+   CAN once a second and the aux sender is read on A0. Both readings carry sender noise and
+   slosh. Every combination of pump mode, fuelTransferMax and fuelTransferThreshold is run in its
+   own forked process, several at a time.
+
+     program [-H hours] [-M mode] [-m max] [-T threshold] [-r runs] [-j jobs] [-b l/h] [-f l/h] [-n %] [-s %]
+
+       -H  simulated hours per run, default 4
+       -M  pump mode, switched, pwm or both, default the sketch's
+       -m  fuelTransferMax values, "75" or "60:90:5", default 75
+       -T  fuelTransferThreshold values, default 10
+       -r  runs with different random seeds per combination, default 4
+       -j  parallel jobs, default one per core
+       -b  average engine burn rate, default 8 l/h
+       -f  pump flow, default 60 l/h
+       -n  sender noise (standard deviation), default 1 %
+       -s  slosh (standard deviation), default 3 %
+
+   Per combination it prints the time from power-up until the aux filter is full, the pump cycles
+   per hour, the time to the first transfer, when the aux tank ran dry, the lowest primary level,
+   the time the pump ran with the aux tank empty, the dry-run faults of the pump controller, the
+   fuel pushed out of a full primary tank and how much the primary level swings around its trend
+   (rms from a SIM_TREND_SECONDS running mean, from the first transfer until the aux tank is
+   nearly empty).
+
+   A second table scores the sketch's level estimates (FuelEstimator) against the true levels,
+   next to what the control code used before them: a 100-reading moving average of the aux sender
+   and the dash's last raw fuel level. It gives the RMS error of each, the aux lag while the pump
+   runs steadily (error over the true drain rate, positive is behind) and the error of the
+   estimated transfer rate. Last come the errors of the analytics (FuelAnalytics): its mean
+   consumption against the engine's mean burn, and the fuel it counted as transferred against
+   what the pump moved.
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "FixedFilters.h"
+#include "FuelEstimator.h"
+#include "PumpController.h"
+#include "FuelAnalytics.h"
+
+// Wiring and limits from main.cpp
+#define SIM_PUMP_PIN 8
+#define SIM_PWM_PIN 9
+#define SIM_TREND_SECONDS 1800.0
+#define SIM_PUMP_DEAD 25                      // duty the pump starts to move fuel above
+#define SIM_AUX_PIN A0
+#define SIM_AUX_EMPTY 450
+#define SIM_AUX_FULL 125
+#define SIM_CAN_ID 0x98FEFC17UL               // extended, PGN 65276 from the instrument cluster
+
+extern byte pumpMode;
+extern byte fuelTransferMax;
+extern byte fuelTransferThreshold;
+int initializeStatus();
+extern FuelEstimator fuelEstimator;
+extern PumpController pumpController;
+extern FuelAnalytics fuelAnalytics;
+
+#define SIM_PRIMARY_LITERS 36.0
+#define SIM_AUX_LITERS 19.0
+#define SIM_LOOP_MICROS 1000UL
+#define SIM_STEP_MICROS 100000UL              // plant integration step
+#define SIM_DASH_MICROS 1000000UL             // dash display broadcast period
+#define SIM_SLOSH_SECONDS 2.0                 // correlation time of the slosh
+#define SIM_THROTTLE_SECONDS 30.0             // correlation time of the burn rate
+#define SIM_MAX_COMBINATIONS 256
+#define SIM_SETTLE_SECONDS 60.0               // before the levels are scored, the moving average's warm-up
+#define SIM_STEADY_SECONDS 20.0               // of pumping before the lag is scored
+#define SIM_SMA_SIZE 100                      // the moving average the estimator replaced
+
+typedef struct {
+  double hours;
+  double burnRate;                            // l/h
+  double pumpFlow;                            // l/h
+  double noise;                               // % of tank
+  double slosh;                               // % of tank
+} simConfig;
+
+typedef struct {
+  byte mode;
+  byte transferMax;
+  byte transferThreshold;
+  unsigned long seed;
+} simRun;
+
+typedef struct {
+  double ready;                               // ms from power-up until initStatus reached 100
+  double pumpCycles;
+  double firstTransfer;                       // s, -1 if the pump never ran
+  double auxEmpty;                            // s, -1 if fuel was left
+  double minPrimary;                          // %
+  double dryPump;                             // s
+  double faults;
+  double overflow;                            // l
+  double priSwing;                            // rms, %
+  double auxEstimate;                         // RMS errors, %
+  double auxAverage;
+  double auxEstimateLag;                      // s
+  double auxAverageLag;
+  double priEstimate;
+  double priRaw;
+  double transferError;                       // % of the pump flow
+  double moved;                               // l
+  double consumptionError;                    // % of the mean burn
+  double movedError;                          // % of the fuel moved
+} simResult;
+
+// Sums behind the tracking scores of the run in this process
+typedef struct {
+  double auxEstimate, auxAverage, priEstimate, priRaw;
+  unsigned long samples;
+  double auxEstimateLag, auxAverageLag, transfer;
+  unsigned long steady;
+  double primaryTrend, primarySwing;
+  unsigned long primarySamples;
+  double consumption, burn;
+} simTracking;
+
+static simConfig config = { 4.0, 8.0, 60.0, 1.0, 3.0 };
+
+// Plant state of the run in this process
+static double primary;                        // l
+static double aux;                            // l
+static double sloshPrimary;
+static double sloshAux;
+static double throttle = 1.0;
+static unsigned long plantTime = 0;
+static unsigned long nextDash = 0;
+static simResult result;
+static simTracking tracking;
+static MovingAverage<SIM_SMA_SIZE> auxAverage;
+static double dashPercent = -1;               // last raw level sent
+static double pumpSince = -1;                 // s
+static uint64_t randomState;
+
+static double uniform(void) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((randomState >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double gaussian(void) {
+  return sqrt(-2.0 * log(uniform())) * cos(2.0 * PI * uniform());
+}
+
+// First-order random process with unit variance and the given correlation time
+static double wander(double value, double dt, double seconds) {
+  double a = exp(-dt / seconds);
+  return a * value + sqrt(1.0 - a * a) * gaussian();
+}
+
+static void scoreLevels(bool pumping, double flow, double dt) {
+  double now = plantTime / 1e6;
+  double auxTrue = aux * 100.0 / SIM_AUX_LITERS;
+  double primaryTrue = primary * 100.0 / SIM_PRIMARY_LITERS;
+
+  if (!pumping)
+    pumpSince = -1;
+  else if (pumpSince < 0)
+    pumpSince = now;
+
+  if (result.firstTransfer < 0)
+    tracking.primaryTrend = primaryTrue;
+  tracking.primaryTrend += (primaryTrue - tracking.primaryTrend) * dt / SIM_TREND_SECONDS;
+  if (result.firstTransfer >= 0 && aux > SIM_AUX_LITERS * 0.05) {
+    tracking.primarySwing += (primaryTrue - tracking.primaryTrend) * (primaryTrue - tracking.primaryTrend);
+    tracking.primarySamples++;
+  }
+
+  if (now < SIM_SETTLE_SECONDS || !fuelEstimator.ready() || dashPercent < 0)
+    return;
+
+  double auxError = fuelEstimator.auxEstimate() / 65536.0 - auxTrue;
+  double averageError = auxAverage.value() - auxTrue;
+  double priError = fuelEstimator.primaryEstimate() / 65536.0 - primaryTrue;
+  double rawError = dashPercent - primaryTrue;
+
+  tracking.auxEstimate += auxError * auxError;
+  tracking.auxAverage += averageError * averageError;
+  tracking.priEstimate += priError * priError;
+  tracking.priRaw += rawError * rawError;
+  tracking.samples++;
+
+  // While the engine burns what the tanks hold
+  if (primary > 0) {
+    tracking.consumption += fuelAnalytics.consumption() / 1000.0;
+    tracking.burn += max(throttle, 0.2) * config.burnRate;
+  }
+
+  // Draining at the pump's flow, as long as there is fuel left
+  if (pumpSince >= 0 && now - pumpSince >= SIM_STEADY_SECONDS && aux > SIM_AUX_LITERS * 0.05 && flow > 0.1) {
+    double drain = flow * 100.0 / SIM_AUX_LITERS / 3600.0;
+
+    tracking.auxEstimateLag += auxError / drain;
+    tracking.auxAverageLag += averageError / drain;
+    tracking.transfer += fabs(fuelEstimator.transferRate() * 3600.0 / 65536.0 * SIM_AUX_LITERS / 100.0 - config.pumpFlow);
+    tracking.steady++;
+  }
+}
+
+static void stepPlant(double dt) {
+  bool pumping = nativePinOutput(SIM_PUMP_PIN) == HIGH;
+  int duty = nativePinOutput(SIM_PWM_PIN);
+  double flow = pumping ? config.pumpFlow * max(duty - SIM_PUMP_DEAD, 0) / (255.0 - SIM_PUMP_DEAD) : 0;
+
+  throttle = wander(throttle - 1.0, dt, SIM_THROTTLE_SECONDS) * 0.5 + 1.0;
+  primary -= max(throttle, 0.2) * config.burnRate * dt / 3600.0;
+  if (primary < 0)
+    primary = 0;
+
+  if (pumping) {
+    double moved = min(aux, flow * dt / 3600.0);
+    if (aux <= 0)
+      result.dryPump += dt;
+    aux -= moved;
+    primary += moved;
+    result.moved += moved;
+    if (primary > SIM_PRIMARY_LITERS) {
+      result.overflow += primary - SIM_PRIMARY_LITERS;
+      primary = SIM_PRIMARY_LITERS;
+    }
+  }
+
+  sloshPrimary = wander(sloshPrimary, dt, SIM_SLOSH_SECONDS);
+  sloshAux = wander(sloshAux, dt, SIM_SLOSH_SECONDS);
+
+  double primaryPercent = primary * 100.0 / SIM_PRIMARY_LITERS;
+  result.minPrimary = min(result.minPrimary, primaryPercent);
+  if (result.auxEmpty < 0 && aux < SIM_AUX_LITERS * 0.01)
+    result.auxEmpty = plantTime / 1e6;
+
+  // Aux sender, 125 full .. 450 empty
+  double auxPercent = aux * 100.0 / SIM_AUX_LITERS + config.slosh * sloshAux + config.noise * gaussian();
+  auxPercent = constrain(auxPercent, 0.0, 100.0);
+  int counts = SIM_AUX_EMPTY - (int)(auxPercent * (SIM_AUX_EMPTY - SIM_AUX_FULL) / 100.0);
+  nativeSetAnalog(SIM_AUX_PIN, counts);
+
+  // The old path, a reading a step into its moving average
+  auxAverage.add(map(counts, SIM_AUX_FULL, SIM_AUX_EMPTY, 100, 0));
+  scoreLevels(pumping, flow, dt);
+}
+
+static void sendDash(void) {
+  double percent = primary * 100.0 / SIM_PRIMARY_LITERS + config.slosh * sloshPrimary + config.noise * gaussian();
+  byte data[8] = { 0xFF, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+  data[1] = (byte)constrain(percent * 255.0 / 100.0, 0.0, 255.0);
+  dashPercent = map(data[1], 0, 255, 0, 100);
+  nativeCanInject(SIM_CAN_ID, sizeof(data), data);
+}
+
+static void onAdvance(unsigned long now) {
+  while (now - plantTime >= SIM_STEP_MICROS) {
+    plantTime += SIM_STEP_MICROS;
+    stepPlant(SIM_STEP_MICROS / 1e6);
+  }
+  if (now >= nextDash) {
+    nextDash += SIM_DASH_MICROS;
+    sendDash();
+  }
+}
+
+static void onPinChange(uint8_t pin, int value) {
+  if (pin != SIM_PUMP_PIN || value != HIGH)
+    return;
+  result.pumpCycles++;
+  if (result.firstTransfer < 0)
+    result.firstTransfer = nativeMicros() / 1e6;
+}
+
+// One run from key-on with both tanks full, in the calling (forked) process
+static simResult runOnce(const simRun &run) {
+  pumpMode = run.mode;
+  fuelTransferMax = run.transferMax;
+  fuelTransferThreshold = run.transferThreshold;
+  randomState = run.seed * 2654435761UL + 1;
+
+  primary = SIM_PRIMARY_LITERS;
+  aux = SIM_AUX_LITERS;
+  result.ready = -1;
+  result.pumpCycles = 0;
+  result.firstTransfer = -1;
+  result.auxEmpty = -1;
+  result.minPrimary = 100;
+  result.dryPump = 0;
+  result.faults = 0;
+  result.overflow = 0;
+  result.moved = 0;
+
+  nativeSerialQuiet(true);
+  nativeOnAdvance(&onAdvance);
+  nativeOnPinChange(&onPinChange);
+  stepPlant(0);
+
+  unsigned long end = (unsigned long)(config.hours * 3600e3);
+  setup();
+  while (millis() < end) {
+    if (result.ready < 0 && initializeStatus() >= 100)
+      result.ready = nativeMicros() / 1e3;
+    bool fault = pumpController.fault();
+    loop();
+    if (pumpController.fault() && !fault)
+      result.faults++;
+    nativeAdvance(SIM_LOOP_MICROS);
+  }
+
+  result.pumpCycles /= config.hours;
+
+  unsigned long samples = max(tracking.samples, 1UL);
+  unsigned long steady = max(tracking.steady, 1UL);
+
+  result.auxEstimate = sqrt(tracking.auxEstimate / samples);
+  result.auxAverage = sqrt(tracking.auxAverage / samples);
+  result.priEstimate = sqrt(tracking.priEstimate / samples);
+  result.priRaw = sqrt(tracking.priRaw / samples);
+  result.auxEstimateLag = tracking.auxEstimateLag / steady;
+  result.auxAverageLag = tracking.auxAverageLag / steady;
+  result.transferError = tracking.transfer / steady * 100.0 / config.pumpFlow;
+
+  result.priSwing = sqrt(tracking.primarySwing / max(tracking.primarySamples, 1UL));
+  result.consumptionError = (tracking.consumption - tracking.burn) * 100.0 / max(tracking.burn, 1e-9);
+  result.movedError = result.moved > 0 ? (fuelAnalytics.sessionTransferred() / 1000.0 - result.moved) * 100.0 / result.moved : 0;
+  return result;
+}
+
+// "75" or "60:90:5"
+static int parseRange(const char *text, byte *values) {
+  int first, last, step = 1;
+  int count = sscanf(text, "%d:%d:%d", &first, &last, &step);
+
+  if (count == 1)
+    last = first;
+  if (count < 1 || step <= 0)
+    return 0;
+
+  int n = 0;
+  for (int value = first; value <= last && n < SIM_MAX_COMBINATIONS; value += step)
+    values[n++] = constrain(value, 0, 100);
+  return n;
+}
+
+static const char *modeNames[] = { "switched", "pwm" };
+
+typedef struct {
+  pid_t pid;
+  int pipe;
+  int combination;
+} simJob;
+
+int main(int argc, char **argv) {
+  // Defaults are the sketch's own limits
+  byte maxValues[SIM_MAX_COMBINATIONS] = { fuelTransferMax };
+  byte thresholdValues[SIM_MAX_COMBINATIONS] = { fuelTransferThreshold };
+  byte modeValues[2] = { pumpMode };
+  int modeCount = 1;
+  int maxCount = 1;
+  int thresholdCount = 1;
+  int runs = 4;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int option;
+
+  while ((option = getopt(argc, argv, "H:M:m:T:r:j:b:f:n:s:")) != -1) {
+    switch (option) {
+      case 'H': config.hours = atof(optarg); break;
+      case 'M':
+        modeCount = strcmp(optarg, "both") == 0 ? 2 : strcmp(optarg, "pwm") == 0 || strcmp(optarg, "switched") == 0 ? 1 : 0;
+        modeValues[0] = strcmp(optarg, "pwm") == 0;
+        modeValues[1] = 1;
+        break;
+      case 'm': maxCount = parseRange(optarg, maxValues); break;
+      case 'T': thresholdCount = parseRange(optarg, thresholdValues); break;
+      case 'r': runs = atoi(optarg); break;
+      case 'j': jobs = atoi(optarg); break;
+      case 'b': config.burnRate = atof(optarg); break;
+      case 'f': config.pumpFlow = atof(optarg); break;
+      case 'n': config.noise = atof(optarg); break;
+      case 's': config.slosh = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-H hours] [-M mode] [-m max] [-T threshold] [-r runs] [-j jobs] [-b l/h] [-f l/h] [-n %%] [-s %%]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  int limits = maxCount * thresholdCount;
+  int combinations = modeCount * limits;
+  if (combinations == 0 || combinations > SIM_MAX_COMBINATIONS || runs <= 0 || config.hours <= 0) {
+    fprintf(stderr, "nothing to run\n");
+    return 1;
+  }
+  jobs = max(jobs, 1);
+
+  static simResult totals[SIM_MAX_COMBINATIONS];
+  static simResult worst[SIM_MAX_COMBINATIONS];
+  static int transfers[SIM_MAX_COMBINATIONS];
+  static int emptied[SIM_MAX_COMBINATIONS];
+  simJob running[jobs];
+  int active = 0;
+  int next = 0;
+  int total = combinations * runs;
+
+  for (int i = 0; i < combinations; i++)
+    worst[i].minPrimary = 100;
+
+  struct timespec start, stop;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fflush(stdout);
+
+  // Every run gets a fresh process, the sketch's globals start from scratch
+  while (next < total || active > 0) {
+    while (active < jobs && next < total) {
+      int fds[2];
+      if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+      }
+
+      simRun run;
+      run.mode = modeValues[(next / runs) / limits];
+      run.transferMax = maxValues[(next / runs) / thresholdCount % maxCount];
+      run.transferThreshold = thresholdValues[(next / runs) % thresholdCount];
+      run.seed = next % runs + 1;
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        simResult r = runOnce(run);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == sizeof(r) ? 0 : 1);
+      }
+      close(fds[1]);
+      running[active].pid = pid;
+      running[active].pipe = fds[0];
+      running[active].combination = next / runs;
+      active++;
+      next++;
+    }
+
+    int status;
+    pid_t done = wait(&status);
+    for (int i = 0; i < active; i++) {
+      if (running[i].pid != done)
+        continue;
+
+      simResult r;
+      int c = running[i].combination;
+      if (read(running[i].pipe, &r, sizeof(r)) == sizeof(r)) {
+        totals[c].ready += r.ready;
+        totals[c].pumpCycles += r.pumpCycles;
+        totals[c].dryPump += r.dryPump;
+        totals[c].faults += r.faults;
+        totals[c].overflow += r.overflow;
+        totals[c].priSwing += r.priSwing;
+        totals[c].minPrimary += r.minPrimary;
+        totals[c].auxEstimate += r.auxEstimate;
+        totals[c].auxAverage += r.auxAverage;
+        totals[c].auxEstimateLag += r.auxEstimateLag;
+        totals[c].auxAverageLag += r.auxAverageLag;
+        totals[c].priEstimate += r.priEstimate;
+        totals[c].priRaw += r.priRaw;
+        totals[c].transferError += r.transferError;
+        totals[c].consumptionError += r.consumptionError;
+        totals[c].movedError += r.movedError;
+        worst[c].minPrimary = min(worst[c].minPrimary, r.minPrimary);
+        if (r.firstTransfer >= 0) {
+          totals[c].firstTransfer += r.firstTransfer;
+          transfers[c]++;
+        }
+        if (r.auxEmpty >= 0) {
+          totals[c].auxEmpty += r.auxEmpty;
+          emptied[c]++;
+        }
+      } else {
+        fprintf(stderr, "run failed\n");
+      }
+      close(running[i].pipe);
+      running[i] = running[--active];
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  double elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("%.1f h per run, burn %.1f l/h, pump %.1f l/h, noise %.1f %%, slosh %.1f %%, %d runs each\n\n",
+         config.hours, config.burnRate, config.pumpFlow, config.noise, config.slosh, runs);
+  printf("  mode      max  thr  ready ms  cycles/h  first xfer s  aux empty min  min pri %% (worst)  dry pump s  faults  overflow l  pri swing %%\n");
+  for (int c = 0; c < combinations; c++) {
+    printf("  %-8s  %3d  %3d  %8.1f  %8.1f  %12.0f  %13.1f  %8.1f (%5.1f)  %10.1f  %6.2f  %10.2f  %11.2f\n",
+           modeNames[modeValues[c / limits]], maxValues[c / thresholdCount % maxCount], thresholdValues[c % thresholdCount],
+           totals[c].ready / runs, totals[c].pumpCycles / runs,
+           transfers[c] ? totals[c].firstTransfer / transfers[c] : -1.0,
+           emptied[c] ? totals[c].auxEmpty / emptied[c] / 60.0 : -1.0,
+           totals[c].minPrimary / runs, worst[c].minPrimary,
+           totals[c].dryPump / runs, totals[c].faults / runs, totals[c].overflow / runs, totals[c].priSwing / runs);
+  }
+  printf("\n  mode      max  thr  aux rms %% est (avg)  aux lag s est (avg)  pri rms %% est (raw)  xfer rate err %%  cons err %%  moved err %%\n");
+  for (int c = 0; c < combinations; c++) {
+    printf("  %-8s  %3d  %3d  %9.2f (%5.2f)  %9.1f (%6.1f)  %9.2f (%5.2f)  %15.1f  %10.1f  %11.1f\n",
+           modeNames[modeValues[c / limits]], maxValues[c / thresholdCount % maxCount], thresholdValues[c % thresholdCount],
+           totals[c].auxEstimate / runs, totals[c].auxAverage / runs,
+           totals[c].auxEstimateLag / runs, totals[c].auxAverageLag / runs,
+           totals[c].priEstimate / runs, totals[c].priRaw / runs, totals[c].transferError / runs,
+           totals[c].consumptionError / runs, totals[c].movedError / runs);
+  }
+  printf("\n%d runs, %.0f simulated hours in %.2f s on %d jobs (%.0fx real time)\n",
+         total, total * config.hours, elapsed, jobs, elapsed > 0 ? total * config.hours * 3600.0 / elapsed : 0.0);
+  return 0;
+}
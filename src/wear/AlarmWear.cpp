@@ -0,0 +1,185 @@
+/*
+   EEPROM endurance of the alarm table on the native EEPROM model ([env:wear]).
+
+   Sets up daily repeating alarms through the app's $AlarmId$ / $AlarmT$ / $AlarmR$ messages and
+   runs AMController for the given number of days of virtual time, so every alarm fires and is
+   rescheduled once a day, and now and then one is moved to another time as a user would. The
+   alarms persist through EepromLog. The same events are counted against the fixed slots used
+   before, where every change rewrote the alarm's 17 bytes in the same place.
+
+     program [-d days] [-n alarms] [-m moves]
+
+       -d  days of virtual time, default 365
+       -n  daily repeating alarms, 1..5, default 3
+       -m  alarms moved per week, default 2
+
+   Prints writes per year to the most worn cell and the average cell of the alarm region for both
+   schemes, then reads the table back from the EEPROM to check that no change was lost.
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "AM_HM10.h"
+
+#define WEAR_START_TIME       1700000000UL  // [s] Unix time the run starts at
+#define WEAR_STEP_MICROS      60000000UL    // virtual time between loop() calls
+#define WEAR_MESSAGE_LOOPS    200           // 1 ms loop() calls for a message to arrive
+#define WEAR_LEGACY_SLOT      17            // sizeof(alarm) on the Uno before the log
+#define WEAR_ENDURANCE        100000UL      // write cycles per cell in the ATmega328P datasheet
+
+typedef struct {
+  unsigned long days;
+  uint8_t       alarms;
+  unsigned long moves;
+} wearConfig;
+
+static wearConfig config = { 365, 3, 2 };
+
+static uint32_t expected[ALARM_SLOTS];      // next fire time of every alarm
+static unsigned long legacyWrites[ALARM_SLOTS];
+static unsigned long fired = 0;
+
+static void doWork(void) {}
+static void doSync(void) {}
+static void processIncomingMessages(char *, char *) {}
+static void processOutgoingMessages(void) {}
+static void deviceConnected(void) {}
+static void deviceDisconnected(void) {}
+
+// Alarms are named A0..A4 after their slot
+static void processAlarms(char *alarm) {
+  uint8_t slot = alarm[1] - '0';
+
+  if (slot < ALARM_SLOTS) {
+    expected[slot] += ALARM_REPEAT_PERIOD;
+    legacyWrites[slot]++;
+    fired++;
+  }
+}
+
+static void send(AMController &controller, const char *text) {
+  nativeSerialInject((const uint8_t *)text, strlen(text));
+  for (int i = 0; i < WEAR_MESSAGE_LOOPS; i++) {
+    controller.loop(0);
+    nativeAdvance(1000);
+  }
+}
+
+static void setAlarm(AMController &controller, uint8_t slot, uint32_t time) {
+  char text[64];
+
+  // Set first, a time already past fires while the messages are processed
+  expected[slot] = time;
+  legacyWrites[slot]++;
+
+  snprintf(text, sizeof(text), "$AlarmId$=A%u#$AlarmT$=%lu#", slot, (unsigned long)time);
+  send(controller, text);
+  send(controller, "$AlarmR$=1#");
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-d days] [-n alarms] [-m moves]\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int option;
+
+  while ((option = getopt(argc, argv, "d:n:m:")) != -1) {
+    switch (option) {
+      case 'd':
+        config.days = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        config.alarms = atoi(optarg);
+        break;
+      case 'm':
+        config.moves = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (config.days == 0 || config.alarms < 1 || config.alarms > ALARM_SLOTS)
+    usage(argv[0]);
+
+  nativeSerialQuiet(true);
+
+  AMController controller(&doWork, &doSync, &processIncomingMessages, &processOutgoingMessages,
+                          &processAlarms, &deviceConnected, &deviceDisconnected);
+  char text[32];
+
+  snprintf(text, sizeof(text), "$Time$=%lu#", WEAR_START_TIME);
+  send(controller, text);
+
+  // Spread over the evening, a few minutes apart
+  for (uint8_t i = 0; i < config.alarms; i++)
+    setAlarm(controller, i, WEAR_START_TIME + 3600UL + i * 300UL);
+
+  unsigned long steps = config.days * (86400000000ULL / WEAR_STEP_MICROS);
+  unsigned long moveEvery = config.moves > 0 ? steps * 7 / (config.days * config.moves) : 0;
+  uint8_t nextMove = 0;
+
+  for (unsigned long step = 1; step <= steps; step++) {
+    controller.loop(0);
+    nativeAdvance(WEAR_STEP_MICROS);
+
+    // Moved by a quarter of an hour, back and forth
+    if (moveEvery > 0 && step % moveEvery == 0) {
+      uint8_t slot = nextMove++ % config.alarms;
+      uint32_t time = expected[slot] + ((step / moveEvery) % 2 ? 900UL : -900L);
+
+      setAlarm(controller, slot, time);
+    }
+  }
+
+  // Wear of the log region against the same events on the fixed slots
+  unsigned long maxWrites = 0;
+  unsigned long long totalWrites = 0;
+  unsigned long legacyMax = 0;
+  unsigned long long legacyTotal = 0;
+
+  for (int address = ALARM_EEPROM_START; address < ALARM_EEPROM_START + ALARM_EEPROM_LENGTH; address++) {
+    unsigned long writes = nativeEepromWrites(address);
+
+    totalWrites += writes;
+    if (writes > maxWrites)
+      maxWrites = writes;
+  }
+  for (uint8_t i = 0; i < ALARM_SLOTS; i++) {
+    legacyTotal += legacyWrites[i] * WEAR_LEGACY_SLOT;
+    if (legacyWrites[i] > legacyMax)
+      legacyMax = legacyWrites[i];
+  }
+
+  double years = config.days / 365.0;
+  double perYear = maxWrites / years;
+  double legacyPerYear = legacyMax / years;
+
+  printf("%lu days, %u alarms, %lu moves a week: %lu fired\n", config.days, config.alarms, config.moves, fired);
+  printf("fixed slots: %8.0f writes/cell/year max, %8.1f average over %d bytes, %6.0f years to %lu\n",
+         legacyPerYear, legacyTotal / years / (ALARM_SLOTS * WEAR_LEGACY_SLOT), ALARM_SLOTS * WEAR_LEGACY_SLOT,
+         WEAR_ENDURANCE / legacyPerYear, WEAR_ENDURANCE);
+  printf("EEPROM log:  %8.0f writes/cell/year max, %8.1f average over %d bytes, %6.0f years to %lu\n",
+         perYear, totalWrites / years / ALARM_EEPROM_LENGTH, ALARM_EEPROM_LENGTH,
+         perYear > 0 ? WEAR_ENDURANCE / perYear : 0.0, WEAR_ENDURANCE);
+
+  // What a restart would load
+  EepromLog log;
+  int lost = 0;
+
+  log.begin(ALARM_EEPROM_START, ALARM_EEPROM_LENGTH, sizeof(alarm));
+  for (uint8_t i = 0; i < config.alarms; i++) {
+    alarm a;
+
+    if (!log.read(i, &a) || a.time != expected[i] || a.id[1] - '0' != i) {
+      printf("alarm %u: not as last written\n", i);
+      lost++;
+    }
+  }
+  printf("%s\n", lost == 0 ? "table read back from the EEPROM" : "TABLE LOST CHANGES");
+  return lost == 0 ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/*
+   AdcAcquisition on [env:native], conversions triggered by the harness' timer interrupt on the
+   virtual clock: readings come at a fixed period whatever the loop does, each one is the sum of
+   4^bits conversions, a stalled loop loses the newest readings and counts them, and the PWM
+   output follows drive().
+
+     pio test -e native -f test_adc_acquisition -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <unity.h>
+#include "AdcAcquisition.h"
+
+// Wiring from main.cpp
+#define AUX_PIN 14
+#define AUX_OVERSAMPLE_BITS 2
+#define AUX_READING_RATE 10
+
+#define CONVERSION_RATE (AUX_READING_RATE << (2 * AUX_OVERSAMPLE_BITS))
+#define CONVERSION_MICROS (4UL * (250000UL / CONVERSION_RATE))    // whole Timer1 ticks of 4 us
+
+static AdcAcquisition acquisition(AUX_PIN);
+static unsigned long conversions;
+
+// Conversion n reads 400 + n % 7, so every sum is known
+static int countedSample(uint8_t) {
+  return 400 + conversions++ % 7;
+}
+
+static uint16_t expectedSum(unsigned long first, uint8_t samples) {
+  uint16_t sum = 0;
+
+  for (uint8_t i = 0; i < samples; i++)
+    sum += 400 + (first + i) % 7;
+  return sum;
+}
+
+static void drain(void) {
+  uint16_t sum;
+
+  while (acquisition.next(&sum))
+    ;
+}
+
+void setUp(void) {
+  conversions = 0;
+  nativeOnAnalogRead(countedSample);
+  acquisition.begin(AUX_OVERSAMPLE_BITS, CONVERSION_RATE);
+  drain();
+}
+
+void tearDown(void) {
+  acquisition.end();
+  drain();
+  nativeOnAnalogRead(NULL);
+}
+
+void test_sums_of_conversions(void) {
+  uint16_t sum;
+
+  TEST_ASSERT_EQUAL_UINT8(16, acquisition.samples());
+
+  // Nothing before the 16th conversion
+  nativeAdvance(15 * CONVERSION_MICROS);
+  TEST_ASSERT_FALSE(acquisition.next(&sum));
+  nativeAdvance(CONVERSION_MICROS);
+  TEST_ASSERT_TRUE(acquisition.next(&sum));
+  TEST_ASSERT_EQUAL_UINT16(expectedSum(0, 16), sum);
+
+  nativeAdvance(3 * 16 * CONVERSION_MICROS);
+  for (uint8_t i = 1; i <= 3; i++) {
+    TEST_ASSERT_TRUE(acquisition.next(&sum));
+    TEST_ASSERT_EQUAL_UINT16(expectedSum(i * 16, 16), sum);
+  }
+  TEST_ASSERT_FALSE(acquisition.next(&sum));
+  TEST_ASSERT_EQUAL_UINT32(64, conversions);
+}
+
+void test_fixed_period_whatever_the_loop(void) {
+  uint16_t sum;
+  unsigned long readings = 0;
+  unsigned long start = nativeMicros();
+
+  // Loops of 3 to 140 ms, the readings still come at AUX_READING_RATE
+  for (uint8_t i = 0; nativeMicros() - start < 10000000UL; i++) {
+    nativeAdvance((3 + (i * 37) % 138) * 1000UL);
+    while (acquisition.next(&sum))
+      readings++;
+  }
+  TEST_ASSERT_UINT_WITHIN(1, 10 * AUX_READING_RATE, readings);
+  TEST_ASSERT_EQUAL_UINT16(0, acquisition.dropped());
+}
+
+void test_stalled_loop_drops_newest(void) {
+  uint16_t sum;
+  uint16_t dropped = acquisition.dropped();
+
+  // Three readings more than the queue holds
+  nativeAdvance((ADC_ACQUISITION_QUEUE_SIZE + 3) * 16 * CONVERSION_MICROS);
+  TEST_ASSERT_EQUAL_UINT16(3, acquisition.dropped() - dropped);
+
+  // The oldest ones are kept
+  for (uint8_t i = 0; i < ADC_ACQUISITION_QUEUE_SIZE; i++) {
+    TEST_ASSERT_TRUE(acquisition.next(&sum));
+    TEST_ASSERT_EQUAL_UINT16(expectedSum(i * 16, 16), sum);
+  }
+  TEST_ASSERT_FALSE(acquisition.next(&sum));
+}
+
+void test_pwm_output(void) {
+  acquisition.drive(128);
+  TEST_ASSERT_EQUAL_UINT8(128, acquisition.duty());
+  TEST_ASSERT_EQUAL_INT(128, nativePinOutput(ADC_ACQUISITION_PWM_PIN));
+
+  // Low after end(), the duty comes back with begin()
+  acquisition.end();
+  TEST_ASSERT_EQUAL_INT(0, nativePinOutput(ADC_ACQUISITION_PWM_PIN));
+  acquisition.begin(AUX_OVERSAMPLE_BITS, CONVERSION_RATE);
+  TEST_ASSERT_EQUAL_INT(128, nativePinOutput(ADC_ACQUISITION_PWM_PIN));
+
+  acquisition.drive(0);
+  TEST_ASSERT_EQUAL_INT(0, nativePinOutput(ADC_ACQUISITION_PWM_PIN));
+}
+
+void test_push_after_end(void) {
+  uint16_t sum;
+
+  // A replay queues the captured sums itself, the timer is off
+  acquisition.end();
+  nativeAdvance(100 * CONVERSION_MICROS);
+  TEST_ASSERT_FALSE(acquisition.next(&sum));
+
+  acquisition.push(6400);
+  acquisition.push(6410);
+  TEST_ASSERT_TRUE(acquisition.next(&sum));
+  TEST_ASSERT_EQUAL_UINT16(6400, sum);
+  TEST_ASSERT_TRUE(acquisition.next(&sum));
+  TEST_ASSERT_EQUAL_UINT16(6410, sum);
+  TEST_ASSERT_EQUAL_UINT32(0, conversions);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_sums_of_conversions);
+  RUN_TEST(test_fixed_period_whatever_the_loop);
+  RUN_TEST(test_stalled_loop_drops_newest);
+  RUN_TEST(test_pwm_output);
+  RUN_TEST(test_push_after_end);
+  return UNITY_END();
+}
@@ -0,0 +1,123 @@
+/*
+   AdcSampler on [env:native]: read(bits) decimates 4^bits conversions to the known sum shifted
+   right by bits, at the conversion cost of the virtual clock, and the sketch's setup() has the aux
+   estimate ready (initStatus 100) within 10 ms of power-up instead of after a warm-up.
+
+     pio test -e native -f test_adc_sampler -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <stdio.h>
+#include <unity.h>
+#include "AdcSampler.h"
+
+// Wiring from main.cpp
+#define AUX_PIN 14
+
+#define CONVERSION_MICROS 112                   // NATIVE_ANALOG_READ_MICROS
+#define READY_MICROS 10000UL
+
+int initializeStatus();
+
+static const int *script;
+static uint8_t scriptLength;
+static uint8_t scriptNext;
+
+// Conversions from script, over and over
+static int scriptedSample(uint8_t) {
+  int value = script[scriptNext];
+
+  scriptNext = (scriptNext + 1) % scriptLength;
+  return value;
+}
+
+static void playScript(const int *values, uint8_t length) {
+  script = values;
+  scriptLength = length;
+  scriptNext = 0;
+  nativeOnAnalogRead(scriptedSample);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+  nativeOnAnalogRead(NULL);
+}
+
+void test_decimation_of_known_sum(void) {
+  static const int values[] = { 500, 503, 498, 501, 502, 499, 500, 505 };
+  AdcSampler sampler(AUX_PIN);
+
+  for (uint8_t bits = 0; bits <= ADC_SAMPLER_MAX_BITS; bits++) {
+    uint8_t samples = 1 << (2 * bits);
+    uint16_t sum = 0;
+
+    for (uint8_t i = 0; i < samples; i++)
+      sum += values[i % 8];
+
+    playScript(values, 8);
+    unsigned long start = nativeMicros();
+    uint16_t reading = sampler.read(bits);
+
+    TEST_ASSERT_EQUAL_UINT8(samples, sampler.samples());
+    TEST_ASSERT_EQUAL_UINT16(sum, sampler.sum());
+    TEST_ASSERT_EQUAL_UINT16(sum >> bits, reading);
+    TEST_ASSERT_EQUAL_UINT32((unsigned long)samples * CONVERSION_MICROS, nativeMicros() - start);
+  }
+}
+
+void test_dither_resolves_fractions(void) {
+  // Half an LSB of dither: a plain read can't tell, 2 extra bits read 500.5 as 2002 / 4
+  static const int values[] = { 500, 501 };
+  AdcSampler sampler(AUX_PIN);
+
+  playScript(values, 2);
+  TEST_ASSERT_EQUAL_UINT16(500, sampler.read(0));
+  playScript(values, 2);
+  TEST_ASSERT_EQUAL_UINT16(2002, sampler.read(2));
+  playScript(values, 2);
+  TEST_ASSERT_EQUAL_UINT16(4004, sampler.read(3));
+}
+
+void test_full_scale_fits(void) {
+  AdcSampler sampler(AUX_PIN);
+
+  nativeSetAnalog(AUX_PIN, 1023);
+  TEST_ASSERT_EQUAL_UINT16(1023 << ADC_SAMPLER_MAX_BITS, sampler.read(ADC_SAMPLER_MAX_BITS));
+  TEST_ASSERT_EQUAL_UINT16(64 * 1023U, sampler.sum());
+
+  // More bits than the sum has room for are capped
+  TEST_ASSERT_EQUAL_UINT16(1023 << ADC_SAMPLER_MAX_BITS, sampler.read(ADC_SAMPLER_MAX_BITS + 2));
+  TEST_ASSERT_EQUAL_UINT8(64, sampler.samples());
+}
+
+void test_setup_ready_within_10ms(void) {
+  char message[60];
+
+  nativeSerialQuiet(true);
+  nativeSetAnalog(AUX_PIN, 300);
+  unsigned long start = nativeMicros();
+  setup();
+  unsigned long elapsed = nativeMicros() - start;
+
+  snprintf(message, sizeof(message), "setup() took %lu us of virtual time", elapsed);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL_INT(100, initializeStatus());
+  TEST_ASSERT_LESS_OR_EQUAL(READY_MICROS, elapsed);
+
+  // And the first loop still has it
+  loop();
+  TEST_ASSERT_EQUAL_INT(100, initializeStatus());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_decimation_of_known_sum);
+  RUN_TEST(test_dither_resolves_fractions);
+  RUN_TEST(test_full_scale_fits);
+  // Last, setup() starts the timer-triggered conversions
+  RUN_TEST(test_setup_ready_within_10ms);
+  return UNITY_END();
+}
@@ -0,0 +1,141 @@
+/*
+   CAN receive path on [env:native]: the sketch's interrupt drains the simulated MCP2515 into
+   canRxQueue while frames arrive at the bus rate, and readPrimaryFuelLevel() consumes them once
+   a loop.
+
+     pio test -e native -f test_can_receive
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <unity.h>
+#include "CanFrameQueue.h"
+
+// Wiring from main.cpp
+#define CAN_RX_QUEUE_SIZE 8
+#define LOOP_MICROS 100000UL                    // amController.loop(100)
+
+// 131 bits of an extended frame with 8 data bytes and the interframe space at 250 kbps, no stuff bits
+#define FRAME_MICROS 524
+
+#define DASH_DISPLAY 0x98FEFC17UL               // extended, PGN 65276 from the instrument cluster
+#define OTHER_PGN    0x98F00400UL               // extended, engine controller, filtered out
+
+extern CanFrameQueue<CAN_RX_QUEUE_SIZE> canRxQueue;
+extern byte priFuelLevel;
+void readPrimaryFuelLevel();
+
+static const uint8_t dashData[8] = { 0xFF, 0x7F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };   // 50 %
+static const uint8_t otherData[8] = { 0 };
+
+// One frame after the other for micros, every dashEvery-th one the dash display, with a loop
+// consuming the queue every LOOP_MICROS; returns the dash frames the MCP2515 accepted
+static unsigned long busLoad(unsigned long micros, unsigned long dashEvery) {
+  unsigned long accepted = 0;
+  unsigned long frames = micros / FRAME_MICROS;
+  unsigned long nextLoop = nativeMicros() + LOOP_MICROS;
+
+  for (unsigned long i = 0; i < frames; i++) {
+    if (i % dashEvery == 0)
+      accepted += nativeCanInject(DASH_DISPLAY, 8, dashData);
+    else
+      TEST_ASSERT_FALSE(nativeCanInject(OTHER_PGN, 8, otherData));
+    nativeAdvance(FRAME_MICROS);
+
+    if (nativeMicros() >= nextLoop) {
+      readPrimaryFuelLevel();
+      nextLoop += LOOP_MICROS;
+    }
+  }
+  readPrimaryFuelLevel();
+  return accepted;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_queue_keeps_order_across_wrap(void) {
+  CanFrameQueue<4> queue;
+
+  // Past the 8 bit indices' wrap
+  for (unsigned long i = 0; i < 600; i++) {
+    canFrame *frame = queue.back();
+
+    TEST_ASSERT_NOT_NULL(frame);
+    frame->id = i;
+    queue.push();
+    TEST_ASSERT_EQUAL(i, queue.front()->id);
+    queue.pop();
+  }
+  TEST_ASSERT_NULL(queue.front());
+  TEST_ASSERT_EQUAL(600, queue.received());
+}
+
+void test_queue_full_counts_drops(void) {
+  CanFrameQueue<4> queue;
+
+  for (uint8_t i = 0; i < 4; i++) {
+    queue.back()->id = i;
+    queue.push();
+  }
+  TEST_ASSERT_NULL(queue.back());
+  queue.drop();
+  TEST_ASSERT_EQUAL(4, queue.count());
+  TEST_ASSERT_EQUAL(4, queue.highWater());
+  TEST_ASSERT_EQUAL(1, queue.dropped());
+  TEST_ASSERT_EQUAL(0, queue.front()->id);
+}
+
+void test_filtered_bus_at_full_load(void) {
+  uint16_t received = canRxQueue.received();
+  uint16_t dropped = canRxQueue.dropped();
+  unsigned long overflows = nativeCanOverflows();
+
+  // 10 s of a saturated bus, the dash display 1 in 100 frames (19 a second)
+  unsigned long accepted = busLoad(10000000UL, 100);
+
+  TEST_ASSERT_EQUAL(10000000UL / FRAME_MICROS / 100 + 1, accepted);
+  TEST_ASSERT_EQUAL(accepted, (uint16_t)(canRxQueue.received() - received));
+  TEST_ASSERT_EQUAL(dropped, canRxQueue.dropped());
+  TEST_ASSERT_EQUAL(overflows, nativeCanOverflows());
+  TEST_ASSERT_EQUAL(0, canRxQueue.count());
+  TEST_ASSERT_EQUAL(50, priFuelLevel);
+}
+
+void test_burst_overflows_queue_not_controller(void) {
+  uint16_t received = canRxQueue.received();
+  uint16_t dropped = canRxQueue.dropped();
+  unsigned long overflows = nativeCanOverflows();
+
+  // 2 * CAN_RX_QUEUE_SIZE back to back within one loop: the interrupt keeps the MCP2515's
+  // buffers empty, the frames past the queue are counted as lost
+  for (uint8_t i = 0; i < 2 * CAN_RX_QUEUE_SIZE; i++) {
+    TEST_ASSERT_TRUE(nativeCanInject(DASH_DISPLAY, 8, dashData));
+    nativeAdvance(FRAME_MICROS);
+  }
+
+  TEST_ASSERT_EQUAL(CAN_RX_QUEUE_SIZE, canRxQueue.count());
+  TEST_ASSERT_EQUAL(CAN_RX_QUEUE_SIZE, canRxQueue.highWater());
+  TEST_ASSERT_EQUAL(CAN_RX_QUEUE_SIZE, (uint16_t)(canRxQueue.received() - received));
+  TEST_ASSERT_EQUAL(CAN_RX_QUEUE_SIZE, (uint16_t)(canRxQueue.dropped() - dropped));
+  TEST_ASSERT_EQUAL(overflows, nativeCanOverflows());
+
+  // One loop catches up
+  readPrimaryFuelLevel();
+  TEST_ASSERT_EQUAL(0, canRxQueue.count());
+}
+
+int main(void) {
+  nativeSerialQuiet(true);
+  setup();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_queue_keeps_order_across_wrap);
+  RUN_TEST(test_queue_full_counts_drops);
+  RUN_TEST(test_filtered_bus_at_full_load);
+  RUN_TEST(test_burst_overflows_queue_not_controller);
+  return UNITY_END();
+}
@@ -0,0 +1,207 @@
+/*
+   EepromLog on [env:native], on the shim's EEPROM: values survive a restart, a slot with a bad
+   CRC falls back to the value before, current values are never written over, the writes move
+   around the region, and a write reads a bounded number of bytes whatever the region's size.
+
+     pio test -e native -f test_eeprom_log -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <avr/eeprom.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+#include "EepromLog.h"
+
+#define LOG_START 64
+#define LOG_SLOTS 16
+#define LOG_LENGTH (LOG_SLOTS * EEPROM_LOG_SLOT_SIZE(sizeof(logValue)))
+
+typedef struct {
+  uint32_t count;
+  uint32_t stamp;
+} logValue;
+
+static logValue value(uint32_t count) {
+  logValue v;
+
+  v.count = count;
+  v.stamp = count * 2654435761UL;
+  return v;
+}
+
+static void assertValue(EepromLog *log, uint8_t key, uint32_t count) {
+  logValue v;
+
+  TEST_ASSERT_TRUE(log->read(key, &v));
+  TEST_ASSERT_EQUAL_UINT32(count, v.count);
+  TEST_ASSERT_EQUAL_UINT32(value(count).stamp, v.stamp);
+}
+
+static void writeValue(EepromLog *log, uint8_t key, uint32_t count) {
+  logValue v = value(count);
+
+  TEST_ASSERT_TRUE(log->write(key, &v));
+}
+
+// Slot holding the value with this count, -1 if none
+static int slotOf(uint32_t count) {
+  for (int i = 0; i < LOG_SLOTS; i++) {
+    uint32_t stored = eeprom_read_dword((const uint32_t *)(LOG_START + i * EEPROM_LOG_SLOT_SIZE(sizeof(logValue)) + 5));
+    if (stored == count)
+      return i;
+  }
+  return -1;
+}
+
+void setUp(void) {
+  uint8_t erased[LOG_LENGTH];
+
+  memset(erased, 0xFF, sizeof(erased));
+  eeprom_update_block(erased, (void *)LOG_START, sizeof(erased));
+}
+
+void tearDown(void) {
+}
+
+void test_empty_region(void) {
+  EepromLog log;
+  logValue v;
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  TEST_ASSERT_EQUAL_UINT8(LOG_SLOTS, log.slots());
+  TEST_ASSERT_TRUE(log.empty());
+  TEST_ASSERT_FALSE(log.read(0, &v));
+
+  // Too short for two slots
+  TEST_ASSERT_FALSE(log.begin(LOG_START, EEPROM_LOG_SLOT_SIZE(sizeof(logValue)) * 2 - 1, sizeof(logValue)));
+
+  // Longer regions stop at the slots the log can track
+  TEST_ASSERT_TRUE(log.begin(0, E2END + 1, 1));
+  TEST_ASSERT_EQUAL_UINT8(EEPROM_LOG_MAX_SLOTS, log.slots());
+}
+
+void test_values_survive_restart(void) {
+  EepromLog log;
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  for (uint32_t i = 0; i < 100; i++)
+    writeValue(&log, i % 3, i);
+  TEST_ASSERT_FALSE(log.empty());
+
+  EepromLog restarted;
+  TEST_ASSERT_TRUE(restarted.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  assertValue(&restarted, 0, 99);
+  assertValue(&restarted, 1, 97);
+  assertValue(&restarted, 2, 98);
+
+  // Writing carries on after the newest slot and wins over the older ones
+  writeValue(&restarted, 1, 1000);
+  TEST_ASSERT_EQUAL_INT((slotOf(99) + 1) % LOG_SLOTS, slotOf(1000));
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  assertValue(&log, 1, 1000);
+}
+
+void test_bad_crc_falls_back(void) {
+  EepromLog log;
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  writeValue(&log, 7, 1);
+  writeValue(&log, 7, 2);
+  writeValue(&log, 8, 3);
+
+  // A write cut off by a power loss: the value is half there
+  int slot = slotOf(2);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, slot);
+  eeprom_write_byte((uint8_t *)(LOG_START + slot * EEPROM_LOG_SLOT_SIZE(sizeof(logValue)) + 9), 0x00);
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  assertValue(&log, 7, 1);
+  assertValue(&log, 8, 3);
+
+  // The broken slot is free again, the next write isn't held up by it
+  writeValue(&log, 7, 4);
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  assertValue(&log, 7, 4);
+}
+
+void test_current_values_kept(void) {
+  EepromLog log;
+  logValue v;
+
+  // Every slot but one holds a current value, the key written over and over takes turns with itself
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  for (uint8_t key = 1; key < LOG_SLOTS - 1; key++)
+    writeValue(&log, key, 1000 + key);
+  for (uint32_t i = 0; i < 50; i++)
+    writeValue(&log, 0, i);
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  assertValue(&log, 0, 49);
+  for (uint8_t key = 1; key < LOG_SLOTS - 1; key++)
+    assertValue(&log, key, 1000 + key);
+
+  // A new key takes the last spare; then nothing can be written without losing a current value
+  writeValue(&log, LOG_SLOTS - 1, 2000);
+  v = value(3000);
+  TEST_ASSERT_FALSE(log.write(0, &v));
+  assertValue(&log, 0, 49);
+}
+
+void test_wear_is_spread(void) {
+  EepromLog log;
+  unsigned long before[LOG_LENGTH];
+  unsigned long most = 0;
+
+  for (unsigned i = 0; i < LOG_LENGTH; i++)
+    before[i] = nativeEepromWrites(LOG_START + i);
+
+  // 4 keys, one of them changing all the time: 12 spare slots share its writes
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  for (uint8_t key = 1; key < 4; key++)
+    writeValue(&log, key, key);
+  for (uint32_t i = 0; i < 1200; i++)
+    writeValue(&log, 0, i);
+
+  for (unsigned i = 0; i < LOG_LENGTH; i++)
+    most = max(most, nativeEepromWrites(LOG_START + i) - before[i]);
+  TEST_ASSERT_LESS_OR_EQUAL(1200 / (LOG_SLOTS - 4) + 2, most);
+}
+
+void test_reads_per_write(void) {
+  EepromLog log;
+  unsigned long reads;
+  char message[80];
+
+  TEST_ASSERT_TRUE(log.begin(LOG_START, LOG_LENGTH, sizeof(logValue)));
+  for (uint8_t key = 0; key < 4; key++)
+    writeValue(&log, key, key);
+
+  // The current slots' key bytes, then the slot it updates
+  reads = nativeEepromReads();
+  for (uint32_t i = 0; i < 100; i++)
+    writeValue(&log, i % 4, 100 + i);
+  reads = nativeEepromReads() - reads;
+
+  snprintf(message, sizeof(message), "%lu bytes read per write over %d slots", reads / 100, LOG_SLOTS);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_LESS_OR_EQUAL(4 + EEPROM_LOG_SLOT_SIZE(sizeof(logValue)), reads / 100);
+
+  // A read only looks at the current slots
+  reads = nativeEepromReads();
+  assertValue(&log, 3, 199);
+  TEST_ASSERT_LESS_OR_EQUAL(4 + sizeof(logValue), nativeEepromReads() - reads);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_region);
+  RUN_TEST(test_values_survive_restart);
+  RUN_TEST(test_bad_crc_falls_back);
+  RUN_TEST(test_current_values_kept);
+  RUN_TEST(test_wear_is_spread);
+  RUN_TEST(test_reads_per_write);
+  return UNITY_END();
+}
@@ -0,0 +1,305 @@
+/*
+   FixedFilters on [env:native]: MovingAverage against the 100 sample re-sum readAuxFuelLevel()
+   used to do every loop, ExpMovingAverage against the exact average, SlidingMedian and
+   MedianMovingAverage against a sort of the window, and a microbenchmark of the averages.
+
+     pio test -e native -f test_filters -v
+*/
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+#include "FixedFilters.h"
+
+#define FUEL_SAMPLE_SIZE 100                    // the old average's window
+#define BENCH_SAMPLES    1000000UL
+
+static uint64_t randomState;
+
+static uint8_t randomLevel(void) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (randomState >> 33) % 101;
+}
+
+// The old average: every sample summed again, over as many as were seen up to the window
+class LegacyAverage {
+
+  public:
+    LegacyAverage() : _index(0), _count(0) {}
+
+    uint8_t add(uint8_t sample) {
+      _samples[_index++] = sample;
+      if (_index >= FUEL_SAMPLE_SIZE)
+        _index = 0;
+      if (++_count > FUEL_SAMPLE_SIZE)
+        _count = FUEL_SAMPLE_SIZE;
+
+      long sum = 0;
+      for (int i = 0; i < _count; i++)
+        sum += _samples[i];
+      return sum / _count;
+    }
+
+  private:
+    uint8_t _samples[FUEL_SAMPLE_SIZE];
+    int     _index;
+    int     _count;
+};
+
+// Median the way SlidingMedian defines it: the lower middle of the last samples, up to N of them
+template<uint8_t N>
+class SortedMedian {
+
+  public:
+    SortedMedian() : _index(0), _count(0) {}
+
+    uint8_t add(uint8_t sample) {
+      uint8_t sorted[N];
+
+      _samples[_index++] = sample;
+      if (_index >= N)
+        _index = 0;
+      if (_count < N)
+        _count++;
+
+      memcpy(sorted, _samples, _count);
+      qsort(sorted, _count, 1, compare);
+      return sorted[(_count - 1) / 2];
+    }
+
+  private:
+    static int compare(const void *a, const void *b) {
+      return *(const uint8_t *)a - *(const uint8_t *)b;
+    }
+
+    uint8_t _samples[N];
+    uint8_t _index;
+    uint8_t _count;
+};
+
+template<uint8_t N>
+static void medianMatchesSort(void) {
+  SlidingMedian<N> median;
+  SortedMedian<N> sorted;
+
+  // From the first sample, through the fill phase and many times around the window; few
+  // distinct levels so equal samples are common
+  for (unsigned long i = 0; i < 10000; i++) {
+    uint8_t sample = i % 3 == 0 ? randomLevel() / 10 : randomLevel();
+
+    TEST_ASSERT_EQUAL(sorted.add(sample), median.add(sample));
+    TEST_ASSERT_EQUAL(i < N ? i + 1 : N, median.count());
+  }
+}
+
+static double seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void setUp(void) {
+  randomState = 1;
+}
+
+void tearDown(void) {
+}
+
+void test_moving_average_matches_resum(void) {
+  MovingAverage<FUEL_SAMPLE_SIZE> average;
+  LegacyAverage legacy;
+
+  // From the first sample on, through the window filling up and many times around it
+  for (unsigned long i = 0; i < 10000; i++) {
+    uint8_t sample = randomLevel();
+
+    TEST_ASSERT_EQUAL(legacy.add(sample), average.add(sample));
+  }
+  TEST_ASSERT_TRUE(average.full());
+}
+
+void test_moving_average_extremes(void) {
+  MovingAverage<FUEL_SAMPLE_SIZE> average;
+
+  // 100 samples of 255 still fit the 16 bit sum
+  for (uint8_t i = 0; i < FUEL_SAMPLE_SIZE; i++)
+    average.add(255);
+  TEST_ASSERT_EQUAL(255, average.value());
+  for (uint8_t i = 0; i < FUEL_SAMPLE_SIZE - 1; i++)
+    average.add(0);
+  TEST_ASSERT_EQUAL(2, average.value());
+  average.add(0);
+  TEST_ASSERT_EQUAL(0, average.value());
+}
+
+void test_moving_average_fill(void) {
+  MovingAverage<FUEL_SAMPLE_SIZE> average;
+
+  TEST_ASSERT_EQUAL(0, average.value());
+  average.fill(40);
+  TEST_ASSERT_TRUE(average.full());
+  TEST_ASSERT_EQUAL(40, average.value());
+
+  // A step replaces the restored level sample by sample
+  for (uint8_t i = 1; i <= FUEL_SAMPLE_SIZE; i++)
+    TEST_ASSERT_EQUAL((40 * (FUEL_SAMPLE_SIZE - i) + 90 * i) / FUEL_SAMPLE_SIZE, average.add(90));
+}
+
+void test_exp_average_tracks_exact(void) {
+  ExpMovingAverage<4, uint16_t, uint32_t> average;
+  double exact = 0;
+
+  // The calibration reading filter's types, sender readings over the ADC range
+  for (unsigned long i = 0; i < 10000; i++) {
+    uint16_t sample = randomLevel() * 10;
+
+    average.add(sample);
+    exact = i == 0 ? sample : exact + (sample - exact) / 16;
+    TEST_ASSERT_INT_WITHIN(1, (int)(exact + 0.5), average.value());
+  }
+}
+
+void test_exp_average_settles(void) {
+  ExpMovingAverage<4> average;
+
+  average.fill(20);
+  for (uint8_t i = 0; i < 200; i++)
+    average.add(80);
+  TEST_ASSERT_EQUAL(80, average.value());
+  for (uint8_t i = 0; i < 200; i++)
+    average.add(20);
+  TEST_ASSERT_EQUAL(20, average.value());
+}
+
+void test_sliding_median_odd_window(void) {
+  medianMatchesSort<5>();
+  medianMatchesSort<3>();
+}
+
+void test_sliding_median_even_window(void) {
+  medianMatchesSort<4>();
+  medianMatchesSort<2>();
+}
+
+void test_sliding_median_fill(void) {
+  SlidingMedian<5> median;
+
+  TEST_ASSERT_EQUAL(0, median.value());
+  median.fill(40);
+  TEST_ASSERT_TRUE(median.full());
+  TEST_ASSERT_EQUAL(40, median.value());
+
+  // Two new samples are outvoted by the restored level, the third takes over
+  TEST_ASSERT_EQUAL(40, median.add(90));
+  TEST_ASSERT_EQUAL(40, median.add(90));
+  TEST_ASSERT_EQUAL(90, median.add(90));
+}
+
+void test_sliding_median_rejects_spikes(void) {
+  SlidingMedian<5> median;
+
+  // Up to two spikes of either sign in any five samples never show
+  median.fill(50);
+  for (unsigned long i = 0; i < 1000; i++) {
+    uint8_t sample = i % 5 == 0 ? 255 : i % 5 == 2 ? 0 : 50;
+
+    TEST_ASSERT_EQUAL(50, median.add(sample));
+  }
+}
+
+void test_median_moving_average_matches(void) {
+  MedianMovingAverage<5, FUEL_SAMPLE_SIZE> filter;
+  SortedMedian<5> median;
+  LegacyAverage average;
+
+  // The median of the raw samples through the old re-sum, from the first sample on
+  for (unsigned long i = 0; i < 10000; i++) {
+    uint8_t sample = randomLevel();
+
+    TEST_ASSERT_EQUAL(average.add(median.add(sample)), filter.add(sample));
+  }
+  TEST_ASSERT_TRUE(filter.full());
+}
+
+void test_median_moving_average_rejects_spikes(void) {
+  MedianMovingAverage<5, 10> filter;
+  MovingAverage<10> average;
+
+  // A slosh spike moves the plain average, not the filtered one
+  filter.fill(30);
+  average.fill(30);
+  for (uint8_t i = 0; i < 20; i++) {
+    uint8_t sample = i % 7 == 3 ? 100 : 30;
+
+    filter.add(sample);
+    average.add(sample);
+    TEST_ASSERT_EQUAL(30, filter.value());
+  }
+  TEST_ASSERT_GREATER_THAN(30, average.value());
+
+  // A real step comes through once the median has turned, then over the average's window
+  for (uint8_t i = 0; i < 5; i++)
+    filter.add(30);
+
+  uint8_t steps = 0;
+  while (filter.add(60) < 60)
+    steps++;
+  TEST_ASSERT_EQUAL(2 + 10 - 1, steps);
+}
+
+void test_average_benchmark(void) {
+  static uint8_t samples[BENCH_SAMPLES];
+  MovingAverage<FUEL_SAMPLE_SIZE> average;
+  ExpMovingAverage<4> exp;
+  LegacyAverage legacy;
+  unsigned long check[3] = { 0, 0, 0 };
+  char message[128];
+
+  for (unsigned long i = 0; i < BENCH_SAMPLES; i++)
+    samples[i] = randomLevel();
+
+  double start = seconds();
+  for (unsigned long i = 0; i < BENCH_SAMPLES; i++)
+    check[0] += legacy.add(samples[i]);
+  double resum = seconds() - start;
+
+  start = seconds();
+  for (unsigned long i = 0; i < BENCH_SAMPLES; i++)
+    check[1] += average.add(samples[i]);
+  double running = seconds() - start;
+
+  start = seconds();
+  for (unsigned long i = 0; i < BENCH_SAMPLES; i++)
+    check[2] += exp.add(samples[i]);
+  double ema = seconds() - start;
+
+  TEST_ASSERT_EQUAL(check[0], check[1]);
+
+  snprintf(message, sizeof(message), "re-sum %.1f ns, running sum %.1f ns (%.0fx), EMA %.1f ns per sample",
+           resum * 1e9 / BENCH_SAMPLES, running * 1e9 / BENCH_SAMPLES, resum / running, ema * 1e9 / BENCH_SAMPLES);
+  TEST_MESSAGE(message);
+
+  TEST_ASSERT_TRUE(running < resum);
+  TEST_ASSERT_TRUE(check[2] > 0);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_moving_average_matches_resum);
+  RUN_TEST(test_moving_average_extremes);
+  RUN_TEST(test_moving_average_fill);
+  RUN_TEST(test_exp_average_tracks_exact);
+  RUN_TEST(test_exp_average_settles);
+  RUN_TEST(test_sliding_median_odd_window);
+  RUN_TEST(test_sliding_median_even_window);
+  RUN_TEST(test_sliding_median_fill);
+  RUN_TEST(test_sliding_median_rejects_spikes);
+  RUN_TEST(test_median_moving_average_matches);
+  RUN_TEST(test_median_moving_average_rejects_spikes);
+  RUN_TEST(test_average_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,184 @@
+/*
+   FuelAnalytics on [env:native], fed the levels of a plant of the two tanks: consumption over the
+   windows whatever the loop time, a fill-up window left out, fuel transferred by a pump run counted
+   once through the noise of the aux level, the pump's duty cycle, the range at the consumption,
+   and the lifetime total carried over a power cycle.
+
+     pio test -e native -f test_fuel_analytics -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <math.h>
+#include <unity.h>
+#include "FuelAnalytics.h"
+
+// Wiring from main.cpp
+#define AUX_TANK_LITERS 19
+#define PRI_TANK_LITERS 36
+#define ANALYTICS_WINDOW 60
+
+#define WINDOW_MS (ANALYTICS_WINDOW * 1000UL)
+
+// The tanks in ml, the engine's burn and the pump's flow in ml/h
+typedef struct {
+  double primary;
+  double aux;
+  double burn;
+  double flow;
+  unsigned long ms;
+} plant;
+
+static FuelAnalytics *analytics;
+static plant tanks;
+static uint64_t randomState;
+
+static int32_t level(double ml, uint8_t liters) {
+  return (int32_t)lround(ml / (liters * 1000.0) * 100 * 65536);
+}
+
+// Uniform noise of +-amplitude ml
+static double noise(double amplitude) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((double)(randomState >> 11) / (1ULL << 53) * 2 - 1) * amplitude;
+}
+
+// ms of the tanks, the pump on or off, updated every loop ms with the aux level off by up to noisy
+static void run(unsigned long ms, bool pumping, unsigned long loop, double noisy) {
+  for (unsigned long end = tanks.ms + ms; tanks.ms < end; ) {
+    double moved = pumping ? tanks.flow * loop / 3600000.0 : 0;
+
+    tanks.ms += loop;
+    tanks.aux -= moved;
+    tanks.primary += moved - tanks.burn * loop / 3600000.0;
+    analytics->update(tanks.ms, level(tanks.primary, PRI_TANK_LITERS),
+                      level(tanks.aux + noise(noisy), AUX_TANK_LITERS), pumping);
+  }
+}
+
+void setUp(void) {
+  tanks.primary = 18000;
+  tanks.aux = 15000;
+  tanks.burn = 0;
+  tanks.flow = 60000;
+  tanks.ms = 0;
+  randomState = 1;
+
+  analytics = new FuelAnalytics(PRI_TANK_LITERS, AUX_TANK_LITERS, ANALYTICS_WINDOW);
+  run(100, false, 100, 0);
+}
+
+void tearDown(void) {
+  delete analytics;
+}
+
+void test_consumption_whatever_the_loop(void) {
+  const unsigned long loops[] = { 20, 100, 730 };
+
+  // 8 l/h out of the primary, some 8 windows averaged
+  for (uint8_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+    tearDown();
+    setUp();
+    tanks.burn = 8000;
+    run(60 * WINDOW_MS, false, loops[i], 0);
+    TEST_ASSERT_UINT_WITHIN(80, 8000, analytics->consumption());
+  }
+
+  // Half the burn, most of the way there after three times the average
+  tanks.burn = 4000;
+  run(24 * WINDOW_MS, false, 100, 0);
+  TEST_ASSERT_UINT_WITHIN(200, 4000, analytics->consumption());
+  TEST_ASSERT_EQUAL_UINT16(0, analytics->dutyCycle());
+}
+
+void test_fill_up_left_out(void) {
+  tanks.burn = 8000;
+  run(60 * WINDOW_MS, false, 100, 0);
+  uint16_t consumption = analytics->consumption();
+
+  // 15 l into the primary in the middle of a window
+  run(WINDOW_MS / 2, false, 100, 0);
+  tanks.primary += 15000;
+  run(WINDOW_MS / 2, false, 100, 0);
+  TEST_ASSERT_EQUAL_UINT16(consumption, analytics->consumption());
+
+  // The next window is counted again
+  run(WINDOW_MS, false, 100, 0);
+  TEST_ASSERT_UINT_WITHIN(80, 8000, analytics->consumption());
+}
+
+void test_transfer_counted_once(void) {
+  // A 3 min run of 60 l/h, the aux level 30 ml off either way
+  run(WINDOW_MS / 3, false, 100, 30);
+  run(3 * WINDOW_MS, true, 100, 30);
+  run(WINDOW_MS, false, 100, 30);
+
+  TEST_ASSERT_UINT_WITHIN(60, 3000, analytics->sessionTransferred());
+  TEST_ASSERT_EQUAL_UINT32(analytics->sessionTransferred(), analytics->lifetimeTransferred());
+
+  // Noise with the pump off adds nothing
+  uint32_t transferred = analytics->sessionTransferred();
+  run(10 * WINDOW_MS, false, 100, 30);
+  TEST_ASSERT_EQUAL_UINT32(transferred, analytics->sessionTransferred());
+}
+
+void test_duty_cycle(void) {
+  // 15 s of every window
+  for (uint8_t i = 0; i < 60; i++) {
+    run(WINDOW_MS / 4, true, 100, 0);
+    run(3 * WINDOW_MS / 4, false, 100, 0);
+  }
+  TEST_ASSERT_UINT_WITHIN(65536 / 100, 65536 / 4, analytics->dutyCycle());
+
+  // Fuel only moved between the tanks, nothing was used
+  TEST_ASSERT_UINT_WITHIN(10, 0, analytics->consumption());
+
+  // Each run counted
+  TEST_ASSERT_UINT_WITHIN(60 * 5, 60 * 250, analytics->sessionTransferred());
+}
+
+void test_range(void) {
+  // Idle: no range
+  run(20 * WINDOW_MS, false, 100, 0);
+  TEST_ASSERT_EQUAL_UINT16(ANALYTICS_NO_RANGE, analytics->range());
+
+  // 33 l at 8 l/h, less the fuel used to get there
+  tanks.burn = 8000;
+  run(60 * WINDOW_MS, false, 100, 0);
+  uint16_t expected = (tanks.primary + tanks.aux) * 60 / 8000;
+  TEST_ASSERT_UINT_WITHIN(expected / 50, expected, analytics->range());
+}
+
+void test_lifetime_restored(void) {
+  run(WINDOW_MS, true, 100, 0);
+  run(100, false, 100, 0);
+  uint32_t lifetime = analytics->lifetimeTransferred();
+  uint16_t consumption = analytics->consumption();
+  uint16_t dutyCycle = analytics->dutyCycle();
+
+  // Power cycle: the lifetime total goes on, the session starts over
+  tearDown();
+  analytics = new FuelAnalytics(PRI_TANK_LITERS, AUX_TANK_LITERS, ANALYTICS_WINDOW);
+  analytics->restore(lifetime, consumption, dutyCycle);
+  TEST_ASSERT_EQUAL_UINT32(lifetime, analytics->lifetimeTransferred());
+  TEST_ASSERT_EQUAL_UINT16(consumption, analytics->consumption());
+  TEST_ASSERT_EQUAL_UINT16(dutyCycle, analytics->dutyCycle());
+  TEST_ASSERT_EQUAL_UINT32(0, analytics->sessionTransferred());
+
+  run(100, false, 100, 0);
+  run(WINDOW_MS, true, 100, 0);
+  run(100, false, 100, 0);
+  TEST_ASSERT_UINT_WITHIN(5, 1000, analytics->sessionTransferred());
+  TEST_ASSERT_EQUAL_UINT32(lifetime + analytics->sessionTransferred(), analytics->lifetimeTransferred());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_consumption_whatever_the_loop);
+  RUN_TEST(test_fill_up_left_out);
+  RUN_TEST(test_transfer_counted_once);
+  RUN_TEST(test_duty_cycle);
+  RUN_TEST(test_range);
+  RUN_TEST(test_lifetime_restored);
+  return UNITY_END();
+}
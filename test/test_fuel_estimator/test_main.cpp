@@ -0,0 +1,242 @@
+/*
+   FuelEstimator on [env:native], against a plant of the two tanks: the compiled gains against
+   Kalata's formulas, no lag on a steady drain, rate changes that undo each other exactly, the
+   pump's feed-forward, the transfer rate learned from the readings of a run, and the engine's
+   consumption through a transfer.
+
+     pio test -e native -f test_fuel_estimator -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+#include "FuelEstimator.h"
+
+// Wiring from main.cpp
+#define AUX_TANK_LITERS 19
+#define PRI_TANK_LITERS 36
+#define PUMP_FLOW_LPH 60
+#define AUX_TRACKING_INDEX 0.000002
+#define AUX_MEASURED_INDEX 0.000002
+#define PRI_TRACKING_INDEX 0.0002
+#define AUX_PERIOD 100                          // [ms] 1000 / AUX_READING_RATE
+#define PRI_LEVEL_PERIOD 1000
+
+#define TRANSFER_PERCENT (PUMP_FLOW_LPH * 100.0 / AUX_TANK_LITERS)     // [%/h] of the aux tank
+#define BURN_PERCENT (8 * 100.0 / PRI_TANK_LITERS)                     // [%/h] of the primary, 8 l/h
+#define RATIO (AUX_TANK_LITERS * 256 / PRI_TANK_LITERS)
+
+// The tanks, in % and %/h
+typedef struct {
+  double aux;
+  double primary;
+  double transfer;                              // of the pump at full flow, out of the aux tank
+  double burn;
+  unsigned long ms;
+} plant;
+
+static FuelEstimator *estimator;
+static plant tanks;
+static uint64_t randomState;
+
+static FuelEstimator *newEstimator(void) {
+  return new FuelEstimator(estimatorGainsOf(AUX_TRACKING_INDEX, AUX_PERIOD),
+                           estimatorGainsOf(AUX_MEASURED_INDEX, AUX_PERIOD),
+                           estimatorGainsOf(PRI_TRACKING_INDEX, PRI_LEVEL_PERIOD),
+                           ESTIMATOR_RATE(TRANSFER_PERCENT), RATIO);
+}
+
+static int16_t reading(double percent) {
+  return (int16_t)lround(percent * 256);
+}
+
+static double percent(int32_t estimate) {
+  return estimate / 65536.0;
+}
+
+// Uniform noise of +-amplitude %
+static double noise(double amplitude) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((double)(randomState >> 11) / (1ULL << 53) * 2 - 1) * amplitude;
+}
+
+// ms of the tanks at flow, the aux readings every AUX_PERIOD and the dash every PRI_LEVEL_PERIOD
+static void run(unsigned long ms, uint16_t flow, double auxNoise) {
+  estimator->pump(tanks.ms, flow);
+
+  for (unsigned long end = tanks.ms + ms; tanks.ms < end; ) {
+    double moved = tanks.transfer * flow / ESTIMATOR_FULL_FLOW * AUX_PERIOD / 3600000.0;
+
+    tanks.ms += AUX_PERIOD;
+    tanks.aux -= moved;
+    tanks.primary += moved * AUX_TANK_LITERS / PRI_TANK_LITERS - tanks.burn * AUX_PERIOD / 3600000.0;
+
+    estimator->aux(reading(tanks.aux + noise(auxNoise)));
+    if (tanks.ms % PRI_LEVEL_PERIOD == 0)
+      estimator->primary(tanks.ms, reading(tanks.primary));
+    estimator->pump(tanks.ms, flow);
+  }
+}
+
+void setUp(void) {
+  tanks.aux = 90;
+  tanks.primary = 50;
+  tanks.transfer = TRANSFER_PERCENT;
+  tanks.burn = 0;
+  tanks.ms = 0;
+  randomState = 1;
+
+  estimator = newEstimator();
+  TEST_ASSERT_FALSE(estimator->ready());
+  estimator->primeAux(reading(tanks.aux));
+  estimator->primary(0, reading(tanks.primary));
+  TEST_ASSERT_TRUE(estimator->ready());
+}
+
+void tearDown(void) {
+  delete estimator;
+}
+
+void test_gains(void) {
+  const double lambdas[] = { AUX_TRACKING_INDEX, PRI_TRACKING_INDEX, 0.000001, 0.001 };
+
+  for (uint8_t i = 0; i < sizeof(lambdas) / sizeof(lambdas[0]); i++) {
+    double lambda = lambdas[i];
+    double r = (4 + lambda - sqrt(8 * lambda + lambda * lambda)) / 4;
+    double alpha = 1 - r * r;
+    double beta = 2 * (2 - alpha) - 4 * sqrt(1 - alpha);
+    estimatorGains gains = estimatorGainsOf(lambda, AUX_PERIOD);
+
+    TEST_ASSERT_TRUE(estimatorGainsFit(lambda));
+    TEST_ASSERT_INT_WITHIN(1, lround(alpha * 65536), gains.alpha);
+    TEST_ASSERT_INT_WITHIN(1, lround(beta * 16777216), gains.beta);
+  }
+
+  // The aux beta that rounds to nothing in Q16 is there in Q24
+  TEST_ASSERT_EQUAL_UINT16(0, lround(estimatorBeta(AUX_TRACKING_INDEX) * 65536));
+  TEST_ASSERT_GREATER_THAN(0, estimatorGainsOf(AUX_TRACKING_INDEX, AUX_PERIOD).beta);
+
+  // Too loose a tracking index saturates beta, too tight rounds it to nothing
+  TEST_ASSERT_FALSE(estimatorGainsFit(0.01));
+  TEST_ASSERT_FALSE(estimatorGainsFit(1e-12));
+}
+
+void test_no_lag_on_steady_drain(void) {
+  TankEstimator tank(estimatorGainsOf(PRI_TRACKING_INDEX, PRI_LEVEL_PERIOD));
+  double level = 80;
+
+  // An hour of 10 %/h, exact readings
+  tank.reset(reading(level));
+  for (int i = 0; i < 3600; i++) {
+    level -= 10.0 / 3600;
+    tank.update(PRI_LEVEL_PERIOD, reading(level));
+  }
+
+  // A 60 s moving average would be 5 / 60 % behind
+  TEST_ASSERT_FLOAT_WITHIN(0.01, level, percent(tank.level()));
+  TEST_ASSERT_INT_WITHIN(ESTIMATOR_RATE(0.2), -ESTIMATOR_RATE(10), tank.rate());
+}
+
+void test_adjust_round_trip(void) {
+  TankEstimator tank(estimatorGainsOf(AUX_TRACKING_INDEX, AUX_PERIOD));
+  const int32_t rates[] = { ESTIMATOR_RATE(TRANSFER_PERCENT), 1, 7, ESTIMATOR_RATE(0.1), ESTIMATOR_RATE(1000) };
+
+  tank.reset(reading(50));
+  tank.adjust(0, -ESTIMATOR_RATE(3));
+  int32_t rate = tank.rate();
+
+  // Any changes that end where they started leave the rate as it was
+  for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    tank.adjust(0, -rates[i]);
+    tank.adjust(-rates[i], -rates[i] / 3);
+    tank.adjust(-rates[i] / 3, 0);
+    TEST_ASSERT_EQUAL_INT32(rate, tank.rate());
+  }
+}
+
+void test_pump_feed_forward(void) {
+  char message[80];
+
+  // Settled with the pump off
+  run(60000, 0, 0.5);
+
+  // The step is taken when the pump starts, not found in the readings
+  estimator->pump(tanks.ms, ESTIMATOR_FULL_FLOW);
+  TEST_ASSERT_INT_WITHIN(ESTIMATOR_RATE(1), ESTIMATOR_RATE(TRANSFER_PERCENT), estimator->auxDrain());
+
+  run(10000, ESTIMATOR_FULL_FLOW, 0.5);
+  TEST_ASSERT_FLOAT_WITHIN(0.2, tanks.aux, percent(estimator->auxEstimate()));
+  TEST_ASSERT_FLOAT_WITHIN(0.2, tanks.primary, percent(estimator->primaryEstimate()));
+
+  // The filter without the pump finds the drain from the readings alone, slowly
+  run(290000, ESTIMATOR_FULL_FLOW, 0.5);
+  snprintf(message, sizeof(message), "measured drain after 5 min %.1f %%/h of %.1f",
+           estimator->measuredDrain() * 3600.0 / 65536, TRANSFER_PERCENT);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_INT_WITHIN(ESTIMATOR_RATE(TRANSFER_PERCENT) / 10, ESTIMATOR_RATE(TRANSFER_PERCENT), estimator->measuredDrain());
+
+  // Half flow, half the step
+  run(1000, ESTIMATOR_FULL_FLOW / 2, 0);
+  TEST_ASSERT_INT_WITHIN(ESTIMATOR_RATE(TRANSFER_PERCENT) / 10, ESTIMATOR_RATE(TRANSFER_PERCENT) / 2, estimator->auxDrain());
+
+  // Taken back when it stops
+  run(1000, 0, 0);
+  TEST_ASSERT_INT_WITHIN(ESTIMATOR_RATE(TRANSFER_PERCENT) / 20, 0, estimator->auxDrain());
+}
+
+void test_transfer_rate_learned(void) {
+  int32_t nominal = estimator->transferRate();
+
+  // A pump 20 % stronger than its rating; a run too short to fit leaves the rate
+  tanks.transfer = TRANSFER_PERCENT * 1.2;
+  run(30000, ESTIMATOR_FULL_FLOW, 0.5);
+  run(10000, 0, 0.5);
+  TEST_ASSERT_EQUAL_INT32(nominal, estimator->transferRate());
+
+  // Each long enough run averages its fit with the rate so far
+  run(90000, ESTIMATOR_FULL_FLOW, 0.5);
+  run(10000, 0, 0.5);
+  TEST_ASSERT_INT_WITHIN(nominal / 50, nominal * 1.1, estimator->transferRate());
+
+  for (uint8_t i = 0; i < 6; i++) {
+    run(90000, ESTIMATOR_FULL_FLOW, 0.5);
+    run(10000, 0, 0.5);
+  }
+  TEST_ASSERT_INT_WITHIN(nominal / 50, nominal * 1.2, estimator->transferRate());
+
+  // Never past twice the nominal rate, whatever the sender says
+  tanks.transfer = TRANSFER_PERCENT * 5;
+  tanks.aux = 100;
+  for (uint8_t i = 0; i < 6; i++) {
+    run(70000, ESTIMATOR_FULL_FLOW, 0);
+    tanks.aux = 100;
+    run(10000, 0, 0);
+  }
+  TEST_ASSERT_EQUAL_INT32(nominal * 2, estimator->transferRate());
+}
+
+void test_burn_rate_through_transfer(void) {
+  int32_t burn = ESTIMATOR_RATE(BURN_PERCENT);
+
+  tanks.burn = BURN_PERCENT;
+  run(1800000UL, 0, 0.5);
+  TEST_ASSERT_INT_WITHIN(burn / 10, burn, estimator->burnRate());
+
+  // The primary rises while the pump runs, its consumption doesn't change
+  run(120000, ESTIMATOR_FULL_FLOW, 0.5);
+  TEST_ASSERT_INT_WITHIN(burn / 4, burn, estimator->burnRate());
+  TEST_ASSERT_FLOAT_WITHIN(0.3, tanks.primary, percent(estimator->primaryEstimate()));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_gains);
+  RUN_TEST(test_no_lag_on_steady_drain);
+  RUN_TEST(test_adjust_round_trip);
+  RUN_TEST(test_pump_feed_forward);
+  RUN_TEST(test_transfer_rate_learned);
+  RUN_TEST(test_burn_rate_through_transfer);
+  return UNITY_END();
+}
@@ -0,0 +1,376 @@
+/*
+   HM_10_BLE on [env:native] against a stand-in for the module: the time begin() takes to
+   configure it, with a slow, silent or refusing module and at any loop() rate, and a soak test of
+   a few million messages, overlong ones and AT queries between them through messageHandler(),
+   with the heap flat from the first message to the last.
+
+     pio test -e native -f test_hm10_ble -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <malloc.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+#include "HM_10_BLE.h"
+
+#define BLE_RX_PIN 6
+#define BLE_TX_PIN 5
+
+#define FAKE_LATENCY_MS   10                    // from the last byte of a command to its answer
+#define FAKE_RESTART_MS   500                   // deaf after OK+RESET
+#define FAKE_SETTINGS     4
+
+#define BYTE_MICROS       (10000000UL / HM_10_BLE_BAUDRATE)
+
+#define SOAK_MESSAGES     2000000UL
+#define SOAK_BATCH        100                   // messages on the wire at a time
+#define SOAK_OVERLONG     97                    // every so many messages is too long
+#define SOAK_QUERY        1009                  // every so many messages an AT query goes in between
+
+// Heap allocations through new, malloc is seen in mallinfo2()
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+
+  void *p = malloc(size);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+// The module: takes a command once the line has gone quiet, as the HM-10 has no line ending,
+// and answers like the real one or not at all for commands it doesn't know
+static const char *const fakeKnown[FAKE_SETTINGS] = { "TYPE", "NAME", "PASS", "ROLE" };
+
+static char fakeSettings[FAKE_SETTINGS][16];
+static char fakeCommand[64];
+static uint8_t fakeLength;
+static unsigned long fakeLastByte;
+static char fakeAnswer[sizeof(fakeCommand) + 8];
+static unsigned long fakeAnswerAt;
+static unsigned long fakeDeafUntil;
+static unsigned long fakeLost;                  // commands sent while it restarts
+static unsigned long fakeLatency;
+static bool fakeSilent;
+static bool fakeRefuses;
+
+static unsigned long nowMillis(void) {
+  return nativeMicros() / 1000;
+}
+
+static void fakeReceive(uint8_t byte) {
+  if (fakeLength < sizeof(fakeCommand) - 1) {
+    fakeCommand[fakeLength++] = byte;
+    fakeCommand[fakeLength] = '\0';
+  }
+  fakeLastByte = nowMillis();
+}
+
+static void fakeAnswerCommand(const char *command) {
+  fakeAnswer[0] = '\0';
+
+  if (nowMillis() < fakeDeafUntil) {
+    fakeLost++;
+    return;
+  }
+  if (fakeSilent)
+    return;
+  if (fakeRefuses) {
+    strcpy(fakeAnswer, "ERROR");
+  } else if (strcmp(command, "AT") == 0) {
+    strcpy(fakeAnswer, "OK");
+  } else if (strcmp(command, "AT+RESET") == 0) {
+    strcpy(fakeAnswer, "OK+RESET");
+    fakeDeafUntil = nowMillis() + fakeLatency + FAKE_RESTART_MS;
+  } else if (strncmp(command, "AT+", 3) == 0) {
+    for (uint8_t i = 0; i < FAKE_SETTINGS; i++) {
+      size_t length = strlen(fakeKnown[i]);
+
+      if (strncmp(command + 3, fakeKnown[i], length) != 0)
+        continue;
+      const char *param = command + 3 + length;
+      if (strcmp(param, "?") == 0) {
+        snprintf(fakeAnswer, sizeof(fakeAnswer), "OK+Get:%s", fakeSettings[i]);
+      } else {
+        snprintf(fakeSettings[i], sizeof(fakeSettings[i]), "%s", param);
+        snprintf(fakeAnswer, sizeof(fakeAnswer), "OK+Set:%s", param);
+      }
+    }
+  }
+  if (fakeAnswer[0] != '\0')
+    fakeAnswerAt = nowMillis() + fakeLatency;
+}
+
+static void fakeStep(void) {
+  if (fakeLength > 0 && nowMillis() - fakeLastByte >= 2) {
+    fakeAnswerCommand(fakeCommand);
+    fakeLength = 0;
+  }
+  if (fakeAnswer[0] != '\0' && nowMillis() >= fakeAnswerAt) {
+    nativeSerialInject((const uint8_t *)fakeAnswer, strlen(fakeAnswer));
+    fakeAnswer[0] = '\0';
+  }
+}
+
+static void fakeReset(void) {
+  memset(fakeSettings, 0, sizeof(fakeSettings));
+  fakeLength = 0;
+  fakeAnswer[0] = '\0';
+  fakeDeafUntil = 0;
+  fakeLost = 0;
+  fakeLatency = FAKE_LATENCY_MS;
+  fakeSilent = false;
+  fakeRefuses = false;
+  nativeOnSerialTx(fakeReceive);
+}
+
+// Counts the messages and checks they come in order, "m<n>" as the soak sends them
+class CountingBLE : public HM_10_BLE {
+  public:
+    CountingBLE() : HM_10_BLE(BLE_RX_PIN, BLE_TX_PIN), received(0), outOfOrder(0), next(0) {}
+
+    void processMessage(const char *msg) override {
+      unsigned long n = strtoul(msg + 1, NULL, 10);
+
+      if (msg[0] != 'm' || n < next)
+        outOfOrder++;
+      next = n + 1;
+      received++;
+    }
+
+    unsigned long received;
+    unsigned long outOfOrder;
+
+  private:
+    unsigned long next;
+};
+
+static unsigned long answered;
+static unsigned long answeredAt;
+static unsigned long configured;
+static bool configuredOk;
+
+static void countAnswer(const char *, bool ok, const char *) {
+  if (ok)
+    answered++;
+  answeredAt = nowMillis();
+}
+
+static void onConfigured(const char *, bool ok, const char *) {
+  configured++;
+  configuredOk = ok;
+}
+
+// Runs loop() as the sketch would for ms, one call every period ms, the module never waits for it
+static void run(HM_10_BLE &ble, unsigned long ms, unsigned long period = 1) {
+  for (unsigned long t = 0; t < ms; t++) {
+    if (t % period == 0) {
+      while (ble.available() > 0)
+        ble.messageHandler();
+      ble.messageHandler();
+    }
+    fakeStep();
+    nativeAdvance(1000);
+  }
+}
+
+// begin(), and a query as soon as it's done, the time to the configured callback
+static unsigned long configure(unsigned long period = 1) {
+  HM_10_BLE ble(BLE_RX_PIN, BLE_TX_PIN);
+
+  // The four commands fill the queue
+  ble.begin("FUEL", "123456", '#', &onConfigured);
+  for (unsigned long t = 0; t < 6000 && configured == 0; t += period)
+    run(ble, period, period);
+  ble.atCommand("TYPE?", &countAnswer);
+  run(ble, 1000, period);
+
+  TEST_ASSERT_EQUAL(1, configured);
+  return ble.configurationTime();
+}
+
+static size_t heapInUse(void) {
+  return mallinfo2().uordblks;
+}
+
+void setUp(void) {
+  fakeReset();
+  answered = 0;
+  answeredAt = 0;
+  configured = 0;
+  configuredOk = false;
+}
+
+void tearDown(void) {
+  nativeOnSerialTx(NULL);
+}
+
+void test_configuration_time(void) {
+  char message[160];
+  unsigned long start = nowMillis();
+  unsigned long time = configure();
+
+  // Each command is its bytes out, the module's gap and latency, and the answer's bytes back
+  TEST_ASSERT_TRUE(configuredOk);
+  TEST_ASSERT_EQUAL_STRING("3", fakeSettings[0]);
+  TEST_ASSERT_EQUAL_STRING("FUEL", fakeSettings[1]);
+  TEST_ASSERT_EQUAL_STRING("123456", fakeSettings[2]);
+  TEST_ASSERT_TRUE(time >= 4 * FAKE_LATENCY_MS);
+  TEST_ASSERT_TRUE(time < 4 * (FAKE_LATENCY_MS + 30));
+
+  // Nothing is sent into the restart, the query after it goes through once the module is back
+  TEST_ASSERT_EQUAL(0, fakeLost);
+  TEST_ASSERT_EQUAL(1, answered);
+  TEST_ASSERT_TRUE(answeredAt - start >= time + HM_10_BLE_RESET_SETTLE);
+
+  snprintf(message, sizeof(message), "TYPE, NAME, PASS and RESET configured in %lu ms with a %d ms module, the next command answered at %lu ms",
+           time, FAKE_LATENCY_MS, answeredAt - start);
+  TEST_MESSAGE(message);
+}
+
+void test_configuration_follows_the_module(void) {
+  char message[160];
+  unsigned long fast;
+  unsigned long slow;
+
+  fakeLatency = 2;
+  fast = configure();
+  setUp();
+  fakeLatency = 100;
+  slow = configure();
+
+  // Only the module's latency is added, four times
+  TEST_ASSERT_INT_WITHIN(8, 4 * 98, slow - fast);
+
+  snprintf(message, sizeof(message), "configured in %lu ms with a 2 ms module, %lu ms with a 100 ms module", fast, slow);
+  TEST_MESSAGE(message);
+}
+
+void test_configuration_any_loop_rate(void) {
+  char message[160];
+  unsigned long every1 = configure(1);
+
+  setUp();
+  unsigned long every10 = configure(10);
+
+  // An answer is seen at the next call after it arrives, at most a period later for each command
+  TEST_ASSERT_TRUE(configuredOk);
+  TEST_ASSERT_TRUE(every10 >= every1);
+  TEST_ASSERT_TRUE(every10 - every1 <= 4 * 10);
+
+  snprintf(message, sizeof(message), "configured in %lu ms with loop() every 1 ms, %lu ms every 10 ms", every1, every10);
+  TEST_MESSAGE(message);
+}
+
+void test_silent_module_times_out(void) {
+  fakeSilent = true;
+
+  unsigned long time = configure();
+
+  // Every command waits its whole timeout, the sequence still ends
+  TEST_ASSERT_FALSE(configuredOk);
+  TEST_ASSERT_INT_WITHIN(50, 4 * HM_10_BLE_AT_TIMEOUT, time);
+  TEST_ASSERT_EQUAL(0, answered);
+}
+
+void test_refusing_module_fails_fast(void) {
+  fakeRefuses = true;
+
+  unsigned long time = configure();
+
+  // A wrong answer fails once the line goes quiet, not at the timeout
+  TEST_ASSERT_FALSE(configuredOk);
+  TEST_ASSERT_TRUE(time < 4 * (FAKE_LATENCY_MS + HM_10_BLE_AT_QUIET + 30));
+  TEST_ASSERT_EQUAL(0, answered);
+}
+
+void test_soak_memory_flat(void) {
+  CountingBLE ble;
+  char message[160];
+  char batch[SOAK_BATCH * 48];
+  unsigned long overlong = 0;
+  unsigned long queries = 0;
+  unsigned long sent = 0;
+
+  ble.begin("SOAK", "123456", '#');
+  run(ble, 2000);
+  TEST_ASSERT_GREATER_THAN(0, ble.configurationTime());
+
+  // Everything from here on must come out of the object's own buffers
+  unsigned long newBefore = allocations;
+  size_t heapBefore = heapInUse();
+  unsigned long start = nativeMicros();
+
+  while (sent < SOAK_MESSAGES) {
+    size_t length = 0;
+
+    for (uint8_t i = 0; i < SOAK_BATCH && sent < SOAK_MESSAGES; i++, sent++) {
+      if (sent % SOAK_OVERLONG == 0) {
+        length += snprintf(batch + length, sizeof(batch) - length, "x%040lu#", sent);
+        overlong++;
+      } else {
+        length += snprintf(batch + length, sizeof(batch) - length, "m%lu#", sent);
+      }
+    }
+    nativeSerialInject((const uint8_t *)batch, length);
+
+    // Drained every 16 byte times, well before the 64 byte receive buffer fills
+    unsigned long end = nativeMicros() + (length + 1) * BYTE_MICROS;
+    while (nativeMicros() < end) {
+      nativeAdvance(BYTE_MICROS * 16);
+      while (ble.available() > 0)
+        ble.messageHandler();
+    }
+
+    // An AT query between two messages, the module answers while nothing else is sent
+    if (sent / SOAK_QUERY != (sent - SOAK_BATCH) / SOAK_QUERY) {
+      ble.atCommand("NAME?", &countAnswer);
+      run(ble, 100);
+      queries++;
+    }
+  }
+
+  size_t heapAfter = heapInUse();
+  unsigned long newAfter = allocations;
+
+  snprintf(message, sizeof(message), "%lu messages (%lu overlong) and %lu AT queries in %.1f h of 9600 baud, heap %zu -> %zu bytes, %lu allocations",
+           sent, overlong, queries, (nativeMicros() - start) / 3.6e9, heapBefore, heapAfter, newAfter - newBefore);
+  TEST_MESSAGE(message);
+  snprintf(message, sizeof(message), "HM_10_BLE is %u bytes on the host, fixed", (unsigned)sizeof(HM_10_BLE));
+  TEST_MESSAGE(message);
+
+  TEST_ASSERT_EQUAL(0, newAfter - newBefore);
+  TEST_ASSERT_EQUAL(heapBefore, heapAfter);
+  TEST_ASSERT_EQUAL(sent - overlong, ble.received);
+  TEST_ASSERT_EQUAL(0, ble.outOfOrder);
+  TEST_ASSERT_EQUAL(overlong, ble.messageOverflows());
+  TEST_ASSERT_EQUAL(queries, answered);
+  TEST_ASSERT_EQUAL(0, fakeLost);
+  TEST_ASSERT_EQUAL(0, ble.atOverflows());
+}
+
+int main(void) {
+  nativeSerialQuiet(true);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_configuration_time);
+  RUN_TEST(test_configuration_follows_the_module);
+  RUN_TEST(test_configuration_any_loop_rate);
+  RUN_TEST(test_silent_module_times_out);
+  RUN_TEST(test_refusing_module_fails_fast);
+  RUN_TEST(test_soak_memory_flat);
+  return UNITY_END();
+}
@@ -0,0 +1,256 @@
+/*
+   J1939 acceptance filters and PGN dispatch on [env:native], with a benchmark of the dispatch
+   against the sprintf and switch every frame went through before, over a bus mix.
+
+     pio test -e native -f test_j1939 -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <mcp_can.h>
+#include <stdio.h>
+#include <time.h>
+#include <unity.h>
+#include "J1939.h"
+
+#define PGN_DASH_DISPLAY        0xFEFCUL
+#define SA_INSTRUMENT_CLUSTER   0x17
+#define PGN_REQUEST             0xEA00UL        // PDU1, the destination is not part of the PGN
+#define SA_ENGINE               0x00
+
+#define BENCH_FRAMES            200000UL
+
+static unsigned long dashFrames;
+static unsigned long requests;
+static byte dashLevel;
+
+static void decodeDash(const canFrame &frame) {
+  dashFrames++;
+  dashLevel = map(frame.data[1], 0, 255, 0, 100);
+}
+
+static void decodeRequest(const canFrame &) {
+  requests++;
+}
+
+static constexpr pgnDecoder decoders[] = {
+  { PGN_DASH_DISPLAY, SA_INSTRUMENT_CLUSTER, &decodeDash },
+  { PGN_REQUEST, SA_ENGINE, &decodeRequest },
+};
+
+static constexpr pgnDecoder dashOnly[] = {
+  { PGN_DASH_DISPLAY, SA_INSTRUMENT_CLUSTER, &decodeDash },
+};
+
+// A powertrain bus with the dash display at 1 Hz among the engine, transmission and body frames
+typedef struct {
+  unsigned long id;
+  uint16_t      perSecond;
+} busEntry;
+
+static const busEntry busMix[] = {
+  { 0x8CF00400UL, 100 },                        // EEC1 engine speed
+  { 0x8CF00300UL, 50 },                         // EEC2 accelerator
+  { 0x98FEF100UL, 10 },                         // CCVS wheel speed
+  { 0x98FEEE00UL, 1 },                          // ET1 engine temperature
+  { 0x98FEEF00UL, 2 },                          // EFL/P1 oil pressure
+  { 0x98FEF200UL, 10 },                         // LFE fuel economy
+  { 0x8CF00203UL, 100 },                        // ETC1 transmission
+  { 0x98FEF527UL, 1 },                          // AMB ambient, from the body controller
+  { 0x98FEFC00UL, 1 },                          // dash display PGN from another source
+  { 0x98FEFC17UL, 1 },                          // dash display from the instrument cluster
+};
+
+#define BUS_ENTRIES (sizeof(busMix) / sizeof(busMix[0]))
+
+static canFrame mix[BENCH_FRAMES];
+
+// Frames of the mix in proportion to their rates, the data moving so nothing is constant
+static void buildMix(void) {
+  int32_t total = 0;
+  int32_t credit[BUS_ENTRIES] = { 0 };
+
+  for (uint8_t e = 0; e < BUS_ENTRIES; e++)
+    total += busMix[e].perSecond;
+
+  for (unsigned long i = 0; i < BENCH_FRAMES; i++) {
+    uint8_t pick = 0;
+
+    // Weighted round robin
+    for (uint8_t e = 0; e < BUS_ENTRIES; e++) {
+      credit[e] += busMix[e].perSecond;
+      if (credit[e] > credit[pick])
+        pick = e;
+    }
+    credit[pick] -= total;
+
+    mix[i].id = busMix[pick].id;
+    mix[i].time = i;
+    mix[i].len = 8;
+    for (uint8_t b = 0; b < 8; b++)
+      mix[i].data[b] = (uint8_t)(i * 7 + b);
+  }
+}
+
+// The path every frame took before the filters: formatted for the debug output, then one case of a switch
+static byte legacyLevel;
+static unsigned long legacyFrames;
+
+static void legacyProcess(const canFrame &frame) {
+  char msgString[128];
+
+  if ((frame.id & 0x80000000) == 0x80000000)
+    sprintf(msgString, "Extended ID: 0x%.8lX  DLC: %1d  Data:", (frame.id & 0x1FFFFFFF), frame.len);
+  else
+    sprintf(msgString, "Standard ID: 0x%.3lX       DLC: %1d  Data:", frame.id, frame.len);
+
+  if ((frame.id & 0x40000000) == 0x40000000) {
+    sprintf(msgString, " REMOTE REQUEST FRAME");
+  } else {
+    switch (frame.id & 0x1FFFFFFF) {
+      case 0x18FEFC17:
+        legacyFrames++;
+        legacyLevel = map(frame.data[1], 0, 255, 0, 100);
+        break;
+
+      default:
+        break;
+    }
+  }
+  __asm__ __volatile__("" : : "r"(msgString) : "memory");
+}
+
+static double seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool accepts(MCP_CAN &can, unsigned long id) {
+  static const uint8_t data[8] = { 0 };
+  unsigned long readId;
+  uint8_t len;
+  uint8_t buf[8];
+
+  if (!nativeCanInject(id, 8, data))
+    return false;
+  can.readMsgBuf(&readId, &len, buf);
+  return readId == id;
+}
+
+void setUp(void) {
+  dashFrames = 0;
+  requests = 0;
+}
+
+void tearDown(void) {
+}
+
+void test_pgn_and_source_address(void) {
+  TEST_ASSERT_EQUAL(0xFEFC, j1939Pgn(0x18FEFC17UL));
+  TEST_ASSERT_EQUAL(0x17, j1939SourceAddress(0x18FEFC17UL));
+  TEST_ASSERT_EQUAL(0xEA00, j1939Pgn(0x18EA2100UL));
+  TEST_ASSERT_TRUE(j1939IsPdu1(PGN_REQUEST));
+  TEST_ASSERT_FALSE(j1939IsPdu1(PGN_DASH_DISPLAY));
+}
+
+void test_filter_mask(void) {
+  // Priority never counts, a PDU1 entry also opens up the destination byte
+  TEST_ASSERT_EQUAL(0x03FFFFFFUL, j1939FilterMask(dashOnly, 1));
+  TEST_ASSERT_EQUAL(0x03FF00FFUL, j1939FilterMask(decoders, 2));
+}
+
+void test_controller_accepts_only_the_table(void) {
+  MCP_CAN can(10);
+
+  can.begin(MCP_EXT, CAN_250KBPS, MCP_8MHZ);
+  j1939ConfigureFilters(can, dashOnly);
+  can.setMode(MCP_LISTENONLY);
+
+  TEST_ASSERT_TRUE(accepts(can, 0x98FEFC17UL));
+  TEST_ASSERT_TRUE(accepts(can, 0x9CFEFC17UL));   // another priority
+  TEST_ASSERT_FALSE(accepts(can, 0x98FEFC00UL));  // another source
+  TEST_ASSERT_FALSE(accepts(can, 0x98FEFD17UL));  // another PGN
+  TEST_ASSERT_FALSE(accepts(can, 0x0000017UL));   // standard frame
+
+  unsigned long accepted = 0;
+  for (uint8_t e = 0; e < BUS_ENTRIES; e++)
+    accepted += accepts(can, busMix[e].id);
+  TEST_ASSERT_EQUAL(1, accepted);
+}
+
+void test_controller_pdu1_any_destination(void) {
+  MCP_CAN can(10);
+
+  can.begin(MCP_EXT, CAN_250KBPS, MCP_8MHZ);
+  j1939ConfigureFilters(can, decoders);
+  can.setMode(MCP_LISTENONLY);
+
+  TEST_ASSERT_TRUE(accepts(can, 0x98EA2100UL));
+  TEST_ASSERT_TRUE(accepts(can, 0x98EAFF00UL));
+  TEST_ASSERT_FALSE(accepts(can, 0x98EA2101UL));
+  TEST_ASSERT_TRUE(accepts(can, 0x98FEFC17UL));
+}
+
+void test_dispatch(void) {
+  canFrame frame = { 0x98FEFC17UL, 0, 8, { 0xFF, 0x7F } };
+
+  TEST_ASSERT_TRUE(j1939Dispatch(decoders, frame));
+  TEST_ASSERT_EQUAL(1, dashFrames);
+  TEST_ASSERT_EQUAL(49, dashLevel);
+
+  frame.id = 0x98EA2100UL;
+  TEST_ASSERT_TRUE(j1939Dispatch(decoders, frame));
+  TEST_ASSERT_EQUAL(1, requests);
+
+  frame.id = 0x98FEFC00UL;
+  TEST_ASSERT_FALSE(j1939Dispatch(decoders, frame));
+  frame.id = 0xD8FEFC17UL;                        // remote request
+  TEST_ASSERT_FALSE(j1939Dispatch(decoders, frame));
+  frame.id = 0x18FEFC17UL;                        // standard frame bit pattern
+  TEST_ASSERT_FALSE(j1939Dispatch(decoders, frame));
+  TEST_ASSERT_EQUAL(1, dashFrames);
+}
+
+void test_dispatch_benchmark(void) {
+  char message[128];
+
+  buildMix();
+
+  double start = seconds();
+  for (unsigned long i = 0; i < BENCH_FRAMES; i++)
+    legacyProcess(mix[i]);
+  double legacy = seconds() - start;
+
+  // Every frame through the table, as if the controller accepted everything
+  start = seconds();
+  for (unsigned long i = 0; i < BENCH_FRAMES; i++)
+    j1939Dispatch(dashOnly, mix[i]);
+  double dispatch = seconds() - start;
+
+  // Same decisions on the same frames
+  TEST_ASSERT_EQUAL(legacyFrames, dashFrames);
+  TEST_ASSERT_EQUAL(legacyLevel, dashLevel);
+  TEST_ASSERT_GREATER_THAN(0, dashFrames);
+
+  snprintf(message, sizeof(message), "%lu frames of the mix, %lu for the dash display, %.1f%% pass the filters",
+           BENCH_FRAMES, dashFrames, 100.0 * dashFrames / BENCH_FRAMES);
+  TEST_MESSAGE(message);
+  snprintf(message, sizeof(message), "sprintf and switch: %.0f frames/s, table dispatch: %.0f frames/s (%.0fx)",
+           BENCH_FRAMES / legacy, BENCH_FRAMES / dispatch, legacy / dispatch);
+  TEST_MESSAGE(message);
+
+  TEST_ASSERT_TRUE(dispatch < legacy);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pgn_and_source_address);
+  RUN_TEST(test_filter_mask);
+  RUN_TEST(test_controller_accepts_only_the_table);
+  RUN_TEST(test_controller_pdu1_any_destination);
+  RUN_TEST(test_dispatch);
+  RUN_TEST(test_dispatch_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,206 @@
+/*
+   AMMessageParser on [env:native]: messages split across loop() calls at every point, overlong
+   fields, link notifications anywhere in the stream, and the parser's throughput.
+
+     pio test -e native -f test_message_parser -v
+*/
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+#include "AM_MessageParser.h"
+
+#define BENCH_MESSAGES 200000UL
+
+static uint64_t randomState;
+
+static uint32_t randomNumber(uint32_t range) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (randomState >> 33) % range;
+}
+
+static double seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Events of feeding text, the complete messages left in the parser
+static uint8_t feedText(AMMessageParser &parser, const char *text) {
+  uint8_t last = AM_PARSER_NONE;
+
+  for (; *text != '\0'; text++) {
+    uint8_t event = parser.feed(*text);
+
+    if (event != AM_PARSER_NONE)
+      last = event;
+  }
+  return last;
+}
+
+static void expectMessage(AMMessageParser &parser, const char *variable, const char *value) {
+  amMessage *message = parser.peek();
+
+  TEST_ASSERT_NOT_NULL(message);
+  TEST_ASSERT_EQUAL_STRING(variable, message->variable);
+  TEST_ASSERT_EQUAL_STRING(value, message->value);
+  parser.pop();
+}
+
+void setUp(void) {
+  randomState = 1;
+}
+
+void tearDown(void) {
+}
+
+void test_split_at_every_point(void) {
+  const char *stream = "pumpOn=1#calPoint=50#Sync=1#";
+  size_t length = strlen(stream);
+
+  // Two loop() calls, the first ending after any character
+  for (size_t split = 0; split <= length; split++) {
+    AMMessageParser parser;
+
+    for (size_t i = 0; i < split; i++)
+      parser.feed(stream[i]);
+    for (size_t i = split; i < length; i++)
+      parser.feed(stream[i]);
+
+    expectMessage(parser, "pumpOn", "1");
+    expectMessage(parser, "calPoint", "50");
+    expectMessage(parser, "Sync", "1");
+    TEST_ASSERT_NULL(parser.peek());
+    TEST_ASSERT_EQUAL(0, parser.overflows());
+  }
+}
+
+void test_random_fragments_lose_nothing(void) {
+  AMMessageParser parser;
+  char stream[32];
+  unsigned long sent = 0;
+  unsigned long received = 0;
+
+  // Messages arriving in fragments of 1 to 20 characters, drained after every fragment as loop() does
+  for (unsigned long m = 0; m < 5000; m++) {
+    snprintf(stream, sizeof(stream), "v%lu=%lu#", m % 1000, m);
+
+    size_t length = strlen(stream);
+    size_t at = 0;
+
+    while (at < length) {
+      size_t fragment = 1 + randomNumber(20);
+
+      for (size_t i = 0; i < fragment && at < length; i++)
+        parser.feed(stream[at++]);
+
+      amMessage *message;
+      while ((message = parser.peek()) != NULL) {
+        char expected[16];
+
+        snprintf(expected, sizeof(expected), "%lu", received);
+        TEST_ASSERT_EQUAL_STRING(expected, message->value);
+        received++;
+        parser.pop();
+      }
+    }
+    sent++;
+  }
+  TEST_ASSERT_EQUAL(sent, received);
+  TEST_ASSERT_EQUAL(0, parser.overflows());
+}
+
+void test_overlong_fields_dropped(void) {
+  AMMessageParser parser;
+
+  TEST_ASSERT_EQUAL(AM_PARSER_NONE, feedText(parser, "aVariableLongerThan14=1#"));
+  TEST_ASSERT_EQUAL(AM_PARSER_NONE, feedText(parser, "v=123456789012345#"));
+  TEST_ASSERT_EQUAL(AM_PARSER_NONE, feedText(parser, "noValue#"));
+  TEST_ASSERT_EQUAL(3, parser.overflows());
+  TEST_ASSERT_NULL(parser.peek());
+
+  // Exactly the longest fields, and the stream is in step again
+  TEST_ASSERT_EQUAL(AM_PARSER_MESSAGE, feedText(parser, "abcdefghijklmn=12345678901234#"));
+  expectMessage(parser, "abcdefghijklmn", "12345678901234");
+}
+
+void test_link_status_anywhere(void) {
+  AMMessageParser parser;
+
+  TEST_ASSERT_EQUAL(AM_PARSER_CONNECTED, feedText(parser, "OK+CONN"));
+  TEST_ASSERT_EQUAL(AM_PARSER_DISCONNECTED, feedText(parser, "OK+LOST"));
+
+  // The partial message before a notification is discarded
+  TEST_ASSERT_EQUAL(AM_PARSER_CONNECTED, feedText(parser, "pump=OK+CONN"));
+  TEST_ASSERT_EQUAL(AM_PARSER_MESSAGE, feedText(parser, "pumpOn=1#"));
+  expectMessage(parser, "pumpOn", "1");
+
+  // A token that starts again inside a broken one
+  TEST_ASSERT_EQUAL(AM_PARSER_CONNECTED, feedText(parser, "OK+COK+CONN"));
+  TEST_ASSERT_EQUAL(AM_PARSER_DISCONNECTED, feedText(parser, "OK+LOK+LOST"));
+  TEST_ASSERT_EQUAL(AM_PARSER_CONNECTED, feedText(parser, "OOK+CONN"));
+  TEST_ASSERT_EQUAL(AM_PARSER_NONE, feedText(parser, "OK+CO"));
+}
+
+void test_split_link_status(void) {
+  AMMessageParser parser;
+
+  TEST_ASSERT_EQUAL(AM_PARSER_NONE, feedText(parser, "OK+C"));
+  TEST_ASSERT_EQUAL(AM_PARSER_CONNECTED, feedText(parser, "ONN"));
+}
+
+void test_full_queue(void) {
+  AMMessageParser parser;
+
+  for (uint8_t i = 0; i < AM_MESSAGE_QUEUE_LEN; i++)
+    feedText(parser, "a=1#");
+  TEST_ASSERT_TRUE(parser.isFull());
+  TEST_ASSERT_EQUAL(0, parser.overflows());
+
+  // Fed while full, the characters are counted as lost
+  feedText(parser, "b=2#");
+  TEST_ASSERT_EQUAL(4, parser.overflows());
+  parser.pop();
+  TEST_ASSERT_FALSE(parser.isFull());
+  TEST_ASSERT_EQUAL(AM_PARSER_MESSAGE, feedText(parser, "c=3#"));
+}
+
+void test_parser_throughput(void) {
+  static const char stream[] = "priFuelLevel=75#auxFuelLevel=40#pumpOn=1#calPoint=1023#";
+  AMMessageParser parser;
+  unsigned long messages = 0;
+  unsigned long characters = 0;
+  char message[128];
+
+  double start = seconds();
+  for (unsigned long n = 0; n < BENCH_MESSAGES / 4; n++) {
+    for (const char *c = stream; *c != '\0'; c++) {
+      if (parser.feed(*c) == AM_PARSER_MESSAGE) {
+        parser.pop();
+        messages++;
+      }
+      characters++;
+    }
+  }
+  double elapsed = seconds() - start;
+
+  TEST_ASSERT_EQUAL(BENCH_MESSAGES, messages);
+  snprintf(message, sizeof(message), "%.1f M characters/s, %.1f M messages/s (9600 baud is 960 characters/s)",
+           characters / elapsed / 1e6, messages / elapsed / 1e6);
+  TEST_MESSAGE(message);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_split_at_every_point);
+  RUN_TEST(test_random_fragments_lose_nothing);
+  RUN_TEST(test_overlong_fields_dropped);
+  RUN_TEST(test_link_status_anywhere);
+  RUN_TEST(test_split_link_status);
+  RUN_TEST(test_full_queue);
+  RUN_TEST(test_parser_throughput);
+  return UNITY_END();
+}
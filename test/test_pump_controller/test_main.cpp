@@ -0,0 +1,156 @@
+/*
+   PumpController state machine on [env:native]: dwell, start cap, dry run, refill and reset.
+
+     pio test -e native -f test_pump_controller
+*/
+
+#include <Arduino.h>
+#include <unity.h>
+#include "PumpController.h"
+
+// The sketch's limits (PUMP_* in main.cpp)
+static const pumpLimits limits = { 30, 60, 90, 2 * 256, 10 * 256, 6 };
+
+#define LOOP 100                                // [ms]
+
+static unsigned long now;
+
+// Loops up to ms with the demand, the aux level moving linearly from level to level + change (%)
+static bool run(PumpController &pump, unsigned long ms, bool demand, double level, double change = 0) {
+  unsigned long from = now;
+  bool on = pump.on();
+
+  while (now < ms) {
+    now += LOOP;
+    pump.level((int16_t)((level + change * (now - from) / (ms - from)) * 256));
+    on = pump.update(now, demand);
+  }
+  return on;
+}
+
+void setUp(void) {
+  now = 0;
+}
+
+void tearDown(void) {
+}
+
+void test_starts_on_demand(void) {
+  PumpController pump(limits);
+
+  TEST_ASSERT_FALSE(run(pump, 1000, false, 80));
+  TEST_ASSERT_EQUAL(PUMP_IDLE, pump.state());
+  TEST_ASSERT_TRUE(run(pump, 1100, true, 80));
+  TEST_ASSERT_EQUAL(PUMP_PRIMING, pump.state());
+  TEST_ASSERT_EQUAL(1, pump.starts(now));
+}
+
+void test_min_on(void) {
+  PumpController pump(limits);
+
+  run(pump, 100, true, 80);
+  TEST_ASSERT_TRUE(run(pump, 29900, false, 80, -0.5));
+  TEST_ASSERT_FALSE(run(pump, 30100, false, 79.5));
+  TEST_ASSERT_EQUAL(PUMP_COOLDOWN, pump.state());
+}
+
+void test_min_off(void) {
+  PumpController pump(limits);
+
+  run(pump, 100, true, 80);
+  run(pump, 30100, false, 80, -0.5);
+  TEST_ASSERT_FALSE(run(pump, 90000, true, 79.5));
+  TEST_ASSERT_EQUAL(PUMP_COOLDOWN, pump.state());
+  TEST_ASSERT_TRUE(run(pump, 90100, true, 79.5));
+  TEST_ASSERT_EQUAL(2, pump.starts(now));
+}
+
+void test_start_cap(void) {
+  PumpController pump(limits);
+
+  // A start every two minutes, the seventh waits for the first to be an hour old
+  for (uint8_t i = 0; i < limits.maxStarts; i++) {
+    run(pump, i * 120000UL, false, 80);
+    TEST_ASSERT_TRUE(run(pump, i * 120000UL + 100, true, 80));
+    run(pump, i * 120000UL + 30100, false, 80);
+  }
+  TEST_ASSERT_EQUAL(limits.maxStarts, pump.starts(now));
+  TEST_ASSERT_FALSE(run(pump, 3600000UL, true, 80));
+  TEST_ASSERT_EQUAL(PUMP_COOLDOWN, pump.state());
+  TEST_ASSERT_TRUE(run(pump, 3600100UL, true, 80));
+  TEST_ASSERT_EQUAL(limits.maxStarts, pump.starts(now));
+}
+
+void test_transfer_runs(void) {
+  PumpController pump(limits);
+
+  // 5 %/min while pumping, well over the least drop per window
+  TEST_ASSERT_TRUE(run(pump, 600000UL, true, 80, -50));
+  TEST_ASSERT_EQUAL(PUMP_TRANSFERRING, pump.state());
+}
+
+void test_dry_run_fault(void) {
+  PumpController pump(limits);
+
+  // Started at 100 ms, the priming window sets the reference, the first transferring one didn't drop
+  TEST_ASSERT_TRUE(run(pump, 180000, true, 60));
+  TEST_ASSERT_EQUAL(PUMP_TRANSFERRING, pump.state());
+  TEST_ASSERT_FALSE(run(pump, 180100, true, 60));
+  TEST_ASSERT_TRUE(pump.fault());
+  TEST_ASSERT_FALSE(run(pump, 600000UL, true, 60));
+  TEST_ASSERT_TRUE(pump.fault());
+}
+
+void test_refill_clears_fault(void) {
+  PumpController pump(limits);
+
+  run(pump, 180100, true, 60);
+  TEST_ASSERT_TRUE(pump.fault());
+
+  // A rise short of the refill keeps it, a full window past the refill clears it into cooldown
+  TEST_ASSERT_FALSE(run(pump, 270100, true, 65));
+  TEST_ASSERT_TRUE(pump.fault());
+  run(pump, 360000, true, 80);
+  TEST_ASSERT_TRUE(pump.fault());
+  TEST_ASSERT_FALSE(run(pump, 360100, true, 80));
+  TEST_ASSERT_EQUAL(PUMP_COOLDOWN, pump.state());
+
+  // Off since the fault, so the pump starts on the next loop
+  TEST_ASSERT_TRUE(run(pump, 360200, true, 80));
+}
+
+void test_reset_clears_fault(void) {
+  PumpController pump(limits);
+
+  run(pump, 180100, true, 60);
+  TEST_ASSERT_TRUE(pump.fault());
+  run(pump, 200000, true, 60);
+  pump.reset();
+  TEST_ASSERT_EQUAL(PUMP_COOLDOWN, pump.state());
+
+  // The minimum off time counts from the fault
+  TEST_ASSERT_FALSE(run(pump, 240000, true, 60));
+  TEST_ASSERT_TRUE(run(pump, 240100, true, 60));
+}
+
+void test_reset_without_fault(void) {
+  PumpController pump(limits);
+
+  run(pump, 100, true, 80);
+  pump.reset();
+  TEST_ASSERT_EQUAL(PUMP_PRIMING, pump.state());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_starts_on_demand);
+  RUN_TEST(test_min_on);
+  RUN_TEST(test_min_off);
+  RUN_TEST(test_start_cap);
+  RUN_TEST(test_transfer_runs);
+  RUN_TEST(test_dry_run_fault);
+  RUN_TEST(test_refill_clears_fault);
+  RUN_TEST(test_reset_without_fault);
+  RUN_TEST(test_reset_clears_fault);
+  return UNITY_END();
+}
@@ -0,0 +1,246 @@
+/*
+   The state kept across power cycles on [env:native]: saveState() and restoreState() of main.cpp
+   against the shim's EEPROM. A blank or outdated store is a cold start, a saved state comes back
+   with one more power cycle, a write cut off by a power loss falls back to the state before, and
+   the saved aux level only seeds the estimate while the sender still reads about the same.
+
+     pio test -e native -f test_restore_state -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <avr/eeprom.h>
+#include <unity.h>
+#include "EepromLog.h"
+#include "FuelAnalytics.h"
+#include "FuelEstimator.h"
+
+// Wiring from main.cpp
+#define AUX_PIN 14
+#define STATE_EEPROM_START 512
+#define STATE_EEPROM_LENGTH 384
+#define STATE_VERSION 2
+#define STATE_KEY 0
+#define STATE_SAVE_INTERVAL 600000UL
+#define STATE_SEED_TOLERANCE 10
+
+typedef struct {
+  uint8_t  version;
+  uint8_t  priFuelLevel;
+  uint8_t  auxFuelLevel;
+  uint8_t  reserved;
+  int16_t  minValue;
+  int16_t  maxValue;
+  uint32_t pumpSeconds;
+  uint16_t pumpStarts;
+  uint16_t powerCycles;
+  uint32_t transferred;
+  uint16_t consumption;
+  uint16_t dutyCycle;
+} persistentState;
+
+extern EepromLog stateLog;
+extern persistentState savedState;
+extern boolean stateRestored;
+extern byte priFuelLevel;
+extern byte auxFuelLevel;
+extern int minValue;
+extern int maxValue;
+extern uint32_t pumpSeconds;
+extern uint16_t pumpStarts;
+extern uint16_t powerCycles;
+extern FuelEstimator fuelEstimator;
+extern FuelAnalytics fuelAnalytics;
+void primeAuxFuelLevel();
+void restoreState();
+void saveState(boolean pumpStopped);
+
+#define SLOT_SIZE EEPROM_LOG_SLOT_SIZE(sizeof(persistentState))
+
+// Power-up values of the globals restoreState() fills in
+static void powerUp(void) {
+  stateRestored = false;
+  priFuelLevel = 0;
+  auxFuelLevel = 0;
+  minValue = 1024;
+  maxValue = 0;
+  pumpSeconds = 0;
+  pumpStarts = 0;
+  powerCycles = 1;
+  fuelAnalytics.restore(0, 0, 0);
+}
+
+// A run that has something to save: the aux sender read once, then totals
+static void run(uint8_t pri, uint32_t seconds, uint16_t starts, uint32_t transferred) {
+  nativeSetAnalog(AUX_PIN, 500);
+  primeAuxFuelLevel();
+  TEST_ASSERT_TRUE(fuelEstimator.ready());
+
+  priFuelLevel = pri;
+  pumpSeconds = seconds;
+  pumpStarts = starts;
+  fuelAnalytics.restore(transferred, 1500, 8000);
+}
+
+// Slot of the newest record in the store
+static int newestSlot(void) {
+  int newest = -1;
+  uint32_t highest = 0;
+
+  for (int i = 0; i < (int)(STATE_EEPROM_LENGTH / SLOT_SIZE); i++) {
+    uint32_t sequence = eeprom_read_dword((const uint32_t *)(STATE_EEPROM_START + i * SLOT_SIZE));
+    if (sequence != 0xFFFFFFFFUL && sequence >= highest) {
+      newest = i;
+      highest = sequence;
+    }
+  }
+  return newest;
+}
+
+void setUp(void) {
+  uint8_t erased[STATE_EEPROM_LENGTH];
+
+  memset(erased, 0xFF, sizeof(erased));
+  eeprom_update_block(erased, (void *)STATE_EEPROM_START, sizeof(erased));
+  powerUp();
+  restoreState();
+}
+
+void tearDown(void) {
+}
+
+void test_cold_start(void) {
+  TEST_ASSERT_FALSE(stateRestored);
+  TEST_ASSERT_EQUAL_UINT16(1, powerCycles);
+  TEST_ASSERT_EQUAL_UINT32(0, pumpSeconds);
+  TEST_ASSERT_EQUAL_UINT8(0, savedState.version);
+
+  // Nothing is saved before the aux level is known
+  unsigned long writes = stateLog.writes();
+  saveState(true);
+  TEST_ASSERT_EQUAL_UINT32(writes, stateLog.writes());
+}
+
+void test_saved_state_restored(void) {
+  unsigned long writes = stateLog.writes();
+
+  run(120, 3600, 12, 45000);
+  powerCycles = 5;
+  saveState(true);
+  TEST_ASSERT_EQUAL_UINT32(writes + 1, stateLog.writes());
+
+  int savedMin = minValue;
+  int savedMax = maxValue;
+  uint8_t savedAux = auxFuelLevel;
+
+  powerUp();
+  restoreState();
+
+  TEST_ASSERT_TRUE(stateRestored);
+  TEST_ASSERT_EQUAL_UINT8(120, priFuelLevel);
+  TEST_ASSERT_EQUAL_UINT8(savedAux, savedState.auxFuelLevel);
+  TEST_ASSERT_EQUAL_INT(savedMin, minValue);
+  TEST_ASSERT_EQUAL_INT(savedMax, maxValue);
+  TEST_ASSERT_EQUAL_UINT32(3600, pumpSeconds);
+  TEST_ASSERT_EQUAL_UINT16(12, pumpStarts);
+  TEST_ASSERT_EQUAL_UINT16(6, powerCycles);
+  TEST_ASSERT_EQUAL_UINT32(45000, fuelAnalytics.lifetimeTransferred());
+  TEST_ASSERT_EQUAL_UINT16(1500, fuelAnalytics.consumption());
+  TEST_ASSERT_EQUAL_UINT16(8000, fuelAnalytics.dutyCycle());
+}
+
+void test_save_interval(void) {
+  run(100, 10, 1, 0);
+  saveState(true);
+  unsigned long writes = stateLog.writes();
+
+  // Unchanged, or changed before the interval with the pump still running: not written
+  saveState(true);
+  pumpSeconds = 20;
+  saveState(false);
+  TEST_ASSERT_EQUAL_UINT32(writes, stateLog.writes());
+
+  nativeAdvance(STATE_SAVE_INTERVAL * 1000UL);
+  saveState(false);
+  TEST_ASSERT_EQUAL_UINT32(writes + 1, stateLog.writes());
+
+  // The pump stopping doesn't wait for the interval
+  pumpSeconds = 30;
+  saveState(true);
+  TEST_ASSERT_EQUAL_UINT32(writes + 2, stateLog.writes());
+}
+
+void test_cut_off_write_falls_back(void) {
+  run(100, 600, 3, 1000);
+  saveState(true);
+  pumpSeconds = 900;
+  pumpStarts = 4;
+  saveState(true);
+
+  // The last record lost its CRC to a power loss
+  int slot = newestSlot();
+  TEST_ASSERT_GREATER_OR_EQUAL(0, slot);
+  eeprom_write_word((uint16_t *)(STATE_EEPROM_START + slot * SLOT_SIZE + SLOT_SIZE - 2), 0);
+
+  powerUp();
+  restoreState();
+  TEST_ASSERT_TRUE(stateRestored);
+  TEST_ASSERT_EQUAL_UINT32(600, pumpSeconds);
+  TEST_ASSERT_EQUAL_UINT16(3, pumpStarts);
+}
+
+void test_other_version_is_cold_start(void) {
+  persistentState state;
+
+  memset(&state, 0, sizeof(state));
+  state.version = STATE_VERSION - 1;
+  state.priFuelLevel = 150;
+  state.pumpSeconds = 1234;
+  TEST_ASSERT_TRUE(stateLog.write(STATE_KEY, &state));
+
+  powerUp();
+  restoreState();
+  TEST_ASSERT_FALSE(stateRestored);
+  TEST_ASSERT_EQUAL_UINT8(0, priFuelLevel);
+  TEST_ASSERT_EQUAL_UINT32(0, pumpSeconds);
+  TEST_ASSERT_EQUAL_UINT16(1, powerCycles);
+}
+
+void test_aux_seed(void) {
+  // The level the sender reads without a saved state
+  nativeSetAnalog(AUX_PIN, 500);
+  primeAuxFuelLevel();
+  uint8_t reading = fuelEstimator.auxLevel();
+
+  // Saved a little higher: the estimate starts from the saved level
+  run(100, 0, 0, 0);
+  auxFuelLevel = reading + STATE_SEED_TOLERANCE / 2;
+  fuelEstimator.primeAux(auxFuelLevel << 8);
+  saveState(true);
+
+  powerUp();
+  restoreState();
+  primeAuxFuelLevel();
+  TEST_ASSERT_EQUAL_UINT8(reading + STATE_SEED_TOLERANCE / 2, fuelEstimator.auxLevel());
+
+  // Saved well away from it, e.g. filled up while off: the reading wins
+  auxFuelLevel = reading + 2 * STATE_SEED_TOLERANCE;
+  fuelEstimator.primeAux(auxFuelLevel << 8);
+  saveState(true);
+
+  powerUp();
+  restoreState();
+  primeAuxFuelLevel();
+  TEST_ASSERT_EQUAL_UINT8(reading, fuelEstimator.auxLevel());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_cold_start);
+  RUN_TEST(test_saved_state_restored);
+  RUN_TEST(test_save_interval);
+  RUN_TEST(test_cut_off_write_falls_back);
+  RUN_TEST(test_other_version_is_cold_start);
+  RUN_TEST(test_aux_seed);
+  return UNITY_END();
+}
@@ -0,0 +1,205 @@
+/*
+   SdBlockLogger and SdBlockReader on [env:native], on the shim's card in a scratch directory:
+   records read back in order across blocks, a reopened log continues its last block, a log that
+   was never closed keeps what the last sync wrote, and seek(), count() and find() agree with
+   what was appended.
+
+     pio test -e native -f test_sd_block_logger -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <SD.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <unity.h>
+#include "SdBlockLogger.h"
+
+#define LOG_FILE "TEST.BIN"
+#define LOG_TEXT "time,aux,pri,rate"
+
+typedef struct {
+  uint32_t time;
+  uint16_t aux;
+  uint16_t pri;
+  uint16_t rate;
+} logRecord;
+
+#define PER_BLOCK SD_LOG_RECORDS_PER_BLOCK(sizeof(logRecord))
+
+static char sdDir[] = "/tmp/test_sd_block_loggerXXXXXX";
+
+// Record number n, time in steps of 100 ms
+static logRecord record(uint32_t n) {
+  logRecord r;
+
+  r.time = n * 100;
+  r.aux = (uint16_t)(n * 7);
+  r.pri = (uint16_t)(n ^ 0x5A5A);
+  r.rate = (uint16_t)(n % 251);
+  return r;
+}
+
+// Field by field, the struct is padded to 12 bytes on the host
+static void assertRecord(uint32_t n, const logRecord *r) {
+  logRecord expected = record(n);
+
+  TEST_ASSERT_EQUAL_UINT32(expected.time, r->time);
+  TEST_ASSERT_EQUAL_UINT16(expected.aux, r->aux);
+  TEST_ASSERT_EQUAL_UINT16(expected.pri, r->pri);
+  TEST_ASSERT_EQUAL_UINT16(expected.rate, r->rate);
+}
+
+static void appendRecords(SdBlockLogger *logger, uint32_t first, uint32_t count) {
+  for (uint32_t n = first; n < first + count; n++) {
+    logRecord r = record(n);
+    TEST_ASSERT_TRUE(logger->append(&r));
+    nativeAdvance(100000UL);
+  }
+}
+
+// Reads the log from the start and checks it holds records 0 to count - 1
+static void assertLog(uint32_t count) {
+  SdBlockReader reader;
+  logRecord r;
+  uint32_t n = 0;
+
+  TEST_ASSERT_TRUE(reader.open(LOG_FILE));
+  TEST_ASSERT_EQUAL(sizeof(logRecord), reader.recordSize());
+  TEST_ASSERT_EQUAL_UINT32(count, reader.count());
+
+  // count() moved the position, start over
+  TEST_ASSERT_TRUE(count == 0 || reader.seek(0));
+  while (reader.next(&r)) {
+    assertRecord(n, &r);
+    n++;
+  }
+  TEST_ASSERT_EQUAL_UINT32(count, n);
+  reader.close();
+}
+
+void setUp(void) {
+  SD.remove(LOG_FILE);
+}
+
+void tearDown(void) {
+  SD.remove(LOG_FILE);
+}
+
+void test_round_trip(void) {
+  SdBlockLogger logger;
+  SdBlockReader reader;
+  char text[SD_LOG_HEADER_TEXT_LEN];
+  uint32_t count = 20 * PER_BLOCK + 7;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  TEST_ASSERT_TRUE(logger.setHeaderText(LOG_TEXT));
+  appendRecords(&logger, 0, count);
+  logger.close();
+
+  TEST_ASSERT_EQUAL_UINT32(count, logger.records());
+  TEST_ASSERT_EQUAL_UINT32(0, logger.errors());
+  assertLog(count);
+
+  TEST_ASSERT_TRUE(reader.open(LOG_FILE));
+  TEST_ASSERT_TRUE(reader.headerText(text, sizeof(text)));
+  TEST_ASSERT_EQUAL_STRING(LOG_TEXT, text);
+  reader.close();
+}
+
+void test_reopen_continues_last_block(void) {
+  SdBlockLogger logger;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&logger, 0, PER_BLOCK + 3);
+  logger.close();
+  assertLog(PER_BLOCK + 3);
+
+  // The second block had room, the new records go into it and on into the third
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&logger, PER_BLOCK + 3, PER_BLOCK);
+  logger.close();
+  assertLog(2 * PER_BLOCK + 3);
+}
+
+void test_other_record_size_refused(void) {
+  SdBlockLogger logger;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&logger, 0, 10);
+  logger.close();
+
+  TEST_ASSERT_FALSE(logger.open(LOG_FILE, sizeof(logRecord) + 2));
+  TEST_ASSERT_FALSE(logger.isOpen());
+  assertLog(10);
+}
+
+void test_unclosed_log_keeps_synced_records(void) {
+  SdBlockLogger logger;
+  uint32_t synced = PER_BLOCK + 10;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&logger, 0, synced);
+
+  // The sync interval passes without a record, loop() writes the partly filled block
+  nativeAdvance(SD_LOG_SYNC_INTERVAL * 1000UL);
+  logger.loop();
+
+  // Records after the sync are still in RAM when the power goes
+  appendRecords(&logger, synced, 5);
+  assertLog(synced);
+
+  // Abandoned without close() like a power cut, the reopened log carries on after the synced ones
+  SdBlockLogger resumed;
+  TEST_ASSERT_TRUE(resumed.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&resumed, synced, PER_BLOCK);
+  resumed.close();
+  assertLog(synced + PER_BLOCK);
+}
+
+void test_seek_and_find(void) {
+  SdBlockLogger logger;
+  SdBlockReader reader;
+  logRecord r;
+  uint32_t count = 5 * PER_BLOCK + 20;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  appendRecords(&logger, 0, count);
+  logger.close();
+
+  TEST_ASSERT_TRUE(reader.open(LOG_FILE));
+
+  uint32_t seeks[] = { 0, PER_BLOCK - 1, PER_BLOCK, 3 * PER_BLOCK + 17, count - 1 };
+  for (uint8_t i = 0; i < sizeof(seeks) / sizeof(seeks[0]); i++) {
+    TEST_ASSERT_TRUE(reader.seek(seeks[i]));
+    TEST_ASSERT_TRUE(reader.next(&r));
+    assertRecord(seeks[i], &r);
+  }
+  TEST_ASSERT_FALSE(reader.seek(count));
+
+  // Exact times, times between records, before the first and after the last
+  TEST_ASSERT_EQUAL_UINT32(0, reader.find(0));
+  TEST_ASSERT_EQUAL_UINT32(123, reader.find(123 * 100));
+  TEST_ASSERT_EQUAL_UINT32(124, reader.find(123 * 100 + 1));
+  TEST_ASSERT_EQUAL_UINT32(count - 1, reader.find((count - 1) * 100));
+  TEST_ASSERT_EQUAL_UINT32(count, reader.find(count * 100));
+  reader.close();
+}
+
+int main(void) {
+  if (mkdtemp(sdDir) == NULL)
+    return 1;
+  nativeSdRoot(sdDir);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_reopen_continues_last_block);
+  RUN_TEST(test_other_record_size_refused);
+  RUN_TEST(test_unclosed_log_keeps_synced_records);
+  RUN_TEST(test_seek_and_find);
+  int failures = UNITY_END();
+
+  rmdir(sdDir);
+  return failures;
+}
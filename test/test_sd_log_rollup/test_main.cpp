@@ -0,0 +1,215 @@
+/*
+   SdLogRollup on [env:native], on the shim's card in a scratch directory: two hours of 1 Hz
+   records logged the way AMController::sdLog() does, then the buckets of each level and the
+   level SdLogRollup::select() answers range queries from.
+
+     pio test -e native -f test_sd_log_rollup -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <SD.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <unity.h>
+#include "SdBlockLogger.h"
+#include "SdLogRollup.h"
+
+#define LOG_FILE "FUEL.BIN"
+#define LOG_SECONDS 7200UL
+
+// As AMController::sdLog() keeps it
+typedef struct {
+  uint32_t time;
+  float value[SD_ROLLUP_VALUES];
+} logRecord;
+
+static char sdDir[] = "/tmp/test_sd_log_rollupXXXXXX";
+
+// Value 0 is the time, 1 a sawtooth with a 60 s period, the others aren't logged
+static void logSeconds(uint32_t seconds) {
+  SdBlockLogger logger;
+  SdLogRollup rollup;
+  logRecord r;
+
+  TEST_ASSERT_TRUE(logger.open(LOG_FILE, sizeof(logRecord)));
+  TEST_ASSERT_TRUE(rollup.open(LOG_FILE));
+
+  for (uint32_t t = 0; t < seconds; t++) {
+    r.time = t;
+    r.value[0] = t;
+    r.value[1] = t % 60;
+    r.value[2] = NAN;
+    r.value[3] = NAN;
+    r.value[4] = NAN;
+
+    TEST_ASSERT_TRUE(logger.append(&r));
+    rollup.add(r.time, r.value);
+    nativeAdvance(1000000UL);
+    logger.loop();
+    rollup.loop();
+  }
+
+  logger.close();
+  rollup.close();
+  TEST_ASSERT_EQUAL_UINT32(0, logger.errors());
+  TEST_ASSERT_EQUAL_UINT32(0, rollup.errors());
+}
+
+static void readBucket(uint8_t level, uint32_t index, sdRollupRecord *record) {
+  char name[13];
+  File file;
+
+  SdLogRollup::fileName(LOG_FILE, level, name);
+  file = SD.open(name, FILE_READ);
+  TEST_ASSERT_TRUE((bool)file);
+  TEST_ASSERT_TRUE(SdLogRollup::read(file, index, record));
+  file.close();
+}
+
+static uint32_t bucketCount(uint8_t level) {
+  char name[13];
+  File file;
+
+  SdLogRollup::fileName(LOG_FILE, level, name);
+  file = SD.open(name, FILE_READ);
+  TEST_ASSERT_TRUE((bool)file);
+
+  uint32_t count = SdLogRollup::count(file);
+  file.close();
+  return count;
+}
+
+static void assertSelect(uint32_t from, uint32_t to, uint16_t points, uint8_t level, uint32_t first, uint32_t count) {
+  SdBlockReader reader;
+  uint32_t selectedFirst;
+  uint32_t selectedCount;
+
+  TEST_ASSERT_EQUAL_UINT8(level, SdLogRollup::select(reader, LOG_FILE, from, to, points, &selectedFirst, &selectedCount));
+  TEST_ASSERT_EQUAL_UINT32(first, selectedFirst);
+  TEST_ASSERT_EQUAL_UINT32(count, selectedCount);
+  TEST_ASSERT_FALSE(reader.isOpen());
+}
+
+void setUp(void) {
+  SD.remove(LOG_FILE);
+  SdLogRollup::remove(LOG_FILE);
+}
+
+void tearDown(void) {
+  SD.remove(LOG_FILE);
+  SdLogRollup::remove(LOG_FILE);
+}
+
+void test_file_names(void) {
+  char name[13];
+
+  SdLogRollup::fileName("FUEL.BIN", 1, name);
+  TEST_ASSERT_EQUAL_STRING("FUEL.R1", name);
+  SdLogRollup::fileName("AUXLEVEL", 3, name);
+  TEST_ASSERT_EQUAL_STRING("AUXLEVEL.R3", name);
+  SdLogRollup::fileName("AUX", 2, name);
+  TEST_ASSERT_EQUAL_STRING("AUX.R2", name);
+}
+
+void test_buckets(void) {
+  sdRollupRecord record;
+
+  logSeconds(LOG_SECONDS);
+
+  TEST_ASSERT_EQUAL_UINT32(LOG_SECONDS / 10, bucketCount(1));
+  TEST_ASSERT_EQUAL_UINT32(LOG_SECONDS / 60, bucketCount(2));
+  TEST_ASSERT_EQUAL_UINT32(LOG_SECONDS / 600, bucketCount(3));
+
+  // 10 s bucket from 1230 s
+  readBucket(1, 123, &record);
+  TEST_ASSERT_EQUAL_UINT32(1230, record.time);
+  TEST_ASSERT_EQUAL_UINT32(10, record.count);
+  TEST_ASSERT_EQUAL_FLOAT(1230, record.min[0]);
+  TEST_ASSERT_EQUAL_FLOAT(1239, record.max[0]);
+  TEST_ASSERT_EQUAL_FLOAT(1234.5, record.avg[0]);
+  TEST_ASSERT_EQUAL_FLOAT(30, record.min[1]);
+  TEST_ASSERT_EQUAL_FLOAT(39, record.max[1]);
+
+  // 1 min bucket: the whole sawtooth
+  readBucket(2, 7, &record);
+  TEST_ASSERT_EQUAL_UINT32(420, record.time);
+  TEST_ASSERT_EQUAL_UINT32(60, record.count);
+  TEST_ASSERT_EQUAL_FLOAT(0, record.min[1]);
+  TEST_ASSERT_EQUAL_FLOAT(59, record.max[1]);
+  TEST_ASSERT_EQUAL_FLOAT(29.5, record.avg[1]);
+
+  // The last 10 min bucket was unfinished and written by close(), values not logged stay NaN
+  readBucket(3, LOG_SECONDS / 600 - 1, &record);
+  TEST_ASSERT_EQUAL_UINT32(LOG_SECONDS - 600, record.time);
+  TEST_ASSERT_EQUAL_UINT32(600, record.count);
+  TEST_ASSERT_EQUAL_FLOAT(LOG_SECONDS - 1, record.max[0]);
+  TEST_ASSERT_FLOAT_IS_NAN(record.min[2]);
+  TEST_ASSERT_FLOAT_IS_NAN(record.avg[4]);
+}
+
+void test_reopen_appends(void) {
+  sdRollupRecord record;
+
+  // Stopped in the middle of a 10 min bucket, the unfinished one is written as it was
+  logSeconds(900);
+  logSeconds(0);
+  TEST_ASSERT_EQUAL_UINT32(90, bucketCount(1));
+  TEST_ASSERT_EQUAL_UINT32(2, bucketCount(3));
+
+  readBucket(3, 1, &record);
+  TEST_ASSERT_EQUAL_UINT32(600, record.time);
+  TEST_ASSERT_EQUAL_UINT32(300, record.count);
+}
+
+void test_select_level(void) {
+  logSeconds(LOG_SECONDS);
+
+  // A 300 s range: raw if the budget allows, else 10 s buckets
+  assertSelect(1000, 1299, 300, 0, 1000, 300);
+  assertSelect(1000, 1299, 50, 1, 100, 30);
+
+  // The bucket holding from counts
+  assertSelect(1005, 1299, 50, 1, 100, 30);
+
+  // The whole log: 720, 120 and 12 buckets
+  assertSelect(0, 0xFFFFFFFFUL, 1000, 1, 0, 720);
+  assertSelect(0, 0xFFFFFFFFUL, 200, 2, 0, 120);
+  assertSelect(0, 0xFFFFFFFFUL, 30, 3, 0, 12);
+
+  // Nothing fits, the coarsest level is left to the caller's stride
+  assertSelect(0, 0xFFFFFFFFUL, 5, 3, 0, 12);
+
+  // Past the end of the log
+  assertSelect(LOG_SECONDS + 100, LOG_SECONDS + 200, 10, 0, LOG_SECONDS, 0);
+}
+
+void test_select_without_rollups(void) {
+  logSeconds(LOG_SECONDS);
+  SdLogRollup::remove(LOG_FILE);
+
+  // The raw log whatever the budget
+  assertSelect(0, 0xFFFFFFFFUL, 30, 0, 0, LOG_SECONDS);
+
+  // No log at all
+  SD.remove(LOG_FILE);
+  assertSelect(0, 0xFFFFFFFFUL, 30, 0, 0, 0);
+}
+
+int main(void) {
+  if (mkdtemp(sdDir) == NULL)
+    return 1;
+  nativeSdRoot(sdDir);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_file_names);
+  RUN_TEST(test_buckets);
+  RUN_TEST(test_reopen_appends);
+  RUN_TEST(test_select_level);
+  RUN_TEST(test_select_without_rollups);
+  int failures = UNITY_END();
+
+  rmdir(sdDir);
+  return failures;
+}
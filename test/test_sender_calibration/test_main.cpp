@@ -0,0 +1,183 @@
+/*
+   SenderCalibration on [env:native]: lookups through the resampled table against the points'
+   piecewise-linear line at every reading, the ends exact and held, a calibration taken with
+   record() and save() giving the same table the compiler builds from the same points, and a
+   stored record that fails its CRC falling back to the defaults.
+
+     pio test -e native -f test_sender_calibration -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <avr/eeprom.h>
+#include <stdio.h>
+#include <unity.h>
+#include "SenderCalibration.h"
+
+#define RECORD_START 0
+
+// Falling sender as the default table: full at 500, empty at 1800
+constexpr calibrationPoint linearPoints[] = {
+  {  500, 100, 0 },
+  { 1800,   0, 0 },
+};
+
+// A saddle tank: slow in the middle, fast at both ends
+constexpr calibrationPoint saddlePoints[] = {
+  {  320, 100, 0 },
+  {  410,  90, 0 },
+  {  560,  75, 0 },
+  {  900,  50, 0 },
+  { 1290,  25, 0 },
+  { 1450,  10, 0 },
+  { 1520,   0, 0 },
+};
+
+#define LINEAR_COUNT (sizeof(linearPoints) / sizeof(linearPoints[0]))
+#define SADDLE_COUNT (sizeof(saddlePoints) / sizeof(saddlePoints[0]))
+
+const calibrationTable linearTable PROGMEM = calibrationTableOf(linearPoints, LINEAR_COUNT);
+const calibrationTable saddleTable PROGMEM = calibrationTableOf(saddlePoints, SADDLE_COUNT);
+
+// Largest difference to the points' line over every reading from 0 to 2047
+static long maxDeviation(SenderCalibration *calibration, const calibrationPoint *points, uint8_t count) {
+  long most = 0;
+
+  for (long reading = 0; reading < 2048; reading++) {
+    long held = constrain(reading, (long)points[0].reading, (long)points[count - 1].reading);
+    long deviation = labs(calibration->level(reading) - calibrationLevel(points, count, held));
+
+    most = max(most, deviation);
+  }
+  return most;
+}
+
+static void recordPoints(SenderCalibration *calibration, const calibrationPoint *points, uint8_t count) {
+  calibration->start();
+  // In the order a fill-up takes them, from empty
+  for (int8_t i = count - 1; i >= 0; i--)
+    TEST_ASSERT_TRUE(calibration->record(points[i].reading, points[i].percent));
+}
+
+void setUp(void) {
+  uint8_t erased[sizeof(calibrationRecord)];
+
+  memset(erased, 0xFF, sizeof(erased));
+  eeprom_update_block(erased, (void *)RECORD_START, sizeof(erased));
+}
+
+void tearDown(void) {
+}
+
+void test_linear_table(void) {
+  SenderCalibration calibration(&linearTable);
+
+  TEST_ASSERT_FALSE(calibration.begin(RECORD_START));
+  TEST_ASSERT_FALSE(calibration.stored());
+
+  // Ends exact and held past them
+  TEST_ASSERT_EQUAL_INT16(100 << 8, calibration.level(500));
+  TEST_ASSERT_EQUAL_INT16(100 << 8, calibration.level(0));
+  TEST_ASSERT_EQUAL_INT16(0, calibration.level(1800));
+  TEST_ASSERT_EQUAL_INT16(0, calibration.level(2047));
+  TEST_ASSERT_EQUAL_UINT8(50, calibration.percent(1150));
+
+  // A straight line is on the table's nodes, only the rounding of the step is left
+  TEST_ASSERT_LESS_OR_EQUAL(1, maxDeviation(&calibration, linearPoints, LINEAR_COUNT));
+}
+
+void test_saddle_table(void) {
+  SenderCalibration calibration(&saddleTable);
+  char message[60];
+
+  TEST_ASSERT_FALSE(calibration.begin(RECORD_START));
+  TEST_ASSERT_EQUAL_INT16(100 << 8, calibration.level(320));
+  TEST_ASSERT_EQUAL_INT16(0, calibration.level(1520));
+
+  // Nodes 64 readings apart cut the corners at the points by a fraction of a percent
+  long deviation = maxDeviation(&calibration, saddlePoints, SADDLE_COUNT);
+  snprintf(message, sizeof(message), "saddle table off the points' line by %ld / 256 %%", deviation);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_LESS_OR_EQUAL(256, deviation);
+
+  // Never rises as the sender reading rises
+  for (uint16_t reading = 1; reading < 2048; reading++)
+    TEST_ASSERT_LESS_OR_EQUAL(calibration.level(reading - 1), calibration.level(reading));
+}
+
+void test_saved_matches_compiled(void) {
+  SenderCalibration compiled(&saddleTable);
+  SenderCalibration taken(&linearTable);
+
+  compiled.begin(RECORD_START);
+  taken.begin(RECORD_START);
+  recordPoints(&taken, saddlePoints, SADDLE_COUNT);
+  TEST_ASSERT_TRUE(taken.save());
+  TEST_ASSERT_TRUE(taken.stored());
+  TEST_ASSERT_EQUAL_UINT8(SADDLE_COUNT, taken.points());
+
+  for (uint16_t reading = 0; reading < 2048; reading++)
+    TEST_ASSERT_EQUAL_INT16(compiled.level(reading), taken.level(reading));
+
+  // Read back at power-up
+  SenderCalibration restarted(&linearTable);
+  TEST_ASSERT_TRUE(restarted.begin(RECORD_START));
+  TEST_ASSERT_EQUAL_INT16(compiled.level(700), restarted.level(700));
+}
+
+void test_bad_points_refused(void) {
+  SenderCalibration calibration(&linearTable);
+
+  calibration.begin(RECORD_START);
+
+  // Not recording, or over 100 %
+  TEST_ASSERT_FALSE(calibration.record(500, 50));
+  calibration.start();
+  TEST_ASSERT_FALSE(calibration.record(500, 101));
+
+  // One point isn't a line
+  TEST_ASSERT_TRUE(calibration.record(900, 50));
+  TEST_ASSERT_FALSE(calibration.save());
+
+  // A level recorded again replaces its point; levels that don't fall steadily are refused
+  TEST_ASSERT_TRUE(calibration.record(400, 100));
+  TEST_ASSERT_TRUE(calibration.record(1500, 0));
+  TEST_ASSERT_TRUE(calibration.record(1600, 50));
+  TEST_ASSERT_EQUAL_UINT8(3, calibration.points());
+  TEST_ASSERT_FALSE(calibration.save());
+  TEST_ASSERT_FALSE(calibration.stored());
+
+  TEST_ASSERT_TRUE(calibration.record(1000, 50));
+  TEST_ASSERT_TRUE(calibration.save());
+  TEST_ASSERT_EQUAL_UINT8(50, calibration.percent(1000));
+}
+
+void test_bad_record_falls_back(void) {
+  SenderCalibration calibration(&linearTable);
+
+  calibration.begin(RECORD_START);
+  recordPoints(&calibration, saddlePoints, SADDLE_COUNT);
+  TEST_ASSERT_TRUE(calibration.save());
+
+  // A write cut off by a power loss in the middle of the table
+  eeprom_write_byte((uint8_t *)(RECORD_START + offsetof(calibrationRecord, table.level) + 20), 0x55);
+  TEST_ASSERT_FALSE(calibration.begin(RECORD_START));
+  TEST_ASSERT_INT_WITHIN(1, calibrationLevel(linearPoints, LINEAR_COUNT, 700), calibration.level(700));
+
+  // clear() goes back to the defaults for good
+  recordPoints(&calibration, saddlePoints, SADDLE_COUNT);
+  TEST_ASSERT_TRUE(calibration.save());
+  calibration.clear();
+  TEST_ASSERT_FALSE(calibration.stored());
+  TEST_ASSERT_FALSE(calibration.begin(RECORD_START));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_linear_table);
+  RUN_TEST(test_saddle_table);
+  RUN_TEST(test_saved_matches_compiled);
+  RUN_TEST(test_bad_points_refused);
+  RUN_TEST(test_bad_record_falls_back);
+  return UNITY_END();
+}
@@ -0,0 +1,224 @@
+/*
+   StaticQueue on [env:native]: FIFO order, full and empty, the index wrap with and without a
+   power of two, the same results as QueueList over random operations, and a benchmark against
+   QueueList with the HM-10 AT command queue's items.
+
+   QueueList.h next to this file is the library HM_10_BLE used before, as it was in the tree.
+
+     pio test -e native -f test_static_queue -v
+*/
+
+#include <Arduino.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+#include "StaticQueue.h"
+#include "HM_10_BLE.h"
+#include "QueueList.h"
+
+#define BENCH_OPERATIONS 1000000UL
+
+// Heap allocations of the whole program, to see which queue uses the heap
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+
+  void *p = malloc(size);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+static uint64_t randomState;
+
+static uint32_t randomNumber(uint32_t range) {
+  randomState = randomState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (randomState >> 33) % range;
+}
+
+static double seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static hm10ATCommand command(unsigned long n) {
+  hm10ATCommand c;
+
+  snprintf(c.text, sizeof(c.text), "AT+NAME%lu", n);
+  c.paramOffset = 7;
+  c.timeout = HM_10_BLE_AT_TIMEOUT;
+  c.callback = NULL;
+  return c;
+}
+
+void setUp(void) {
+  randomState = 1;
+}
+
+void tearDown(void) {
+}
+
+void test_fifo_order(void) {
+  StaticQueue<int, 4> queue;
+  int item;
+
+  TEST_ASSERT_TRUE(queue.isEmpty());
+  TEST_ASSERT_NULL(queue.peek());
+  TEST_ASSERT_FALSE(queue.tryPop(item));
+
+  for (int i = 1; i <= 4; i++)
+    TEST_ASSERT_TRUE(queue.tryPush(i));
+  TEST_ASSERT_TRUE(queue.isFull());
+  TEST_ASSERT_FALSE(queue.tryPush(5));
+  TEST_ASSERT_EQUAL(4, queue.count());
+
+  TEST_ASSERT_EQUAL(1, *queue.peek());
+  for (int i = 1; i <= 4; i++) {
+    TEST_ASSERT_TRUE(queue.tryPop(item));
+    TEST_ASSERT_EQUAL(i, item);
+  }
+  TEST_ASSERT_TRUE(queue.isEmpty());
+}
+
+void test_pop_and_clear(void) {
+  StaticQueue<int, 3> queue;
+
+  queue.pop();
+  TEST_ASSERT_EQUAL(0, queue.count());
+
+  queue.tryPush(1);
+  queue.tryPush(2);
+  queue.pop();
+  TEST_ASSERT_EQUAL(2, *queue.peek());
+  queue.clear();
+  TEST_ASSERT_TRUE(queue.isEmpty());
+  TEST_ASSERT_TRUE(queue.tryPush(3));
+  TEST_ASSERT_EQUAL(3, *queue.peek());
+}
+
+template<uint8_t N>
+static void wrapAround(void) {
+  StaticQueue<unsigned long, N> queue;
+  unsigned long pushed = 0;
+  unsigned long popped = 0;
+
+  // Half full and then some, so head and tail go around many times at every offset
+  for (unsigned long round = 0; round < 1000; round++) {
+    while (!queue.isFull())
+      TEST_ASSERT_TRUE(queue.tryPush(pushed++));
+    for (uint8_t i = 0; i < N / 2 + 1; i++) {
+      unsigned long item;
+
+      TEST_ASSERT_TRUE(queue.tryPop(item));
+      TEST_ASSERT_EQUAL(popped++, item);
+    }
+  }
+  TEST_ASSERT_EQUAL(pushed - popped, queue.count());
+}
+
+void test_wrap_power_of_two(void) {
+  wrapAround<8>();
+}
+
+void test_wrap_other_sizes(void) {
+  wrapAround<5>();
+  wrapAround<1>();
+  wrapAround<255>();
+}
+
+void test_same_as_queue_list(void) {
+  StaticQueue<hm10ATCommand, HM_10_BLE_AT_QUEUE_LEN> queue;
+  QueueList<hm10ATCommand> list;
+  unsigned long n = 0;
+
+  // QueueList can't be full, so pushes stop at the capacity as HM_10_BLE's callers do
+  for (unsigned long i = 0; i < 100000; i++) {
+    if (randomNumber(2) == 0 && list.count() < HM_10_BLE_AT_QUEUE_LEN) {
+      hm10ATCommand c = command(n++);
+
+      TEST_ASSERT_TRUE(queue.tryPush(c));
+      list.push(c);
+    }
+    else if (!list.isEmpty()) {
+      hm10ATCommand a;
+      hm10ATCommand b = list.pop();
+
+      TEST_ASSERT_TRUE(queue.tryPop(a));
+      TEST_ASSERT_EQUAL_STRING(b.text, a.text);
+    }
+    TEST_ASSERT_EQUAL(list.count(), queue.count());
+    TEST_ASSERT_EQUAL(list.isEmpty(), queue.isEmpty());
+  }
+}
+
+void test_queue_benchmark(void) {
+  StaticQueue<hm10ATCommand, HM_10_BLE_AT_QUEUE_LEN> queue;
+  QueueList<hm10ATCommand> list;
+  hm10ATCommand c = command(42);
+  hm10ATCommand out;
+  unsigned long check = 0;
+  char message[160];
+
+  // A command queued and answered, with a few others waiting as when the module is configured
+  for (uint8_t i = 0; i < HM_10_BLE_AT_QUEUE_LEN - 1; i++) {
+    queue.tryPush(c);
+    list.push(c);
+  }
+
+  unsigned long before = allocations;
+  double start = seconds();
+  for (unsigned long i = 0; i < BENCH_OPERATIONS; i++) {
+    c.timeout = i;
+    list.push(c);
+    check += list.pop().timeout;
+  }
+  double listTime = seconds() - start;
+  unsigned long listAllocations = allocations - before;
+
+  before = allocations;
+  start = seconds();
+  for (unsigned long i = 0; i < BENCH_OPERATIONS; i++) {
+    c.timeout = i;
+    queue.tryPush(c);
+    queue.tryPop(out);
+    check -= out.timeout;
+  }
+  double queueTime = seconds() - start;
+  unsigned long queueAllocations = allocations - before;
+
+  TEST_ASSERT_EQUAL(0, check);
+  TEST_ASSERT_EQUAL(0, queueAllocations);
+  TEST_ASSERT_EQUAL(BENCH_OPERATIONS, listAllocations);
+
+  snprintf(message, sizeof(message), "QueueList %.1f ns, StaticQueue %.1f ns per push and pop (%.1fx), %lu against 0 heap allocations",
+           listTime * 1e9 / BENCH_OPERATIONS, queueTime * 1e9 / BENCH_OPERATIONS, listTime / queueTime, listAllocations);
+  TEST_MESSAGE(message);
+  snprintf(message, sizeof(message), "StaticQueue<hm10ATCommand, %d> is %u bytes on the host, fixed",
+           HM_10_BLE_AT_QUEUE_LEN, (unsigned)sizeof(queue));
+  TEST_MESSAGE(message);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fifo_order);
+  RUN_TEST(test_pop_and_clear);
+  RUN_TEST(test_wrap_power_of_two);
+  RUN_TEST(test_wrap_other_sizes);
+  RUN_TEST(test_same_as_queue_list);
+  RUN_TEST(test_queue_benchmark);
+  return UNITY_END();
+}
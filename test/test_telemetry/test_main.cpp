@@ -0,0 +1,183 @@
+/*
+   Telemetry cost per cycle on [env:native], text messages against the binary frame: the bytes
+   the sketch writes to the BLE module every loop, the virtual time its writes wait for room in
+   the transmit queue, and the host CPU time of processOutgoingMessages().
+
+     pio test -e native -f test_telemetry -v
+*/
+
+#include <Arduino.h>
+#include <ArduinoNative.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+#include "AM_HM10.h"
+#include "AM_Publisher.h"
+
+// Wiring from main.cpp
+#define AUX_PIN 14
+#define DASH_DISPLAY 0x98FEFC17UL
+
+#define RUN_SECONDS 300
+#define CALLS 10000UL
+
+extern AMController amController;
+extern AMPublisher publisher;
+void doWork();
+void processOutgoingMessages();
+
+typedef struct {
+  unsigned long cycles;
+  unsigned long bytes;
+  unsigned long maxBytes;
+  unsigned long micros;
+} cycleCost;
+
+static cycleCost textCost;
+static cycleCost binaryCost;
+static unsigned long workBytes;               // of the doWork() log line every loop sends in both modes
+
+static double seconds(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void inject(const char *text) {
+  nativeSerialInject((const uint8_t *)text, strlen(text));
+}
+
+// Loops for seconds of a drive: the primary drains by a percent a minute, the aux sender drifts
+// and the dash display comes once a second
+static void drive(unsigned long seconds, cycleCost *cost) {
+  unsigned long end = millis() + seconds * 1000;
+  unsigned long nextFrame = millis();
+
+  memset(cost, 0, sizeof(*cost));
+  while (millis() < end) {
+    if (millis() >= nextFrame) {
+      uint8_t data[8] = { 0xFF, (uint8_t)(200 - millis() / 60000 * 255 / 100), 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+      nativeCanInject(DASH_DISPLAY, 8, data);
+      nativeSetAnalog(AUX_PIN, 250 + (millis() / 7000) % 20);
+      nextFrame += 1000;
+    }
+
+    unsigned long bytes = amController.txBytes();
+    unsigned long micros = amController.txMicros();
+
+    loop();
+
+    cost->cycles++;
+    cost->bytes += amController.txBytes() - bytes;
+    cost->maxBytes = max(cost->maxBytes, amController.txBytes() - bytes);
+    cost->micros += amController.txMicros() - micros;
+  }
+}
+
+// Host time of one processOutgoingMessages(), everything resent (as after a Sync) or nothing changed
+static double outgoingMicros(bool resend) {
+  double total = 0;
+
+  for (unsigned long i = 0; i < CALLS; i++) {
+    // Room in the transmit queue again, so the resend isn't deferred
+    nativeAdvance(200000UL);
+    if (resend)
+      publisher.resendAll();
+
+    double start = seconds();
+    processOutgoingMessages();
+    total += seconds() - start;
+  }
+  return total * 1e6 / CALLS;
+}
+
+// Bytes every value takes once, as after a Sync, over as many cycles as the queue needs
+static unsigned long resendBytes(void) {
+  unsigned long start = amController.txBytes();
+  unsigned long sent;
+
+  nativeAdvance(1000000UL);
+  publisher.resendAll();
+  do {
+    sent = amController.txBytes();
+    processOutgoingMessages();
+    nativeAdvance(100000UL);
+  } while (amController.txBytes() != sent);
+  return amController.txBytes() - start;
+}
+
+static void report(const char *mode, const cycleCost &cost) {
+  char message[192];
+
+  snprintf(message, sizeof(message), "%s: %.1f bytes per cycle, %.1f of them telemetry (at most %lu), %.0f us per cycle waiting for the queue",
+           mode, (double)cost.bytes / cost.cycles, (double)cost.bytes / cost.cycles - workBytes, cost.maxBytes - workBytes,
+           (double)cost.micros / cost.cycles);
+  TEST_MESSAGE(message);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_text_mode(void) {
+  inject("OK+CONN");
+  inject("Sync=1#");
+  drive(10, &textCost);
+  TEST_ASSERT_FALSE(amController.binaryMode());
+
+  unsigned long bytes = amController.txBytes();
+  doWork();
+  workBytes = amController.txBytes() - bytes;
+
+  drive(RUN_SECONDS, &textCost);
+  report("text", textCost);
+
+  char message[160];
+  double resend = outgoingMicros(true);
+  double unchanged = outgoingMicros(false);
+
+  snprintf(message, sizeof(message), "text: processOutgoingMessages() %.2f us resending all, %.2f us unchanged (host), "
+           "%lu bytes for every value", resend, unchanged, resendBytes());
+  TEST_MESSAGE(message);
+  TEST_ASSERT_GREATER_THAN(0, textCost.bytes);
+}
+
+void test_binary_mode(void) {
+  inject("OK+LOST");
+  inject("OK+CONN");
+  inject("$BinFrame$=1#");
+  inject("Sync=1#");
+  drive(10, &binaryCost);
+  TEST_ASSERT_TRUE(amController.binaryMode());
+
+  drive(RUN_SECONDS, &binaryCost);
+  report("binary", binaryCost);
+
+  char message[160];
+  double resend = outgoingMicros(true);
+  double unchanged = outgoingMicros(false);
+
+  snprintf(message, sizeof(message), "binary: processOutgoingMessages() %.2f us resending all, %.2f us unchanged (host), "
+           "%lu bytes for every value", resend, unchanged, resendBytes());
+  TEST_MESSAGE(message);
+
+  // The same drive, fewer bytes on the link
+  TEST_ASSERT_GREATER_THAN(0, binaryCost.bytes);
+  TEST_ASSERT_TRUE((double)binaryCost.bytes / binaryCost.cycles < (double)textCost.bytes / textCost.cycles);
+}
+
+int main(void) {
+  nativeSerialQuiet(true);
+  nativeSetAnalog(AUX_PIN, 250);
+  setup();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_text_mode);
+  RUN_TEST(test_binary_mode);
+  return UNITY_END();
+}